@@ -14,6 +14,45 @@
 #define JSON_PARSER_SILENT 0
 #endif
 
+#if !defined(JSON_PARSER_MAX_DEPTH)
+#define JSON_PARSER_MAX_DEPTH 1024
+#endif
+
+#if !defined(JSON_PARSER_STATS)
+#define JSON_PARSER_STATS 0
+#endif
+
+// Estimated bookkeeping bytes the allocator adds to every allocation, only used
+// by json_memory_usage. 16 matches glibc malloc on 64-bit targets.
+#if !defined(JSON_PARSER_ALLOC_OVERHEAD)
+#define JSON_PARSER_ALLOC_OVERHEAD 16
+#endif
+
+// Nesting checks of the streaming writer (key outside an object, unbalanced
+// end calls...). On unless NDEBUG is defined. It changes JSON_WRITER, so it
+// must be the same in every translation unit.
+#if !defined(JSON_PARSER_WRITER_CHECKS)
+#if defined(NDEBUG)
+#define JSON_PARSER_WRITER_CHECKS 0
+#else
+#define JSON_PARSER_WRITER_CHECKS 1
+#endif
+#endif
+
+// Worker threads for json_stringify_parallel, json_stringify_ndjson and
+// json_free_async, atomic counts for json_retain and JSON_CONFIG_HANDLE, link
+// with -pthread on POSIX. At 0 the same work runs on the calling thread and
+// shared documents and handles must stay on one thread.
+#if !defined(JSON_PARSER_THREADS)
+#define JSON_PARSER_THREADS 0
+#endif
+
+// The header defines the library. When it is included from several translation
+// units, define JSON_PARSER_DECLARATIONS_ONLY to 1 in all of them but one.
+#if !defined(JSON_PARSER_DECLARATIONS_ONLY)
+#define JSON_PARSER_DECLARATIONS_ONLY 0
+#endif
+
 #include "stdlib.h"
 #include "stdio.h"
 #include "stdint.h"
@@ -21,6 +60,38 @@
 #include "math.h"
 #include "stdarg.h"
 #include "errno.h"
+#include "stddef.h"
+#include "time.h"
+
+#if JSON_PARSER_STATS || JSON_PARSER_THREADS
+#include "stdatomic.h"
+#endif
+
+#if JSON_PARSER_THREADS
+#if defined(_WIN32)
+#include "windows.h"
+#else
+#include "pthread.h"
+#endif
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/stat.h"
+#include "sys/mman.h"
+#include "sys/uio.h"
+#define __HAS_MMAP 1
+#else
+#define __HAS_MMAP 0
+
+// Same layout as POSIX, filled by json_stringify_iov
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
 
 typedef uint8_t VALUE_TYPE;
 
@@ -31,7 +102,418 @@ typedef uint8_t VALUE_TYPE;
 #define VAL_BOOL (VALUE_TYPE)4
 #define VAL_NULL (VALUE_TYPE)5
 
-const char *__VAL_TO_STR[6] = {
+typedef struct json
+{
+    void *value;
+    VALUE_TYPE type;
+    uint8_t flags; // internal ownership bits, 0 for nodes that own all their memory
+} JSON;
+
+typedef struct json_obj
+{
+    char **fields;
+    JSON **values;
+    uint64_t length;
+} JSON_OBJECT;
+
+typedef struct json_array
+{
+    JSON **elements;
+    uint64_t length;
+} JSON_ARRAY;
+
+typedef double JSON_NUMBER;
+
+typedef int err_t;
+
+/**
+ * Allocation callbacks used for every allocation the library makes. `resize`
+ * follows realloc semantics and `release` must accept NULL. The struct is not
+ * copied, it must outlive every tree or string allocated through it.
+ */
+typedef struct json_allocator
+{
+    void *(*alloc)(void *user, size_t size);
+    void *(*resize)(void *user, void *ptr, size_t size);
+    void (*release)(void *user, void *ptr);
+    void *user;
+} JSON_ALLOCATOR;
+
+typedef uint8_t JSON_ERROR_CODE;
+
+#define JSON_ERR_NONE (JSON_ERROR_CODE)0
+#define JSON_ERR_NULL_INPUT (JSON_ERROR_CODE)1
+#define JSON_ERR_EOF (JSON_ERROR_CODE)2
+#define JSON_ERR_UNEXPECTED_CHAR (JSON_ERROR_CODE)3
+#define JSON_ERR_INVALID_LITERAL (JSON_ERROR_CODE)4
+#define JSON_ERR_INVALID_NUMBER (JSON_ERROR_CODE)5
+#define JSON_ERR_INVALID_ESCAPE (JSON_ERROR_CODE)6
+#define JSON_ERR_MAX_DEPTH (JSON_ERROR_CODE)7
+#define JSON_ERR_ALLOC (JSON_ERROR_CODE)8
+#define JSON_ERR_IO (JSON_ERROR_CODE)9
+#define JSON_ERR_INVALID_UTF8 (JSON_ERROR_CODE)10
+#define JSON_ERR_TYPE_MISMATCH (JSON_ERROR_CODE)11
+#define JSON_ERR_CAPACITY (JSON_ERROR_CODE)12
+
+typedef struct json_error
+{
+    const char *expected; // read-only description of the expected token, NULL if not applicable
+    uint64_t offset;      // byte offset of the failure in the input
+    uint32_t depth;       // container nesting depth at the failure
+    JSON_ERROR_CODE code;
+} JSON_ERROR;
+
+typedef void (*JSON_DIAGNOSTIC_FN)(const JSON_ERROR *err, const char *message, void *user);
+
+typedef uint8_t JSON_PARSE_FLAGS;
+
+#define JSON_PARSE_DEFAULT (JSON_PARSE_FLAGS)0
+#define JSON_PARSE_VALIDATE_UTF8 (JSON_PARSE_FLAGS)1 // reject strings that are not valid UTF-8
+
+// Key orders learned across parses, see json_shapes_new
+typedef struct json_shapes JSON_SHAPES;
+
+typedef struct json_shape_stats
+{
+    uint64_t hits;      // keys matched with a single compare against the learned order
+    uint64_t misses;    // keys parsed the regular way
+    uint64_t positions; // object and array positions learned
+    uint64_t keys;      // keys interned
+} JSON_SHAPE_STATS;
+
+typedef struct json_parse_options
+{
+    JSON_DIAGNOSTIC_FN on_error;      // NULL | called once with the first error of a parse
+    void *user;                       // passed as is to on_error
+    const JSON_ALLOCATOR *allocator;  // NULL defaults to the global allocator
+    uint32_t max_depth;               // 0 defaults to JSON_PARSER_MAX_DEPTH
+    JSON_PARSE_FLAGS flags;           // JSON_PARSE_DEFAULT | JSON_PARSE_VALIDATE_UTF8
+    JSON_SHAPES *shapes;              // NULL | learned key orders, the tree borrows its keys from it
+} JSON_PARSE_OPTIONS;
+
+// Parse in progress, see json_parse_begin
+typedef struct json_parse_state JSON_PARSE_STATE;
+
+typedef uint8_t JSON_STEP_STATUS;
+
+#define JSON_STEP_DONE (JSON_STEP_STATUS)0  // the document is complete, call json_parse_end
+#define JSON_STEP_AGAIN (JSON_STEP_STATUS)1 // the budget ran out, call json_parse_step again
+#define JSON_STEP_ERROR (JSON_STEP_STATUS)2 // call json_parse_end for the error
+
+// Frozen document readers reach without locks while it is replaced, see json_config_new
+typedef struct json_config_handle JSON_CONFIG_HANDLE;
+
+typedef uint8_t JSON_STRINGIFY_FLAGS;
+
+#define JSON_STRINGIFY_DEFAULT (JSON_STRINGIFY_FLAGS)0
+#define JSON_STRINGIFY_ASCII (JSON_STRINGIFY_FLAGS)1 // escape every non-ASCII character as \uXXXX
+
+typedef uint8_t JSON_FILE_FLAGS;
+
+#define JSON_FILE_DEFAULT (JSON_FILE_FLAGS)0
+#define JSON_FILE_NO_MMAP (JSON_FILE_FLAGS)1 // read into a heap buffer instead of mapping
+
+typedef struct json_stats
+{
+    uint64_t bytes_parsed;
+    uint64_t nodes_created[6]; // indexed by VALUE_TYPE
+    uint64_t mallocs;
+    uint64_t reallocs;
+    uint64_t frees;
+    uint64_t bytes_allocated;
+    uint64_t object_get_calls;
+    uint64_t object_get_probes; // fields compared by json_object_get, probes / calls is the mean probe length
+    uint64_t array_get_calls;
+    uint64_t get_deep_steps; // path components resolved by json_get_deep
+    uint64_t parse_calls;
+    uint64_t parse_ns;
+    uint64_t stringify_calls;
+    uint64_t stringify_ns;
+    uint64_t free_calls;
+    uint64_t free_ns;
+} JSON_STATS;
+
+typedef struct json_memory
+{
+    uint64_t nodes;       // JSON headers
+    uint64_t containers;  // JSON_OBJECT and JSON_ARRAY headers
+    uint64_t vectors;     // field, value and element pointer vectors
+    uint64_t keys;        // field strings, terminators included
+    uint64_t strings;     // string values, terminators included
+    uint64_t scalars;     // number and bool boxes
+    uint64_t allocations; // allocations currently owned by the document
+    uint64_t overhead;    // allocations * JSON_PARSER_ALLOC_OVERHEAD
+    uint64_t total;       // sum of the fields above, memory owned by the document alone
+    uint64_t shared;      // payloads shared with json_retain, counts and overhead included, once per reference
+} JSON_MEMORY;
+
+// A value inside an image loaded with json_snapshot_map. Offsets are relative
+// to the node itself, so images can be mapped at any address.
+typedef struct json_snapshot_node
+{
+    VALUE_TYPE type;
+    uint64_t length; // object entries, array elements or string bytes
+    union
+    {
+        JSON_NUMBER number;
+        int boolean;
+        uint64_t offset; // entry table, element table or string
+    } as;
+} JSON_SNAPSHOT_NODE;
+
+typedef struct json_snapshot
+{
+    const void *base;
+    uint64_t size;
+    uint8_t mapped; // 1 if base is a file mapping, 0 if it was read into memory
+} JSON_SNAPSHOT;
+
+typedef uint8_t JSON_FIELD_TYPE;
+
+#define JSON_FIELD_DOUBLE (JSON_FIELD_TYPE)0
+#define JSON_FIELD_FLOAT (JSON_FIELD_TYPE)1
+#define JSON_FIELD_INT32 (JSON_FIELD_TYPE)2
+#define JSON_FIELD_INT64 (JSON_FIELD_TYPE)3
+#define JSON_FIELD_BOOL (JSON_FIELD_TYPE)4   // int
+#define JSON_FIELD_STRING (JSON_FIELD_TYPE)5 // char *, allocated by json_decode_struct
+#define JSON_FIELD_CHARS (JSON_FIELD_TYPE)6  // char[N], NUL terminated
+#define JSON_FIELD_STRUCT (JSON_FIELD_TYPE)7 // nested struct, described by desc
+
+struct json_struct_desc;
+
+typedef struct json_field
+{
+    const char *name; // JSON key
+    JSON_FIELD_TYPE type;
+    size_t offset;    // offsetof the member
+    size_t size;      // sizeof the member, checked against type
+    const struct json_struct_desc *desc; // JSON_FIELD_STRUCT only
+} JSON_FIELD;
+
+typedef struct json_struct_desc
+{
+    const JSON_FIELD *fields;
+    uint64_t length;
+} JSON_STRUCT_DESC;
+
+typedef uint8_t JSON_COLUMN_TYPE;
+
+#define JSON_COLUMN_DOUBLE (JSON_COLUMN_TYPE)0
+#define JSON_COLUMN_INT64 (JSON_COLUMN_TYPE)1
+#define JSON_COLUMN_STRING (JSON_COLUMN_TYPE)2 // borrowed from the source array
+#define JSON_COLUMN_BOOL (JSON_COLUMN_TYPE)3
+
+// One field of an array of records, filled by json_extract_columns. Bit
+// (row % 8) of validity[row / 8] is set when the row holds a value.
+typedef struct json_column
+{
+    JSON_COLUMN_TYPE type; // set by the caller
+    const char *field;
+    uint64_t length; // rows
+    uint64_t valid;  // rows with their validity bit set
+    union
+    {
+        double *doubles;
+        int64_t *ints;
+        const char **strings;
+        uint8_t *bools;
+    } as;
+    uint8_t *validity;
+} JSON_COLUMN;
+
+// Receives consecutive pieces of a document, returns 1 to abort the writer
+typedef err_t (*JSON_WRITER_SINK)(void *user, const char *data, uint64_t len);
+
+// Push-style writer, see json_writer_init. Lives on the caller's stack, the
+// fields are internal.
+typedef struct json_writer
+{
+    char *data;
+    uint64_t len;
+    uint64_t cap;
+    JSON_WRITER_SINK sink; // NULL to accumulate everything in data
+    void *user;
+    const JSON_ALLOCATOR *allocator;
+    JSON_STRINGIFY_FLAGS flags;
+    uint8_t need_comma;
+    uint8_t after_key;
+    uint8_t done; // a complete top level value was written
+    uint8_t failed;
+    uint32_t depth;
+#if JSON_PARSER_WRITER_CHECKS
+    uint8_t nesting[(JSON_PARSER_MAX_DEPTH + 7) / 8]; // bit set for objects
+#endif
+} JSON_WRITER;
+
+// Descriptor tables are built from these, e.g.
+//   static const JSON_FIELD POINT_FIELDS[] = {
+//       JSON_FIELD_OF(POINT, x, JSON_FIELD_DOUBLE),
+//       JSON_FIELD_NAMED(POINT, label, "name", JSON_FIELD_STRING),
+//   };
+//   static const JSON_STRUCT_DESC POINT_DESC = JSON_STRUCT_DESC_OF(POINT_FIELDS);
+#define JSON_FIELD_NAMED(struct_type, member, json_name, field_type) \
+    {                                                                \
+        .name = (json_name),                                         \
+        .type = (field_type),                                        \
+        .offset = offsetof(struct_type, member),                     \
+        .size = sizeof(((struct_type *)0)->member),                  \
+        .desc = NULL,                                                \
+    }
+#define JSON_FIELD_OF(struct_type, member, field_type) JSON_FIELD_NAMED(struct_type, member, #member, field_type)
+#define JSON_FIELD_NESTED(struct_type, member, json_name, descriptor) \
+    {                                                                 \
+        .name = (json_name),                                          \
+        .type = JSON_FIELD_STRUCT,                                    \
+        .offset = offsetof(struct_type, member),                      \
+        .size = sizeof(((struct_type *)0)->member),                   \
+        .desc = &(descriptor),                                        \
+    }
+#define JSON_STRUCT_DESC_OF(fields_array)                                    \
+    {                                                                        \
+        .fields = (fields_array),                                            \
+        .length = sizeof(fields_array) / sizeof((fields_array)[0]),          \
+    }
+
+// Public API, documented at the definitions below.
+
+err_t json_stats_snapshot(JSON_STATS *out);
+void json_stats_reset(void);
+void json_set_allocator(const JSON_ALLOCATOR *allocator);
+const JSON_ALLOCATOR *json_get_allocator(void);
+const char *json_error_to_str(JSON_ERROR_CODE code);
+JSON *json_parse_ex(const char *s, uint64_t len, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err);
+JSON *json_parse(const char *s);
+err_t json_parse_into_ex(JSON *existing, const char *s, uint64_t len, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err);
+err_t json_parse_into(JSON *existing, const char *s, uint64_t len);
+JSON_SHAPES *json_shapes_new(const JSON_ALLOCATOR *allocator);
+void json_shapes_free(JSON_SHAPES *shapes);
+void json_shapes_stats(const JSON_SHAPES *shapes, JSON_SHAPE_STATS *out);
+err_t json_validate(const char *s, uint64_t len, JSON_ERROR *err);
+JSON *json_parse_file_ex(const char *path, JSON_FILE_FLAGS flags, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err);
+JSON *json_parse_file(const char *path, JSON_FILE_FLAGS flags);
+JSON_PARSE_STATE *json_parse_begin(const char *s, uint64_t len, const JSON_PARSE_OPTIONS *opts);
+JSON_STEP_STATUS json_parse_step(JSON_PARSE_STATE *st, uint64_t max_bytes, uint64_t max_ns);
+JSON *json_parse_end(JSON_PARSE_STATE *st, JSON_ERROR *err);
+JSON *json_object_get(JSON *self, const char *field);
+JSON *json_array_get(JSON *self, uint64_t index);
+JSON *json_get_deep(JSON *self, uint64_t fields_amount, const char *fields[fields_amount]);
+const char *json_type_to_str(VALUE_TYPE type);
+char *json_stringify_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+char *json_stringify_flags(JSON *json, JSON_STRINGIFY_FLAGS flags, const JSON_ALLOCATOR *allocator);
+char *json_stringify(JSON *json);
+uint64_t json_stringify_size_flags(JSON *json, JSON_STRINGIFY_FLAGS flags);
+uint64_t json_stringify_size(JSON *json);
+err_t json_stringify_iov_ex(JSON *json, JSON_STRINGIFY_FLAGS flags, struct iovec **iov, uint64_t *count, const JSON_ALLOCATOR *allocator);
+err_t json_stringify_iov(JSON *json, struct iovec **iov, uint64_t *count);
+char *json_stringify_parallel(JSON *json, JSON_STRINGIFY_FLAGS flags, uint32_t threads, uint64_t *len, const JSON_ALLOCATOR *allocator);
+char *json_stringify_ndjson(JSON **docs, uint64_t count, JSON_STRINGIFY_FLAGS flags, uint32_t threads, uint64_t *len, const JSON_ALLOCATOR *allocator);
+void json_print(JSON *json);
+void json_free_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+void json_free(JSON *json);
+void json_free_async_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+void json_free_async(JSON *json);
+void json_free_wait(void);
+char *json_value_string(JSON *json);
+int *json_value_bool(JSON *json);
+double *json_value_number(JSON *json);
+void *json_value_null(JSON *json);
+int json_is_null(JSON *json);
+JSON_OBJECT *json_value_object(JSON *json);
+JSON_ARRAY *json_value_array(JSON *json);
+JSON *json_make_string_ex(const char *s, const JSON_ALLOCATOR *allocator);
+JSON *json_make_string(const char *s);
+JSON *json_make_string_owned_ex(char *s, const JSON_ALLOCATOR *allocator);
+JSON *json_make_string_owned(char *s);
+JSON *json_make_string_borrowed_ex(const char *s, const JSON_ALLOCATOR *allocator);
+JSON *json_make_string_borrowed(const char *s);
+JSON *json_make_number_ex(double num, const JSON_ALLOCATOR *allocator);
+JSON *json_make_number(double num);
+JSON *json_make_bool_ex(int b, const JSON_ALLOCATOR *allocator);
+JSON *json_make_bool(int b);
+JSON *json_make_null_ex(const JSON_ALLOCATOR *allocator);
+JSON *json_make_null(void);
+JSON *json_make_object_ex(uint64_t len, char *fields[len], JSON *values[len], const JSON_ALLOCATOR *allocator);
+JSON *json_make_object(uint64_t len, char *fields[len], JSON *values[len]);
+JSON *json_make_array_ex(uint64_t len, JSON *values[len], const JSON_ALLOCATOR *allocator);
+JSON *json_make_array(uint64_t len, JSON *values[len]);
+err_t json_object_append_ex(JSON *json, const char *field, JSON *value, const JSON_ALLOCATOR *allocator);
+err_t json_object_append(JSON *json, const char *field, JSON *value);
+err_t json_object_append_owned_ex(JSON *json, char *field, JSON *value, const JSON_ALLOCATOR *allocator);
+err_t json_object_append_owned(JSON *json, char *field, JSON *value);
+err_t json_object_append_borrowed_ex(JSON *json, const char *field, JSON *value, const JSON_ALLOCATOR *allocator);
+err_t json_object_append_borrowed(JSON *json, const char *field, JSON *value);
+err_t json_object_delete_ex(JSON *json, const char *field, const JSON_ALLOCATOR *allocator);
+err_t json_object_delete(JSON *json, const char *field);
+err_t json_array_append_ex(JSON *json, JSON *value, const JSON_ALLOCATOR *allocator);
+err_t json_array_append(JSON *json, JSON *value);
+err_t json_array_delete_ex(JSON *json, uint64_t index, const JSON_ALLOCATOR *allocator);
+err_t json_array_delete(JSON *json, uint64_t index);
+JSON *json_clone_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+JSON *json_clone(JSON *json);
+JSON *json_retain_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+JSON *json_retain(JSON *json);
+void json_release_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+void json_release(JSON *json);
+err_t json_unshare_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+err_t json_unshare(JSON *json);
+err_t json_freeze(JSON *json);
+int json_is_frozen(JSON *json);
+JSON_CONFIG_HANDLE *json_config_new(JSON *json, const JSON_ALLOCATOR *allocator);
+JSON *json_config_read_begin(JSON_CONFIG_HANDLE *handle);
+void json_config_read_end(JSON_CONFIG_HANDLE *handle);
+err_t json_config_publish(JSON_CONFIG_HANDLE *handle, JSON *json);
+uint64_t json_config_reclaim(JSON_CONFIG_HANDLE *handle);
+void json_config_free(JSON_CONFIG_HANDLE *handle);
+JSON *json_compact_ex(JSON *json, const JSON_ALLOCATOR *allocator);
+JSON *json_compact(JSON *json);
+err_t json_memory_usage(JSON *json, JSON_MEMORY *out);
+err_t json_snapshot_write(JSON *json, const char *path);
+JSON_SNAPSHOT *json_snapshot_map(const char *path);
+void json_snapshot_unmap(JSON_SNAPSHOT *snap);
+const JSON_SNAPSHOT_NODE *json_snapshot_root(const JSON_SNAPSHOT *snap);
+const JSON_SNAPSHOT_NODE *json_snapshot_object_get(const JSON_SNAPSHOT_NODE *self, const char *field);
+const JSON_SNAPSHOT_NODE *json_snapshot_object_at(const JSON_SNAPSHOT_NODE *self, uint64_t index, const char **field);
+const JSON_SNAPSHOT_NODE *json_snapshot_array_get(const JSON_SNAPSHOT_NODE *self, uint64_t index);
+const JSON_SNAPSHOT_NODE *json_snapshot_get_deep(const JSON_SNAPSHOT_NODE *self, uint64_t fields_amount, const char *fields[fields_amount]);
+const char *json_snapshot_string(const JSON_SNAPSHOT_NODE *self);
+const double *json_snapshot_number(const JSON_SNAPSHOT_NODE *self);
+const int *json_snapshot_bool(const JSON_SNAPSHOT_NODE *self);
+const char *json_field_type_to_str(JSON_FIELD_TYPE type);
+err_t json_decode_struct(const char *s, uint64_t len, const JSON_STRUCT_DESC *desc, void *out, JSON_ERROR *err);
+void json_struct_free(const JSON_STRUCT_DESC *desc, void *obj);
+char *json_encode_struct(const JSON_STRUCT_DESC *desc, const void *in);
+void json_writer_init(JSON_WRITER *w, JSON_STRINGIFY_FLAGS flags, const JSON_ALLOCATOR *allocator);
+void json_writer_init_sink(JSON_WRITER *w, JSON_WRITER_SINK sink, void *user, JSON_STRINGIFY_FLAGS flags, const JSON_ALLOCATOR *allocator);
+err_t json_writer_begin_object(JSON_WRITER *w);
+err_t json_writer_end_object(JSON_WRITER *w);
+err_t json_writer_begin_array(JSON_WRITER *w);
+err_t json_writer_end_array(JSON_WRITER *w);
+err_t json_writer_key(JSON_WRITER *w, const char *key);
+err_t json_writer_string_len(JSON_WRITER *w, const char *s, uint64_t len);
+err_t json_writer_string(JSON_WRITER *w, const char *s);
+err_t json_writer_number(JSON_WRITER *w, JSON_NUMBER num);
+err_t json_writer_integer(JSON_WRITER *w, int64_t num);
+err_t json_writer_bool(JSON_WRITER *w, int b);
+err_t json_writer_null(JSON_WRITER *w);
+err_t json_writer_value(JSON_WRITER *w, JSON *json);
+err_t json_writer_finish(JSON_WRITER *w, char **out, uint64_t *out_len);
+void json_writer_discard(JSON_WRITER *w);
+uint64_t json_hash(JSON *json, uint64_t seed);
+int json_equal(JSON *a, JSON *b);
+err_t json_extract_columns_ex(JSON *array, const char *const *field_names, uint64_t n, JSON_COLUMN *out_columns, const JSON_ALLOCATOR *allocator);
+err_t json_extract_columns(JSON *array, const char *const *field_names, uint64_t n, JSON_COLUMN *out_columns);
+void json_columns_free_ex(JSON_COLUMN *columns, uint64_t n, const JSON_ALLOCATOR *allocator);
+void json_columns_free(JSON_COLUMN *columns, uint64_t n);
+err_t json_parse_number_array(const char *s, uint64_t len, float *out, uint64_t cap, uint64_t *count, JSON_ERROR *err);
+err_t json_parse_number_array_double(const char *s, uint64_t len, double *out, uint64_t cap, uint64_t *count, JSON_ERROR *err);
+char *json_write_number_array_ex(const float *values, uint64_t count, const JSON_ALLOCATOR *allocator);
+char *json_write_number_array(const float *values, uint64_t count);
+char *json_write_number_array_double_ex(const double *values, uint64_t count, const JSON_ALLOCATOR *allocator);
+char *json_write_number_array_double(const double *values, uint64_t count);
+
+#if !JSON_PARSER_DECLARATIONS_ONLY
+
+static const char *const __VAL_TO_STR[6] = {
     [VAL_OBJECT] = "object",
     [VAL_ARRAY] = "array",
     [VAL_STRING] = "string",
@@ -40,10 +522,21 @@ const char *__VAL_TO_STR[6] = {
     [VAL_NULL] = "null",
 };
 
-const char *__LIST_SEQ = "\"\\\b\f\n\r\t";
-const char *__LIST_ESC = "\"\\/bfnrt";
+static const char *const __FIELD_TO_STR[8] = {
+    [JSON_FIELD_DOUBLE] = "double",
+    [JSON_FIELD_FLOAT] = "float",
+    [JSON_FIELD_INT32] = "int32",
+    [JSON_FIELD_INT64] = "int64",
+    [JSON_FIELD_BOOL] = "bool",
+    [JSON_FIELD_STRING] = "string",
+    [JSON_FIELD_CHARS] = "char array",
+    [JSON_FIELD_STRUCT] = "object",
+};
+
+static const char __LIST_SEQ[] = "\"\\\b\f\n\r\t";
+static const char __LIST_ESC[] = "\"\\/bfnrt";
 
-char __ESC_TO_SEQ[117] = {
+static const char __ESC_TO_SEQ[117] = {
     ['\"'] = '\"',
     ['\\'] = '\\',
     ['/'] = '/',
@@ -54,7 +547,7 @@ char __ESC_TO_SEQ[117] = {
     ['t'] = '\t',
 };
 
-const char *__SEQ_TO_ESC[93] = {
+static const char *const __SEQ_TO_ESC[93] = {
     ['\"'] = "\\\"",
     ['\\'] = "\\\\",
     ['\b'] = "\\b",
@@ -64,48 +557,361 @@ const char *__SEQ_TO_ESC[93] = {
     ['\t'] = "\\t",
 };
 
-const uint64_t __MAX_ITER = ((uint64_t)0) - 1;
+static const uint64_t __MAX_ITER = ((uint64_t)0) - 1;
 
-typedef struct json
+// Strings at least this long are referenced in place by json_stringify_iov,
+// shorter ones are cheaper to copy than to give their own iovec
+#define __IOV_REF_MIN 64
+
+typedef struct stringify_out
 {
-    void *value;
-    VALUE_TYPE type;
-} JSON;
+    char *buff;        // NULL while measuring
+    uint64_t len;      // bytes written to buff, or that would be
+    struct iovec *iov; // NULL unless filling segments
+    uint64_t iov_len;
+    int segmented;     // produce iovecs, referencing long strings in place
+    int run_open;      // the last iovec points into buff and can still grow
+    JSON_STRINGIFY_FLAGS flags;
+} __STRINGIFY_OUT;
+
+static const char *const __ERR_TO_STR[13] = {
+    [JSON_ERR_NONE] = "none",
+    [JSON_ERR_NULL_INPUT] = "null input",
+    [JSON_ERR_EOF] = "unexpected end of input",
+    [JSON_ERR_UNEXPECTED_CHAR] = "unexpected character",
+    [JSON_ERR_INVALID_LITERAL] = "invalid literal",
+    [JSON_ERR_INVALID_NUMBER] = "invalid number",
+    [JSON_ERR_INVALID_ESCAPE] = "invalid escape sequence",
+    [JSON_ERR_MAX_DEPTH] = "maximum depth exceeded",
+    [JSON_ERR_ALLOC] = "allocation failure",
+    [JSON_ERR_IO] = "file could not be read",
+    [JSON_ERR_INVALID_UTF8] = "invalid UTF-8",
+    [JSON_ERR_TYPE_MISMATCH] = "value does not match the field type",
+    [JSON_ERR_CAPACITY] = "output buffer too small",
+};
 
-typedef struct json_obj
+// Interned keys and positions per JSON_SHAPES, past that nothing new is learned
+#define __SHAPES_MAX 4096
+
+// Keys learned per position, objects used as maps stop learning there
+#define __SHAPE_MAX_KEYS 64
+
+// Key indexes past any learned key: before the first entry, and no key
+#define __SHAPE_START (uint64_t)__SHAPE_MAX_KEYS
+#define __SHAPE_NONE (uint64_t)(__SHAPE_MAX_KEYS + 1)
+
+typedef struct shape_key
 {
-    char **fields;
-    JSON **values;
-    uint64_t length;
-} JSON_OBJECT;
+    char *key;           // never contains '"' or '\\', so it matches the raw text
+    uint64_t len;
+    uint64_t next;       // key that followed this one last time, __SHAPE_NONE if none
+    struct shape *child; // position of the value, NULL until a container is found there
+} __SHAPE_KEY;
 
-typedef struct json_array
+// One position in a document: every key of the objects found there, the key
+// that followed each one last time, and the position shared by array elements
+typedef struct shape
 {
-    JSON **elements;
+    __SHAPE_KEY *keys;
     uint64_t length;
-} JSON_ARRAY;
+    uint64_t first;   // key the last object started with, __SHAPE_NONE if none
+    uint64_t entries; // entry count of the last object, its successor starts with that room
+    struct shape *items;
+} __SHAPE;
 
-typedef double JSON_NUMBER;
+struct json_shapes
+{
+    const JSON_ALLOCATOR *alloc;
+    __SHAPE *root;
+    JSON_SHAPE_STATS stats;
+};
 
-typedef struct string_seg
+typedef struct parser
 {
-    char *str;
+    const char *s;
     uint64_t len;
-} __STRING_SEGMENT;
+    const JSON_PARSE_OPTIONS *opts;
+    const JSON_ALLOCATOR *alloc;
+    JSON_ERROR err;
+    uint32_t depth;
+    uint32_t max_depth;
+    JSON_PARSE_FLAGS flags;
+    JSON_SHAPES *shapes; // NULL unless opts->shapes is set
+    __SHAPE **shape;     // position of the next container, NULL when not learning
+} __PARSER;
+
+// JSON.flags
+#define __NODE_COMPACT (uint8_t)1 // lives inside a json_compact block
+#define __NODE_BLOCK (uint8_t)2   // first node of a json_compact block, owns it
+#define __NODE_BORROWED (uint8_t)4     // VAL_STRING pointing to caller memory, never freed
+#define __NODE_BORROWED_KEY (uint8_t)8 // the key of this node in its parent object is never freed
+#define __NODE_SHARED (uint8_t)16      // container whose payload is reference counted, see json_retain
+#define __NODE_IN_SHARED (uint8_t)32   // lives inside a shared payload, read only
+#define __NODE_FROZEN (uint8_t)64      // json_freeze, never modified again
 
-typedef struct builder
+/**
+ * A shared payload (JSON_OBJECT or JSON_ARRAY) is preceded in its allocation
+ * by the number of nodes pointing at it. Every container below a shared
+ * payload is shared too, so handing out another reference never writes to
+ * memory other documents may be reading.
+ */
+typedef struct share
 {
-    __STRING_SEGMENT *segments;
-    uint64_t len;
-} __BUILDER;
+#if JSON_PARSER_THREADS
+    _Atomic uint64_t refs;
+#else
+    uint64_t refs;
+#endif
+} __SHARE;
 
-typedef int err_t;
+#define __SHARE_OF(json) ((__SHARE *)(json)->value - 1)
+
+static uint64_t __share_count(JSON *json)
+{
+#if JSON_PARSER_THREADS
+    return atomic_load_explicit(&__SHARE_OF(json)->refs, memory_order_acquire);
+#else
+    return __SHARE_OF(json)->refs;
+#endif
+}
+
+static void __share_acquire(JSON *json)
+{
+#if JSON_PARSER_THREADS
+    atomic_fetch_add_explicit(&__SHARE_OF(json)->refs, 1, memory_order_relaxed);
+#else
+    __SHARE_OF(json)->refs += 1;
+#endif
+}
 
-err_t __parse_any_value(JSON *self, const char *s, uint64_t *i);
-err_t __parse_object(JSON *self, const char *s, uint64_t *i);
-err_t __parse_array(JSON *self, const char *s, uint64_t *i);
+// Drops the reference json holds, returns how many are left
+static uint64_t __share_release(JSON *json)
+{
+#if JSON_PARSER_THREADS
+    return atomic_fetch_sub_explicit(&__SHARE_OF(json)->refs, 1, memory_order_acq_rel) - 1;
+#else
+    return --__SHARE_OF(json)->refs;
+#endif
+}
+
+#define __STATS_WORDS (sizeof(JSON_STATS) / sizeof(uint64_t))
+
+#if JSON_PARSER_STATS
+
+/**
+ * Every thread accumulates into its own block, only the owning thread writes to
+ * it so relaxed load/store pairs are enough and compile to plain adds. Blocks
+ * are never released so counts from exited threads stay in the totals.
+ */
+typedef struct stats_block
+{
+    _Atomic uint64_t counters[__STATS_WORDS];
+    struct stats_block *next;
+} __STATS_BLOCK;
+
+static _Atomic(__STATS_BLOCK *) __STATS_HEAD = NULL;
+static _Thread_local __STATS_BLOCK *__STATS_LOCAL = NULL;
+static _Atomic uint64_t __STATS_BASELINE[__STATS_WORDS];
+
+static __STATS_BLOCK *__stats_local(void)
+{
+    if (__STATS_LOCAL != NULL)
+        return __STATS_LOCAL;
+
+    // Not routed through __mem_alloc, the block outlives any allocator
+    __STATS_BLOCK *block = calloc(1, sizeof(__STATS_BLOCK));
+
+    if (block == NULL)
+        return NULL;
+
+    block->next = atomic_load_explicit(&__STATS_HEAD, memory_order_acquire);
+
+    while (!atomic_compare_exchange_weak_explicit(&__STATS_HEAD, &block->next, block,
+                                                  memory_order_release, memory_order_acquire))
+    {
+    }
+
+    __STATS_LOCAL = block;
+    return block;
+}
+
+static void __stats_add(uint64_t index, uint64_t n)
+{
+    __STATS_BLOCK *block = __stats_local();
+
+    if (block == NULL)
+        return;
+
+    uint64_t value = atomic_load_explicit(&block->counters[index], memory_order_relaxed);
+    atomic_store_explicit(&block->counters[index], value + n, memory_order_relaxed);
+}
+
+static uint64_t __stats_now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void __stats_sum(uint64_t *words)
+{
+    for (uint64_t k = 0; k < __STATS_WORDS; ++k)
+        words[k] = 0;
+
+    __STATS_BLOCK *block = atomic_load_explicit(&__STATS_HEAD, memory_order_acquire);
+
+    while (block != NULL)
+    {
+        for (uint64_t k = 0; k < __STATS_WORDS; ++k)
+            words[k] += atomic_load_explicit(&block->counters[k], memory_order_relaxed);
+
+        block = block->next;
+    }
+}
+
+#define __STAT_INDEX(field) (offsetof(JSON_STATS, field) / sizeof(uint64_t))
+#define __STAT_ADD(field, n) __stats_add(__STAT_INDEX(field), (uint64_t)(n))
+#define __STAT_NODE(type) __stats_add(__STAT_INDEX(nodes_created) + (type), 1)
+#define __STAT_TIMER_START(name) uint64_t name = __stats_now_ns()
+#define __STAT_TIMER_STOP(name, field) __STAT_ADD(field, __stats_now_ns() - (name))
+
+#else
+
+#define __STAT_ADD(field, n)
+#define __STAT_NODE(type)
+#define __STAT_TIMER_START(name)
+#define __STAT_TIMER_STOP(name, field)
+
+#endif
+
+/**
+ * @brief Fills `out` with the library counters summed over every thread since
+ * the last json_stats_reset. Requires JSON_PARSER_STATS to be defined to 1.
+ *
+ * @param out
+ * @return err_t (1 if stats are compiled out, out is zeroed)
+ */
+err_t json_stats_snapshot(JSON_STATS *out)
+{
+    uint64_t *words = (uint64_t *)out;
+
+#if JSON_PARSER_STATS
+    __stats_sum(words);
+
+    for (uint64_t k = 0; k < __STATS_WORDS; ++k)
+        words[k] -= atomic_load_explicit(&__STATS_BASELINE[k], memory_order_relaxed);
+
+    return 0;
+#else
+    for (uint64_t k = 0; k < __STATS_WORDS; ++k)
+        words[k] = 0;
+
+    return 1;
+#endif
+}
+
+/**
+ * @brief Resets the counters seen by json_stats_snapshot. Meant to be called
+ * from a single exporter thread, counting threads are never blocked.
+ */
+void json_stats_reset(void)
+{
+#if JSON_PARSER_STATS
+    uint64_t words[__STATS_WORDS];
+    __stats_sum(words);
+
+    for (uint64_t k = 0; k < __STATS_WORDS; ++k)
+        atomic_store_explicit(&__STATS_BASELINE[k], words[k], memory_order_relaxed);
+#endif
+}
+
+static void *__std_alloc(void *user, size_t size)
+{
+    return malloc(size);
+}
+
+static void *__std_resize(void *user, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void __std_release(void *user, void *ptr)
+{
+    free(ptr);
+}
+
+static const JSON_ALLOCATOR __STD_ALLOCATOR = {
+    .alloc = __std_alloc,
+    .resize = __std_resize,
+    .release = __std_release,
+    .user = NULL,
+};
+
+static const JSON_ALLOCATOR *__ALLOCATOR = &__STD_ALLOCATOR;
+
+/**
+ * @brief Sets the allocator used by every call that does not override it.
+ * Not synchronized, set it before other threads start using the library.
+ *
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL restores malloc/realloc/free)
+ */
+void json_set_allocator(const JSON_ALLOCATOR *allocator)
+{
+    __ALLOCATOR = (allocator != NULL) ? allocator : &__STD_ALLOCATOR;
+}
+
+/**
+ * @brief Returns the global allocator.
+ *
+ * @return JSON_ALLOCATOR* (read-only memory, do not free)
+ */
+const JSON_ALLOCATOR *json_get_allocator(void)
+{
+    return __ALLOCATOR;
+}
+
+// Every internal allocation goes through these, `a` NULL means the global allocator
+
+static void *__mem_alloc(const JSON_ALLOCATOR *a, size_t size)
+{
+    if (a == NULL)
+        a = __ALLOCATOR;
+
+    __STAT_ADD(mallocs, 1);
+    __STAT_ADD(bytes_allocated, size);
+    return a->alloc(a->user, size);
+}
+
+static void *__mem_realloc(const JSON_ALLOCATOR *a, void *ptr, size_t size)
+{
+    if (a == NULL)
+        a = __ALLOCATOR;
+
+    __STAT_ADD(reallocs, 1);
+    __STAT_ADD(bytes_allocated, size);
+    return a->resize(a->user, ptr, size);
+}
 
-void __print(const char *s)
+static void __mem_free(const JSON_ALLOCATOR *a, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    if (a == NULL)
+        a = __ALLOCATOR;
+
+    __STAT_ADD(frees, 1);
+    a->release(a->user, ptr);
+}
+
+static err_t __parse_any_value(JSON *self, __PARSER *p, uint64_t *i);
+static err_t __parse_object(JSON *self, __PARSER *p, uint64_t *i);
+static err_t __parse_array(JSON *self, __PARSER *p, uint64_t *i);
+static void __free_value(JSON *json, const JSON_ALLOCATOR *a);
+static void __free_contents(JSON *json, const JSON_ALLOCATOR *a);
+static err_t __unshare(JSON *json, const JSON_ALLOCATOR *a);
+
+static void __print(const char *s)
 {
     if (JSON_PARSER_SILENT)
         return;
@@ -113,7 +919,7 @@ void __print(const char *s)
     printf("JSONparser: %s\n", s);
 }
 
-void __printf(const char *format, ...)
+static void __printf(const char *format, ...)
 {
     if (JSON_PARSER_SILENT)
         return;
@@ -124,7 +930,7 @@ void __printf(const char *format, ...)
     va_end(args);
 }
 
-int __is_whitespace(char c)
+static int __is_whitespace(char c)
 {
     if (JSON_PARSER_DEBUG)
         __print("__is_whitespace");
@@ -132,7 +938,7 @@ int __is_whitespace(char c)
     return c == ' ' || c == '\n' || c == '\r' || c == '\t';
 }
 
-int __is_digit(char c)
+static int __is_digit(char c)
 {
     if (JSON_PARSER_DEBUG)
         __print("__is_digit");
@@ -140,24 +946,25 @@ int __is_digit(char c)
     return c >= 48 && c <= 57;
 }
 
-err_t __init_object(JSON_OBJECT *self)
+// Makes room for cap entries before the vectors are grown
+static err_t __init_object_sized(JSON_OBJECT *self, uint64_t cap, const JSON_ALLOCATOR *a)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__init_object");
+        __print("__init_object_sized");
 
-    self->fields = malloc(sizeof(char *));
+    self->fields = __mem_alloc(a, sizeof(char *) * (cap + 1));
 
     if (self->fields == NULL)
     {
-        __print("Failed to alloc fields in object.");
         return 1;
     }
 
-    self->values = malloc(sizeof(JSON *));
+    self->values = __mem_alloc(a, sizeof(JSON *) * (cap + 1));
 
     if (self->values == NULL)
     {
-        __print("Failed to alloc values in object.");
+        __mem_free(a, self->fields);
+        self->fields = NULL;
         return 1;
     }
 
@@ -168,7 +975,12 @@ err_t __init_object(JSON_OBJECT *self)
     return 0;
 }
 
-int __str_contains_c(const char *s, char c)
+static err_t __init_object(JSON_OBJECT *self, const JSON_ALLOCATOR *a)
+{
+    return __init_object_sized(self, 0, a);
+}
+
+static int __str_contains_c(const char *s, char c)
 {
     if (JSON_PARSER_DEBUG)
         __print("__str_contains_c");
@@ -183,7 +995,7 @@ int __str_contains_c(const char *s, char c)
     return 0;
 }
 
-int __str_comp(const char *x, const char *y)
+static int __str_comp(const char *x, const char *y)
 {
     if (JSON_PARSER_DEBUG)
         __print("__str_comp");
@@ -201,7 +1013,7 @@ int __str_comp(const char *x, const char *y)
     return 0;
 }
 
-uint64_t __str_len(const char *s)
+static uint64_t __str_len(const char *s)
 {
     if (JSON_PARSER_DEBUG)
         __print("__str_len");
@@ -228,59 +1040,31 @@ uint64_t __str_len(const char *s)
     return i;
 }
 
-uint64_t __number_len(const char *s)
+static err_t __str_copy_alloc(const char *s, char **buff, const JSON_ALLOCATOR *a)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__number_len");
+        __print("__str_copy_alloc");
 
     if (s == NULL)
-        return 0;
-
-    uint64_t i = 0;
-
-    if (s[0] == '\0')
     {
-        return 0;
-    }
+        __print("s is NULL in call to __str_copy_alloc");
+        (*buff) = __mem_alloc(a, sizeof(char));
 
-    while (s[i] != '\0' && (__is_digit(s[i]) || s[i] == '.' || s[i] == '-'))
-    {
-        if (i == __MAX_ITER)
+        if ((*buff) == NULL)
         {
-            __print("__MAX_ITER reached in __number_len");
-            return 0;
+            __print("Failed to allocate empty string in __str_copy_alloc");
+            return 1;
         }
-        ++i;
-    }
-    return i;
-}
-
-err_t __str_copy_alloc(const char *s, char **buff)
-{
-    if (JSON_PARSER_DEBUG)
-        __print("__str_copy_alloc");
-
-    if (s == NULL)
-    {
-        __print("s is NULL in call to __str_copy_alloc");
-        (*buff) = malloc(sizeof(char));
-
-        if ((*buff) == NULL)
-        {
-            __print("Failed to allocate empty string in __str_copy_alloc");
-            return 1;
-        }
-
-        (*buff)[0] = '\0';
-        return 1;
+
+        (*buff)[0] = '\0';
+        return 1;
     }
 
     uint64_t len = __str_len(s);
-    (*buff) = malloc(sizeof(char) * (len + 1));
+    (*buff) = __mem_alloc(a, sizeof(char) * (len + 1));
 
     if ((*buff) == NULL)
     {
-        __print("Failed to allocate string in __str_copy_alloc");
         return 1;
     }
 
@@ -309,42 +1093,36 @@ err_t __str_copy_alloc(const char *s, char **buff)
     return 0;
 }
 
-err_t __append_object_entry(JSON_OBJECT *self, const char *field, JSON *value)
+// Stores field as is, the object owns it from here unless value has __NODE_BORROWED_KEY
+static err_t __append_object_entry_owned(JSON_OBJECT *self, char *field, JSON *value, const JSON_ALLOCATOR *a)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__append_object_entry");
+        __print("__append_object_entry_owned");
 
-    self->fields = realloc(self->fields, sizeof(char *) * (self->length + 2));
+    char **fields = __mem_realloc(a, self->fields, sizeof(char *) * (self->length + 2));
 
-    if (self->fields == NULL)
+    if (fields == NULL)
     {
-        __print("Failed to reallocate fields in __append_object_entry");
         return 1;
     }
 
-    self->values = realloc(self->values, sizeof(JSON *) * (self->length + 2));
-
-    if (self->values == NULL)
-    {
-        __print("Failed to reallocate values in __append_object_entry");
-        return 1;
-    }
+    self->fields = fields;
 
-    err_t res = __str_copy_alloc(field, &self->fields[self->length]);
+    JSON **values = __mem_realloc(a, self->values, sizeof(JSON *) * (self->length + 2));
 
-    if (res != 0)
+    if (values == NULL)
     {
-        __print("Failed to field name in __append_object_entry");
         return 1;
     }
 
+    self->values = values;
+    self->fields[self->length] = field;
+
     if (JSON_PARSER_DEBUG)
     {
         __printf("JSONparser: Added field %s to object.\n", field);
     }
 
-    self->fields[self->length + 1] = NULL;
-
     self->values[self->length] = value;
     self->fields[self->length + 1] = NULL;
 
@@ -352,565 +1130,854 @@ err_t __append_object_entry(JSON_OBJECT *self, const char *field, JSON *value)
     return 0;
 }
 
-uint64_t __unparsed_str_len(const char *s)
+static err_t __append_object_entry(JSON_OBJECT *self, const char *field, JSON *value, const JSON_ALLOCATOR *a)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__unparsed_str_len");
-
-    int is_escaped = 0;
+        __print("__append_object_entry");
 
-    uint64_t i = 0;
+    char *copy;
 
-    while (!(s[i] == '"' && !is_escaped))
+    if (__str_copy_alloc(field, &copy, a) != 0)
     {
-        is_escaped = 0;
-
-        if (i == __MAX_ITER)
-        {
-            __print("__MAX_ITER reached in __unparsed_str_len");
-            return 0;
-        }
-
-        if (s[i] == '\0')
-        {
-            __print("Failed to get length of string, found EOF while counting.");
-            return 0;
-        }
-
-        if (s[i] == '\\')
-        {
-            is_escaped = 1;
-        }
+        return 1;
+    }
 
-        ++i;
+    if (__append_object_entry_owned(self, copy, value, a) != 0)
+    {
+        __mem_free(a, copy);
+        return 1;
     }
 
-    return i;
+    return 0;
 }
 
-char *__unescape_string(const char *s)
+/**
+ * Decodes the UTF-8 sequence at s[i] (RFC 3629: no overlong forms, no
+ * surrogates, nothing above U+10FFFF). Returns its length, 0 if it is invalid.
+ */
+static uint64_t __utf8_decode(const char *s, uint64_t i, uint64_t end, uint32_t *cp)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__unescape_string");
-
-    uint64_t len = __str_len(s);
-    char *parsed = malloc(sizeof(char) * (len + 1));
+        __print("__utf8_decode");
 
-    uint64_t si = 0;
-    uint64_t pi = 0;
-    int is_escaped = 0;
+    const unsigned char *u = (const unsigned char *)s + i;
+    uint64_t avail = end - i;
 
-    while (!(s[si] == '"' && !is_escaped))
+    if (u[0] < 0x80)
     {
-        if (si == __MAX_ITER)
-        {
-            __print("__MAX_ITER reached in __unescape_string");
-            return NULL;
-        }
-
-        if (is_escaped)
-        {
-            if (s[si] == '\0' || !__str_contains_c(__LIST_ESC, s[si]))
-            {
-                __printf("JSONparser: Found invalid escaped character '\\%c' inside string.", s[si] ? s[si] : '0');
-                return NULL;
-            }
-
-            char seq = __ESC_TO_SEQ[s[si]];
+        (*cp) = u[0];
+        return 1;
+    }
 
-            parsed[si - pi] = seq;
-            ++si;
+    uint64_t n;
+    uint32_t min;
 
-            is_escaped = 0;
-            continue;
-        }
+    if ((u[0] & 0xE0) == 0xC0)
+    {
+        n = 2;
+        min = 0x80;
+        (*cp) = u[0] & 0x1F;
+    }
+    else if ((u[0] & 0xF0) == 0xE0)
+    {
+        n = 3;
+        min = 0x800;
+        (*cp) = u[0] & 0x0F;
+    }
+    else if ((u[0] & 0xF8) == 0xF0)
+    {
+        n = 4;
+        min = 0x10000;
+        (*cp) = u[0] & 0x07;
+    }
+    else
+    {
+        return 0;
+    }
 
-        is_escaped = 0;
+    if (avail < n)
+        return 0;
 
-        if (s[si] == '\0')
-        {
-            __print("Failed to unescape string: found NULL before end of string, how does that happen??");
-            return NULL;
-        }
+    for (uint64_t k = 1; k < n; ++k)
+    {
+        if ((u[k] & 0xC0) != 0x80)
+            return 0;
+        (*cp) = ((*cp) << 6) | (u[k] & 0x3F);
+    }
 
-        if (s[si] == '\\')
-        {
-            is_escaped = 1;
-            ++si;
-            ++pi;
-            continue;
-        }
+    if ((*cp) < min || (*cp) > 0x10FFFF || ((*cp) >= 0xD800 && (*cp) <= 0xDFFF))
+        return 0;
 
-        parsed[si - pi] = s[si];
-        ++si;
-    }
-    parsed[si - pi] = '\0';
-    return parsed;
+    return n;
 }
 
-char *__parse_string(const char *s, uint64_t *i)
+/**
+ * Returns the offset of the first byte of s[start..end) that is not part of a
+ * valid UTF-8 sequence, end if there is none. ASCII runs are skipped 8 bytes
+ * at a time.
+ */
+static uint64_t __utf8_invalid_at(const char *s, uint64_t start, uint64_t end)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__parse_string");
-
-    (*i) += 1; // Add opening quote to i
+        __print("__utf8_invalid_at");
 
-    uint64_t len = __unparsed_str_len(&s[*i]);
-    char *parsed = malloc(sizeof(char) * (len + 1));
+    uint64_t i = start;
 
-    uint64_t si = *i;
-    uint64_t pi = 0;
-    int is_escaped = 0;
-
-    while (!(s[si] == '"' && !is_escaped))
+    while (i < end)
     {
-        if (si == __MAX_ITER)
+        while (i + 8 <= end)
         {
-            __print("__MAX_ITER reached in __parse_string");
-            return NULL;
+            uint64_t word;
+            memcpy(&word, s + i, 8);
+            if (word & 0x8080808080808080ull)
+                break;
+            i += 8;
         }
 
-        if (is_escaped)
-        {
-            if (s[si] == '\0' || !__str_contains_c(__LIST_ESC, s[si]))
-            {
-                __printf("JSONparser: Found invalid escaped character '\\%c' inside string.", s[si] ? s[si] : '0');
-                return NULL;
-            }
+        if (i >= end)
+            break;
 
-            char seq = __ESC_TO_SEQ[s[si]];
-
-            parsed[si - pi - (*i)] = seq;
-            ++si;
-
-            is_escaped = 0;
+        if ((unsigned char)s[i] < 0x80)
+        {
+            ++i;
             continue;
         }
 
-        is_escaped = 0;
+        uint32_t cp;
+        uint64_t n = __utf8_decode(s, i, end, &cp);
 
-        if (s[si] == '\0')
-        {
-            __print("Failed to parse string: found EOF during parsing.");
-            return NULL;
-        }
-
-        if (s[si] == '\\')
-        {
-            is_escaped = 1;
-            ++si;
-            ++pi;
-            continue;
-        }
+        if (n == 0)
+            return i;
 
-        parsed[si - pi - (*i)] = s[si];
-        ++si;
+        i += n;
     }
-    parsed[si - pi - (*i)] = '\0';
 
-    (*i) += len + 1; // we add length of str + last closing quote
-    return parsed;
+    return end;
 }
 
-err_t __consume_colon(const char *s, uint64_t *i)
+static uint64_t __utf8_encode(uint32_t cp, char *out)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__consume_colon");
+        __print("__utf8_encode");
 
-    while (s[*i] != '\0')
+    if (cp < 0x80)
     {
-        if ((*i) == __MAX_ITER)
-        {
-            __print("__MAX_ITER reached in __consume_colon");
-            return 1;
-        }
-
-        if (__is_whitespace(s[*i]))
-        {
-            ++(*i);
-            continue;
-        }
-
-        if (s[*i] == ':')
-        {
-            ++(*i);
-            return 0;
-        }
-
-        __printf("JSONparser: Expected character ':' but found unexpected '%c' instead at position %lld.\n", s[*i], *i);
+        out[0] = (char)cp;
         return 1;
     }
+    if (cp < 0x800)
+    {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000)
+    {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
 
-    __print("Found EOF while expecting character ':'");
-    return 1;
+static int __hex_value(char c)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__hex_value");
+
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
 }
 
-err_t __parse_number(JSON *self, const char *s, uint64_t *i)
+/**
+ * Reads the 4 hex digits following "\\u" at s[i] (i points at the 'u').
+ * Returns 1 if they are not all within end or not all hex digits.
+ */
+static err_t __read_u_escape(const char *s, uint64_t i, uint64_t end, uint32_t *unit)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__parse_number");
+        __print("__read_u_escape");
 
-    err_t ret = 0;
+    if (i + 4 >= end)
+        return 1;
 
-    if (s[*i] == '\0')
+    (*unit) = 0;
+    for (uint64_t k = 1; k <= 4; ++k)
     {
-        __print("Failed to parse object: found EOF during parsing in __parse_number");
-        return 1;
+        int h = __hex_value(s[i + k]);
+        if (h < 0)
+            return 1;
+        (*unit) = ((*unit) << 4) | (uint32_t)h;
     }
+    return 0;
+}
 
-    uint64_t len = __number_len(&s[*i]);
-
-    char *digits_buff = malloc(sizeof(char) * (len + 1));
+static char __peek(const __PARSER *p, uint64_t i)
+{
+    return i < p->len ? p->s[i] : '\0';
+}
 
-    if (digits_buff == NULL)
+static void __skip_whitespace(const __PARSER *p, uint64_t *i)
+{
+    while ((*i) < p->len && __is_whitespace(p->s[*i]))
     {
-        __print("Failed to allocate digits string in __parse_number");
-        return 1;
+        ++(*i);
     }
+}
 
-    for (uint64_t j = 0; j < len; ++j)
+static int __match_literal(const __PARSER *p, uint64_t i, const char *literal)
+{
+    for (uint64_t j = 0; literal[j] != '\0'; ++j)
     {
-        digits_buff[j] = s[*i + j];
+        if (__peek(p, i + j) != literal[j])
+            return 0;
     }
-    digits_buff[len] = '\0';
+    return 1;
+}
 
-    JSON_NUMBER *num_ptr = malloc(sizeof(JSON_NUMBER));
-    if (num_ptr == NULL)
+/**
+ * Records the first failure of a parse and forwards it to the diagnostic
+ * callback, later failures raised while unwinding are ignored.
+ */
+static err_t __parser_fail(__PARSER *p, JSON_ERROR_CODE code, uint64_t offset, const char *expected, const char *message)
+{
+    if (p->err.code != JSON_ERR_NONE)
+        return 1;
+
+    p->err.code = code;
+    p->err.offset = offset;
+    p->err.depth = p->depth;
+    p->err.expected = expected;
+
+    if (p->opts != NULL && p->opts->on_error != NULL)
+        p->opts->on_error(&p->err, message, p->opts->user);
+
+    return 1;
+}
+
+static err_t __parser_unexpected(__PARSER *p, uint64_t offset, const char *expected, const char *message)
+{
+    JSON_ERROR_CODE code = (__peek(p, offset) == '\0') ? JSON_ERR_EOF : JSON_ERR_UNEXPECTED_CHAR;
+    return __parser_fail(p, code, offset, expected, message);
+}
+
+static uint64_t __number_len(const __PARSER *p, uint64_t start)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__number_len");
+
+    uint64_t i = start;
+
+    while (i < p->len && (__is_digit(p->s[i]) || p->s[i] == '.' || p->s[i] == '-' ||
+                          p->s[i] == 'e' || p->s[i] == 'E' || p->s[i] == '+'))
     {
-        __print("Failed to allocate memory for digits buffer in __parse_number.");
-        ret = 1;
-        goto clean_digits;
+        ++i;
     }
+    return i - start;
+}
 
-    errno = 0;
-    (*num_ptr) = (double)strtod(digits_buff, NULL);
-    if (errno != 0)
-    {
-        __print("Failed to parse number using strtold.");
+static err_t __unparsed_str_len(__PARSER *p, uint64_t start, uint64_t *len, int *has_escape)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__unparsed_str_len");
 
-        free(num_ptr);
-        num_ptr = NULL;
+    int is_escaped = 0;
+    (*has_escape) = 0;
 
-        ret = 1;
-        goto clean_digits;
-    }
+    for (uint64_t i = start; i < p->len; ++i)
+    {
+        char c = p->s[i];
 
-    self->type = VAL_NUMBER;
-    self->value = num_ptr;
+        if (c == '"' && !is_escaped)
+        {
+            (*len) = i - start;
+            return 0;
+        }
 
-    (*i) += len;
+        if (c == '\0')
+            break;
+
+        is_escaped = (c == '\\' && !is_escaped);
+        (*has_escape) |= is_escaped;
+    }
 
-clean_digits:
-    free(digits_buff);
-    digits_buff = NULL;
-    return ret;
+    return __parser_fail(p, JSON_ERR_EOF, p->len, "'\"'", "Found EOF while parsing string.");
 }
 
-err_t __parse_any_value(JSON *self, const char *s, uint64_t *i)
+/**
+ * Parses the string at *i into reuse when it is long enough, otherwise into a
+ * new allocation. reuse is never freed, on failure it is still NUL terminated.
+ */
+static char *__parse_string_into(__PARSER *p, uint64_t *i, char *reuse)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__parse_any_value");
+        __print("__parse_string_into");
+
+    (*i) += 1; // Add opening quote to i
+
+    uint64_t len = 0;
+    int has_escape = 0;
+
+    if (__unparsed_str_len(p, *i, &len, &has_escape) != 0)
+        return NULL;
 
-    if (s[*i] == '\0')
+    char *parsed = (reuse != NULL && len <= __str_len(reuse)) ? reuse : __mem_alloc(p->alloc, sizeof(char) * (len + 1));
+
+    if (parsed == NULL)
     {
-        __print("Failed to parse object: found EOF during parsing in __parse_any_value");
-        return 1;
+        __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate string in __parse_string.");
+        return NULL;
     }
 
-    while (s[*i] != '\0')
+    const char *s = p->s;
+    uint64_t end = (*i) + len;
+    uint64_t pi = 0;
+
+    if (p->flags & JSON_PARSE_VALIDATE_UTF8)
     {
-        if ((*i) == __MAX_ITER)
+        uint64_t bad = __utf8_invalid_at(s, *i, end);
+
+        if (bad != end)
         {
-            __print("__MAX_ITER reached in __parse_any_value");
-            return 1;
+            if (parsed != reuse)
+                __mem_free(p->alloc, parsed);
+            __parser_fail(p, JSON_ERR_INVALID_UTF8, bad, "UTF-8 sequence", "Found invalid UTF-8 inside string.");
+            return NULL;
         }
+    }
+
+    if (!has_escape)
+    {
+        memcpy(parsed, s + *i, len);
+        pi = len;
+    }
 
-        if (__is_whitespace(s[*i]))
+    // Escaped forms are never shorter than what they decode to, len + 1 is enough
+    for (uint64_t si = *i; has_escape && si < end; ++si)
+    {
+        if (s[si] != '\\')
         {
-            ++(*i);
+            parsed[pi++] = s[si];
             continue;
         }
 
-        if (s[*i] == 'n')
+        // an escape can never be the last character, it would have escaped the closing quote
+        ++si;
+
+        if (s[si] != 'u')
         {
-            if (s[(*i) + 1] == 'u' && s[(*i) + 2] == 'l' && s[(*i) + 3] == 'l')
+            if (!__str_contains_c(__LIST_ESC, s[si]))
             {
-                self->type = VAL_NULL;
-                self->value = NULL;
-                (*i) += 4;
-                return 0;
-            }
-            else
-            {
-                __print("Failed to parse null in __parse_any_value");
-                return 1;
+                if (parsed != reuse)
+                    __mem_free(p->alloc, parsed);
+                parsed = NULL;
+                __parser_fail(p, JSON_ERR_INVALID_ESCAPE, si, "escape character", "Found invalid escaped character inside string.");
+                return NULL;
             }
-        }
 
-        if (s[*i] == 't')
-        {
-            if (s[(*i) + 1] == 'r' && s[(*i) + 2] == 'u' && s[(*i) + 3] == 'e')
-            {
-                int *boolean = malloc(sizeof(int));
+            parsed[pi++] = __ESC_TO_SEQ[(unsigned char)s[si]];
+            continue;
+        }
 
-                if (boolean == NULL)
-                {
-                    __print("Failed to allocate bool in __parse_any_value");
-                    return 1;
-                }
+        uint32_t cp;
+        const char *expected = NULL;
 
-                (*boolean) = 1;
+        if (__read_u_escape(s, si, end, &cp) != 0)
+        {
+            expected = "4 hex digits";
+        }
+        else if (cp >= 0xD800 && cp <= 0xDBFF)
+        {
+            // A high surrogate must be followed by an escaped low surrogate
+            uint32_t low;
 
-                self->type = VAL_BOOL;
-                self->value = boolean;
-                (*i) += 4;
-                return 0;
+            if (si + 6 < end && s[si + 5] == '\\' && s[si + 6] == 'u' &&
+                __read_u_escape(s, si + 6, end, &low) == 0 && low >= 0xDC00 && low <= 0xDFFF)
+            {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                si += 6;
             }
             else
             {
-                __print("Failed to parse true in __parse_any_value");
-                return 1;
+                expected = "low surrogate \\uDC00-\\uDFFF";
             }
         }
+        else if (cp >= 0xDC00 && cp <= 0xDFFF)
+        {
+            expected = "high surrogate before low surrogate";
+        }
+        else if (cp == 0)
+        {
+            // Strings are NUL terminated, an embedded NUL would silently truncate them
+            expected = "non-NUL character";
+        }
 
-        if (s[*i] == 'f')
+        if (expected != NULL)
         {
-            if (s[(*i) + 1] == 'a' && s[(*i) + 2] == 'l' && s[(*i) + 3] == 's' && s[(*i) + 4] == 'e')
-            {
-                int *boolean = malloc(sizeof(int));
+            if (parsed != reuse)
+                __mem_free(p->alloc, parsed);
+            parsed = NULL;
+            __parser_fail(p, JSON_ERR_INVALID_ESCAPE, si, expected, "Found invalid \\u escape inside string.");
+            return NULL;
+        }
 
-                if (boolean == NULL)
-                {
-                    __print("Failed to allocate bool in __parse_any_value");
-                    return 1;
-                }
+        pi += __utf8_encode(cp, parsed + pi);
+        si += 4;
+    }
+    parsed[pi] = '\0';
 
-                (*boolean) = 0;
+    (*i) = end + 1; // we add length of str + last closing quote
+    return parsed;
+}
 
-                self->type = VAL_BOOL;
-                self->value = boolean;
-                (*i) += 5;
-                return 0;
-            }
-            else
-            {
-                __print("Failed to parse true in __parse_any_value");
-                return 1;
-            }
-        }
+static char *__parse_string(__PARSER *p, uint64_t *i)
+{
+    return __parse_string_into(p, i, NULL);
+}
 
-        if (s[*i] == '{')
-        {
-            self->type = VAL_OBJECT;
-            err_t err = __parse_object(self, s, i);
+static err_t __consume_colon(__PARSER *p, uint64_t *i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__consume_colon");
 
-            if (err != 0)
-            {
-                __print("Failed to parse object in __parse_any_value");
-                return 1;
-            }
-            return 0;
-        }
+    __skip_whitespace(p, i);
 
-        if (s[*i] == '[')
-        {
-            self->type = VAL_ARRAY;
-            err_t err = __parse_array(self, s, i);
+    if (__peek(p, *i) != ':')
+        return __parser_unexpected(p, *i, "':'", "Expected character ':' after field name.");
 
-            if (err != 0)
-            {
-                __print("Failed to parse array in __parse_any_value");
-                return 1;
-            }
-            return 0;
-        }
+    ++(*i);
+    return 0;
+}
 
-        if (s[*i] == '"')
-        {
-            char *str = __parse_string(s, i);
+/**
+ * Reads the number at *i without allocating unless it is unusually long, the
+ * input is not NUL terminated so strtod needs a copy. The whole token must be
+ * consumed by strtod.
+ */
+static err_t __read_number(__PARSER *p, uint64_t *i, JSON_NUMBER *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__read_number");
 
-            if (str == NULL)
-            {
-                __print("Failed to parse string value in __parse_any_value");
-                return 1;
-            }
+    uint64_t len = __number_len(p, *i);
 
-            self->type = VAL_STRING;
-            self->value = str;
-            return 0;
-        }
+    if (len == 0)
+        return __parser_unexpected(p, *i, "number", "Found unexpected character while parsing number.");
 
-        if (__is_digit(s[*i]) || s[*i] == '.' || s[*i] == '-')
-        {
-            self->type = VAL_NUMBER;
+    char stack_buff[64];
+    char *digits_buff = stack_buff;
 
-            err_t err = __parse_number(self, s, i);
-            if (err != 0)
-            {
-                __print("Failed to parse number in __parse_any_value");
-                return 1;
-            }
-            return 0;
-        }
+    if (len >= sizeof(stack_buff))
+    {
+        digits_buff = __mem_alloc(p->alloc, sizeof(char) * (len + 1));
 
-        __printf("JSONparser: Found unexpected '%c' character while parsing value.\n", s[*i]);
-        return 1;
+        if (digits_buff == NULL)
+            return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate digits string in __read_number.");
     }
 
+    memcpy(digits_buff, &p->s[*i], len);
+    digits_buff[len] = '\0';
+
+    char *end = NULL;
+    errno = 0;
+    (*out) = (JSON_NUMBER)strtod(digits_buff, &end);
+    int failed = errno != 0 || end != digits_buff + len;
+
+    if (digits_buff != stack_buff)
+        __mem_free(p->alloc, digits_buff);
+
+    if (failed)
+        return __parser_fail(p, JSON_ERR_INVALID_NUMBER, *i, "number", "Failed to parse number using strtod.");
+
+    (*i) += len;
     return 0;
 }
 
-err_t __parse_object(JSON *self, const char *s, uint64_t *i)
+static err_t __parse_number(JSON *self, __PARSER *p, uint64_t *i)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__parse_object");
+        __print("__parse_number");
 
-    ++(*i);
+    JSON_NUMBER num;
 
-    if (s[*i] == '\0')
-    {
-        __print("Failed to parse object: found EOF during parsing in __parse_object");
+    if (__read_number(p, i, &num) != 0)
         return 1;
+
+    JSON_NUMBER *num_ptr = __mem_alloc(p->alloc, sizeof(JSON_NUMBER));
+
+    if (num_ptr == NULL)
+        return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate number in __parse_number.");
+
+    (*num_ptr) = num;
+
+    self->type = VAL_NUMBER;
+    self->value = num_ptr;
+    __STAT_NODE(VAL_NUMBER);
+    return 0;
+}
+
+static err_t __parse_bool(JSON *self, __PARSER *p, uint64_t *i, int value)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_bool");
+
+    const char *literal = value ? "true" : "false";
+
+    if (!__match_literal(p, *i, literal))
+        return __parser_fail(p, JSON_ERR_INVALID_LITERAL, *i, literal, "Failed to parse bool literal.");
+
+    int *boolean = __mem_alloc(p->alloc, sizeof(int));
+
+    if (boolean == NULL)
+        return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate bool in __parse_bool.");
+
+    (*boolean) = value;
+
+    self->type = VAL_BOOL;
+    self->value = boolean;
+    __STAT_NODE(VAL_BOOL);
+    (*i) += __str_len(literal);
+    return 0;
+}
+
+static err_t __parse_any_value(JSON *self, __PARSER *p, uint64_t *i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_any_value");
+
+    // A failed value is always left in a state json_free can release
+    self->type = VAL_NULL;
+    self->value = NULL;
+    self->flags = 0;
+
+    __skip_whitespace(p, i);
+
+    char c = __peek(p, *i);
+
+    if (c == 'n')
+    {
+        if (!__match_literal(p, *i, "null"))
+            return __parser_fail(p, JSON_ERR_INVALID_LITERAL, *i, "null", "Failed to parse null literal.");
+
+        __STAT_NODE(VAL_NULL);
+        (*i) += 4;
+        return 0;
     }
 
-    JSON_OBJECT *obj = malloc(sizeof(JSON_OBJECT));
-    err_t res = __init_object(obj);
+    if (c == 't')
+        return __parse_bool(self, p, i, 1);
 
-    if (res != 0)
+    if (c == 'f')
+        return __parse_bool(self, p, i, 0);
+
+    if (c == '{')
+        return __parse_object(self, p, i);
+
+    if (c == '[')
+        return __parse_array(self, p, i);
+
+    if (c == '"')
     {
-        free(obj);
-        obj = NULL;
-        __print("Failed to allocate object in __parse_object");
-        return 1;
+        char *str = __parse_string(p, i);
+
+        if (str == NULL)
+            return 1;
+
+        self->type = VAL_STRING;
+        self->value = str;
+        __STAT_NODE(VAL_STRING);
+        return 0;
     }
 
-    self->type = VAL_OBJECT;
-    self->value = obj;
+    if (__is_digit(c) || c == '.' || c == '-')
+        return __parse_number(self, p, i);
+
+    return __parser_unexpected(p, *i, "value", "Found unexpected character while parsing value.");
+}
+
+// Returns the shape at *slot, learning a new empty one the first time
+static __SHAPE *__shape_get(JSON_SHAPES *shapes, __SHAPE **slot)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__shape_get");
+
+    if ((*slot) != NULL)
+        return *slot;
+
+    if (shapes->stats.positions >= __SHAPES_MAX)
+        return NULL;
+
+    __SHAPE *shape = __mem_alloc(shapes->alloc, sizeof(__SHAPE));
+
+    if (shape == NULL)
+        return NULL;
+
+    (*shape) = (__SHAPE){.first = __SHAPE_NONE};
+    (*slot) = shape;
+    shapes->stats.positions += 1;
+    return shape;
+}
+
+/**
+ * Returns the index of field in shape, after a key that was not the expected
+ * one. Keys that are new at this position are interned and appended while
+ * there is room, otherwise __SHAPE_NONE.
+ */
+static uint64_t __shape_key_find(JSON_SHAPES *shapes, __SHAPE *shape, const char *field)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__shape_key_find");
 
-    while (s[*i] != '\0')
+    for (uint64_t k = 0; k < shape->length; ++k)
     {
-        if ((*i) == __MAX_ITER)
-        {
-            __print("__MAX_ITER reached in __parse_object");
-            goto clean_obj_entries;
-        }
+        if (strcmp(shape->keys[k].key, field) == 0)
+            return k;
+    }
 
-        if (__is_whitespace(s[*i]))
-        {
-            ++(*i);
-            continue;
-        }
+    if (shape->length >= __SHAPE_MAX_KEYS || shapes->stats.keys >= __SHAPES_MAX)
+        return __SHAPE_NONE;
+
+    uint64_t len = __str_len(field);
 
-        if (s[*i] == '}')
+    // Only keys that read the same raw and decoded can be matched in place
+    if (strchr(field, '"') != NULL || strchr(field, '\\') != NULL || __utf8_invalid_at(field, 0, len) != len)
+        return __SHAPE_NONE;
+
+    __SHAPE_KEY *keys = __mem_realloc(shapes->alloc, shape->keys, sizeof(__SHAPE_KEY) * (shape->length + 1));
+
+    if (keys == NULL)
+        return __SHAPE_NONE;
+
+    shape->keys = keys;
+
+    char *key = NULL;
+
+    if (__str_copy_alloc(field, &key, shapes->alloc) != 0)
+    {
+        __mem_free(shapes->alloc, key);
+        return __SHAPE_NONE;
+    }
+
+    keys[shape->length] = (__SHAPE_KEY){.key = key, .len = len, .next = __SHAPE_NONE, .child = NULL};
+    shape->length += 1;
+    shapes->stats.keys += 1;
+    return shape->length - 1;
+}
+
+// Returns where the key following index prev is learned, NULL after an unlearned key
+static uint64_t *__shape_next(__SHAPE *shape, uint64_t prev)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__shape_next");
+
+    if (prev == __SHAPE_START)
+        return &shape->first;
+
+    return (prev < shape->length) ? &shape->keys[prev].next : NULL;
+}
+
+// Appends to an object whose vectors have room for *cap entries
+static err_t __object_push(JSON_OBJECT *obj, uint64_t *cap, char *field, JSON *value, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__object_push");
+
+    if (obj->length >= (*cap))
+    {
+        if (__append_object_entry_owned(obj, field, value, a) != 0)
+            return 1;
+
+        (*cap) = obj->length;
+        return 0;
+    }
+
+    obj->fields[obj->length] = field;
+    obj->values[obj->length] = value;
+    obj->length += 1;
+    obj->fields[obj->length] = NULL;
+    return 0;
+}
+
+/**
+ * Parses the entry at *i ("key": value) and appends it to obj. With a shape,
+ * the key that followed the previous key *prev last time is compared against
+ * the input first, and on a match the entry borrows the interned key instead
+ * of parsing a copy. *prev is then moved to this key.
+ */
+static err_t __parse_object_entry(JSON_OBJECT *obj, uint64_t *cap, __SHAPE *shape, uint64_t *prev, __PARSER *p,
+                                  uint64_t *i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_object_entry");
+
+    uint64_t *link = (shape != NULL) ? __shape_next(shape, *prev) : NULL;
+    uint64_t k = (link != NULL) ? (*link) : __SHAPE_NONE;
+    __SHAPE_KEY *expected = (shape != NULL && k < shape->length) ? &shape->keys[k] : NULL;
+    __SHAPE **child = NULL;
+    char *field = NULL;
+    int borrowed = 0;
+
+    if (expected != NULL && (*i) + expected->len + 1 < p->len && p->s[(*i) + 1 + expected->len] == '"' &&
+        memcmp(p->s + (*i) + 1, expected->key, expected->len) == 0)
+    {
+        field = expected->key;
+        borrowed = 1;
+        (*i) += expected->len + 2;
+        p->shapes->stats.hits += 1;
+    }
+    else
+    {
+        field = __parse_string(p, i);
+
+        if (field == NULL)
+            return 1;
+
+        if (shape != NULL)
         {
-            ++(*i);
-            return 0;
+            k = __shape_key_find(p->shapes, shape, field);
+            p->shapes->stats.misses += 1;
+
+            // Interning may have moved the keys
+            link = __shape_next(shape, *prev);
+
+            if (link != NULL && k < shape->length)
+                (*link) = k;
         }
+    }
 
-        if (s[*i] == '"')
-        {
-            char *field = __parse_string(s, i);
+    if (shape != NULL)
+    {
+        child = (k < shape->length) ? &shape->keys[k].child : NULL;
+        (*prev) = k;
+    }
 
-            if (field == NULL)
-            {
-                __print("Failed to parse object, could not parse field string.");
-                goto clean_obj_entries;
-            }
+    if (__consume_colon(p, i) != 0)
+        goto clean_field;
 
-            int res = __consume_colon(s, i);
-            if (res != 0)
-            {
-                __print("Failed to parse object, incomplete entry missing the ':' character.");
-                goto clean_field;
-            }
+    JSON *value = __mem_alloc(p->alloc, sizeof(JSON));
 
-            JSON *value = malloc(sizeof(JSON));
+    if (value == NULL)
+    {
+        __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate value in __parse_object.");
+        goto clean_field;
+    }
 
-            if (value == NULL)
-            {
-                __print("Failed to allocate value in __parse_object");
-                goto clean_field;
-            }
+    p->shape = child;
 
-            err_t err = __parse_any_value(value, s, i);
+    if (__parse_any_value(value, p, i) != 0)
+        goto clean_value;
 
-            if (err != 0)
-            {
-                __print("Failed to parse value in __parse_object");
-                goto clean_value;
-            }
+    if (borrowed)
+        value->flags |= __NODE_BORROWED_KEY;
 
-            err = __append_object_entry(obj, field, value);
+    // The parsed key moves into the object, no second copy
+    if (__object_push(obj, cap, field, value, p->alloc) != 0)
+    {
+        __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to append entry in __parse_object.");
+        goto clean_value;
+    }
+    return 0;
 
-            if (err != 0)
-            {
-                __print("Failed to parse value in __parse_object");
-                goto clean_value;
-            }
+clean_value:
+    __free_value(value, p->alloc);
+    value = NULL;
+clean_field:
+    if (!borrowed)
+        __mem_free(p->alloc, field);
+    field = NULL;
+    return 1;
+}
 
-            while (__is_whitespace(s[*i]))
-            {
-                ++(*i);
-            }
+static err_t __parse_object(JSON *self, __PARSER *p, uint64_t *i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_object");
 
-            if (s[*i] == ',')
-            {
-                free(field);
-                field = NULL;
+    if (p->depth >= p->max_depth)
+        return __parser_fail(p, JSON_ERR_MAX_DEPTH, *i, NULL, "Maximum nesting depth reached while parsing object.");
 
-                ++(*i);
-                continue;
-            }
-            else if (s[*i] != '}')
-            {
-                __printf("JSONparser: Expected ',', or '}', but found '%c' instead at position %lld.\n", s[*i], *i);
-                goto clean_value;
-            }
+    ++(*i);
 
-            free(field);
-            field = NULL;
+    __SHAPE *shape = (p->shape != NULL) ? __shape_get(p->shapes, p->shape) : NULL;
+    uint64_t cap = (shape != NULL) ? shape->entries : 0;
+    uint64_t prev = __SHAPE_START;
 
-            ++(*i);
-            return 0;
+    JSON_OBJECT *obj = __mem_alloc(p->alloc, sizeof(JSON_OBJECT));
 
-        clean_value:
-            free(value);
-            value = NULL;
-        clean_field:
-            free(field);
-            field = NULL;
-        clean_obj_entries:
-            free(obj->fields);
-            obj->fields = NULL;
-            free(obj->values);
-            obj->values = NULL;
-        clean_obj:
-            free(obj);
-            obj = NULL;
+    if (obj == NULL)
+        return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate object in __parse_object.");
+
+    if (__init_object_sized(obj, cap, p->alloc) != 0)
+    {
+        __mem_free(p->alloc, obj);
+        obj = NULL;
+        return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate object in __parse_object.");
+    }
+
+    // From here on the partially parsed object is owned by self
+    self->type = VAL_OBJECT;
+    self->value = obj;
+    __STAT_NODE(VAL_OBJECT);
+    ++p->depth;
+
+    while (1)
+    {
+        __skip_whitespace(p, i);
+
+        char c = __peek(p, *i);
+
+        if (c == '}')
+            break;
+
+        if (c != '"')
+            return __parser_unexpected(p, *i, "'\"' or '}'", "Found unexpected character while parsing object.");
+
+        if (__parse_object_entry(obj, &cap, shape, &prev, p, i) != 0)
             return 1;
+
+        __skip_whitespace(p, i);
+
+        c = __peek(p, *i);
+
+        if (c == ',')
+        {
+            ++(*i);
+            continue;
         }
 
-        __printf("JSONparser: Found unexpected '%c' character while parsing object.\n", s[*i]);
-        free(obj);
-        obj = NULL;
-        return 1;
+        if (c == '}')
+            break;
+
+        return __parser_unexpected(p, *i, "',' or '}'", "Expected ',' or '}' after object entry.");
     }
 
-    __print("Found EOF when parsing object.");
-    free(obj);
-    obj = NULL;
-    return 1;
-};
+    ++(*i);
+    --p->depth;
+
+    if (shape != NULL)
+        shape->entries = obj->length;
+
+    return 0;
+}
 
-err_t __init_array(JSON_ARRAY *self)
+static err_t __init_array(JSON_ARRAY *self, const JSON_ALLOCATOR *a)
 {
     if (JSON_PARSER_DEBUG)
         __print("__init_array");
 
-    self->elements = malloc(sizeof(JSON *));
+    self->elements = __mem_alloc(a, sizeof(JSON *));
     if (self->elements == NULL)
     {
-        __print("Failed to allocate elements in array.");
         return 1;
     }
 
@@ -918,1252 +1985,7321 @@ err_t __init_array(JSON_ARRAY *self)
     return 0;
 }
 
-err_t __append_array_element(JSON_ARRAY *array, JSON *value)
+static err_t __append_array_element(JSON_ARRAY *array, JSON *value, const JSON_ALLOCATOR *a)
 {
     if (JSON_PARSER_DEBUG)
         __print("__append_array_element");
 
-    array->elements = realloc(array->elements, sizeof(JSON *) * (array->length + 1));
+    JSON **elements = __mem_realloc(a, array->elements, sizeof(JSON *) * (array->length + 1));
 
-    if (array->elements == NULL)
+    if (elements == NULL)
     {
-        __print("Failed to reallocate elements in array.");
         return 1;
     }
 
+    array->elements = elements;
     array->elements[array->length] = value;
     array->length += 1;
     return 0;
 }
 
-err_t __parse_array(JSON *self, const char *s, uint64_t *i)
+static err_t __parse_array(JSON *self, __PARSER *p, uint64_t *i)
 {
     if (JSON_PARSER_DEBUG)
         __print("__parse_array");
 
-    (*i)++;
+    if (p->depth >= p->max_depth)
+        return __parser_fail(p, JSON_ERR_MAX_DEPTH, *i, NULL, "Maximum nesting depth reached while parsing array.");
 
-    if (s[*i] == '\0')
-    {
-        __print("Failed to parse array: found EOF during parsing in __parse_array");
-        return 1;
-    }
+    ++(*i);
 
-    JSON_ARRAY *array = malloc(sizeof(JSON_ARRAY));
+    __SHAPE *shape = (p->shape != NULL) ? __shape_get(p->shapes, p->shape) : NULL;
+
+    JSON_ARRAY *array = __mem_alloc(p->alloc, sizeof(JSON_ARRAY));
 
     if (array == NULL)
-    {
-        __print("Failed to allocate array in __parse_array");
-        return 1;
-    }
+        return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate array in __parse_array.");
 
-    err_t err = __init_array(array);
-    if (err != 0)
+    if (__init_array(array, p->alloc) != 0)
     {
-        free(array);
+        __mem_free(p->alloc, array);
         array = NULL;
-        return 1;
+        return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate array in __parse_array.");
     }
 
+    // From here on the partially parsed array is owned by self
     self->type = VAL_ARRAY;
     self->value = array;
+    __STAT_NODE(VAL_ARRAY);
+    ++p->depth;
 
-    while (s[*i] != '\0')
+    while (1)
     {
-        if ((*i) == __MAX_ITER)
-        {
-            __print("__MAX_ITER reached in __parse_array");
-            goto clean_arr_elems;
-        }
-
-        if (__is_whitespace(s[*i]))
-        {
-            ++(*i);
-            continue;
-        }
+        __skip_whitespace(p, i);
 
-        if (s[*i] == ']')
+        if (__peek(p, *i) == ']')
         {
             ++(*i);
+            --p->depth;
             return 0;
         }
 
-        JSON *value = malloc(sizeof(JSON));
+        JSON *value = __mem_alloc(p->alloc, sizeof(JSON));
 
         if (value == NULL)
-        {
-            __print("Failed to allocate JSON for element in array.");
-            goto clean_arr_elems;
-        }
+            return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate element in __parse_array.");
 
-        err_t err = __parse_any_value(value, s, i);
-        if (err != 0)
-        {
-            __print("Failed to parse value in array.");
+        // Every element shares one position
+        p->shape = (shape != NULL) ? &shape->items : NULL;
+
+        if (__parse_any_value(value, p, i) != 0)
             goto clean_value;
-        }
 
-        err = __append_array_element(array, value);
-        if (err != 0)
+        if (__append_array_element(array, value, p->alloc) != 0)
         {
+            __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to append element in __parse_array.");
             goto clean_value;
         }
 
-        while (__is_whitespace(s[*i]))
-        {
-            ++(*i);
-        }
+        __skip_whitespace(p, i);
 
-        if (s[*i] == ',')
+        char c = __peek(p, *i);
+
+        if (c == ',')
         {
             ++(*i);
             continue;
         }
 
-        if (s[*i] == ']')
+        if (c == ']')
         {
             ++(*i);
+            --p->depth;
             return 0;
         }
 
-        __printf("JSONparser: Unexpected character '%c' while parsing array.\n", s[*i]);
+        return __parser_unexpected(p, *i, "',' or ']'", "Expected ',' or ']' after array element.");
 
     clean_value:
-        free(value);
+        __free_value(value, p->alloc);
         value = NULL;
-    clean_arr_elems:
-        free(array->elements);
-        array->elements = NULL;
-    clean_arr:
-        free(array);
-        array = NULL;
         return 1;
     }
-
-    __print("Found EOF while parsing array.");
-    free(array->elements);
-    array->elements = NULL;
-    free(array);
-    array = NULL;
-    return 1;
 }
 
-/**
- * @brief Parses a JSON string and returns a `JSON` struct pointer
- *
- * @param s json string (s is not modified)
- * @return NULL | JSON* (memory owned, you need to free it using `json_free`)
- */
-JSON *json_parse(const char *s)
+static JSON *__parse_root(__PARSER *p)
 {
     if (JSON_PARSER_DEBUG)
-        __print("json_parse");
-
-    if (s == NULL)
-        return NULL;
+        __print("__parse_root");
 
     uint64_t i = 0;
 
-    while (1)
-    {
-        if (i == __MAX_ITER)
-        {
-            __print("__MAX_ITER reached in json_parse");
-            return NULL;
-        }
-
-        if (s[i] == '\0')
-        {
-            __print("Found EOF in json_parse");
-            return NULL;
-        }
-
-        if (s[i] == '{')
-        {
-            JSON *obj = malloc(sizeof(JSON));
-
-            if (obj == NULL)
-            {
-                __print("Failed to alloc object in json_parse");
-                return NULL;
-            }
-
-            obj->type = VAL_OBJECT;
-
-            err_t err = __parse_object(obj, s, &i);
-
-            if (err != 0)
-            {
-                __print("Failed to parse outer object.");
-                goto clean_obj;
-            }
+    __skip_whitespace(p, &i);
 
-            return obj;
-
-        clean_obj:
-            free(obj);
-            obj = NULL;
-            return NULL;
-        }
+    char c = __peek(p, i);
 
-        if (s[i] == '[')
-        {
-            JSON *arr = malloc(sizeof(JSON));
+    if (c != '{' && c != '[')
+    {
+        __parser_unexpected(p, i, "'{' or '['", "Expected an object or an array at the top level.");
+        return NULL;
+    }
 
-            if (arr == NULL)
-            {
-                __print("Failed to alloc array in json_parse");
-                return NULL;
-            }
+    JSON *root = __mem_alloc(p->alloc, sizeof(JSON));
 
-            arr->type = VAL_ARRAY;
-            err_t err = __parse_array(arr, s, &i);
+    if (root == NULL)
+    {
+        __parser_fail(p, JSON_ERR_ALLOC, i, NULL, "Failed to allocate root in json_parse.");
+        return NULL;
+    }
 
-            if (err != 0)
-            {
-                __print("Failed to parse outer array.");
-                goto clean_arr;
-            }
+    root->type = VAL_NULL;
+    root->value = NULL;
+    root->flags = 0;
 
-            return arr;
+    p->shapes = (p->opts != NULL) ? p->opts->shapes : NULL;
+    p->shape = (p->shapes != NULL) ? &p->shapes->root : NULL;
 
-        clean_arr:
-            free(arr);
-            arr = NULL;
-            return NULL;
-        }
+    err_t err = (c == '{') ? __parse_object(root, p, &i) : __parse_array(root, p, &i);
 
-        if (__is_whitespace(s[i]))
-        {
-            ++i;
-            continue;
-        }
-        else
-        {
-            __printf("JSONparser: Expected characters ['{','[',' ','\\n','\\r','\\t'] but got unexpected '%c' instead at position %lld\n", s[i], i);
-            return NULL;
-        }
+    if (err != 0)
+    {
+        __free_value(root, p->alloc);
+        root = NULL;
+        return NULL;
     }
-    __print("Somehow you escaped an infinite loop, how did we get here??");
-    return NULL;
+
+    return root;
 }
 
 /**
- * @brief Get a value in object using field name
+ * @brief Returns a string representation of a parse error code.
  *
- * @param self JSON struct of type VAL_OBJECT
- * @param field name of field
- * @return NULL | JSON* (do not free, if you wish to free the memory, free the highest parent instead using json_free)
+ * @param code Obtained from err.code
+ * @return NULL | const char* (read-only memory, do not free)
  */
-JSON *json_object_get(JSON *self, const char *field)
+const char *json_error_to_str(JSON_ERROR_CODE code)
 {
-    if (JSON_PARSER_DEBUG)
-        __print("json_object_get");
-
-    if (self->type != VAL_OBJECT)
+    if (code > JSON_ERR_CAPACITY)
     {
-        __print("Cannot use json_object_get on object that is not of type VAL_OBJECT.");
         return NULL;
     }
-
-    JSON_OBJECT *obj = self->value;
-
-    for (uint64_t i = 0; i < obj->length; ++i)
-    {
-        if (__str_comp(field, obj->fields[i]))
-        {
-            return obj->values[i];
-        }
-    }
-    __printf("JSONparser: json_object_get failed to find field \"%s\" in object.\n", field);
-    return NULL;
+    return __ERR_TO_STR[code];
 }
 
 /**
- * @brief Get the item at index in array
+ * @brief Parses a JSON string of known length without ever writing to stdio.
+ * On failure, the first error is reported through `err` and, if set, through
+ * `opts->on_error`.
  *
- * @param self JSON struct of type VAL_ARRAY
- * @param index
- * @return NULL | JSON* (do not free, if you wish to free the memory, free the highest parent instead using json_free)
+ * @param s json string (s is not modified, does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @param opts NULL | parse options
+ * @param err NULL | filled with the error, err->code is JSON_ERR_NONE on success
+ * @return NULL | JSON* (memory owned, you need to free it using `json_free`)
  */
-JSON *json_array_get(JSON *self, uint64_t index)
+JSON *json_parse_ex(const char *s, uint64_t len, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err)
 {
     if (JSON_PARSER_DEBUG)
-        __print("json_array_get");
+        __print("json_parse_ex");
+
+    __PARSER p = {
+        .s = s,
+        .len = len,
+        .opts = opts,
+        .alloc = (opts != NULL) ? opts->allocator : NULL,
+        .err = {0},
+        .depth = 0,
+        .max_depth = (opts != NULL && opts->max_depth != 0) ? opts->max_depth : JSON_PARSER_MAX_DEPTH,
+        .flags = (opts != NULL) ? opts->flags : JSON_PARSE_DEFAULT,
+    };
 
-    if (self->type != VAL_ARRAY)
-    {
-        __print("Cannot use json_array_get on object that is not of type VAL_ARRAY.");
-        return NULL;
-    }
+    __STAT_TIMER_START(start);
 
-    JSON_ARRAY *arr = self->value;
+    JSON *result = NULL;
 
-    if (index >= arr->length)
-    {
-        __printf("JSONparser: in json_get_array, tried to access index %llu, which is out of bounds of array.", index);
-        return NULL;
-    }
+    if (s == NULL)
+        __parser_fail(&p, JSON_ERR_NULL_INPUT, 0, NULL, "Input string is NULL.");
+    else
+        result = __parse_root(&p);
 
-    return arr->elements[index];
-}
+    __STAT_ADD(parse_calls, 1);
+    __STAT_ADD(bytes_parsed, (result != NULL) ? len : p.err.offset);
+    __STAT_TIMER_STOP(start, parse_ns);
 
-JSON *json_get_deep(JSON *self, uint64_t fields_amount, const char *fields[fields_amount])
-{
-    if (JSON_PARSER_DEBUG)
-        __print("json_get_deep");
+    if (err != NULL)
+        (*err) = p.err;
 
-    if (fields_amount == 0)
-    {
-        __print("json_get_deep called with 0 fields to access.");
-        return NULL;
-    }
+    return result;
+}
 
-    const char *access = fields[0];
+static void __print_diagnostic(const JSON_ERROR *err, const char *message, void *user)
+{
+    if (JSON_PARSER_SILENT)
+        return;
 
-    if (access == NULL)
-    {
-        __print("argument fields[0] of json_get_deep is NULL.");
-        return NULL;
-    }
+    const char *s = user;
 
-    if (self->type == VAL_OBJECT)
+    if (err->code == JSON_ERR_UNEXPECTED_CHAR)
     {
-        JSON *val = json_object_get(self, access);
-
-        if (val == NULL)
-        {
-            __print("Failed to get value from object access.");
-            return NULL;
-        }
-
-        if (fields_amount == 1)
-        {
-            return val;
-        }
-        else
-        {
-            return json_get_deep(val, fields_amount - 1, &fields[1]);
-        }
+        __printf("JSONparser: %s Found '%c' at position %llu, expected %s.\n",
+                 message, s[err->offset], (unsigned long long)err->offset, err->expected);
+        return;
     }
-    else if (self->type == VAL_ARRAY)
-    {
-        uint64_t index = strtoull(access, NULL, 10);
-        JSON *val = json_array_get(self, index);
-
-        if (val == NULL)
-        {
-            __print("Failed to get value from array access.");
-            return NULL;
-        }
 
-        if (fields_amount == 1)
-        {
-            return val;
-        }
-        else
-        {
-            return json_get_deep(val, fields_amount - 1, &fields[1]);
-        }
-    }
-    else
-    {
-        __print("Type of JSON value cannot be accessed.");
-        return NULL;
-    }
+    __printf("JSONparser: %s (%s at position %llu)\n",
+             message, json_error_to_str(err->code), (unsigned long long)err->offset);
 }
 
 /**
- * @brief Returns a string representation of a JSON value type.
+ * @brief Parses a JSON string and returns a `JSON` struct pointer
  *
- * @param type Obtained from json->type
- * @return NULL | const char* (read-only memory, do not free)
+ * @param s json string (s is not modified)
+ * @return NULL | JSON* (memory owned, you need to free it using `json_free`)
  */
-const char *json_type_to_str(VALUE_TYPE type)
+JSON *json_parse(const char *s)
 {
-    if (type > VAL_NULL)
-    {
+    if (JSON_PARSER_DEBUG)
+        __print("json_parse");
+
+    if (s == NULL)
         return NULL;
-    }
-    return __VAL_TO_STR[type];
+
+    JSON_PARSE_OPTIONS opts = {
+        .on_error = __print_diagnostic,
+        .user = (void *)s,
+        .allocator = NULL,
+        .max_depth = 0,
+        .flags = JSON_PARSE_DEFAULT,
+    };
+
+    return json_parse_ex(s, __str_len(s), &opts, NULL);
 }
 
-void __builder_append(__BUILDER *builder, char *segment)
+// Parse into an existing tree
+
+static err_t __parse_value_into(JSON *self, __PARSER *p, uint64_t *i);
+
+// Turns json into a VAL_NULL, keeping the node and how its key is owned
+static void __reset_value(JSON *json, const JSON_ALLOCATOR *a)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__builder_append");
-
-    __STRING_SEGMENT seg = {
-        .str = segment,
-        .len = __str_len(segment),
-    };
+        __print("__reset_value");
 
-    if (builder->len == 0)
-    {
-        builder->segments = malloc(sizeof(__STRING_SEGMENT));
-        builder->len = 1;
-        builder->segments[0] = seg;
-    }
-    else
-    {
-        builder->segments = realloc(builder->segments, sizeof(__STRING_SEGMENT) * (builder->len + 1));
-        builder->len += 1;
-        builder->segments[builder->len - 1] = seg;
-    }
+    __free_contents(json, a);
+    json->type = VAL_NULL;
+    json->value = NULL;
+    json->flags &= __NODE_BORROWED_KEY;
 }
 
-char *__builder_get_str(__BUILDER *builder)
+/**
+ * __parse_value_into for a child of a container. A compacted document
+ * appended to the tree keeps its header inside its block, so it is released
+ * and replaced by a new node instead of being reset in place.
+ */
+static err_t __parse_slot_into(JSON **slot, __PARSER *p, uint64_t *i)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__builder_get_str");
+        __print("__parse_slot_into");
 
-    if (builder == NULL || builder->len == 0)
+    JSON *self = *slot;
+
+    if (self->flags & __NODE_COMPACT)
     {
-        char *result = malloc(sizeof(char));
+        JSON *fresh = __mem_alloc(p->alloc, sizeof(JSON));
 
-        if (result == NULL)
-        {
-            __print("Failed to allocate memory for empty string in __builder_get_str");
-            return NULL;
-        }
+        if (fresh == NULL)
+            return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate node in __parse_slot_into.");
 
-        (*result) = '\0';
-        return result;
+        fresh->value = NULL;
+        fresh->type = VAL_NULL;
+        fresh->flags = self->flags & __NODE_BORROWED_KEY;
+        __free_value(self, p->alloc);
+        *slot = self = fresh;
     }
 
-    uint64_t total_len = 0;
+    return __parse_value_into(self, p, i);
+}
 
-    for (uint64_t i = 0; i < builder->len; ++i)
-    {
-        total_len += builder->segments[i].len;
-    }
+/**
+ * Parses the key at *i into (*field), keeping the current key without
+ * touching it when the text is the same. borrowed is the __NODE_BORROWED_KEY
+ * bit of the entry, cleared when the key is replaced.
+ */
+static err_t __parse_key_into(__PARSER *p, uint64_t *i, char **field, uint8_t *borrowed)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_key_into");
 
-    char *result = malloc(sizeof(char) * (total_len + 1));
+    uint64_t start = (*i) + 1;
+    uint64_t len = 0;
+    int has_escape = 0;
 
-    if (result == NULL)
-    {
-        __print("Failed to allocate memory for string in __builder_get_str");
-        return NULL;
-    }
+    if (__unparsed_str_len(p, start, &len, &has_escape) != 0)
+        return 1;
 
-    uint64_t offset = 0;
-    for (uint64_t i = 0; i < builder->len; ++i)
+    if (!has_escape && strncmp(*field, p->s + start, len) == 0 && (*field)[len] == '\0' &&
+        (!(p->flags & JSON_PARSE_VALIDATE_UTF8) || __utf8_invalid_at(p->s, start, start + len) == start + len))
     {
-        memcpy(result + offset, builder->segments[i].str, builder->segments[i].len);
-        offset += builder->segments[i].len;
+        (*i) = start + len + 1;
+        return 0;
     }
 
-    result[total_len] = '\0';
-    return result;
+    char *key = __parse_string_into(p, i, (*borrowed) ? NULL : (*field));
+
+    if (key == NULL)
+        return 1;
+
+    if (key != (*field) && !(*borrowed))
+        __mem_free(p->alloc, *field);
+
+    (*field) = key;
+    (*borrowed) = 0;
+    return 0;
 }
 
-char *__escape_string(const char *value)
+static err_t __parse_object_into(JSON *self, __PARSER *p, uint64_t *i)
 {
     if (JSON_PARSER_DEBUG)
-        __print("__escape_string");
+        __print("__parse_object_into");
 
-    uint64_t len = __str_len(value);
-    uint64_t capacity = len + 1;
-    char *escaped = malloc(sizeof(char) * capacity);
+    if (p->depth >= p->max_depth)
+        return __parser_fail(p, JSON_ERR_MAX_DEPTH, *i, NULL, "Maximum nesting depth reached while parsing object.");
 
-    if (!escaped)
-    {
-        __print("Memory allocation failed in __escape_string");
-        return NULL;
-    }
+    ++(*i);
+    ++p->depth;
 
-    uint64_t index = 0;
-    for (uint64_t i = 0; i < len; ++i)
+    JSON_OBJECT *obj = self->value;
+    uint64_t cap = obj->length;
+    uint64_t k = 0;
+
+    while (1)
     {
-        char c = value[i];
+        __skip_whitespace(p, i);
 
-        if (c != '\0' && __str_contains_c(__LIST_SEQ, c))
-        {
-            const char *esc_seq = __SEQ_TO_ESC[(unsigned char)c];
-            uint64_t esc_len = 2;
+        char c = __peek(p, *i);
 
-            if (index + esc_len >= capacity)
-            {
-                capacity *= 2;
-                char *temp = realloc(escaped, sizeof(char) * capacity);
-                if (!temp)
-                {
-                    __print("Memory reallocation failed in __escape_string");
-                    free(escaped);
-                    escaped = NULL;
-                    return NULL;
-                }
-                escaped = temp;
-            }
+        if (c == '}')
+            break;
 
-            escaped[index] = esc_seq[0];
-            escaped[index + 1] = esc_seq[1];
-            index += esc_len;
-        }
-        else
+        if (c != '"')
+            return __parser_unexpected(p, *i, "'\"' or '}'", "Found unexpected character while parsing object.");
+
+        if (k < obj->length)
         {
-            if (index + 1 >= capacity)
-            {
-                capacity *= 2;
-                char *temp = realloc(escaped, sizeof(char) * capacity);
-                if (!temp)
-                {
-                    __print("Memory reallocation failed in __escape_string");
-                    free(escaped);
-                    escaped = NULL;
-                    return NULL;
-                }
-                escaped = temp;
-            }
-            escaped[index++] = c;
-        }
-    }
-
-    escaped[index] = '\0';
-    return escaped;
-}
+            // Same position as in the previous document, reuse the entry
+            JSON *value = obj->values[k];
+            uint8_t borrowed = value->flags & __NODE_BORROWED_KEY;
 
-/**
- * @brief Stringifies a JSON struct as well as all its descendants.
- *
- * @param json JSON struct (obtained from json_parse)
- * @return NULL | char* (memory owned, you need to free it)
- */
-char *json_stringify(JSON *json)
-{
-    if (JSON_PARSER_DEBUG)
-        __print("json_stringify");
+            if (__parse_key_into(p, i, &obj->fields[k], &borrowed) != 0)
+                return 1;
 
-    __BUILDER builder = {
-        .len = 0,
-        .segments = NULL,
-    };
+            value->flags = (value->flags & ~__NODE_BORROWED_KEY) | borrowed;
 
-    switch (json->type)
-    {
-    case VAL_OBJECT:
-    {
-        __builder_append(&builder, "{");
+            if (__consume_colon(p, i) != 0 || __parse_slot_into(&obj->values[k], p, i) != 0)
+                return 1;
+        }
+        else if (__parse_object_entry(obj, &cap, NULL, NULL, p, i) != 0)
+        {
+            return 1;
+        }
+        ++k;
 
-        JSON_OBJECT *obj = json->value;
+        __skip_whitespace(p, i);
 
-        const uint64_t cleaner_size = obj->length * 2;
-        char *to_clean[cleaner_size];
+        c = __peek(p, *i);
 
-        for (uint64_t i = 0; i < obj->length; ++i)
+        if (c == ',')
         {
-            // create dud STRING value object to parse as json string
-            JSON *field_obj = malloc(sizeof(JSON));
-            field_obj->type = VAL_STRING;
-            field_obj->value = obj->fields[i];
+            ++(*i);
+            continue;
+        }
 
-            char *string_field = json_stringify(field_obj);
-            if (string_field == NULL)
-            {
-                __print("Failed to stringify field in object entry.");
-                free(builder.segments);
-                builder.segments = NULL;
-                return NULL;
-            }
+        if (c == '}')
+            break;
 
-            free(field_obj);
-            field_obj = NULL;
+        return __parser_unexpected(p, *i, "',' or '}'", "Expected ',' or '}' after object entry.");
+    }
+    ++(*i);
+    --p->depth;
+
+    // Entries the new document does not have anymore
+    for (uint64_t j = k; j < obj->length; ++j)
+    {
+        if (!(obj->values[j]->flags & __NODE_BORROWED_KEY))
+            __mem_free(p->alloc, obj->fields[j]);
+        obj->fields[j] = NULL;
+        __free_value(obj->values[j], p->alloc);
+        obj->values[j] = NULL;
+    }
+    obj->length = k;
+    return 0;
+}
 
-            __builder_append(&builder, string_field);
-            __builder_append(&builder, ":");
+static err_t __parse_array_into(JSON *self, __PARSER *p, uint64_t *i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_array_into");
 
-            char *string_val = json_stringify(obj->values[i]);
-            if (string_val == NULL)
-            {
-                __print("Failed to stringify value in object entry.");
-                free(builder.segments);
-                builder.segments = NULL;
-                return NULL;
-            }
+    if (p->depth >= p->max_depth)
+        return __parser_fail(p, JSON_ERR_MAX_DEPTH, *i, NULL, "Maximum nesting depth reached while parsing array.");
 
-            __builder_append(&builder, string_val);
+    ++(*i);
+    ++p->depth;
 
-            to_clean[i] = string_field;
-            to_clean[(uint64_t)(cleaner_size / 2) + i] = string_val;
+    JSON_ARRAY *arr = self->value;
+    uint64_t k = 0;
 
-            if (i != obj->length - 1)
-            {
-                __builder_append(&builder, ",");
-            }
-        }
-        __builder_append(&builder, "}");
+    while (1)
+    {
+        __skip_whitespace(p, i);
 
-        char *result = __builder_get_str(&builder);
-        free(builder.segments);
-        builder.segments = NULL;
+        if (__peek(p, *i) == ']')
+            break;
 
-        for (uint64_t i = 0; i < cleaner_size; ++i)
+        if (k < arr->length)
         {
-            free(to_clean[i]);
-            to_clean[i] = NULL;
+            if (__parse_slot_into(&arr->elements[k], p, i) != 0)
+                return 1;
         }
-        return result;
-    }
-    case VAL_ARRAY:
-    {
-        __builder_append(&builder, "[");
-
-        JSON_ARRAY *arr = json->value;
+        else
+        {
+            JSON *value = __mem_alloc(p->alloc, sizeof(JSON));
 
-        char *to_clean[arr->length];
+            if (value == NULL)
+                return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to allocate element in __parse_array_into.");
 
-        for (uint64_t i = 0; i < arr->length; ++i)
-        {
-            char *string_val = json_stringify(arr->elements[i]);
-            if (string_val == NULL)
+            if (__parse_any_value(value, p, i) != 0)
             {
-                __print("Failed to stringify value in array.");
-                free(builder.segments);
-                builder.segments = NULL;
-                return NULL;
+                __free_value(value, p->alloc);
+                return 1;
             }
 
-            to_clean[i] = string_val;
-
-            __builder_append(&builder, string_val);
-
-            if (i != arr->length - 1)
+            if (__append_array_element(arr, value, p->alloc) != 0)
             {
-                __builder_append(&builder, ",");
+                __free_value(value, p->alloc);
+                return __parser_fail(p, JSON_ERR_ALLOC, *i, NULL, "Failed to append element in __parse_array_into.");
             }
         }
-        __builder_append(&builder, "]");
+        ++k;
 
-        char *result = __builder_get_str(&builder);
-        free(builder.segments);
-        builder.segments = NULL;
+        __skip_whitespace(p, i);
 
-        for (uint64_t i = 0; i < arr->length; ++i)
+        char c = __peek(p, *i);
+
+        if (c == ',')
         {
-            free(to_clean[i]);
-            to_clean[i] = NULL;
+            ++(*i);
+            continue;
         }
-        return result;
+
+        if (c == ']')
+            break;
+
+        return __parser_unexpected(p, *i, "',' or ']'", "Expected ',' or ']' after array element.");
     }
-    case VAL_BOOL:
+    ++(*i);
+    --p->depth;
+
+    for (uint64_t j = k; j < arr->length; ++j)
     {
-        int *boolean = json->value;
-        __builder_append(&builder, (*boolean) ? "true" : "false");
-        char *result = __builder_get_str(&builder);
-        free(builder.segments);
-        builder.segments = NULL;
-        return result;
+        __free_value(arr->elements[j], p->alloc);
+        arr->elements[j] = NULL;
     }
-    case VAL_NUMBER:
-    {
-        JSON_NUMBER *number = json->value;
-        JSON_NUMBER num_val = *number;
+    arr->length = k;
+    return 0;
+}
 
-        double diff = fabs(round(num_val) - num_val);
+/**
+ * Parses the value at *i into self, reusing its container, its string buffer
+ * or its number and bool box when the type is the same. Otherwise the old
+ * value is released and parsed fresh. self always stays freeable.
+ */
+static err_t __parse_value_into(JSON *self, __PARSER *p, uint64_t *i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_value_into");
 
-        char buff[512];
+    __skip_whitespace(p, i);
 
-        if (diff < 0.00001)
-        {
-            uint64_t size = snprintf(buff, 512, "%lld", (int64_t)num_val);
-            buff[511] = '\0';
+    char c = __peek(p, *i);
+    int owned = !(self->flags & __NODE_BORROWED);
 
-            if (size > 512)
-            {
-                __print("Buffer overflow when trying to stringify integer number.");
-                return NULL;
-            }
-            __builder_append(&builder, buff);
-        }
-        else
-        {
-            uint64_t size = snprintf(buff, 512, "%.12g", (double)num_val);
-            buff[511] = '\0';
+    // A shared payload is never written to, the reference is dropped below instead
+    int shared = self->flags & __NODE_SHARED;
 
-            if (size > 512)
-            {
-                __print("Buffer overflow when trying to stringify decimal number.");
-                return NULL;
-            }
+    // Neither reused nor replaced, a frozen subtree may be read by other threads
+    if (self->flags & __NODE_FROZEN)
+        return __parser_fail(p, JSON_ERR_TYPE_MISMATCH, *i, NULL, "Cannot parse into a frozen subtree.");
 
-            char *decimal_point = strchr(buff, '.');
-            if (decimal_point != NULL)
-            {
-                char *end = buff + strlen(buff) - 1;
-                while (end > decimal_point && *end == '0')
-                {
-                    *end = '\0';
-                    end--;
-                }
-                if (*end == '.')
-                {
-                    *end = '\0';
-                }
-            }
+    if (c == '{' && self->type == VAL_OBJECT && !shared)
+        return __parse_object_into(self, p, i);
 
-            __builder_append(&builder, buff);
-        }
+    if (c == '[' && self->type == VAL_ARRAY && !shared)
+        return __parse_array_into(self, p, i);
 
-        char *result = __builder_get_str(&builder);
-        free(builder.segments);
-        builder.segments = NULL;
-        return result;
+    if ((c == 't' || c == 'f') && self->type == VAL_BOOL && owned)
+    {
+        const char *literal = (c == 't') ? "true" : "false";
+
+        if (!__match_literal(p, *i, literal))
+            return __parser_fail(p, JSON_ERR_INVALID_LITERAL, *i, literal, "Failed to parse bool literal.");
+
+        *(int *)self->value = (c == 't');
+        (*i) += __str_len(literal);
+        return 0;
     }
-    case VAL_STRING:
+
+    if ((__is_digit(c) || c == '.' || c == '-') && self->type == VAL_NUMBER && owned)
+        return __read_number(p, i, self->value);
+
+    if (c == '"' && self->type == VAL_STRING && owned)
     {
-        __builder_append(&builder, "\"");
+        char *str = __parse_string_into(p, i, self->value);
+
+        if (str == NULL)
+            return 1;
 
-        char *escaped_string = __escape_string(json->value);
-        if (escaped_string == NULL)
+        if (str != self->value)
         {
-            __print("Failed to escape string.");
-            return NULL;
+            __mem_free(p->alloc, self->value);
+            self->value = str;
         }
-        __builder_append(&builder, escaped_string);
-        __builder_append(&builder, "\"");
-        char *result = __builder_get_str(&builder);
-        free(builder.segments);
-        builder.segments = NULL;
-        free(escaped_string);
-        escaped_string = NULL;
-        return result;
-    }
-    case VAL_NULL:
-    {
-        __builder_append(&builder, "null");
-        char *result = __builder_get_str(&builder);
-        free(builder.segments);
-        builder.segments = NULL;
-        return result;
-    }
-    default:
-        return NULL;
+        return 0;
     }
-    return NULL;
-}
-
-/**
- * @brief Prints the JSON struct + a newline characters. If you do not want the
- * newline character, use json_stringify
- *
- * @param json JSON struct (obtained from json_parse)
- */
-void json_print(JSON *json)
-{
-    char *s = json_stringify(json);
 
-    if (s == NULL)
+    if (c == 'n' && self->type == VAL_NULL)
     {
-        printf("<error>\n");
-        return;
+        if (!__match_literal(p, *i, "null"))
+            return __parser_fail(p, JSON_ERR_INVALID_LITERAL, *i, "null", "Failed to parse null literal.");
+
+        (*i) += 4;
+        return 0;
     }
 
-    printf("%s\n", s);
-    free(s);
+    // Different type, start over with this node
+    uint8_t key_flag = self->flags & __NODE_BORROWED_KEY;
+
+    __reset_value(self, p->alloc);
+    err_t err = __parse_any_value(self, p, i);
+    self->flags |= key_flag;
+    return err;
 }
 
 /**
- * @brief Frees the JSON struct as well as all its descendants.
- * @param json JSON struct (obtained from json_parse)
+ * @brief Parses a JSON string into a tree returned by an earlier parse, for
+ * streams of documents that share their shape. Entries are matched by
+ * position: containers, keys, string buffers and number and bool boxes are
+ * reused in place wherever the new document has the same key and type, and
+ * memory is only allocated where it differs. Entries and elements the new
+ * document does not have are freed. The root node itself is never moved.
+ *
+ * @param existing JSON struct (from json_parse_ex with the same allocator, not
+ * compacted, compacted subtrees appended to it are replaced)
+ * @param s json string (s is not modified, does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @param opts NULL | parse options
+ * @param err NULL | filled with the error, err->code is JSON_ERR_NONE on success
+ * @return 0 (existing holds the new document) | 1 (existing holds a partial
+ * document that can be parsed into again or freed with json_free)
  */
-void json_free(JSON *json)
+err_t json_parse_into_ex(JSON *existing, const char *s, uint64_t len, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err)
 {
     if (JSON_PARSER_DEBUG)
-        __print("json_free");
+        __print("json_parse_into_ex");
+
+    __PARSER p = {
+        .s = s,
+        .len = len,
+        .opts = opts,
+        .alloc = (opts != NULL) ? opts->allocator : NULL,
+        .err = {0},
+        .depth = 0,
+        .max_depth = (opts != NULL && opts->max_depth != 0) ? opts->max_depth : JSON_PARSER_MAX_DEPTH,
+        .flags = (opts != NULL) ? opts->flags : JSON_PARSE_DEFAULT,
+    };
 
-    switch (json->type)
-    {
-    case VAL_OBJECT:
-    {
-        JSON_OBJECT *obj = json->value;
+    __STAT_TIMER_START(start);
 
-        for (uint64_t i = 0; i < obj->length; ++i)
-        {
-            free(obj->fields[i]);
-            obj->fields[i] = NULL;
-            json_free(obj->values[i]);
-            obj->values[i] = NULL;
-        }
-        free(obj->fields);
-        obj->fields = NULL;
-        free(obj->values);
-        obj->values = NULL;
-        free(obj);
-        obj = NULL;
-        break;
+    uint64_t i = 0;
+    err_t result = 1;
+
+    if (s == NULL || existing == NULL)
+    {
+        __parser_fail(&p, JSON_ERR_NULL_INPUT, 0, NULL, "Input string or tree is NULL.");
     }
-    case VAL_ARRAY:
+    else if (existing->flags & __NODE_COMPACT)
     {
-        JSON_ARRAY *arr = json->value;
-
-        for (uint64_t i = 0; i < arr->length; ++i)
-        {
-            json_free(arr->elements[i]);
-            arr->elements[i] = NULL;
-        }
-        free(arr->elements);
-        arr->elements = NULL;
-        free(arr);
-        arr = NULL;
-        break;
+        __parser_fail(&p, JSON_ERR_TYPE_MISMATCH, 0, NULL, "Cannot parse into a compacted document.");
     }
-    case VAL_BOOL:
-    case VAL_NUMBER:
-    case VAL_STRING:
+    else if (existing->flags & __NODE_IN_SHARED)
     {
-        free(json->value);
-        json->value = NULL;
-        break;
+        __parser_fail(&p, JSON_ERR_TYPE_MISMATCH, 0, NULL, "Cannot parse into a node of a shared subtree.");
     }
-    case VAL_NULL:
+    else if (existing->flags & __NODE_FROZEN)
     {
-        break;
+        __parser_fail(&p, JSON_ERR_TYPE_MISMATCH, 0, NULL, "Cannot parse into a frozen document.");
     }
-    default:
-        break;
+    else
+    {
+        __skip_whitespace(&p, &i);
+
+        char c = __peek(&p, i);
+
+        if (c != '{' && c != '[')
+            __parser_unexpected(&p, i, "'{' or '['", "Expected an object or an array at the top level.");
+        else
+            result = __parse_value_into(existing, &p, &i);
     }
 
-    free(json);
-    return;
+    __STAT_ADD(parse_calls, 1);
+    __STAT_ADD(bytes_parsed, (result == 0) ? len : p.err.offset);
+    __STAT_TIMER_STOP(start, parse_ns);
+
+    if (err != NULL)
+        (*err) = p.err;
+
+    return result;
 }
 
 /**
- * @brief Get the char* value out of a JSON struct of type VAL_STRING
+ * @brief Parses a JSON string into a tree returned by an earlier json_parse,
+ * reusing its memory wherever the shape is the same, see json_parse_into_ex.
  *
- * @param json JSON struct (obtained from json_parse)
- * @return NULL | char* (memory not owned, do not free)
+ * @param existing JSON struct (obtained from json_parse)
+ * @param s json string (s is not modified, does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @return 0 (ok) | 1 (error, existing must still be freed with json_free)
  */
-char *json_value_string(JSON *json)
+err_t json_parse_into(JSON *existing, const char *s, uint64_t len)
 {
-    if (json->type != VAL_STRING)
-    {
-        __print("Tried to get string value out of JSON struct not of type VAL_STRING");
-        return NULL;
-    }
+    if (JSON_PARSER_DEBUG)
+        __print("json_parse_into");
+
+    JSON_PARSE_OPTIONS opts = {
+        .on_error = __print_diagnostic,
+        .user = (void *)s,
+        .allocator = NULL,
+        .max_depth = 0,
+        .flags = JSON_PARSE_DEFAULT,
+    };
 
-    return (char *)json->value;
+    return json_parse_into_ex(existing, s, len, &opts, NULL);
 }
 
 /**
- * @brief Get a pointer to bool(int) value out of a JSON struct of type VAL_BOOL
+ * @brief Creates an empty set of learned shapes. Set it in
+ * JSON_PARSE_OPTIONS.shapes and json_parse_ex and json_parse_file_ex learn
+ * the keys of the objects at each position of the documents they parse (the
+ * same key of the parent object, or any element of the same array) and which
+ * key followed which. Later objects at that position compare each key
+ * against the one that followed the previous key last time in place, borrow
+ * the interned key instead of copying it and start with their vectors sized
+ * for as many entries as the last object there. Keys that do not match are
+ * parsed as usual.
+ * A JSON_SHAPES is not thread safe, use one per thread.
  *
- * @param json JSON struct (obtained from json_parse)
- * @return NULL | int* (memory not owned, do not free)
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON_SHAPES* (memory owned, free it with json_shapes_free
+ * after every tree parsed with it)
  */
-int *json_value_bool(JSON *json)
+JSON_SHAPES *json_shapes_new(const JSON_ALLOCATOR *allocator)
 {
-    if (json->type != VAL_BOOL)
+    if (JSON_PARSER_DEBUG)
+        __print("json_shapes_new");
+
+    JSON_SHAPES *shapes = __mem_alloc(allocator, sizeof(JSON_SHAPES));
+
+    if (shapes == NULL)
     {
-        __print("Tried to get bool value out of JSON struct not of type VAL_BOOL");
+        __print("Failed to allocate shapes in json_shapes_new");
         return NULL;
     }
 
-    return (int *)json->value;
+    (*shapes) = (JSON_SHAPES){.alloc = allocator, .root = NULL, .stats = {0}};
+    return shapes;
 }
 
-/**
- * @brief Get a pointer to double value out of a JSON struct of type VAL_NUMBER
- *
- * @param json JSON struct (obtained from json_parse)
- * @return NULL | double* (memory not owned, do not free)
- */
-double *json_value_number(JSON *json)
+static void __shape_free(__SHAPE *shape, const JSON_ALLOCATOR *a)
 {
-    if (json->type != VAL_NUMBER)
+    if (JSON_PARSER_DEBUG)
+        __print("__shape_free");
+
+    if (shape == NULL)
+        return;
+
+    for (uint64_t k = 0; k < shape->length; ++k)
     {
-        __print("Tried to get number value out of JSON struct not of type VAL_NUMBER");
-        return NULL;
+        __mem_free(a, shape->keys[k].key);
+        __shape_free(shape->keys[k].child, a);
     }
-
-    return (double *)json->value;
+    __mem_free(a, shape->keys);
+    __shape_free(shape->items, a);
+    __mem_free(a, shape);
 }
 
 /**
- * @brief No real need for this one, just use NULL instead lol
- * @param json JSON struct (obtained from json_parse)
- * @return NULL
+ * @brief Frees learned shapes and their interned keys. Trees parsed with
+ * them borrow those keys, so they must be freed first.
+ *
+ * @param shapes NULL | JSON_SHAPES* (obtained from json_shapes_new)
  */
-void *json_value_null(JSON *json)
+void json_shapes_free(JSON_SHAPES *shapes)
 {
-    return NULL;
+    if (JSON_PARSER_DEBUG)
+        __print("json_shapes_free");
+
+    if (shapes == NULL)
+        return;
+
+    __shape_free(shapes->root, shapes->alloc);
+    __mem_free(shapes->alloc, shapes);
 }
 
 /**
- * @brief Check if JSON struct is of type VAL_NULL
+ * @brief Reports how often keys matched the learned order. The hit rate is
+ * hits / (hits + misses).
  *
- * @param json JSON struct (obtained from json_parse)
- * @return bool(int)
+ * @param shapes JSON_SHAPES* (obtained from json_shapes_new)
+ * @param out filled with the counters since json_shapes_new
  */
-int json_is_null(JSON *json)
+void json_shapes_stats(const JSON_SHAPES *shapes, JSON_SHAPE_STATS *out)
 {
-    return json->type == VAL_NULL;
+    if (JSON_PARSER_DEBUG)
+        __print("json_shapes_stats");
+
+    (*out) = (shapes != NULL) ? shapes->stats : (JSON_SHAPE_STATS){0};
 }
 
-/**
- * @brief Get a pointer to the JSON_OBJECT value out of a JSON struct of type VAL_OBJECT
- *
- * @param json JSON struct (obtained from json_parse)
- * @return NULL | JSON_OBJECT* (memory not owned, do not free)
- */
-JSON_OBJECT *json_value_object(JSON *json)
+typedef uint8_t __VALIDATE_STATE;
+
+#define __VALIDATE_VALUE (__VALIDATE_STATE)0 // expecting any value
+#define __VALIDATE_KEY (__VALIDATE_STATE)1   // expecting a field name
+#define __VALIDATE_NEXT (__VALIDATE_STATE)2  // a value ended, expecting ',' or a closing bracket
+
+static err_t __validate_fail(JSON_ERROR *e, const char *s, uint64_t len, uint64_t i, uint32_t depth, JSON_ERROR_CODE code, const char *expected)
 {
-    if (json->type != VAL_OBJECT)
+    if (JSON_PARSER_DEBUG)
+        __print("__validate_fail");
+
+    if (code == JSON_ERR_UNEXPECTED_CHAR && i >= len)
+        code = JSON_ERR_EOF;
+
+    e->code = code;
+    e->offset = i;
+    e->depth = depth;
+    e->expected = expected;
+    return 1;
+}
+
+static uint64_t __validate_whitespace(const char *s, uint64_t len, uint64_t i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__validate_whitespace");
+
+    while (i < len && (s[i] == ' ' || s[i] == '\n' || s[i] == '\r' || s[i] == '\t'))
+        ++i;
+    return i;
+}
+
+/**
+ * @brief Checks that s[0..len) is exactly one JSON value as defined by RFC 8259,
+ * surrounded by optional whitespace. Nothing is allocated, nesting is tracked
+ * with a bit per level on the stack, up to JSON_PARSER_MAX_DEPTH levels.
+ *
+ * Stricter than json_parse: numbers must match the RFC grammar (no ".5", "-",
+ * "01" or "1."), strings must be valid UTF-8 with control characters escaped,
+ * \u needs four hex digits, any value is allowed at the top level and nothing
+ * but whitespace may follow it.
+ *
+ * @param s json string (does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @param err NULL | filled with the error, err->code is JSON_ERR_NONE on success
+ * @return err_t (0 if s is valid JSON)
+ */
+err_t json_validate(const char *s, uint64_t len, JSON_ERROR *err)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_validate");
+
+    JSON_ERROR local;
+    JSON_ERROR *e = (err != NULL) ? err : &local;
+    e->code = JSON_ERR_NONE;
+    e->offset = 0;
+    e->depth = 0;
+    e->expected = NULL;
+
+    if (s == NULL)
+        return __validate_fail(e, s, len, 0, 0, JSON_ERR_NULL_INPUT, NULL);
+
+    // bit set: the container at that depth is an object
+    uint8_t objects[(JSON_PARSER_MAX_DEPTH + 7) / 8];
+    uint32_t depth = 0;
+    uint64_t i = 0;
+    __VALIDATE_STATE state = __VALIDATE_VALUE;
+
+    for (;;)
     {
-        __print("Tried to get object value out of JSON struct not of type VAL_OBJECT");
+        i = __validate_whitespace(s, len, i);
+
+        if (state == __VALIDATE_NEXT)
+        {
+            if (depth == 0)
+            {
+                if (i != len)
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_UNEXPECTED_CHAR, "end of input");
+                return 0;
+            }
+
+            int in_object = (objects[(depth - 1) / 8] >> ((depth - 1) % 8)) & 1;
+            char c = (i < len) ? s[i] : '\0';
+
+            if (c == ',')
+            {
+                ++i;
+                state = in_object ? __VALIDATE_KEY : __VALIDATE_VALUE;
+                continue;
+            }
+
+            if (c != (in_object ? '}' : ']'))
+                return __validate_fail(e, s, len, i, depth, JSON_ERR_UNEXPECTED_CHAR, in_object ? "',' or '}'" : "',' or ']'");
+
+            ++i;
+            --depth;
+            continue;
+        }
+
+        if (state == __VALIDATE_KEY && (i >= len || s[i] != '"'))
+            return __validate_fail(e, s, len, i, depth, JSON_ERR_UNEXPECTED_CHAR, "field name");
+
+        if (i >= len)
+            return __validate_fail(e, s, len, i, depth, JSON_ERR_EOF, "value");
+
+        char c = s[i];
+
+        if (c == '{' || c == '[')
+        {
+            if (depth >= JSON_PARSER_MAX_DEPTH)
+                return __validate_fail(e, s, len, i, depth, JSON_ERR_MAX_DEPTH, NULL);
+
+            uint8_t bit = (uint8_t)(1 << (depth % 8));
+            if (c == '{')
+                objects[depth / 8] |= bit;
+            else
+                objects[depth / 8] &= (uint8_t)~bit;
+            ++depth;
+
+            i = __validate_whitespace(s, len, i + 1);
+
+            if (i < len && s[i] == (c == '{' ? '}' : ']'))
+            {
+                ++i;
+                --depth;
+                state = __VALIDATE_NEXT;
+            }
+            else
+            {
+                state = (c == '{') ? __VALIDATE_KEY : __VALIDATE_VALUE;
+            }
+            continue;
+        }
+
+        if (c == '"')
+        {
+            for (++i;; ++i)
+            {
+                // Plain characters are the common case, skip them in a tight loop
+                while (i < len && (unsigned char)s[i] >= 0x20 && (unsigned char)s[i] < 0x80 && s[i] != '"' && s[i] != '\\')
+                    ++i;
+
+                if (i >= len)
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_EOF, "'\"'");
+
+                unsigned char u = (unsigned char)s[i];
+
+                if (u == '"')
+                    break;
+
+                if (u < 0x20)
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_UNEXPECTED_CHAR, "escaped control character");
+
+                if (u >= 0x80)
+                {
+                    uint32_t cp;
+                    uint64_t n = __utf8_decode(s, i, len, &cp);
+
+                    if (n == 0)
+                        return __validate_fail(e, s, len, i, depth, JSON_ERR_INVALID_UTF8, "UTF-8 sequence");
+
+                    i += n - 1;
+                    continue;
+                }
+
+                if (u != '\\')
+                    continue;
+
+                ++i;
+                if (i >= len)
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_EOF, "escape sequence");
+
+                if (s[i] == 'u')
+                {
+                    for (int h = 1; h <= 4; ++h)
+                    {
+                        if (i + h >= len || __hex_value(s[i + h]) < 0)
+                            return __validate_fail(e, s, len, i + h, depth, JSON_ERR_INVALID_ESCAPE, "hex digit");
+                    }
+                    i += 4;
+                }
+                else if (!__str_contains_c(__LIST_ESC, s[i]))
+                {
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_INVALID_ESCAPE, "escape sequence");
+                }
+            }
+            ++i;
+
+            if (state == __VALIDATE_KEY)
+            {
+                i = __validate_whitespace(s, len, i);
+
+                if (i >= len || s[i] != ':')
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_UNEXPECTED_CHAR, "':'");
+
+                ++i;
+                state = __VALIDATE_VALUE;
+                continue;
+            }
+
+            state = __VALIDATE_NEXT;
+            continue;
+        }
+
+        if (c == '-' || __is_digit(c))
+        {
+            if (c == '-')
+                ++i;
+
+            if (i < len && s[i] == '0')
+                ++i;
+            else if (i < len && s[i] >= '1' && s[i] <= '9')
+                while (i < len && __is_digit(s[i]))
+                    ++i;
+            else
+                return __validate_fail(e, s, len, i, depth, JSON_ERR_INVALID_NUMBER, "digit");
+
+            if (i < len && s[i] == '.')
+            {
+                ++i;
+                if (i >= len || !__is_digit(s[i]))
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_INVALID_NUMBER, "digit");
+                while (i < len && __is_digit(s[i]))
+                    ++i;
+            }
+
+            if (i < len && (s[i] == 'e' || s[i] == 'E'))
+            {
+                ++i;
+                if (i < len && (s[i] == '+' || s[i] == '-'))
+                    ++i;
+                if (i >= len || !__is_digit(s[i]))
+                    return __validate_fail(e, s, len, i, depth, JSON_ERR_INVALID_NUMBER, "digit");
+                while (i < len && __is_digit(s[i]))
+                    ++i;
+            }
+
+            state = __VALIDATE_NEXT;
+            continue;
+        }
+
+        const char *literal = (c == 't') ? "true" : (c == 'f') ? "false" : (c == 'n') ? "null" : NULL;
+
+        if (literal == NULL)
+            return __validate_fail(e, s, len, i, depth, JSON_ERR_UNEXPECTED_CHAR, "value");
+
+        uint64_t literal_len = __str_len(literal);
+
+        if (len - i < literal_len || memcmp(s + i, literal, literal_len) != 0)
+            return __validate_fail(e, s, len, i, depth, JSON_ERR_INVALID_LITERAL, literal);
+
+        i += literal_len;
+        state = __VALIDATE_NEXT;
+    }
+}
+
+static JSON *__parse_buffer(const char *data, uint64_t len, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err, int diagnose)
+{
+    if (!diagnose)
+        return json_parse_ex(data, len, opts, err);
+
+    // The default printer quotes the input, which only exists once the file is loaded
+    JSON_PARSE_OPTIONS with_input = *opts;
+    with_input.user = (void *)data;
+    return json_parse_ex(data, len, &with_input, err);
+}
+
+static JSON *__parse_file_read(__PARSER *p, const char *path, JSON_ERROR *err, int diagnose)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_file_read");
+
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL)
+    {
+        __parser_fail(p, JSON_ERR_IO, 0, NULL, "Failed to open file.");
         return NULL;
     }
 
-    return (JSON_OBJECT *)json->value;
+    // Read in chunks rather than trusting ftell so pipes and special files work
+    uint64_t cap = 1 << 16;
+    uint64_t len = 0;
+    char *data = __mem_alloc(p->alloc, cap);
+
+    while (data != NULL)
+    {
+        len += fread(data + len, 1, cap - len, f);
+
+        if (len < cap)
+            break;
+
+        char *grown = __mem_realloc(p->alloc, data, cap * 2);
+        if (grown == NULL)
+            __mem_free(p->alloc, data);
+        data = grown;
+        cap *= 2;
+    }
+
+    int failed = ferror(f);
+    fclose(f);
+
+    if (data == NULL)
+    {
+        __parser_fail(p, JSON_ERR_ALLOC, 0, NULL, "Failed to allocate file buffer.");
+        return NULL;
+    }
+
+    if (failed)
+    {
+        __mem_free(p->alloc, data);
+        __parser_fail(p, JSON_ERR_IO, 0, NULL, "Failed to read file.");
+        return NULL;
+    }
+
+    JSON *result = __parse_buffer(data, len, p->opts, err, diagnose);
+    __mem_free(p->alloc, data);
+    return result;
+}
+
+static JSON *__parse_file(const char *path, JSON_FILE_FLAGS flags, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err, int diagnose)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_file");
+
+    // Only used to report failures that happen before parsing starts
+    __PARSER p = {
+        .s = NULL,
+        .len = 0,
+        .opts = opts,
+        .alloc = (opts != NULL) ? opts->allocator : NULL,
+        .err = {0},
+        .depth = 0,
+        .max_depth = 0,
+        .flags = JSON_PARSE_DEFAULT,
+    };
+
+    JSON *result = NULL;
+
+    if (path == NULL)
+    {
+        __parser_fail(&p, JSON_ERR_NULL_INPUT, 0, NULL, "File path is NULL.");
+        goto done;
+    }
+
+#if __HAS_MMAP
+    if (!(flags & JSON_FILE_NO_MMAP))
+    {
+        int fd = open(path, O_RDONLY);
+
+        if (fd < 0)
+        {
+            __parser_fail(&p, JSON_ERR_IO, 0, NULL, "Failed to open file.");
+            goto done;
+        }
+
+        struct stat st;
+        void *data = MAP_FAILED;
+
+        // Empty and special files cannot be mapped, they go through the read path
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        close(fd);
+
+        if (data != MAP_FAILED)
+        {
+#if defined(MADV_SEQUENTIAL)
+            madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#elif defined(POSIX_MADV_SEQUENTIAL)
+            posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+            // The parser never reads past len, so the mapping needs neither a
+            // NUL terminator nor padding. Parsed values are copies, unmap now.
+            result = __parse_buffer(data, (uint64_t)st.st_size, opts, err, diagnose);
+            munmap(data, (size_t)st.st_size);
+            return result;
+        }
+    }
+#endif
+
+    result = __parse_file_read(&p, path, err, diagnose);
+
+    // Parse errors were already reported by json_parse_ex
+    if (p.err.code == JSON_ERR_NONE)
+        return result;
+
+done:
+    if (err != NULL)
+        (*err) = p.err;
+
+    return result;
 }
 
 /**
- * @brief Get a pointer to the JSON_ARRAY value out of a JSON struct of type VAL_ARRAY
+ * @brief Parses a JSON file. The file is memory mapped read-only where the
+ * platform supports it and parsed in place, without a heap copy of its
+ * contents. The mapping is released before returning.
  *
- * @param json JSON struct (obtained from json_parse)
- * @return NULL | JSON_ARRAY* (memory not owned, do not free)
+ * @param path path of the file
+ * @param flags JSON_FILE_DEFAULT | JSON_FILE_NO_MMAP
+ * @param opts NULL | parse options
+ * @param err NULL | filled with the error (JSON_ERR_IO if the file could not be read)
+ * @return NULL | JSON* (memory owned, you need to free it using `json_free`)
  */
-JSON_ARRAY *json_value_array(JSON *json)
+JSON *json_parse_file_ex(const char *path, JSON_FILE_FLAGS flags, const JSON_PARSE_OPTIONS *opts, JSON_ERROR *err)
 {
-    if (json->type != VAL_ARRAY)
+    if (JSON_PARSER_DEBUG)
+        __print("json_parse_file_ex");
+
+    return __parse_file(path, flags, opts, err, 0);
+}
+
+/**
+ * @brief Parses a JSON file, see json_parse_file_ex.
+ *
+ * @param path path of the file
+ * @param flags JSON_FILE_DEFAULT | JSON_FILE_NO_MMAP
+ * @return NULL | JSON* (memory owned, you need to free it using `json_free`)
+ */
+JSON *json_parse_file(const char *path, JSON_FILE_FLAGS flags)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_parse_file");
+
+    JSON_PARSE_OPTIONS opts = {
+        .on_error = __print_diagnostic,
+        .user = NULL,
+        .allocator = NULL,
+        .max_depth = 0,
+        .flags = JSON_PARSE_DEFAULT,
+    };
+
+    return __parse_file(path, flags, &opts, NULL, 1);
+}
+
+/**
+ * @brief Get a value in object using field name
+ *
+ * @param self JSON struct of type VAL_OBJECT
+ * @param field name of field
+ * @return NULL | JSON* (do not free, if you wish to free the memory, free the highest parent instead using json_free)
+ */
+JSON *json_object_get(JSON *self, const char *field)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_object_get");
+
+    if (self->type != VAL_OBJECT)
     {
-        __print("Tried to get array value out of JSON struct not of type VAL_ARRAY");
+        __print("Cannot use json_object_get on object that is not of type VAL_OBJECT.");
         return NULL;
     }
 
-    return (JSON_ARRAY *)json->value;
+    JSON_OBJECT *obj = self->value;
+
+    __STAT_ADD(object_get_calls, 1);
+
+    for (uint64_t i = 0; i < obj->length; ++i)
+    {
+        if (__str_comp(field, obj->fields[i]))
+        {
+            __STAT_ADD(object_get_probes, i + 1);
+            return obj->values[i];
+        }
+    }
+
+    __STAT_ADD(object_get_probes, obj->length);
+    __printf("JSONparser: json_object_get failed to find field \"%s\" in object.\n", field);
+    return NULL;
 }
 
 /**
- * @brief Creates a JSON struct of type VAL_STRING. Creates a copy of the string.
+ * @brief Get the item at index in array
  *
- * @param s
- * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ * @param self JSON struct of type VAL_ARRAY
+ * @param index
+ * @return NULL | JSON* (do not free, if you wish to free the memory, free the highest parent instead using json_free)
  */
-JSON *json_make_string(const char *s)
+JSON *json_array_get(JSON *self, uint64_t index)
 {
-    if (s == NULL)
+    if (JSON_PARSER_DEBUG)
+        __print("json_array_get");
+
+    if (self->type != VAL_ARRAY)
     {
+        __print("Cannot use json_array_get on object that is not of type VAL_ARRAY.");
         return NULL;
     }
-    JSON *j = malloc(sizeof(JSON));
-    j->type = VAL_STRING;
 
-    char *buff;
-    err_t err = __str_copy_alloc(s, &buff);
+    JSON_ARRAY *arr = self->value;
+
+    __STAT_ADD(array_get_calls, 1);
+
+    if (index >= arr->length)
+    {
+        __printf("JSONparser: in json_get_array, tried to access index %llu, which is out of bounds of array.", index);
+        return NULL;
+    }
+
+    return arr->elements[index];
+}
+
+JSON *json_get_deep(JSON *self, uint64_t fields_amount, const char *fields[fields_amount])
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_get_deep");
+
+    __STAT_ADD(get_deep_steps, 1);
+
+    if (fields_amount == 0)
+    {
+        __print("json_get_deep called with 0 fields to access.");
+        return NULL;
+    }
+
+    const char *access = fields[0];
+
+    if (access == NULL)
+    {
+        __print("argument fields[0] of json_get_deep is NULL.");
+        return NULL;
+    }
+
+    if (self->type == VAL_OBJECT)
+    {
+        JSON *val = json_object_get(self, access);
+
+        if (val == NULL)
+        {
+            __print("Failed to get value from object access.");
+            return NULL;
+        }
+
+        if (fields_amount == 1)
+        {
+            return val;
+        }
+        else
+        {
+            return json_get_deep(val, fields_amount - 1, &fields[1]);
+        }
+    }
+    else if (self->type == VAL_ARRAY)
+    {
+        uint64_t index = strtoull(access, NULL, 10);
+        JSON *val = json_array_get(self, index);
+
+        if (val == NULL)
+        {
+            __print("Failed to get value from array access.");
+            return NULL;
+        }
+
+        if (fields_amount == 1)
+        {
+            return val;
+        }
+        else
+        {
+            return json_get_deep(val, fields_amount - 1, &fields[1]);
+        }
+    }
+    else
+    {
+        __print("Type of JSON value cannot be accessed.");
+        return NULL;
+    }
+}
+
+/**
+ * @brief Returns a string representation of a JSON value type.
+ *
+ * @param type Obtained from json->type
+ * @return NULL | const char* (read-only memory, do not free)
+ */
+const char *json_type_to_str(VALUE_TYPE type)
+{
+    if (type > VAL_NULL)
+    {
+        return NULL;
+    }
+    return __VAL_TO_STR[type];
+}
+
+static const char __HEX_DIGITS[] = "0123456789abcdef";
+
+/**
+ * Escapes the character starting at value[*i] and advances *i past it. Writes
+ * to out unless it is NULL, returns the length of the escaped form. Control
+ * characters without a short escape become \\u00XX, with JSON_STRINGIFY_ASCII
+ * every other non-ASCII character becomes \\uXXXX (a surrogate pair above
+ * U+FFFF, U+FFFD for bytes that are not valid UTF-8).
+ */
+static uint64_t __escape_char(const char *value, uint64_t *i, uint64_t len, JSON_STRINGIFY_FLAGS flags, char *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__escape_char");
+
+    unsigned char c = (unsigned char)value[*i];
+    uint32_t units[2];
+    uint64_t n_units = 0;
+
+    if (c != '\0' && __str_contains_c(__LIST_SEQ, (char)c))
+    {
+        (*i) += 1;
+        if (out != NULL)
+            memcpy(out, __SEQ_TO_ESC[c], 2);
+        return 2;
+    }
+
+    if (c < 0x20)
+    {
+        (*i) += 1;
+        units[n_units++] = c;
+    }
+    else if (c < 0x80 || !(flags & JSON_STRINGIFY_ASCII))
+    {
+        (*i) += 1;
+        if (out != NULL)
+            out[0] = (char)c;
+        return 1;
+    }
+    else
+    {
+        uint32_t cp;
+        uint64_t n = __utf8_decode(value, *i, len, &cp);
+
+        if (n == 0)
+        {
+            n = 1;
+            cp = 0xFFFD;
+        }
+        (*i) += n;
+
+        if (cp >= 0x10000)
+        {
+            units[n_units++] = 0xD800 + ((cp - 0x10000) >> 10);
+            units[n_units++] = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+        }
+        else
+        {
+            units[n_units++] = cp;
+        }
+    }
+
+    if (out != NULL)
+    {
+        for (uint64_t u = 0; u < n_units; ++u)
+        {
+            char *at = out + u * 6;
+            at[0] = '\\';
+            at[1] = 'u';
+            at[2] = __HEX_DIGITS[(units[u] >> 12) & 0xF];
+            at[3] = __HEX_DIGITS[(units[u] >> 8) & 0xF];
+            at[4] = __HEX_DIGITS[(units[u] >> 4) & 0xF];
+            at[5] = __HEX_DIGITS[units[u] & 0xF];
+        }
+    }
+
+    return n_units * 6;
+}
+
+static int __needs_escape(unsigned char c, JSON_STRINGIFY_FLAGS flags)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__needs_escape");
+
+    return c < 0x20 || c == '"' || c == '\\' || (c >= 0x80 && (flags & JSON_STRINGIFY_ASCII));
+}
+
+/**
+ * Formats num the way the serializer writes numbers: as an integer when it is
+ * within 0.00001 of one, otherwise with up to 12 significant digits and no
+ * trailing zeros. Magnitudes of 2^53 and above use %.17g.
+ */
+static err_t __format_number(JSON_NUMBER num_val, char buff[512])
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__format_number");
+
+    double diff = fabs(round(num_val) - num_val);
+
+    // Past 2^53 doubles are all integers, and the cast below would overflow past 2^63
+    if (fabs(num_val) >= 9007199254740992.0)
+    {
+        snprintf(buff, 512, "%.17g", (double)num_val);
+        return 0;
+    }
+
+    if (diff < 0.00001)
+    {
+        uint64_t size = snprintf(buff, 512, "%lld", (long long)num_val);
+        buff[511] = '\0';
+
+        if (size > 512)
+        {
+            __print("Buffer overflow when trying to stringify integer number.");
+            return 1;
+        }
+        return 0;
+    }
+
+    uint64_t size = snprintf(buff, 512, "%.12g", (double)num_val);
+    buff[511] = '\0';
+
+    if (size > 512)
+    {
+        __print("Buffer overflow when trying to stringify decimal number.");
+        return 1;
+    }
+
+    char *decimal_point = strchr(buff, '.');
+    if (decimal_point != NULL)
+    {
+        char *end = buff + strlen(buff) - 1;
+        while (end > decimal_point && *end == '0')
+        {
+            *end = '\0';
+            end--;
+        }
+        if (*end == '.')
+        {
+            *end = '\0';
+        }
+    }
+    return 0;
+}
+
+static void __out_bytes(__STRINGIFY_OUT *out, const char *s, uint64_t n)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__out_bytes");
+
+    if (out->buff != NULL)
+        memcpy(out->buff + out->len, s, n);
+
+    if (out->segmented)
+    {
+        if (!out->run_open)
+        {
+            if (out->iov != NULL)
+                out->iov[out->iov_len] = (struct iovec){.iov_base = out->buff + out->len, .iov_len = 0};
+            out->iov_len += 1;
+            out->run_open = 1;
+        }
+        if (out->iov != NULL)
+            out->iov[out->iov_len - 1].iov_len += n;
+    }
+    out->len += n;
+}
+
+static void __out_ref(__STRINGIFY_OUT *out, const char *s, uint64_t n)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__out_ref");
+
+    if (out->iov != NULL)
+        out->iov[out->iov_len] = (struct iovec){.iov_base = (void *)s, .iov_len = n};
+    out->iov_len += 1;
+    out->run_open = 0;
+}
+
+static void __out_string(__STRINGIFY_OUT *out, const char *s)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__out_string");
+
+    uint64_t len = __str_len(s);
+    uint64_t start = 0;
+
+    __out_bytes(out, "\"", 1);
+    for (uint64_t i = 0; i < len;)
+    {
+        if (!__needs_escape((unsigned char)s[i], out->flags))
+        {
+            ++i;
+            continue;
+        }
+        if (i > start)
+            __out_bytes(out, s + start, i - start);
+
+        char esc[12];
+        __out_bytes(out, esc, __escape_char(s, &i, len, out->flags, esc));
+        start = i;
+    }
+
+    if (start == 0 && out->segmented && len >= __IOV_REF_MIN)
+        __out_ref(out, s, len);
+    else if (len > start)
+        __out_bytes(out, s + start, len - start);
+    __out_bytes(out, "\"", 1);
+}
+
+/**
+ * Serializes json into out. Called once with out->buff == NULL to measure the
+ * output, then again with a buffer of that size, so both passes must take the
+ * same path through the tree.
+ */
+static err_t __stringify(__STRINGIFY_OUT *out, JSON *json)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__stringify");
+
+    switch (json->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *obj = json->value;
+
+        __out_bytes(out, "{", 1);
+        for (uint64_t i = 0; i < obj->length; ++i)
+        {
+            if (i != 0)
+                __out_bytes(out, ",", 1);
+
+            __out_string(out, obj->fields[i]);
+            __out_bytes(out, ":", 1);
+
+            if (__stringify(out, obj->values[i]) != 0)
+                return 1;
+        }
+        __out_bytes(out, "}", 1);
+        return 0;
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *arr = json->value;
+
+        __out_bytes(out, "[", 1);
+        for (uint64_t i = 0; i < arr->length; ++i)
+        {
+            if (i != 0)
+                __out_bytes(out, ",", 1);
+
+            if (__stringify(out, arr->elements[i]) != 0)
+                return 1;
+        }
+        __out_bytes(out, "]", 1);
+        return 0;
+    }
+    case VAL_BOOL:
+    {
+        if (*(int *)json->value)
+            __out_bytes(out, "true", 4);
+        else
+            __out_bytes(out, "false", 5);
+        return 0;
+    }
+    case VAL_NUMBER:
+    {
+        char buff[512];
+
+        if (__format_number(*(JSON_NUMBER *)json->value, buff) != 0)
+            return 1;
+
+        __out_bytes(out, buff, __str_len(buff));
+        return 0;
+    }
+    case VAL_STRING:
+    {
+        __out_string(out, json->value);
+        return 0;
+    }
+    case VAL_NULL:
+    {
+        __out_bytes(out, "null", 4);
+        return 0;
+    }
+    default:
+        return 1;
+    }
+}
+
+/**
+ * @brief Stringifies a JSON struct with output flags, using a specific
+ * allocator for the result. The output is measured first, so it is
+ * allocated once at its exact size.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @param flags JSON_STRINGIFY_DEFAULT | JSON_STRINGIFY_ASCII
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | char* (memory owned, release it with the same allocator)
+ */
+char *json_stringify_flags(JSON *json, JSON_STRINGIFY_FLAGS flags, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_stringify_flags");
+
+    if (json == NULL)
+        return NULL;
+
+    __STAT_TIMER_START(start);
+
+    __STRINGIFY_OUT out = {.flags = flags};
+    if (__stringify(&out, json) != 0)
+        return NULL;
+
+    char *result = __mem_alloc(allocator, sizeof(char) * (out.len + 1));
+    if (result == NULL)
+    {
+        __print("Failed to allocate memory for string in json_stringify_flags");
+        return NULL;
+    }
+
+    out = (__STRINGIFY_OUT){.buff = result, .flags = flags};
+    __stringify(&out, json);
+    result[out.len] = '\0';
+
+    __STAT_ADD(stringify_calls, 1);
+    __STAT_TIMER_STOP(start, stringify_ns);
+    return result;
+}
+
+/**
+ * @brief Computes the length of what json_stringify_flags would return,
+ * without the terminator and without allocating.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @param flags JSON_STRINGIFY_DEFAULT | JSON_STRINGIFY_ASCII
+ * @return 0 (json is NULL or invalid) | uint64_t
+ */
+uint64_t json_stringify_size_flags(JSON *json, JSON_STRINGIFY_FLAGS flags)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_stringify_size_flags");
+
+    if (json == NULL)
+        return 0;
+
+    __STRINGIFY_OUT out = {.flags = flags};
+    if (__stringify(&out, json) != 0)
+        return 0;
+    return out.len;
+}
+
+/**
+ * @brief Computes the length of what json_stringify would return, without
+ * the terminator and without allocating.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return 0 (json is NULL or invalid) | uint64_t
+ */
+uint64_t json_stringify_size(JSON *json)
+{
+    return json_stringify_size_flags(json, JSON_STRINGIFY_DEFAULT);
+}
+
+/**
+ * @brief Stringifies a JSON struct as a list of iovecs for writev. String
+ * values and keys of at least 64 bytes that need no escaping are referenced in
+ * place, everything else is written to a scratch area that lives in the same
+ * allocation as the iovecs. The iovecs are only valid while the tree is alive
+ * and unmodified. writev accepts at most IOV_MAX of them per call.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @param flags JSON_STRINGIFY_DEFAULT | JSON_STRINGIFY_ASCII
+ * @param iov Receives the iovecs (memory owned, release *iov with the same allocator)
+ * @param count Receives the number of iovecs
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return 0 (ok) | 1 (invalid json or allocation failure, *iov is NULL)
+ */
+err_t json_stringify_iov_ex(JSON *json, JSON_STRINGIFY_FLAGS flags, struct iovec **iov, uint64_t *count, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_stringify_iov_ex");
+
+    if (iov == NULL || count == NULL)
+        return 1;
+
+    (*iov) = NULL;
+    (*count) = 0;
+
+    if (json == NULL)
+        return 1;
+
+    __STAT_TIMER_START(start);
+
+    __STRINGIFY_OUT out = {.segmented = 1, .flags = flags};
+    if (__stringify(&out, json) != 0)
+        return 1;
+
+    uint64_t n = out.iov_len;
+    struct iovec *block = __mem_alloc(allocator, sizeof(struct iovec) * n + out.len);
+    if (block == NULL)
+    {
+        __print("Failed to allocate memory for iovecs in json_stringify_iov_ex");
+        return 1;
+    }
+
+    out = (__STRINGIFY_OUT){.buff = (char *)(block + n), .iov = block, .segmented = 1, .flags = flags};
+    __stringify(&out, json);
+
+    (*iov) = block;
+    (*count) = n;
+
+    __STAT_ADD(stringify_calls, 1);
+    __STAT_TIMER_STOP(start, stringify_ns);
+    return 0;
+}
+
+/**
+ * @brief Stringifies a JSON struct as a list of iovecs for writev, see
+ * json_stringify_iov_ex.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @param iov Receives the iovecs (memory owned, free *iov with the global allocator)
+ * @param count Receives the number of iovecs
+ * @return 0 (ok) | 1 (invalid json or allocation failure, *iov is NULL)
+ */
+err_t json_stringify_iov(JSON *json, struct iovec **iov, uint64_t *count)
+{
+    return json_stringify_iov_ex(json, JSON_STRINGIFY_DEFAULT, iov, count, NULL);
+}
+
+// Elements per worker at least, below that a thread costs more than it saves
+#define __PARALLEL_MIN_ITEMS 256
+#define __PARALLEL_MAX_THREADS 64
+
+// A run of consecutive array elements or NDJSON documents
+typedef struct stringify_chunk
+{
+    JSON **items;
+    uint64_t count;
+    int first; // holds the very first item, no separator before it
+    int lines; // NDJSON: a newline after every item instead of commas between them
+    JSON_STRINGIFY_FLAGS flags;
+    char *buff; // NULL while measuring
+    uint64_t len;
+    err_t err;
+} __STRINGIFY_CHUNK;
+
+static void __stringify_chunk(__STRINGIFY_CHUNK *c)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__stringify_chunk");
+
+    __STRINGIFY_OUT out = {.buff = c->buff, .flags = c->flags};
+
+    c->err = 1;
+    for (uint64_t k = 0; k < c->count; ++k)
+    {
+        if (!c->lines && (k != 0 || !c->first))
+            __out_bytes(&out, ",", 1);
+
+        if (c->items[k] == NULL || __stringify(&out, c->items[k]) != 0)
+            return;
+
+        if (c->lines)
+            __out_bytes(&out, "\n", 1);
+    }
+    c->len = out.len;
+    c->err = 0;
+}
+
+#if JSON_PARSER_THREADS && defined(_WIN32)
+static DWORD WINAPI __stringify_thread(LPVOID arg)
+{
+    __stringify_chunk(arg);
+    return 0;
+}
+#elif JSON_PARSER_THREADS
+static void *__stringify_thread(void *arg)
+{
+    __stringify_chunk(arg);
+    return NULL;
+}
+#endif
+
+// Runs every chunk, the first one on the calling thread
+static void __stringify_chunks(__STRINGIFY_CHUNK *chunks, uint32_t n)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__stringify_chunks");
+
+#if JSON_PARSER_THREADS
+#if defined(_WIN32)
+    HANDLE handles[__PARALLEL_MAX_THREADS];
+#else
+    pthread_t handles[__PARALLEL_MAX_THREADS];
+#endif
+    int started[__PARALLEL_MAX_THREADS] = {0};
+
+    for (uint32_t t = 1; t < n; ++t)
+    {
+#if defined(_WIN32)
+        handles[t] = CreateThread(NULL, 0, __stringify_thread, &chunks[t], 0, NULL);
+        started[t] = handles[t] != NULL;
+#else
+        started[t] = pthread_create(&handles[t], NULL, __stringify_thread, &chunks[t]) == 0;
+#endif
+        // Out of threads, the result is the same
+        if (!started[t])
+            __stringify_chunk(&chunks[t]);
+    }
+
+    __stringify_chunk(&chunks[0]);
+
+    for (uint32_t t = 1; t < n; ++t)
+    {
+        if (!started[t])
+            continue;
+#if defined(_WIN32)
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+#else
+        pthread_join(handles[t], NULL);
+#endif
+    }
+#else
+    for (uint32_t t = 0; t < n; ++t)
+        __stringify_chunk(&chunks[t]);
+#endif
+}
+
+/**
+ * Writes what surrounds the array split over the threads, before its
+ * elements (head) or after them. For a root array that is the brackets, for
+ * a root object the other entries around entry m are written too.
+ */
+static err_t __stringify_frame(__STRINGIFY_OUT *out, JSON *json, uint64_t m, int head)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__stringify_frame");
+
+    if (json->type == VAL_ARRAY)
+    {
+        __out_bytes(out, head ? "[" : "]", 1);
+        return 0;
+    }
+
+    JSON_OBJECT *obj = json->value;
+    uint64_t lo = head ? 0 : m + 1;
+    uint64_t hi = head ? m : obj->length;
+
+    __out_bytes(out, head ? "{" : "]", 1);
+    for (uint64_t k = lo; k < hi; ++k)
+    {
+        if (k != 0)
+            __out_bytes(out, ",", 1);
+
+        __out_string(out, obj->fields[k]);
+        __out_bytes(out, ":", 1);
+
+        if (__stringify(out, obj->values[k]) != 0)
+            return 1;
+    }
+
+    if (head)
+    {
+        if (m != 0)
+            __out_bytes(out, ",", 1);
+
+        __out_string(out, obj->fields[m]);
+        __out_bytes(out, ":[", 2);
+    }
+    else
+    {
+        __out_bytes(out, "}", 1);
+    }
+    return 0;
+}
+
+/**
+ * Serializes items split in one chunk per thread, framed by json (see
+ * __stringify_frame) or as NDJSON lines when json is NULL. Every chunk is
+ * measured in parallel, then written in parallel straight to its offset in
+ * the result, so nothing is joined or copied afterwards.
+ */
+static char *__stringify_parallel(JSON *json, uint64_t m, JSON **items, uint64_t count, JSON_STRINGIFY_FLAGS flags, uint32_t threads, uint64_t *len, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__stringify_parallel");
+
+    uint64_t n = threads;
+
+    if (n > __PARALLEL_MAX_THREADS)
+        n = __PARALLEL_MAX_THREADS;
+    if (n > count / __PARALLEL_MIN_ITEMS)
+        n = count / __PARALLEL_MIN_ITEMS;
+    if (n == 0)
+        n = 1;
+
+    __STRINGIFY_CHUNK chunks[__PARALLEL_MAX_THREADS];
+
+    for (uint64_t t = 0; t < n; ++t)
+    {
+        uint64_t lo = count * t / n;
+        uint64_t hi = count * (t + 1) / n;
+
+        chunks[t] = (__STRINGIFY_CHUNK){
+            .items = items + lo,
+            .count = hi - lo,
+            .first = t == 0,
+            .lines = json == NULL,
+            .flags = flags,
+        };
+    }
+
+    __STRINGIFY_OUT head = {.flags = flags};
+    __STRINGIFY_OUT tail = {.flags = flags};
+
+    if (json != NULL && (__stringify_frame(&head, json, m, 1) != 0 || __stringify_frame(&tail, json, m, 0) != 0))
+        return NULL;
+
+    __stringify_chunks(chunks, (uint32_t)n);
+
+    uint64_t total = head.len + tail.len;
+
+    for (uint64_t t = 0; t < n; ++t)
+    {
+        if (chunks[t].err != 0)
+            return NULL;
+        total += chunks[t].len;
+    }
+
+    char *result = __mem_alloc(a, sizeof(char) * (total + 1));
+
+    if (result == NULL)
+    {
+        __print("Failed to allocate memory for string in __stringify_parallel");
+        return NULL;
+    }
+
+    uint64_t offset = head.len;
+
+    for (uint64_t t = 0; t < n; ++t)
+    {
+        chunks[t].buff = result + offset;
+        offset += chunks[t].len;
+    }
+
+    if (json != NULL)
+    {
+        head = (__STRINGIFY_OUT){.buff = result, .flags = flags};
+        tail = (__STRINGIFY_OUT){.buff = result + offset, .flags = flags};
+        __stringify_frame(&head, json, m, 1);
+        __stringify_frame(&tail, json, m, 0);
+    }
+
+    __stringify_chunks(chunks, (uint32_t)n);
+
+    result[total] = '\0';
+
+    if (len != NULL)
+        (*len) = total;
+    return result;
+}
+
+/**
+ * @brief Stringifies a JSON struct like json_stringify_flags, splitting a
+ * large array into one run of elements per thread: the root array, or for a
+ * root object the entry holding the longest array. Each run is measured and
+ * then written by its own thread directly into the result, in order. Other
+ * documents are stringified on the calling thread. Threads are only used when
+ * JSON_PARSER_THREADS is 1.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @param flags JSON_STRINGIFY_DEFAULT | JSON_STRINGIFY_ASCII
+ * @param threads Number of threads to use, including the calling one (at most 64)
+ * @param len NULL | receives the length of the result
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | char* (memory owned, release it with the same allocator)
+ */
+char *json_stringify_parallel(JSON *json, JSON_STRINGIFY_FLAGS flags, uint32_t threads, uint64_t *len, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_stringify_parallel");
+
+    if (json == NULL)
+        return NULL;
+
+    JSON_ARRAY *arr = (json->type == VAL_ARRAY) ? json->value : NULL;
+    uint64_t m = 0;
+
+    if (json->type == VAL_OBJECT)
+    {
+        JSON_OBJECT *obj = json->value;
+
+        for (uint64_t k = 0; k < obj->length; ++k)
+        {
+            JSON *value = obj->values[k];
+
+            if (value->type == VAL_ARRAY && (arr == NULL || ((JSON_ARRAY *)value->value)->length > arr->length))
+            {
+                arr = value->value;
+                m = k;
+            }
+        }
+    }
+
+    if (arr == NULL || arr->length < 2 * __PARALLEL_MIN_ITEMS)
+    {
+        char *result = json_stringify_flags(json, flags, allocator);
+
+        if (result != NULL && len != NULL)
+            (*len) = __str_len(result);
+        return result;
+    }
+
+    __STAT_TIMER_START(start);
+
+    char *result = __stringify_parallel(json, m, arr->elements, arr->length, flags, threads, len, allocator);
+
+    __STAT_ADD(stringify_calls, 1);
+    __STAT_TIMER_STOP(start, stringify_ns);
+    return result;
+}
+
+/**
+ * @brief Stringifies documents as NDJSON, one per line, each line ending
+ * with '\n'. The documents are split in one run per thread like
+ * json_stringify_parallel, and keep their order.
+ *
+ * @param docs JSON structs (none of them NULL)
+ * @param count Number of documents
+ * @param flags JSON_STRINGIFY_DEFAULT | JSON_STRINGIFY_ASCII
+ * @param threads Number of threads to use, including the calling one (at most 64)
+ * @param len NULL | receives the length of the result
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | char* (memory owned, release it with the same allocator)
+ */
+char *json_stringify_ndjson(JSON **docs, uint64_t count, JSON_STRINGIFY_FLAGS flags, uint32_t threads, uint64_t *len, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_stringify_ndjson");
+
+    if (docs == NULL && count != 0)
+        return NULL;
+
+    __STAT_TIMER_START(start);
+
+    char *result = __stringify_parallel(NULL, 0, docs, count, flags, threads, len, allocator);
+
+    __STAT_ADD(stringify_calls, 1);
+    __STAT_TIMER_STOP(start, stringify_ns);
+    return result;
+}
+
+/**
+ * @brief Stringifies a JSON struct using a specific allocator for the
+ * result.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | char* (memory owned, release it with the same allocator)
+ */
+char *json_stringify_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    return json_stringify_flags(json, JSON_STRINGIFY_DEFAULT, allocator);
+}
+
+/**
+ * @brief Stringifies a JSON struct as well as all its descendants.
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return NULL | char* (memory owned, you need to free it with the global allocator, free() by default)
+ */
+char *json_stringify(JSON *json)
+{
+    return json_stringify_ex(json, NULL);
+}
+
+/**
+ * @brief Prints the JSON struct + a newline characters. If you do not want the
+ * newline character, use json_stringify
+ *
+ * @param json JSON struct (obtained from json_parse)
+ */
+void json_print(JSON *json)
+{
+    char *s = json_stringify(json);
+
+    if (s == NULL)
+    {
+        printf("<error>\n");
+        return;
+    }
+
+    printf("%s\n", s);
+    __mem_free(NULL, s);
+}
+
+// The child slots and length of a VAL_OBJECT or VAL_ARRAY node
+static JSON **__child_slots(JSON *node, uint64_t **length)
+{
+    if (node->type == VAL_OBJECT)
+    {
+        (*length) = &((JSON_OBJECT *)node->value)->length;
+        return ((JSON_OBJECT *)node->value)->values;
+    }
+
+    (*length) = &((JSON_ARRAY *)node->value)->length;
+    return ((JSON_ARRAY *)node->value)->elements;
+}
+
+/**
+ * Releases what json->value holds, but not json itself. Containers are emptied
+ * from their last child without recursion: before walking into a child, the
+ * parent of the current container is stored in the slot that child leaves
+ * free, and read back from there once the child is released. Teardown needs
+ * neither C stack nor memory however deep the document is.
+ */
+static void __free_contents(JSON *json, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__free_contents");
+
+    if (json->type != VAL_OBJECT && json->type != VAL_ARRAY)
+    {
+        if ((json->type == VAL_BOOL || json->type == VAL_NUMBER || json->type == VAL_STRING) && !(json->flags & __NODE_BORROWED))
+            __mem_free(a, json->value);
+        json->value = NULL;
+        return;
+    }
+
+    // Other nodes still point at the payload, only this reference goes
+    if ((json->flags & __NODE_SHARED) && __share_release(json) != 0)
+    {
+        json->value = NULL;
+        return;
+    }
+
+    JSON *node = json;
+    JSON *up = NULL;
+
+    while (node != NULL)
+    {
+        uint64_t *length;
+        JSON **slots = __child_slots(node, &length);
+
+        if ((*length) == 0)
+        {
+            if (node->type == VAL_OBJECT)
+                __mem_free(a, ((JSON_OBJECT *)node->value)->fields);
+            __mem_free(a, slots);
+            __mem_free(a, (node->flags & __NODE_SHARED) ? (void *)__SHARE_OF(node) : node->value);
+            node->value = NULL;
+
+            if (node != json)
+                __mem_free(a, node);
+
+            // Back in node, its own parent waits in the slot it was left at
+            node = up;
+            if (node != NULL)
+            {
+                slots = __child_slots(node, &length);
+                up = slots[*length];
+            }
+            continue;
+        }
+
+        uint64_t i = --(*length);
+        JSON *child = slots[i];
+
+        if (node->type == VAL_OBJECT)
+        {
+            JSON_OBJECT *obj = node->value;
+
+            if (!(child->flags & __NODE_BORROWED_KEY))
+                __mem_free(a, obj->fields[i]);
+            obj->fields[i] = NULL;
+        }
+
+        // Scalars and compacted nodes have nothing to walk into
+        if ((child->flags & __NODE_COMPACT) || (child->type != VAL_OBJECT && child->type != VAL_ARRAY))
+        {
+            slots[i] = NULL;
+            __free_value(child, a);
+            continue;
+        }
+
+        if ((child->flags & __NODE_SHARED) && __share_release(child) != 0)
+        {
+            slots[i] = NULL;
+            __mem_free(a, child);
+            continue;
+        }
+
+        slots[i] = up;
+        up = node;
+        node = child;
+    }
+}
+
+static void __free_value(JSON *json, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__free_value");
+
+    // Nodes of a compacted document share the block owned by its root
+    if (json->flags & __NODE_COMPACT)
+    {
+        if (json->flags & __NODE_BLOCK)
+            __mem_free(a, json);
+        return;
+    }
+
+    __free_contents(json, a);
+    __mem_free(a, json);
+}
+
+/**
+ * @brief Frees a JSON struct allocated with a specific allocator (parse
+ * options, json_make_*_ex...) as well as all its descendants.
+ *
+ * @param json JSON struct
+ * @param allocator NULL | JSON_ALLOCATOR* (must be the one used to allocate json)
+ */
+void json_free_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_free_ex");
+
+    __STAT_TIMER_START(start);
+
+    __free_value(json, allocator);
+
+    __STAT_ADD(free_calls, 1);
+    __STAT_TIMER_STOP(start, free_ns);
+}
+
+/**
+ * @brief Frees the JSON struct as well as all its descendants.
+ * @param json JSON struct (obtained from json_parse)
+ */
+void json_free(JSON *json)
+{
+    json_free_ex(json, NULL);
+}
+
+#if JSON_PARSER_THREADS
+
+// A document waiting for the reclaimer thread
+typedef struct free_job
+{
+    JSON *json;
+    const JSON_ALLOCATOR *alloc;
+    struct free_job *next;
+} __FREE_JOB;
+
+#if defined(_WIN32)
+static SRWLOCK __FREE_LOCK = SRWLOCK_INIT;
+static CONDITION_VARIABLE __FREE_QUEUED = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE __FREE_DONE = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t __FREE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __FREE_QUEUED = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t __FREE_DONE = PTHREAD_COND_INITIALIZER;
+#endif
+
+static __FREE_JOB *__FREE_QUEUE = NULL;
+static uint64_t __FREE_PENDING = 0; // queued or being freed
+static int __FREE_STARTED = 0;
+
+static void __free_lock(void)
+{
+#if defined(_WIN32)
+    AcquireSRWLockExclusive(&__FREE_LOCK);
+#else
+    pthread_mutex_lock(&__FREE_LOCK);
+#endif
+}
+
+static void __free_unlock(void)
+{
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive(&__FREE_LOCK);
+#else
+    pthread_mutex_unlock(&__FREE_LOCK);
+#endif
+}
+
+static void __free_sleep(int done)
+{
+#if defined(_WIN32)
+    SleepConditionVariableSRW(done ? &__FREE_DONE : &__FREE_QUEUED, &__FREE_LOCK, INFINITE, 0);
+#else
+    pthread_cond_wait(done ? &__FREE_DONE : &__FREE_QUEUED, &__FREE_LOCK);
+#endif
+}
+
+static void __free_wake(int done)
+{
+#if defined(_WIN32)
+    if (done)
+        WakeAllConditionVariable(&__FREE_DONE);
+    else
+        WakeConditionVariable(&__FREE_QUEUED);
+#else
+    pthread_cond_broadcast(done ? &__FREE_DONE : &__FREE_QUEUED);
+#endif
+}
+
+// Takes everything queued so far as one batch and frees it outside the lock
+static void __free_reclaim(void)
+{
+    __free_lock();
+    for (;;)
+    {
+        while (__FREE_QUEUE == NULL)
+            __free_sleep(0);
+
+        __FREE_JOB *batch = __FREE_QUEUE;
+        uint64_t count = 0;
+
+        __FREE_QUEUE = NULL;
+        __free_unlock();
+
+        while (batch != NULL)
+        {
+            __FREE_JOB *next = batch->next;
+            const JSON_ALLOCATOR *a = batch->alloc;
+
+            json_free_ex(batch->json, a);
+            __mem_free(a, batch);
+            batch = next;
+            ++count;
+        }
+
+        __free_lock();
+        __FREE_PENDING -= count;
+        if (__FREE_PENDING == 0)
+            __free_wake(1);
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI __free_thread(LPVOID arg)
+{
+    __free_reclaim();
+    return 0;
+}
+#else
+static void *__free_thread(void *arg)
+{
+    __free_reclaim();
+    return NULL;
+}
+#endif
+
+// Starts the reclaimer on first use, called with the lock held
+static int __free_start(void)
+{
+    if (__FREE_STARTED)
+        return 1;
+
+#if defined(_WIN32)
+    HANDLE handle = CreateThread(NULL, 0, __free_thread, NULL, 0, NULL);
+
+    __FREE_STARTED = handle != NULL;
+    if (handle != NULL)
+        CloseHandle(handle);
+#else
+    pthread_t handle;
+
+    __FREE_STARTED = pthread_create(&handle, NULL, __free_thread, NULL) == 0;
+    if (__FREE_STARTED)
+        pthread_detach(handle);
+#endif
+    return __FREE_STARTED;
+}
+
+#endif
+
+/**
+ * @brief Hands a JSON struct over to a background thread that frees it, so
+ * releasing a large document does not block the caller. json must not be used
+ * afterwards, and allocator must be usable from another thread and outlive
+ * the release (json_free_wait). Without JSON_PARSER_THREADS, or when the
+ * thread cannot be started, json is freed right away like json_free_ex.
+ *
+ * @param json NULL | JSON struct (obtained from json_parse, the highest parent)
+ * @param allocator NULL | JSON_ALLOCATOR* (must be the one used to allocate json)
+ */
+void json_free_async_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_free_async_ex");
+
+    if (json == NULL)
+        return;
+
+#if JSON_PARSER_THREADS
+    __FREE_JOB *job = __mem_alloc(allocator, sizeof(__FREE_JOB));
+
+    if (job != NULL)
+    {
+        job->json = json;
+        job->alloc = allocator;
+
+        __free_lock();
+        if (__free_start())
+        {
+            job->next = __FREE_QUEUE;
+            __FREE_QUEUE = job;
+            __FREE_PENDING += 1;
+            __free_wake(0);
+            __free_unlock();
+            return;
+        }
+        __free_unlock();
+        __mem_free(allocator, job);
+    }
+#endif
+
+    json_free_ex(json, allocator);
+}
+
+/**
+ * @brief Hands a JSON struct over to a background thread that frees it (see
+ * json_free_async_ex).
+ * @param json NULL | JSON struct (obtained from json_parse)
+ */
+void json_free_async(JSON *json)
+{
+    json_free_async_ex(json, NULL);
+}
+
+/**
+ * @brief Waits until every document given to json_free_async so far has been
+ * released, e.g. before changing the global allocator or exiting.
+ */
+void json_free_wait(void)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_free_wait");
+
+#if JSON_PARSER_THREADS
+    __free_lock();
+    while (__FREE_PENDING != 0)
+        __free_sleep(1);
+    __free_unlock();
+#endif
+}
+
+/**
+ * @brief Get the char* value out of a JSON struct of type VAL_STRING
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return NULL | char* (memory not owned, do not free)
+ */
+char *json_value_string(JSON *json)
+{
+    if (json->type != VAL_STRING)
+    {
+        __print("Tried to get string value out of JSON struct not of type VAL_STRING");
+        return NULL;
+    }
+
+    return (char *)json->value;
+}
+
+/**
+ * @brief Get a pointer to bool(int) value out of a JSON struct of type VAL_BOOL
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return NULL | int* (memory not owned, do not free)
+ */
+int *json_value_bool(JSON *json)
+{
+    if (json->type != VAL_BOOL)
+    {
+        __print("Tried to get bool value out of JSON struct not of type VAL_BOOL");
+        return NULL;
+    }
+
+    return (int *)json->value;
+}
+
+/**
+ * @brief Get a pointer to double value out of a JSON struct of type VAL_NUMBER
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return NULL | double* (memory not owned, do not free)
+ */
+double *json_value_number(JSON *json)
+{
+    if (json->type != VAL_NUMBER)
+    {
+        __print("Tried to get number value out of JSON struct not of type VAL_NUMBER");
+        return NULL;
+    }
+
+    return (double *)json->value;
+}
+
+/**
+ * @brief No real need for this one, just use NULL instead lol
+ * @param json JSON struct (obtained from json_parse)
+ * @return NULL
+ */
+void *json_value_null(JSON *json)
+{
+    return NULL;
+}
+
+/**
+ * @brief Check if JSON struct is of type VAL_NULL
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return bool(int)
+ */
+int json_is_null(JSON *json)
+{
+    return json->type == VAL_NULL;
+}
+
+/**
+ * @brief Get a pointer to the JSON_OBJECT value out of a JSON struct of type VAL_OBJECT
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return NULL | JSON_OBJECT* (memory not owned, do not free)
+ */
+JSON_OBJECT *json_value_object(JSON *json)
+{
+    if (json->type != VAL_OBJECT)
+    {
+        __print("Tried to get object value out of JSON struct not of type VAL_OBJECT");
+        return NULL;
+    }
+
+    return (JSON_OBJECT *)json->value;
+}
+
+/**
+ * @brief Get a pointer to the JSON_ARRAY value out of a JSON struct of type VAL_ARRAY
+ *
+ * @param json JSON struct (obtained from json_parse)
+ * @return NULL | JSON_ARRAY* (memory not owned, do not free)
+ */
+JSON_ARRAY *json_value_array(JSON *json)
+{
+    if (json->type != VAL_ARRAY)
+    {
+        __print("Tried to get array value out of JSON struct not of type VAL_ARRAY");
+        return NULL;
+    }
+
+    return (JSON_ARRAY *)json->value;
+}
+
+/**
+ * @brief json_make_string using a specific allocator.
+ *
+ * @param s
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_string_ex(const char *s, const JSON_ALLOCATOR *allocator)
+{
+    if (s == NULL)
+    {
+        return NULL;
+    }
+
+    JSON *j = __mem_alloc(allocator, sizeof(JSON));
+
+    if (j == NULL)
+    {
+        return NULL;
+    }
+
+    char *buff;
+    err_t err = __str_copy_alloc(s, &buff, allocator);
+
+    if (err)
+    {
+        __mem_free(allocator, j);
+        return NULL;
+    }
+
+    j->type = VAL_STRING;
+    j->value = buff;
+    j->flags = 0;
+    __STAT_NODE(VAL_STRING);
+    return j;
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_STRING. Creates a copy of the string.
+ *
+ * @param s
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_string(const char *s)
+{
+    return json_make_string_ex(s, NULL);
+}
+
+static JSON *__make_string_node(char *s, uint8_t flags, const JSON_ALLOCATOR *allocator)
+{
+    if (s == NULL)
+    {
+        return NULL;
+    }
+
+    JSON *j = __mem_alloc(allocator, sizeof(JSON));
+
+    if (j == NULL)
+    {
+        return NULL;
+    }
+
+    j->type = VAL_STRING;
+    j->value = s;
+    j->flags = flags;
+    __STAT_NODE(VAL_STRING);
+    return j;
+}
+
+/**
+ * @brief json_make_string_owned using a specific allocator.
+ *
+ * @param s heap string allocated with allocator
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_string_owned_ex(char *s, const JSON_ALLOCATOR *allocator)
+{
+    return __make_string_node(s, 0, allocator);
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_STRING that takes ownership of s
+ * instead of copying it. s is released by json_free, on failure it stays
+ * owned by the caller.
+ *
+ * @param s heap string allocated with the global allocator
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_string_owned(char *s)
+{
+    return json_make_string_owned_ex(s, NULL);
+}
+
+/**
+ * @brief json_make_string_borrowed using a specific allocator.
+ *
+ * @param s
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_string_borrowed_ex(const char *s, const JSON_ALLOCATOR *allocator)
+{
+    return __make_string_node((char *)s, __NODE_BORROWED, allocator);
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_STRING pointing to s without
+ * copying it. s is never freed, it must outlive the node (string literals,
+ * static tables, buffers released after the tree).
+ *
+ * @param s
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_string_borrowed(const char *s)
+{
+    return json_make_string_borrowed_ex(s, NULL);
+}
+
+/**
+ * @brief json_make_number using a specific allocator.
+ *
+ * @param num
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_number_ex(double num, const JSON_ALLOCATOR *allocator)
+{
+    if (isnan(num))
+    {
+        return NULL;
+    }
+
+    JSON *j = __mem_alloc(allocator, sizeof(JSON));
+
+    if (j == NULL)
+    {
+        return NULL;
+    }
+
+    JSON_NUMBER *num_ptr = __mem_alloc(allocator, sizeof(JSON_NUMBER));
+
+    if (num_ptr == NULL)
+    {
+        __mem_free(allocator, j);
+        return NULL;
+    }
+
+    (*num_ptr) = num;
+
+    j->type = VAL_NUMBER;
+    j->value = num_ptr;
+    j->flags = 0;
+    __STAT_NODE(VAL_NUMBER);
+    return j;
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_NUMBER.
+ *
+ * @param d
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_number(double num)
+{
+    return json_make_number_ex(num, NULL);
+}
+
+/**
+ * @brief json_make_bool using a specific allocator.
+ *
+ * @param b bool (0|1). if != 0, will be considered true.
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_bool_ex(int b, const JSON_ALLOCATOR *allocator)
+{
+    JSON *j = __mem_alloc(allocator, sizeof(JSON));
+
+    if (j == NULL)
+    {
+        return NULL;
+    }
+
+    int *bool_ptr = __mem_alloc(allocator, sizeof(int));
+
+    if (bool_ptr == NULL)
+    {
+        __mem_free(allocator, j);
+        return NULL;
+    }
+
+    (*bool_ptr) = b ? 1 : 0;
+
+    j->type = VAL_BOOL;
+    j->value = bool_ptr;
+    j->flags = 0;
+    __STAT_NODE(VAL_BOOL);
+    return j;
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_BOOL.
+ *
+ * @param b bool (0|1). if != 0, will be considered true.
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_bool(int b)
+{
+    return json_make_bool_ex(b, NULL);
+}
+
+/**
+ * @brief json_make_null using a specific allocator.
+ *
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_null_ex(const JSON_ALLOCATOR *allocator)
+{
+    JSON *j = __mem_alloc(allocator, sizeof(JSON));
+
+    if (j == NULL)
+    {
+        return NULL;
+    }
+
+    j->type = VAL_NULL;
+    j->value = NULL;
+    j->flags = 0;
+    __STAT_NODE(VAL_NULL);
+    return j;
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_NULL.
+ *
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_null(void)
+{
+    return json_make_null_ex(NULL);
+}
+
+/**
+ * @brief json_make_object using a specific allocator. The values must have
+ * been created with the same allocator.
+ *
+ * @param len
+ * @param fields
+ * @param values
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_object_ex(uint64_t len, char *fields[len], JSON *values[len], const JSON_ALLOCATOR *allocator)
+{
+    JSON_OBJECT *obj = __mem_alloc(allocator, sizeof(JSON_OBJECT));
+
+    if (obj == NULL)
+    {
+        return NULL;
+    }
+
+    err_t err = __init_object(obj, allocator);
+
+    if (err)
+    {
+        __mem_free(allocator, obj);
+        return NULL;
+    }
+
+    JSON *j = __mem_alloc(allocator, sizeof(JSON));
+
+    if (j == NULL)
+    {
+        goto clean_obj;
+    }
+
+    for (uint64_t i = 0; i < len; ++i)
+    {
+        err_t err = __append_object_entry(obj, fields[i], values[i], allocator);
+
+        if (err)
+        {
+            goto clean_j;
+        }
+    }
+
+    j->type = VAL_OBJECT;
+    j->value = obj;
+    j->flags = 0;
+    __STAT_NODE(VAL_OBJECT);
+    return j;
+
+    // The values stay owned by the caller on failure, only release what was made here
+clean_j:
+    __mem_free(allocator, j);
+clean_obj:
+    for (uint64_t i = 0; i < obj->length; ++i)
+    {
+        __mem_free(allocator, obj->fields[i]);
+    }
+    __mem_free(allocator, obj->fields);
+    __mem_free(allocator, obj->values);
+    __mem_free(allocator, obj);
+    return NULL;
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_OBJECT. Field strings are copied.
+ * Make sure to not free the JSON structs or let them fall out of scope.
+ *
+ * @param len
+ * @param fields
+ * @param values
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_object(uint64_t len, char *fields[len], JSON *values[len])
+{
+    return json_make_object_ex(len, fields, values, NULL);
+}
+
+/**
+ * @brief json_make_array using a specific allocator. The values must have
+ * been created with the same allocator.
+ *
+ * @param len
+ * @param values
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release if standalone)
+ */
+JSON *json_make_array_ex(uint64_t len, JSON *values[len], const JSON_ALLOCATOR *allocator)
+{
+    JSON_ARRAY *arr = __mem_alloc(allocator, sizeof(JSON_ARRAY));
+
+    if (arr == NULL)
+    {
+        return NULL;
+    }
+
+    err_t err = __init_array(arr, allocator);
+
+    if (err)
+    {
+        __mem_free(allocator, arr);
+        return NULL;
+    }
+
+    JSON *j = __mem_alloc(allocator, sizeof(JSON));
+
+    if (j == NULL)
+    {
+        goto clean_arr;
+    }
+
+    for (uint64_t i = 0; i < len; ++i)
+    {
+        err_t err = __append_array_element(arr, values[i], allocator);
+
+        if (err)
+        {
+            goto clean_j;
+        }
+    }
+
+    j->type = VAL_ARRAY;
+    j->value = arr;
+    j->flags = 0;
+    __STAT_NODE(VAL_ARRAY);
+    return j;
+
+clean_j:
+    __mem_free(allocator, j);
+clean_arr:
+    __mem_free(allocator, arr->elements);
+    __mem_free(allocator, arr);
+    return NULL;
+}
+
+/**
+ * @brief Creates a JSON struct of type VAL_ARRAY.
+ * Make sure to not free the JSON structs or let them fall out of scope.
+ *
+ * @param len
+ * @param values
+ * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ */
+JSON *json_make_array(uint64_t len, JSON *values[len])
+{
+    return json_make_array_ex(len, values, NULL);
+}
+
+// Makes sure json can be modified by fn, giving it its own copy when it is shared
+static err_t __prepare_write(JSON *json, JSON *value, const char *fn, const JSON_ALLOCATOR *a)
+{
+    if (json->flags & __NODE_FROZEN)
+    {
+        __printf("JSONparser: %s cannot modify a frozen document, use json_clone first.\n", fn);
+        return 1;
+    }
+
+    if (json->flags & __NODE_IN_SHARED)
+    {
+        __printf("JSONparser: %s cannot modify a node of a shared subtree, use json_unshare on its parent first.\n", fn);
+        return 1;
+    }
+
+    if (value != NULL && (value->flags & __NODE_IN_SHARED))
+    {
+        __printf("JSONparser: %s cannot take a node of a shared subtree, use json_retain on it first.\n", fn);
+        return 1;
+    }
+
+    // The new parent would own it, and json_parse_into on the parent would write to it
+    if (value != NULL && (value->flags & __NODE_FROZEN))
+    {
+        __printf("JSONparser: %s cannot take a frozen document, use json_clone first.\n", fn);
+        return 1;
+    }
+
+    if (__unshare(json, a) != 0)
+    {
+        __printf("JSONparser: %s failed to copy a shared node.\n", fn);
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief json_object_append using a specific allocator (the one json was created with).
+ */
+err_t json_object_append_ex(JSON *json, const char *field, JSON *value, const JSON_ALLOCATOR *allocator)
+{
+    if (json == NULL || field == NULL || value == NULL)
+    {
+        __print("json_object_append failed NULL argument.");
+        return 1;
+    }
+
+    if (json->type != VAL_OBJECT)
+    {
+        __print("json_object_append first argument is not of type VAL_OBJECT");
+        return 1;
+    }
+
+    if (json->flags & __NODE_COMPACT)
+    {
+        __print("json_object_append cannot modify a compacted document, use json_clone first.");
+        return 1;
+    }
+
+    if (__prepare_write(json, value, "json_object_append", allocator) != 0)
+    {
+        return 1;
+    }
+
+    err_t err = __append_object_entry(json->value, field, value, allocator);
+
+    if (err)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Appends an entry to an object. The field string is copied, the value
+ * is now owned by the object.
+ *
+ * @param json JSON struct of type VAL_OBJECT
+ * @param field
+ * @param value
+ * @return err_t
+ */
+err_t json_object_append(JSON *json, const char *field, JSON *value)
+{
+    return json_object_append_ex(json, field, value, NULL);
+}
+
+static err_t __object_append_key(JSON *json, char *field, JSON *value, int borrowed, const JSON_ALLOCATOR *allocator)
+{
+    if (json == NULL || field == NULL || value == NULL)
+    {
+        __print("json_object_append failed NULL argument.");
+        return 1;
+    }
+
+    if (json->type != VAL_OBJECT)
+    {
+        __print("json_object_append first argument is not of type VAL_OBJECT");
+        return 1;
+    }
+
+    if (json->flags & __NODE_COMPACT)
+    {
+        __print("json_object_append cannot modify a compacted document, use json_clone first.");
+        return 1;
+    }
+
+    if (__prepare_write(json, value, "json_object_append", allocator) != 0)
+    {
+        return 1;
+    }
+
+    if (__append_object_entry_owned(json->value, field, value, allocator) != 0)
+    {
+        return 1;
+    }
+
+    if (borrowed)
+    {
+        value->flags |= __NODE_BORROWED_KEY;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief json_object_append_owned using a specific allocator (the one json
+ * and field were created with).
+ */
+err_t json_object_append_owned_ex(JSON *json, char *field, JSON *value, const JSON_ALLOCATOR *allocator)
+{
+    return __object_append_key(json, field, value, 0, allocator);
+}
+
+/**
+ * @brief Appends an entry to an object, taking ownership of the field string
+ * instead of copying it. On failure field and value stay owned by the caller.
+ *
+ * @param json JSON struct of type VAL_OBJECT
+ * @param field heap string allocated with the global allocator
+ * @param value
+ * @return err_t
+ */
+err_t json_object_append_owned(JSON *json, char *field, JSON *value)
+{
+    return json_object_append_owned_ex(json, field, value, NULL);
+}
+
+/**
+ * @brief json_object_append_borrowed using a specific allocator (the one json was created with).
+ */
+err_t json_object_append_borrowed_ex(JSON *json, const char *field, JSON *value, const JSON_ALLOCATOR *allocator)
+{
+    return __object_append_key(json, (char *)field, value, 1, allocator);
+}
+
+/**
+ * @brief Appends an entry to an object without copying the field string,
+ * which is never freed and must outlive the object (string literals, static
+ * key tables). The value is now owned by the object.
+ *
+ * @param json JSON struct of type VAL_OBJECT
+ * @param field
+ * @param value
+ * @return err_t
+ */
+err_t json_object_append_borrowed(JSON *json, const char *field, JSON *value)
+{
+    return json_object_append_borrowed_ex(json, field, value, NULL);
+}
+
+/**
+ * @brief json_object_delete using a specific allocator (the one json was created with).
+ */
+err_t json_object_delete_ex(JSON *json, const char *field, const JSON_ALLOCATOR *allocator)
+{
+    if (json == NULL || field == NULL)
+    {
+        __print("json_object_delete failed NULL argument.");
+        return 1;
+    }
+
+    if (json->type != VAL_OBJECT)
+    {
+        __print("json_object_delete first argument is not of type VAL_OBJECT");
+        return 1;
+    }
+
+    if (json->flags & __NODE_COMPACT)
+    {
+        __print("json_object_delete cannot modify a compacted document, use json_clone first.");
+        return 1;
+    }
+
+    if (__prepare_write(json, NULL, "json_object_delete", allocator) != 0)
+    {
+        return 1;
+    }
+
+    JSON_OBJECT *obj = json->value;
+
+    for (uint64_t i = 0; i < obj->length; ++i)
+    {
+        if (!__str_comp(field, obj->fields[i]))
+        {
+            continue;
+        }
+
+        if (!(obj->values[i]->flags & __NODE_BORROWED_KEY))
+            __mem_free(allocator, obj->fields[i]);
+        __free_value(obj->values[i], allocator);
+
+        // Shift the tail down, the NULL terminator of fields moves with it
+        memmove(&obj->fields[i], &obj->fields[i + 1], sizeof(char *) * (obj->length - i));
+        memmove(&obj->values[i], &obj->values[i + 1], sizeof(JSON *) * (obj->length - i - 1));
+        obj->length -= 1;
+        return 0;
+    }
+
+    __printf("JSONparser: json_object_delete failed to find field \"%s\" in object.\n", field);
+    return 1;
+}
+
+/**
+ * @brief Removes an entry from an object, the field and its value are freed.
+ *
+ * @param json JSON struct of type VAL_OBJECT
+ * @param field
+ * @return err_t (1 if the field does not exist)
+ */
+err_t json_object_delete(JSON *json, const char *field)
+{
+    return json_object_delete_ex(json, field, NULL);
+}
+
+/**
+ * @brief json_array_append using a specific allocator (the one json was created with).
+ */
+err_t json_array_append_ex(JSON *json, JSON *value, const JSON_ALLOCATOR *allocator)
+{
+    if (json == NULL || value == NULL)
+    {
+        __print("json_array_append failed NULL argument.");
+        return 1;
+    }
+
+    if (json->type != VAL_ARRAY)
+    {
+        __print("json_array_append first argument is not of type VAL_ARRAY");
+        return 1;
+    }
+
+    if (json->flags & __NODE_COMPACT)
+    {
+        __print("json_array_append cannot modify a compacted document, use json_clone first.");
+        return 1;
+    }
+
+    if (__prepare_write(json, value, "json_array_append", allocator) != 0)
+    {
+        return 1;
+    }
+
+    err_t err = __append_array_element(json->value, value, allocator);
+
+    if (err)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Appends an element to an array, the value is now owned by the array.
+ *
+ * @param json JSON struct of type VAL_ARRAY
+ * @param value
+ * @return err_t
+ */
+err_t json_array_append(JSON *json, JSON *value)
+{
+    return json_array_append_ex(json, value, NULL);
+}
+
+/**
+ * @brief json_array_delete using a specific allocator (the one json was created with).
+ */
+err_t json_array_delete_ex(JSON *json, uint64_t index, const JSON_ALLOCATOR *allocator)
+{
+    if (json == NULL)
+    {
+        __print("json_array_delete failed NULL argument.");
+        return 1;
+    }
+
+    if (json->type != VAL_ARRAY)
+    {
+        __print("json_array_delete first argument is not of type VAL_ARRAY");
+        return 1;
+    }
+
+    if (json->flags & __NODE_COMPACT)
+    {
+        __print("json_array_delete cannot modify a compacted document, use json_clone first.");
+        return 1;
+    }
+
+    if (__prepare_write(json, NULL, "json_array_delete", allocator) != 0)
+    {
+        return 1;
+    }
+
+    JSON_ARRAY *arr = json->value;
+
+    if (index >= arr->length)
+    {
+        __print("json_array_delete index is out of bounds of array");
+        return 1;
+    }
+
+    __free_value(arr->elements[index], allocator);
+
+    memmove(&arr->elements[index], &arr->elements[index + 1], sizeof(JSON *) * (arr->length - index - 1));
+    arr->length -= 1;
+    return 0;
+}
+
+/**
+ * @brief Removes the element at index from an array, the element is freed.
+ *
+ * @param json JSON struct of type VAL_ARRAY
+ * @param index
+ * @return err_t (1 if index is out of bounds)
+ */
+err_t json_array_delete(JSON *json, uint64_t index)
+{
+    return json_array_delete_ex(json, index, NULL);
+}
+
+static JSON *__clone_value(JSON *json, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__clone_value");
+
+    switch (json->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *src = json->value;
+        JSON *copy = json_make_object_ex(0, NULL, NULL, a);
+
+        if (copy == NULL)
+        {
+            return NULL;
+        }
+
+        for (uint64_t i = 0; i < src->length; ++i)
+        {
+            JSON *value = __clone_value(src->values[i], a);
+
+            if (value == NULL || __append_object_entry(copy->value, src->fields[i], value, a) != 0)
+            {
+                if (value != NULL)
+                    __free_value(value, a);
+                __free_value(copy, a);
+                return NULL;
+            }
+        }
+
+        return copy;
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *src = json->value;
+        JSON *copy = json_make_array_ex(0, NULL, a);
+
+        if (copy == NULL)
+        {
+            return NULL;
+        }
+
+        for (uint64_t i = 0; i < src->length; ++i)
+        {
+            JSON *value = __clone_value(src->elements[i], a);
+
+            if (value == NULL || __append_array_element(copy->value, value, a) != 0)
+            {
+                if (value != NULL)
+                    __free_value(value, a);
+                __free_value(copy, a);
+                return NULL;
+            }
+        }
+
+        return copy;
+    }
+    case VAL_NUMBER:
+        return json_make_number_ex(*(JSON_NUMBER *)json->value, a);
+    case VAL_STRING:
+        return json_make_string_ex(json->value, a);
+    case VAL_BOOL:
+        return json_make_bool_ex(*(int *)json->value, a);
+    case VAL_NULL:
+        return json_make_null_ex(a);
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief json_clone using a specific allocator.
+ *
+ * @param json JSON struct
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release)
+ */
+JSON *json_clone_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_clone_ex");
+
+    if (json == NULL)
+    {
+        __print("json_clone failed NULL argument.");
+        return NULL;
+    }
+
+    return __clone_value(json, allocator);
+}
+
+/**
+ * @brief Deep copies a JSON struct and all its descendants. The copy is a
+ * regular document even when json was compacted, so it can be modified.
+ *
+ * @param json JSON struct
+ * @return NULL | JSON* (memory is owned, use json_free to release)
+ */
+JSON *json_clone(JSON *json)
+{
+    return json_clone_ex(json, NULL);
+}
+
+// Sharing subtrees between documents
+
+static size_t __payload_size(JSON *json)
+{
+    return (json->type == VAL_OBJECT) ? sizeof(JSON_OBJECT) : sizeof(JSON_ARRAY);
+}
+
+/**
+ * Moves the payload of json and of every container below it behind a
+ * reference count, and marks the nodes inside them read only. Subtrees that
+ * are shared already are left as they are. On failure the part done so far
+ * stays valid.
+ */
+static err_t __share_tree(JSON *json, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__share_tree");
+
+    if (json->flags & __NODE_SHARED)
+        return 0;
+
+    if (json->flags & __NODE_COMPACT)
+    {
+        __print("json_retain cannot share nodes of a compacted document, use json_clone first.");
+        return 1;
+    }
+
+    if (json->flags & __NODE_FROZEN)
+    {
+        __print("json_retain cannot share nodes of a frozen document, use json_clone first.");
+        return 1;
+    }
+
+    if (json->type != VAL_OBJECT && json->type != VAL_ARRAY)
+        return 0;
+
+    uint64_t *length;
+    JSON **slots = __child_slots(json, &length);
+
+    for (uint64_t k = 0; k < (*length); ++k)
+    {
+        if (__share_tree(slots[k], a) != 0)
+            return 1;
+    }
+
+    size_t size = __payload_size(json);
+    __SHARE *share = __mem_alloc(a, sizeof(__SHARE) + size);
+
+    if (share == NULL)
+    {
+        __print("Failed to allocate memory for shared payload in __share_tree");
+        return 1;
+    }
+
+    share->refs = 1;
+    memcpy(share + 1, json->value, size);
+    __mem_free(a, json->value);
+    json->value = share + 1;
+    json->flags |= __NODE_SHARED;
+
+    slots = __child_slots(json, &length);
+    for (uint64_t k = 0; k < (*length); ++k)
+        slots[k]->flags |= __NODE_IN_SHARED;
+    return 0;
+}
+
+/**
+ * Gives json a payload of its own before it is modified. The last reference
+ * takes the shared payload back as is. Otherwise it is copied one level deep
+ * (copy on write): keys are copied and every child gets a reference of its
+ * own, so the cost is O(length) whatever the size of the subtree.
+ */
+static err_t __unshare(JSON *json, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__unshare");
+
+    if (!(json->flags & __NODE_SHARED))
+        return 0;
+
+    uint64_t *length;
+    JSON **slots;
+
+    if (__share_count(json) == 1)
+    {
+        size_t size = __payload_size(json);
+        void *payload = __mem_alloc(a, size);
+
+        if (payload == NULL)
+        {
+            __print("Failed to allocate memory for payload in __unshare");
+            return 1;
+        }
+
+        memcpy(payload, json->value, size);
+        __mem_free(a, __SHARE_OF(json));
+        json->value = payload;
+        json->flags &= ~__NODE_SHARED;
+
+        slots = __child_slots(json, &length);
+        for (uint64_t k = 0; k < (*length); ++k)
+            slots[k]->flags &= ~__NODE_IN_SHARED;
+        return 0;
+    }
+
+    JSON *copy = (json->type == VAL_OBJECT) ? json_make_object_ex(0, NULL, NULL, a) : json_make_array_ex(0, NULL, a);
+
+    if (copy == NULL)
+        return 1;
+
+    slots = __child_slots(json, &length);
+    for (uint64_t k = 0; k < (*length); ++k)
+    {
+        JSON *child = json_retain_ex(slots[k], a);
+        err_t err = 1;
+
+        if (child != NULL && json->type == VAL_OBJECT)
+            err = __append_object_entry(copy->value, ((JSON_OBJECT *)json->value)->fields[k], child, a);
+        else if (child != NULL)
+            err = __append_array_element(copy->value, child, a);
+
+        if (err != 0)
+        {
+            if (child != NULL)
+                __free_value(child, a);
+            __free_value(copy, a);
+            return 1;
+        }
+    }
+
+    // Drops this reference, the other holders may have let go in the meantime
+    JSON old = *json;
+
+    json->value = copy->value;
+    json->flags &= ~__NODE_SHARED;
+    __mem_free(a, copy);
+    __free_contents(&old, a);
+    return 0;
+}
+
+/**
+ * @brief json_retain using a specific allocator (the one json was created with).
+ *
+ * @param json JSON struct
+ * @param allocator NULL | JSON_ALLOCATOR*
+ * @return NULL | JSON* (memory is owned, use json_release_ex to release if standalone)
+ */
+JSON *json_retain_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_retain_ex");
+
+    if (json == NULL)
+    {
+        __print("json_retain failed NULL argument.");
+        return NULL;
+    }
+
+    // Scalars are small, a copy is as cheap as a reference
+    if (json->type != VAL_OBJECT && json->type != VAL_ARRAY)
+        return __clone_value(json, allocator);
+
+    JSON *ref = __mem_alloc(allocator, sizeof(JSON));
+
+    if (ref == NULL)
+    {
+        __print("Failed to allocate memory for node in json_retain_ex");
+        return NULL;
+    }
+
+    if (__share_tree(json, allocator) != 0)
+    {
+        __mem_free(allocator, ref);
+        return NULL;
+    }
+
+    __share_acquire(json);
+    ref->value = json->value;
+    ref->type = json->type;
+    ref->flags = __NODE_SHARED;
+    return ref;
+}
+
+/**
+ * @brief Returns a new reference to an object or array, for embedding the
+ * same subtree in many documents without copying it. The reference is a
+ * node of its own that can be appended anywhere; json stays where it is.
+ * Both point at one reference counted payload, freed with its last node.
+ *
+ * The first reference to a subtree moves each of its containers behind a
+ * count, once (O(size), do it before other threads use the subtree). After
+ * that a reference costs O(1) and counts are atomic with JSON_PARSER_THREADS.
+ * Appending to or deleting from a shared node copies one level of it first
+ * (copy on write), so the other documents never see the change. Nodes reached
+ * through a shared node belong to all of them and cannot be modified: call
+ * json_unshare on the shared node and look the child up again. Scalars are
+ * copied, nodes of a compacted document cannot be shared.
+ *
+ * @param json JSON struct
+ * @return NULL | JSON* (memory is owned, use json_release to release if standalone)
+ */
+JSON *json_retain(JSON *json)
+{
+    return json_retain_ex(json, NULL);
+}
+
+/**
+ * @brief json_release using a specific allocator (the one json was created with).
+ */
+void json_release_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_release_ex");
+
+    if (json == NULL)
+        return;
+
+    json_free_ex(json, allocator);
+}
+
+/**
+ * @brief Frees a node and drops the references it holds (json_free does the
+ * same). Shared payloads are freed by the last node pointing at them.
+ *
+ * @param json NULL | JSON struct (a document or a reference from json_retain)
+ */
+void json_release(JSON *json)
+{
+    json_release_ex(json, NULL);
+}
+
+/**
+ * @brief json_unshare using a specific allocator (the one json was created with).
+ */
+err_t json_unshare_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_unshare_ex");
+
+    if (json == NULL)
+    {
+        __print("json_unshare failed NULL argument.");
+        return 1;
+    }
+
+    if (json->flags & __NODE_IN_SHARED)
+    {
+        __print("json_unshare cannot modify a node of a shared subtree, unshare its parent first.");
+        return 1;
+    }
+
+    if (json->flags & __NODE_FROZEN)
+    {
+        __print("json_unshare cannot modify a frozen document.");
+        return 1;
+    }
+
+    return __unshare(json, allocator);
+}
+
+/**
+ * @brief Gives a shared node (see json_retain) a copy of its container, one
+ * level deep, so its children can be looked up and modified without other
+ * documents seeing it. Does nothing for nodes that are not shared.
+ *
+ * @param json JSON struct
+ * @return err_t
+ */
+err_t json_unshare(JSON *json)
+{
+    return json_unshare_ex(json, NULL);
+}
+
+// Frozen documents and configuration handles
+
+static void __freeze(JSON *json)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__freeze");
+
+    json->flags |= __NODE_FROZEN;
+
+    // Compacted blocks never change, shared payloads are read only already
+    if ((json->flags & (__NODE_COMPACT | __NODE_SHARED)) || (json->type != VAL_OBJECT && json->type != VAL_ARRAY))
+        return;
+
+    uint64_t *length;
+    JSON **slots = __child_slots(json, &length);
+
+    for (uint64_t k = 0; k < (*length); ++k)
+        __freeze(slots[k]);
+}
+
+/**
+ * @brief Makes a document read only for good: append, delete, json_unshare,
+ * json_parse_into and json_retain of its containers fail from then on, and
+ * nothing the library does while reading it writes to it, so any number of
+ * threads can read it without locks. It cannot be appended to another
+ * document, it can still be freed by its owner, and json_clone gives an
+ * editable copy. json_parse_into of a tree holding a frozen node fails with
+ * JSON_ERR_TYPE_MISMATCH when it reaches it.
+ *
+ * @param json JSON struct (obtained from json_parse, the highest parent)
+ * @return err_t
+ */
+err_t json_freeze(JSON *json)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_freeze");
+
+    if (json == NULL)
+    {
+        __print("json_freeze failed NULL argument.");
+        return 1;
+    }
+
+    __freeze(json);
+    return 0;
+}
+
+/**
+ * @brief Checks if a node belongs to a frozen document (see json_freeze).
+ *
+ * @param json JSON struct
+ * @return 1 (frozen) | 0 (not frozen or NULL)
+ */
+int json_is_frozen(JSON *json)
+{
+    return json != NULL && (json->flags & __NODE_FROZEN) != 0;
+}
+
+/**
+ * Readers of every handle register one slot per thread, kept in a list that
+ * only grows to the most threads that were reading at once: a slot is given
+ * back when its thread exits and the next thread to register takes it over.
+ * A slot holds the epoch its thread saw when it started reading, 0 when not
+ * reading. Publishing a document advances the epoch after the swap, and the
+ * previous document is freed once no slot holds an epoch older than that.
+ */
+typedef struct config_reader
+{
+#if JSON_PARSER_THREADS
+    _Atomic uint64_t epoch;
+    _Atomic int used; // 0 once the owning thread exited, claimed again under the lock
+#else
+    uint64_t epoch;
+    int used;
+#endif
+    uint64_t depth; // nested reads, only touched by the owning thread
+    struct config_reader *next;
+} __CONFIG_READER;
+
+// A replaced document waiting for the readers that may still hold it
+typedef struct config_retired
+{
+    JSON *json;
+    uint64_t epoch;
+    struct config_retired *next;
+} __CONFIG_RETIRED;
+
+struct json_config_handle
+{
+#if JSON_PARSER_THREADS
+    _Atomic(JSON *) current;
+#else
+    JSON *current;
+#endif
+    __CONFIG_RETIRED *retired;
+    const JSON_ALLOCATOR *alloc;
+};
+
+#if JSON_PARSER_THREADS
+static _Atomic uint64_t __CONFIG_EPOCH = 1;
+#else
+static uint64_t __CONFIG_EPOCH = 1;
+#endif
+static __CONFIG_READER *__CONFIG_READERS = NULL;
+static _Thread_local __CONFIG_READER *__CONFIG_LOCAL = NULL;
+
+// Serializes writers and the first read of each thread, which registers its
+// slot. Later reads of that thread never take it.
+#if JSON_PARSER_THREADS && defined(_WIN32)
+static SRWLOCK __CONFIG_LOCK = SRWLOCK_INIT;
+static INIT_ONCE __CONFIG_EXIT_ONCE = INIT_ONCE_STATIC_INIT;
+static DWORD __CONFIG_EXIT = FLS_OUT_OF_INDEXES;
+#elif JSON_PARSER_THREADS
+static pthread_mutex_t __CONFIG_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t __CONFIG_EXIT_ONCE = PTHREAD_ONCE_INIT;
+static pthread_key_t __CONFIG_EXIT;
+static int __CONFIG_EXIT_SET = 0;
+#endif
+
+static void __config_lock(void)
+{
+#if JSON_PARSER_THREADS && defined(_WIN32)
+    AcquireSRWLockExclusive(&__CONFIG_LOCK);
+#elif JSON_PARSER_THREADS
+    pthread_mutex_lock(&__CONFIG_LOCK);
+#endif
+}
+
+static void __config_unlock(void)
+{
+#if JSON_PARSER_THREADS && defined(_WIN32)
+    ReleaseSRWLockExclusive(&__CONFIG_LOCK);
+#elif JSON_PARSER_THREADS
+    pthread_mutex_unlock(&__CONFIG_LOCK);
+#endif
+}
+
+#if JSON_PARSER_THREADS
+
+// Runs when a thread that registered a slot exits, ends a read it left open
+// and gives the slot back
+#if defined(_WIN32)
+static VOID WINAPI __config_reader_exit(PVOID slot)
+#else
+static void __config_reader_exit(void *slot)
+#endif
+{
+    __CONFIG_READER *reader = slot;
+
+    if (reader == NULL)
+        return;
+
+    // A read started by a later destructor of this thread registers again
+    __CONFIG_LOCAL = NULL;
+    reader->depth = 0;
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    atomic_store_explicit(&reader->used, 0, memory_order_release);
+}
+
+#if defined(_WIN32)
+static BOOL CALLBACK __config_exit_init(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    __CONFIG_EXIT = FlsAlloc(__config_reader_exit);
+    return TRUE;
+}
+#else
+static void __config_exit_init(void)
+{
+    __CONFIG_EXIT_SET = pthread_key_create(&__CONFIG_EXIT, __config_reader_exit) == 0;
+}
+#endif
+
+// Has __config_reader_exit called for reader when the calling thread exits.
+// Without a key left the slot simply stays taken.
+static void __config_reader_on_exit(__CONFIG_READER *reader)
+{
+#if defined(_WIN32)
+    InitOnceExecuteOnce(&__CONFIG_EXIT_ONCE, __config_exit_init, NULL, NULL);
+
+    if (__CONFIG_EXIT != FLS_OUT_OF_INDEXES)
+        FlsSetValue(__CONFIG_EXIT, reader);
+#else
+    pthread_once(&__CONFIG_EXIT_ONCE, __config_exit_init);
+
+    if (__CONFIG_EXIT_SET)
+        pthread_setspecific(__CONFIG_EXIT, reader);
+#endif
+}
+
+#endif
+
+static __CONFIG_READER *__config_reader(void)
+{
+    if (__CONFIG_LOCAL != NULL)
+        return __CONFIG_LOCAL;
+
+    __config_lock();
+
+    __CONFIG_READER *reader = __CONFIG_READERS;
+
+    // A slot given back by an exited thread
+#if JSON_PARSER_THREADS
+    while (reader != NULL && atomic_load_explicit(&reader->used, memory_order_acquire) != 0)
+        reader = reader->next;
+#else
+    while (reader != NULL && reader->used != 0)
+        reader = reader->next;
+#endif
+
+    if (reader == NULL)
+    {
+        // Not routed through __mem_alloc, the slot outlives any allocator
+        reader = calloc(1, sizeof(__CONFIG_READER));
+
+        if (reader == NULL)
+        {
+            __config_unlock();
+            return NULL;
+        }
+
+        reader->next = __CONFIG_READERS;
+        __CONFIG_READERS = reader;
+    }
+
+    reader->used = 1;
+    __config_unlock();
+
+#if JSON_PARSER_THREADS
+    __config_reader_on_exit(reader);
+#endif
+
+    __CONFIG_LOCAL = reader;
+    return reader;
+}
+
+// Frees the retired documents no reader can hold anymore, called with the lock held
+static uint64_t __config_reclaim(JSON_CONFIG_HANDLE *handle)
+{
+    uint64_t oldest = UINT64_MAX;
+
+    for (__CONFIG_READER *r = __CONFIG_READERS; r != NULL; r = r->next)
+    {
+#if JSON_PARSER_THREADS
+        uint64_t epoch = atomic_load_explicit(&r->epoch, memory_order_seq_cst);
+#else
+        uint64_t epoch = r->epoch;
+#endif
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    __CONFIG_RETIRED **link = &handle->retired;
+    uint64_t left = 0;
+
+    while ((*link) != NULL)
+    {
+        __CONFIG_RETIRED *retired = (*link);
+
+        if (retired->epoch > oldest)
+        {
+            link = &retired->next;
+            ++left;
+            continue;
+        }
+
+        (*link) = retired->next;
+        json_free_ex(retired->json, handle->alloc);
+        __mem_free(handle->alloc, retired);
+    }
+
+    return left;
+}
+
+/**
+ * @brief Creates a handle holding a frozen document (see json_freeze) that
+ * threads read without locks while writers replace it. Readers wrap their
+ * use of the document in json_config_read_begin/json_config_read_end, writers
+ * swap in a new one with json_config_publish. Replaced documents are freed
+ * once every read that started before the swap has ended (epoch based
+ * reclamation), so a read never sees its document go away.
+ *
+ * @param json JSON struct, frozen and owned by the handle from now on
+ * @param allocator NULL | JSON_ALLOCATOR* (the one the documents are created with)
+ * @return NULL | JSON_CONFIG_HANDLE* (memory owned, free it with json_config_free)
+ */
+JSON_CONFIG_HANDLE *json_config_new(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_config_new");
+
+    if (json == NULL)
+    {
+        __print("json_config_new failed NULL argument.");
+        return NULL;
+    }
+
+    JSON_CONFIG_HANDLE *handle = __mem_alloc(allocator, sizeof(JSON_CONFIG_HANDLE));
+
+    if (handle == NULL)
+    {
+        __print("Failed to allocate memory for handle in json_config_new");
+        return NULL;
+    }
+
+    __freeze(json);
+    handle->current = json;
+    handle->retired = NULL;
+    handle->alloc = allocator;
+    return handle;
+}
+
+/**
+ * @brief Starts reading the current document of a handle. The document stays
+ * valid until json_config_read_end, even if a new one is published meanwhile.
+ * This is a store to a slot of the calling thread and a load of the current
+ * document: no lock and nothing written that other threads write. Reads can
+ * be nested. The first read of a thread registers its slot under the lock
+ * writers take, and the slot is given back when the thread exits, ending a
+ * read it left open.
+ *
+ * @param handle JSON_CONFIG_HANDLE*
+ * @return NULL | JSON* (frozen, do not free)
+ */
+JSON *json_config_read_begin(JSON_CONFIG_HANDLE *handle)
+{
+    if (handle == NULL)
+        return NULL;
+
+    __CONFIG_READER *reader = __config_reader();
+
+    if (reader == NULL)
+    {
+        __print("Failed to allocate memory for reader in json_config_read_begin");
+        return NULL;
+    }
+
+#if JSON_PARSER_THREADS
+    // The slot must be visible before the document is loaded, both seq_cst.
+    // The epoch load is acquire: seeing the epoch a publish advanced to must
+    // also make its swap visible, or this thread could hold the replaced
+    // document while its slot claims the newer epoch, and the document would
+    // be freed under it.
+    if (reader->depth++ == 0)
+        atomic_store_explicit(&reader->epoch, atomic_load_explicit(&__CONFIG_EPOCH, memory_order_acquire), memory_order_seq_cst);
+
+    return atomic_load_explicit(&handle->current, memory_order_seq_cst);
+#else
+    if (reader->depth++ == 0)
+        reader->epoch = __CONFIG_EPOCH;
+
+    return handle->current;
+#endif
+}
+
+/**
+ * @brief Ends a read started with json_config_read_begin, on the same thread.
+ * Documents returned since the outermost json_config_read_begin must not be
+ * used afterwards.
+ *
+ * @param handle JSON_CONFIG_HANDLE*
+ */
+void json_config_read_end(JSON_CONFIG_HANDLE *handle)
+{
+    __CONFIG_READER *reader = __CONFIG_LOCAL;
+
+    if (handle == NULL || reader == NULL || reader->depth == 0)
+        return;
+
+    if (--reader->depth != 0)
+        return;
+
+#if JSON_PARSER_THREADS
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+#else
+    reader->epoch = 0;
+#endif
+}
+
+/**
+ * @brief Freezes json and makes it the current document of a handle. Reads
+ * that start afterwards see json, the previous document is freed as soon as
+ * the reads still using it have ended, here or in a later publish or
+ * json_config_reclaim.
+ *
+ * @param handle JSON_CONFIG_HANDLE*
+ * @param json JSON struct (same allocator as the handle), owned by the handle on success
+ * @return err_t (on failure json is still owned by the caller)
+ */
+err_t json_config_publish(JSON_CONFIG_HANDLE *handle, JSON *json)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_config_publish");
+
+    if (handle == NULL || json == NULL)
+    {
+        __print("json_config_publish failed NULL argument.");
+        return 1;
+    }
+
+    __CONFIG_RETIRED *retired = __mem_alloc(handle->alloc, sizeof(__CONFIG_RETIRED));
+
+    if (retired == NULL)
+    {
+        __print("Failed to allocate memory in json_config_publish");
+        return 1;
+    }
+
+    __freeze(json);
+
+    __config_lock();
+#if JSON_PARSER_THREADS
+    retired->json = atomic_exchange_explicit(&handle->current, json, memory_order_seq_cst);
+    retired->epoch = atomic_fetch_add_explicit(&__CONFIG_EPOCH, 1, memory_order_seq_cst) + 1;
+#else
+    retired->json = handle->current;
+    handle->current = json;
+    retired->epoch = ++__CONFIG_EPOCH;
+#endif
+    retired->next = handle->retired;
+    handle->retired = retired;
+    __config_reclaim(handle);
+    __config_unlock();
+    return 0;
+}
+
+/**
+ * @brief Frees the replaced documents of a handle whose readers are done,
+ * for writers that publish rarely and want old versions gone sooner.
+ *
+ * @param handle JSON_CONFIG_HANDLE*
+ * @return number of replaced documents still in use by readers
+ */
+uint64_t json_config_reclaim(JSON_CONFIG_HANDLE *handle)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_config_reclaim");
+
+    if (handle == NULL)
+        return 0;
+
+    __config_lock();
+    uint64_t left = __config_reclaim(handle);
+    __config_unlock();
+    return left;
+}
+
+/**
+ * @brief Frees a handle with its current and replaced documents. No thread
+ * may be reading from it anymore.
+ *
+ * @param handle NULL | JSON_CONFIG_HANDLE*
+ */
+void json_config_free(JSON_CONFIG_HANDLE *handle)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_config_free");
+
+    if (handle == NULL)
+        return;
+
+    const JSON_ALLOCATOR *a = handle->alloc;
+
+    while (handle->retired != NULL)
+    {
+        __CONFIG_RETIRED *next = handle->retired->next;
+
+        json_free_ex(handle->retired->json, a);
+        __mem_free(a, handle->retired);
+        handle->retired = next;
+    }
+
+    json_free_ex(handle->current, a);
+    __mem_free(a, handle);
+}
+
+// Every fixed size part of a compacted document is placed on this alignment,
+// strings are packed right after whatever precedes them.
+typedef union compact_unit
+{
+    void *ptr;
+    JSON_NUMBER num;
+    uint64_t u64;
+    int b;
+} __COMPACT_UNIT;
+
+typedef struct compact
+{
+    char *base; // NULL while measuring
+    uint64_t used;
+} __COMPACT;
+
+static void *__compact_take(__COMPACT *c, uint64_t size, int aligned)
+{
+    if (aligned)
+    {
+        const uint64_t align = _Alignof(__COMPACT_UNIT);
+        c->used = (c->used + align - 1) & ~(align - 1);
+    }
+
+    void *at = c->base == NULL ? NULL : c->base + c->used;
+    c->used += size;
+    return at;
+}
+
+static char *__compact_string(__COMPACT *c, const char *s)
+{
+    uint64_t size = __str_len(s) + 1;
+    char *copy = __compact_take(c, size, 0);
+
+    if (copy != NULL)
+        memcpy(copy, s, size);
+
+    return copy;
+}
+
+/**
+ * @brief Lays json out depth first: node, container header, child vectors,
+ * then each entry (field string, value subtree) in order. With c->base NULL
+ * only c->used advances, which is how the block size is measured.
+ */
+static JSON *__compact_value(__COMPACT *c, JSON *json)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__compact_value");
+
+    JSON *node = __compact_take(c, sizeof(JSON), 1);
+
+    if (node != NULL)
+    {
+        node->type = json->type;
+        node->value = NULL;
+        node->flags = __NODE_COMPACT;
+        __STAT_NODE(json->type);
+    }
+
+    switch (json->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *src = json->value;
+        JSON_OBJECT *obj = __compact_take(c, sizeof(JSON_OBJECT), 1);
+        char **fields = __compact_take(c, sizeof(char *) * (src->length + 1), 1);
+        JSON **values = __compact_take(c, sizeof(JSON *) * (src->length + 1), 1);
+
+        for (uint64_t i = 0; i < src->length; ++i)
+        {
+            char *field = __compact_string(c, src->fields[i]);
+            JSON *value = __compact_value(c, src->values[i]);
+
+            if (node != NULL)
+            {
+                fields[i] = field;
+                values[i] = value;
+            }
+        }
+
+        if (node != NULL)
+        {
+            fields[src->length] = NULL;
+            values[src->length] = NULL;
+            obj->fields = fields;
+            obj->values = values;
+            obj->length = src->length;
+            node->value = obj;
+        }
+        break;
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *src = json->value;
+        JSON_ARRAY *arr = __compact_take(c, sizeof(JSON_ARRAY), 1);
+        JSON **elements = __compact_take(c, sizeof(JSON *) * (src->length + 1), 1);
+
+        for (uint64_t i = 0; i < src->length; ++i)
+        {
+            JSON *value = __compact_value(c, src->elements[i]);
+
+            if (node != NULL)
+                elements[i] = value;
+        }
+
+        if (node != NULL)
+        {
+            elements[src->length] = NULL;
+            arr->elements = elements;
+            arr->length = src->length;
+            node->value = arr;
+        }
+        break;
+    }
+    case VAL_NUMBER:
+    {
+        JSON_NUMBER *num = __compact_take(c, sizeof(JSON_NUMBER), 1);
+
+        if (node != NULL)
+        {
+            *num = *(JSON_NUMBER *)json->value;
+            node->value = num;
+        }
+        break;
+    }
+    case VAL_STRING:
+    {
+        char *str = __compact_string(c, json->value);
+
+        if (node != NULL)
+            node->value = str;
+        break;
+    }
+    case VAL_BOOL:
+    {
+        int *b = __compact_take(c, sizeof(int), 1);
+
+        if (node != NULL)
+        {
+            *b = *(int *)json->value;
+            node->value = b;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    return node;
+}
+
+/**
+ * @brief json_compact using a specific allocator.
+ *
+ * @param json JSON struct
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | JSON* (memory is owned, use json_free_ex to release)
+ */
+JSON *json_compact_ex(JSON *json, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_compact_ex");
+
+    if (json == NULL)
+    {
+        __print("json_compact failed NULL argument.");
+        return NULL;
+    }
+
+    __COMPACT c = {.base = NULL, .used = 0};
+    __compact_value(&c, json);
+
+    c.base = __mem_alloc(allocator, c.used);
+
+    if (c.base == NULL)
+    {
+        __print("Failed to allocate block in json_compact.");
+        return NULL;
+    }
+
+    c.used = 0;
+    JSON *root = __compact_value(&c, json);
+    root->flags |= __NODE_BLOCK;
+    return root;
+}
+
+/**
+ * @brief Deep copies a JSON struct into a single allocation laid out in depth
+ * first order, for documents that are read often and rarely modified. The
+ * source is left untouched. The copy cannot be modified (append/delete fail,
+ * use json_clone to get an editable copy) and json_free releases it with a
+ * single free. Nodes inside it must not be appended to other documents.
+ *
+ * @param json JSON struct
+ * @return NULL | JSON* (memory is owned, use json_free to release)
+ */
+JSON *json_compact(JSON *json)
+{
+    return json_compact_ex(json, NULL);
+}
+
+static void __memory_payload(JSON *json, uint64_t allocations, JSON_MEMORY *out);
+static void __memory_shared(JSON *json, JSON_MEMORY *out);
+
+static void __memory_total(JSON_MEMORY *out)
+{
+    out->overhead = out->allocations * JSON_PARSER_ALLOC_OVERHEAD;
+    out->total = out->nodes + out->containers + out->vectors + out->keys + out->strings + out->scalars + out->overhead;
+}
+
+static void __memory_usage(JSON *json, JSON_MEMORY *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__memory_usage");
+
+    // Inside a compacted block only the root owns an allocation, the whole block
+    uint64_t allocations = 1;
+    if (json->flags & __NODE_COMPACT)
+    {
+        out->allocations += (json->flags & __NODE_BLOCK) ? 1 : 0;
+        allocations = 0;
+    }
+
+    out->nodes += sizeof(JSON);
+    out->allocations += allocations;
+
+    if (json->flags & __NODE_SHARED)
+        __memory_shared(json, out);
+    else
+        __memory_payload(json, allocations, out);
+}
+
+/**
+ * Measures a shared payload (see json_retain) apart from the document: other
+ * documents may hold it too, so it is added to out->shared as a whole, with
+ * its reference count and the payloads shared below it.
+ */
+static void __memory_shared(JSON *json, JSON_MEMORY *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__memory_shared");
+
+    JSON_MEMORY payload;
+    memset(&payload, 0, sizeof(JSON_MEMORY));
+
+    // The count lives in the allocation of the container
+    payload.containers += sizeof(__SHARE);
+    __memory_payload(json, 1, &payload);
+
+    __memory_total(&payload);
+    out->shared += payload.total + payload.shared;
+}
+
+// What json points to, allocations is 0 inside a compacted block
+static void __memory_payload(JSON *json, uint64_t allocations, JSON_MEMORY *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__memory_payload");
+
+    switch (json->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *obj = json->value;
+
+        // fields and values both hold length + 1 slots
+        out->containers += sizeof(JSON_OBJECT);
+        out->vectors += (sizeof(char *) + sizeof(JSON *)) * (obj->length + 1);
+        if (allocations)
+            out->allocations += 3;
+
+        for (uint64_t i = 0; i < obj->length; ++i)
+        {
+            // Borrowed keys belong to the caller
+            if (!(obj->values[i]->flags & __NODE_BORROWED_KEY))
+            {
+                out->keys += __str_len(obj->fields[i]) + 1;
+                out->allocations += allocations;
+            }
+            __memory_usage(obj->values[i], out);
+        }
+        break;
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *arr = json->value;
+
+        // Never less than the one slot __init_array makes, compacted arrays keep a terminator
+        uint64_t slots = (json->flags & __NODE_COMPACT) ? arr->length + 1 : (arr->length ? arr->length : 1);
+
+        out->containers += sizeof(JSON_ARRAY);
+        out->vectors += sizeof(JSON *) * slots;
+        if (allocations)
+            out->allocations += 2;
+
+        for (uint64_t i = 0; i < arr->length; ++i)
+        {
+            __memory_usage(arr->elements[i], out);
+        }
+        break;
+    }
+    case VAL_STRING:
+    {
+        if (json->flags & __NODE_BORROWED)
+            break;
+        out->strings += __str_len(json->value) + 1;
+        out->allocations += allocations;
+        break;
+    }
+    case VAL_NUMBER:
+    {
+        out->scalars += sizeof(JSON_NUMBER);
+        out->allocations += allocations;
+        break;
+    }
+    case VAL_BOOL:
+    {
+        out->scalars += sizeof(int);
+        out->allocations += allocations;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Reports how much memory json and its descendants use, in a single
+ * traversal. Vector sizes are derived from lengths, so arrays shrunk with
+ * json_array_delete may hold slightly more than reported, and alignment padding
+ * inside json_compact blocks is not counted. The allocator overhead is
+ * estimated as JSON_PARSER_ALLOC_OVERHEAD bytes per allocation. Payloads
+ * shared with json_retain are not part of the breakdown: each node pointing
+ * at one adds all of it, reference count included, to out->shared, since
+ * other documents may hold it too.
+ *
+ * @param json JSON struct
+ * @param out filled with the breakdown, out->total is the sum of every field but out->shared
+ * @return err_t (1 on NULL argument)
+ */
+err_t json_memory_usage(JSON *json, JSON_MEMORY *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_memory_usage");
+
+    if (json == NULL || out == NULL)
+    {
+        __print("json_memory_usage failed NULL argument.");
+        return 1;
+    }
+
+    memset(out, 0, sizeof(JSON_MEMORY));
+    __memory_usage(json, out);
+    __memory_total(out);
+    return 0;
+}
+
+// Snapshot images are written in native byte order, a mismatching magic means
+// the image comes from another platform (or is not an image at all)
+#define __SNAPSHOT_MAGIC (uint32_t)0x4A534E50 // "JSNP"
+#define __SNAPSHOT_VERSION (uint32_t)1
+
+typedef struct snapshot_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // whole image, header included
+    uint64_t root; // offset of the root node from the start of the image
+} __SNAPSHOT_HEADER;
+
+typedef struct snapshot_entry
+{
+    uint64_t field; // NUL terminated field name, relative to the object node
+    uint64_t value; // relative to the object node
+} __SNAPSHOT_ENTRY;
+
+/**
+ * @brief Writes json into c depth first: node, entry or element table, then
+ * each (field, value subtree). Every offset is relative to the node holding it.
+ * With c->base NULL only c->used advances. Returns the node position.
+ */
+static uint64_t __snapshot_value(__COMPACT *c, JSON *json)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__snapshot_value");
+
+    JSON_SNAPSHOT_NODE *node = __compact_take(c, sizeof(JSON_SNAPSHOT_NODE), 1);
+    uint64_t at = c->used - sizeof(JSON_SNAPSHOT_NODE);
+
+    if (node != NULL)
+    {
+        memset(node, 0, sizeof(JSON_SNAPSHOT_NODE));
+        node->type = json->type;
+    }
+
+    switch (json->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *obj = json->value;
+        __SNAPSHOT_ENTRY *entries = __compact_take(c, sizeof(__SNAPSHOT_ENTRY) * obj->length, 1);
+        uint64_t table = c->used - sizeof(__SNAPSHOT_ENTRY) * obj->length;
+
+        for (uint64_t i = 0; i < obj->length; ++i)
+        {
+            uint64_t field = c->used;
+            __compact_string(c, obj->fields[i]);
+            uint64_t value = __snapshot_value(c, obj->values[i]);
+
+            if (entries != NULL)
+            {
+                entries[i].field = field - at;
+                entries[i].value = value - at;
+            }
+        }
+
+        if (node != NULL)
+        {
+            node->length = obj->length;
+            node->as.offset = table - at;
+        }
+        break;
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *arr = json->value;
+        uint64_t *elements = __compact_take(c, sizeof(uint64_t) * arr->length, 1);
+        uint64_t table = c->used - sizeof(uint64_t) * arr->length;
+
+        for (uint64_t i = 0; i < arr->length; ++i)
+        {
+            uint64_t value = __snapshot_value(c, arr->elements[i]);
+
+            if (elements != NULL)
+                elements[i] = value - at;
+        }
+
+        if (node != NULL)
+        {
+            node->length = arr->length;
+            node->as.offset = table - at;
+        }
+        break;
+    }
+    case VAL_STRING:
+    {
+        uint64_t str = c->used;
+        __compact_string(c, json->value);
+
+        if (node != NULL)
+        {
+            node->length = __str_len(json->value);
+            node->as.offset = str - at;
+        }
+        break;
+    }
+    case VAL_NUMBER:
+    {
+        if (node != NULL)
+            node->as.number = *(JSON_NUMBER *)json->value;
+        break;
+    }
+    case VAL_BOOL:
+    {
+        if (node != NULL)
+            node->as.boolean = *(int *)json->value;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return at;
+}
+
+/**
+ * @brief Writes json to `path` as a binary snapshot image that
+ * json_snapshot_map can load without parsing. The image holds no absolute
+ * pointers, only offsets, so it can be mapped at any address and shared
+ * between processes. It is only readable on the platform that wrote it.
+ *
+ * @param json JSON struct
+ * @param path output file, replaced if it exists
+ * @return err_t (1 on NULL argument, allocation or write failure)
+ */
+err_t json_snapshot_write(JSON *json, const char *path)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_snapshot_write");
+
+    if (json == NULL || path == NULL)
+    {
+        __print("json_snapshot_write failed NULL argument.");
+        return 1;
+    }
+
+    __COMPACT c = {.base = NULL, .used = sizeof(__SNAPSHOT_HEADER)};
+    __snapshot_value(&c, json);
+
+    uint64_t size = c.used;
+    c.base = __mem_alloc(NULL, size);
+
+    if (c.base == NULL)
+    {
+        __print("Failed to allocate image in json_snapshot_write.");
+        return 1;
+    }
+
+    // Padding bytes are zeroed so the same document always gives the same image
+    memset(c.base, 0, size);
+    c.used = sizeof(__SNAPSHOT_HEADER);
+
+    __SNAPSHOT_HEADER *header = (__SNAPSHOT_HEADER *)c.base;
+    header->magic = __SNAPSHOT_MAGIC;
+    header->version = __SNAPSHOT_VERSION;
+    header->size = size;
+    header->root = __snapshot_value(&c, json);
+
+    FILE *f = fopen(path, "wb");
+    err_t failed = f == NULL;
+
+    if (f != NULL)
+    {
+        failed = fwrite(c.base, 1, size, f) != size;
+        failed |= fclose(f) != 0;
+    }
+
+    __mem_free(NULL, c.base);
+
+    if (failed)
+    {
+        __print("Failed to write file in json_snapshot_write.");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Loads an image written by json_snapshot_write. It is memory mapped
+ * read-only where the platform supports it, otherwise read into memory. Only
+ * the header is checked, do not map images from untrusted sources.
+ *
+ * @param path image file
+ * @return NULL | JSON_SNAPSHOT* (memory owned, release it using `json_snapshot_unmap`)
+ */
+JSON_SNAPSHOT *json_snapshot_map(const char *path)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_snapshot_map");
+
+    if (path == NULL)
+    {
+        __print("json_snapshot_map failed NULL argument.");
+        return NULL;
+    }
+
+    JSON_SNAPSHOT *snap = __mem_alloc(NULL, sizeof(JSON_SNAPSHOT));
+
+    if (snap == NULL)
+    {
+        return NULL;
+    }
+
+    snap->base = NULL;
+    snap->size = 0;
+    snap->mapped = 0;
+
+#if __HAS_MMAP
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(__SNAPSHOT_HEADER))
+    {
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data != MAP_FAILED)
+        {
+            snap->base = data;
+            snap->size = (uint64_t)st.st_size;
+            snap->mapped = 1;
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+#else
+    FILE *f = fopen(path, "rb");
+
+    if (f != NULL)
+    {
+        __SNAPSHOT_HEADER header;
+
+        // Check the magic before trusting the size, the file may not be an image
+        if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == __SNAPSHOT_MAGIC &&
+            header.size >= sizeof(header))
+        {
+            char *data = __mem_alloc(NULL, header.size);
+
+            if (data != NULL)
+            {
+                memcpy(data, &header, sizeof(header));
+                snap->base = data;
+                snap->size = sizeof(header) + fread(data + sizeof(header), 1, header.size - sizeof(header), f);
+            }
+        }
+
+        fclose(f);
+    }
+#endif
+
+    if (snap->base == NULL)
+    {
+        __print("Failed to read file in json_snapshot_map.");
+        __mem_free(NULL, snap);
+        return NULL;
+    }
+
+    const __SNAPSHOT_HEADER *header = snap->base;
+
+    if (header->magic != __SNAPSHOT_MAGIC || header->version != __SNAPSHOT_VERSION ||
+        header->size != snap->size || header->root + sizeof(JSON_SNAPSHOT_NODE) > snap->size)
+    {
+        __print("json_snapshot_map file is not a snapshot image written on this platform.");
+        json_snapshot_unmap(snap);
+        return NULL;
+    }
+
+    return snap;
+}
+
+/**
+ * @brief Releases a snapshot. Every node obtained from it becomes invalid.
+ *
+ * @param snap NULL | JSON_SNAPSHOT*
+ */
+void json_snapshot_unmap(JSON_SNAPSHOT *snap)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_snapshot_unmap");
+
+    if (snap == NULL)
+        return;
+
+#if __HAS_MMAP
+    if (snap->mapped)
+        munmap((void *)snap->base, (size_t)snap->size);
+    else
+        __mem_free(NULL, (void *)snap->base);
+#else
+    __mem_free(NULL, (void *)snap->base);
+#endif
+
+    __mem_free(NULL, snap);
+}
+
+/**
+ * @brief Get the root value of a snapshot
+ *
+ * @param snap JSON_SNAPSHOT*
+ * @return const JSON_SNAPSHOT_NODE* (lives as long as the snapshot)
+ */
+const JSON_SNAPSHOT_NODE *json_snapshot_root(const JSON_SNAPSHOT *snap)
+{
+    const __SNAPSHOT_HEADER *header = snap->base;
+    return (const JSON_SNAPSHOT_NODE *)((const char *)snap->base + header->root);
+}
+
+static const JSON_SNAPSHOT_NODE *__snapshot_at(const JSON_SNAPSHOT_NODE *node, uint64_t offset)
+{
+    return (const JSON_SNAPSHOT_NODE *)((const char *)node + offset);
+}
+
+/**
+ * @brief json_object_get for snapshot nodes
+ *
+ * @param self node of type VAL_OBJECT
+ * @param field name of field
+ * @return NULL | const JSON_SNAPSHOT_NODE*
+ */
+const JSON_SNAPSHOT_NODE *json_snapshot_object_get(const JSON_SNAPSHOT_NODE *self, const char *field)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_snapshot_object_get");
+
+    if (self->type != VAL_OBJECT)
+    {
+        __print("Cannot use json_snapshot_object_get on node that is not of type VAL_OBJECT.");
+        return NULL;
+    }
+
+    const __SNAPSHOT_ENTRY *entries = (const __SNAPSHOT_ENTRY *)__snapshot_at(self, self->as.offset);
+
+    __STAT_ADD(object_get_calls, 1);
+
+    for (uint64_t i = 0; i < self->length; ++i)
+    {
+        __STAT_ADD(object_get_probes, 1);
+
+        if (__str_comp((const char *)self + entries[i].field, field))
+        {
+            return __snapshot_at(self, entries[i].value);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get the i-th entry of a snapshot object, for iteration
+ *
+ * @param self node of type VAL_OBJECT
+ * @param index entry index
+ * @param field NULL | set to the field name of the entry
+ * @return NULL | const JSON_SNAPSHOT_NODE*
+ */
+const JSON_SNAPSHOT_NODE *json_snapshot_object_at(const JSON_SNAPSHOT_NODE *self, uint64_t index, const char **field)
+{
+    if (self->type != VAL_OBJECT || index >= self->length)
+    {
+        __print("json_snapshot_object_at called on a non object or with an index out of bounds.");
+        return NULL;
+    }
+
+    const __SNAPSHOT_ENTRY *entries = (const __SNAPSHOT_ENTRY *)__snapshot_at(self, self->as.offset);
+
+    if (field != NULL)
+        (*field) = (const char *)self + entries[index].field;
+
+    return __snapshot_at(self, entries[index].value);
+}
+
+/**
+ * @brief json_array_get for snapshot nodes
+ *
+ * @param self node of type VAL_ARRAY
+ * @param index
+ * @return NULL | const JSON_SNAPSHOT_NODE*
+ */
+const JSON_SNAPSHOT_NODE *json_snapshot_array_get(const JSON_SNAPSHOT_NODE *self, uint64_t index)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_snapshot_array_get");
+
+    if (self->type != VAL_ARRAY)
+    {
+        __print("Cannot use json_snapshot_array_get on node that is not of type VAL_ARRAY.");
+        return NULL;
+    }
+
+    __STAT_ADD(array_get_calls, 1);
+
+    if (index >= self->length)
+    {
+        __print("json_snapshot_array_get index is out of bounds of array");
+        return NULL;
+    }
+
+    const uint64_t *elements = (const uint64_t *)__snapshot_at(self, self->as.offset);
+    return __snapshot_at(self, elements[index]);
+}
+
+/**
+ * @brief json_get_deep for snapshot nodes, array indices are given as strings
+ *
+ * @param self node
+ * @param fields_amount
+ * @param fields
+ * @return NULL | const JSON_SNAPSHOT_NODE*
+ */
+const JSON_SNAPSHOT_NODE *json_snapshot_get_deep(const JSON_SNAPSHOT_NODE *self, uint64_t fields_amount, const char *fields[fields_amount])
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_snapshot_get_deep");
+
+    if (fields_amount == 0)
+    {
+        __print("json_snapshot_get_deep called with 0 fields to access.");
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < fields_amount && self != NULL; ++i)
+    {
+        __STAT_ADD(get_deep_steps, 1);
+
+        if (fields[i] == NULL)
+            return NULL;
+
+        if (self->type == VAL_OBJECT)
+            self = json_snapshot_object_get(self, fields[i]);
+        else if (self->type == VAL_ARRAY)
+            self = json_snapshot_array_get(self, strtoull(fields[i], NULL, 10));
+        else
+            return NULL;
+    }
+
+    return self;
+}
+
+/**
+ * @brief Get the string value of a snapshot node of type VAL_STRING
+ *
+ * @param self
+ * @return NULL | const char* (lives as long as the snapshot, length is self->length)
+ */
+const char *json_snapshot_string(const JSON_SNAPSHOT_NODE *self)
+{
+    if (self->type != VAL_STRING)
+    {
+        __print("Tried to get string value out of snapshot node not of type VAL_STRING");
+        return NULL;
+    }
+
+    return (const char *)self + self->as.offset;
+}
+
+/**
+ * @brief Get the number value of a snapshot node of type VAL_NUMBER
+ *
+ * @param self
+ * @return NULL | const double* (lives as long as the snapshot)
+ */
+const double *json_snapshot_number(const JSON_SNAPSHOT_NODE *self)
+{
+    if (self->type != VAL_NUMBER)
+    {
+        __print("Tried to get number value out of snapshot node not of type VAL_NUMBER");
+        return NULL;
+    }
+
+    return &self->as.number;
+}
+
+/**
+ * @brief Get the bool(int) value of a snapshot node of type VAL_BOOL
+ *
+ * @param self
+ * @return NULL | const int* (lives as long as the snapshot)
+ */
+const int *json_snapshot_bool(const JSON_SNAPSHOT_NODE *self)
+{
+    if (self->type != VAL_BOOL)
+    {
+        __print("Tried to get bool value out of snapshot node not of type VAL_BOOL");
+        return NULL;
+    }
+
+    return &self->as.boolean;
+}
+
+/**
+ * Skips the value at *i without allocating, for fields a descriptor does not
+ * bind. Only the structure is checked, escapes and number syntax are not.
+ */
+static err_t __skip_value(__PARSER *p, uint64_t *i)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__skip_value");
+
+    __skip_whitespace(p, i);
+
+    char c = __peek(p, *i);
+    uint64_t len = 0;
+    int has_escape = 0;
+
+    if (c == '"')
+    {
+        if (__unparsed_str_len(p, *i + 1, &len, &has_escape) != 0)
+            return 1;
+        (*i) += len + 2;
+        return 0;
+    }
+
+    if (c == 't' || c == 'f' || c == 'n')
+    {
+        const char *literal = (c == 't') ? "true" : (c == 'f') ? "false" : "null";
+
+        if (!__match_literal(p, *i, literal))
+            return __parser_fail(p, JSON_ERR_INVALID_LITERAL, *i, literal, "Found invalid literal.");
+
+        (*i) += __str_len(literal);
+        return 0;
+    }
+
+    if (c == '-' || __is_digit(c))
+    {
+        (*i) += __number_len(p, *i);
+        return 0;
+    }
+
+    if (c != '{' && c != '[')
+        return __parser_unexpected(p, *i, "value", "Found unexpected character while parsing value.");
+
+    if (p->depth >= p->max_depth)
+        return __parser_fail(p, JSON_ERR_MAX_DEPTH, *i, NULL, "Maximum nesting depth exceeded.");
+
+    char close = (c == '{') ? '}' : ']';
+    p->depth += 1;
+    (*i) += 1;
+    __skip_whitespace(p, i);
+
+    if (__peek(p, *i) == close)
+    {
+        (*i) += 1;
+        p->depth -= 1;
+        return 0;
+    }
+
+    for (;;)
+    {
+        if (c == '{')
+        {
+            __skip_whitespace(p, i);
+
+            if (__peek(p, *i) != '"')
+                return __parser_unexpected(p, *i, "'\"'", "Expected a field name.");
+            if (__skip_value(p, i) != 0 || __consume_colon(p, i) != 0)
+                return 1;
+        }
+
+        if (__skip_value(p, i) != 0)
+            return 1;
+
+        __skip_whitespace(p, i);
+
+        char next = __peek(p, *i);
+        (*i) += 1;
+
+        if (next == close)
+            break;
+        if (next != ',')
+            return __parser_unexpected(p, *i - 1, (c == '{') ? "',' or '}'" : "',' or ']'", "Found unexpected character after value.");
+    }
+
+    p->depth -= 1;
+    return 0;
+}
+
+static int __field_size_ok(const JSON_FIELD *field)
+{
+    switch (field->type)
+    {
+    case JSON_FIELD_DOUBLE:
+        return field->size == sizeof(double);
+    case JSON_FIELD_FLOAT:
+        return field->size == sizeof(float);
+    case JSON_FIELD_INT32:
+        return field->size == sizeof(int32_t);
+    case JSON_FIELD_INT64:
+        return field->size == sizeof(int64_t);
+    case JSON_FIELD_BOOL:
+        return field->size == sizeof(int);
+    case JSON_FIELD_STRING:
+        return field->size == sizeof(char *);
+    case JSON_FIELD_CHARS:
+        return field->size > 0;
+    case JSON_FIELD_STRUCT:
+        return field->desc != NULL;
+    default:
+        return 0;
+    }
+}
+
+static err_t __decode_object(__PARSER *p, uint64_t *i, const JSON_STRUCT_DESC *desc, char *out);
+
+static err_t __decode_field(__PARSER *p, uint64_t *i, const JSON_FIELD *field, char *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__decode_field");
+
+    __skip_whitespace(p, i);
+
+    char c = __peek(p, *i);
+    char *dst = out + field->offset;
+
+    // null keeps whatever the caller had in the field
+    if (c == 'n')
+    {
+        if (!__match_literal(p, *i, "null"))
+            return __parser_fail(p, JSON_ERR_INVALID_LITERAL, *i, "null", "Found invalid literal.");
+        (*i) += 4;
+        return 0;
+    }
+
+    switch (field->type)
+    {
+    case JSON_FIELD_DOUBLE:
+    case JSON_FIELD_FLOAT:
+    case JSON_FIELD_INT32:
+    case JSON_FIELD_INT64:
+    {
+        if (c != '-' && !__is_digit(c))
+            break;
+
+        uint64_t start = *i;
+        JSON_NUMBER num;
+
+        if (__read_number(p, i, &num) != 0)
+            return 1;
+
+        if (field->type == JSON_FIELD_DOUBLE)
+        {
+            memcpy(dst, &num, sizeof(double));
+            return 0;
+        }
+
+        if (field->type == JSON_FIELD_FLOAT)
+        {
+            float f = (float)num;
+            memcpy(dst, &f, sizeof(float));
+            return 0;
+        }
+
+        // Integers are re-read with strtoll, doubles lose precision past 2^53
+        int64_t min = (field->type == JSON_FIELD_INT32) ? INT32_MIN : INT64_MIN;
+        int64_t max = (field->type == JSON_FIELD_INT32) ? INT32_MAX : INT64_MAX;
+        char digits[32];
+        uint64_t len = *i - start;
+        int64_t value = 0;
+        int integral = len < sizeof(digits);
+
+        if (integral)
+        {
+            memcpy(digits, &p->s[start], len);
+            digits[len] = '\0';
+
+            char *end = NULL;
+            errno = 0;
+            value = strtoll(digits, &end, 10);
+            integral = errno == 0 && end == digits + len;
+        }
+
+        if (!integral || value < min || value > max)
+            return __parser_fail(p, JSON_ERR_TYPE_MISMATCH, start, "integer in range", "Number does not fit the integer field.");
+
+        if (field->type == JSON_FIELD_INT32)
+        {
+            int32_t v32 = (int32_t)value;
+            memcpy(dst, &v32, sizeof(int32_t));
+        }
+        else
+        {
+            memcpy(dst, &value, sizeof(int64_t));
+        }
+        return 0;
+    }
+    case JSON_FIELD_BOOL:
+    {
+        int b = (c == 't');
+        const char *literal = b ? "true" : "false";
+
+        if (c != 't' && c != 'f')
+            break;
+        if (!__match_literal(p, *i, literal))
+            return __parser_fail(p, JSON_ERR_INVALID_LITERAL, *i, literal, "Found invalid literal.");
+
+        (*i) += __str_len(literal);
+        memcpy(dst, &b, sizeof(int));
+        return 0;
+    }
+    case JSON_FIELD_STRING:
+    case JSON_FIELD_CHARS:
+    {
+        if (c != '"')
+            break;
+
+        uint64_t start = *i;
+        char *str = __parse_string(p, i);
+
+        if (str == NULL)
+            return 1;
+
+        if (field->type == JSON_FIELD_STRING)
+        {
+            // A repeated key replaces the string decoded for the previous one
+            char *old;
+            memcpy(&old, dst, sizeof(char *));
+            __mem_free(p->alloc, old);
+            memcpy(dst, &str, sizeof(char *));
+            return 0;
+        }
+
+        uint64_t len = __str_len(str);
+
+        if (len >= field->size)
+        {
+            __mem_free(p->alloc, str);
+            return __parser_fail(p, JSON_ERR_TYPE_MISMATCH, start, "shorter string", "String does not fit the char array field.");
+        }
+
+        memcpy(dst, str, len + 1);
+        __mem_free(p->alloc, str);
+        return 0;
+    }
+    case JSON_FIELD_STRUCT:
+    {
+        if (c != '{')
+            break;
+
+        return __decode_object(p, i, field->desc, dst);
+    }
+    default:
+        break;
+    }
+
+    return __parser_fail(p, JSON_ERR_TYPE_MISMATCH, *i, json_field_type_to_str(field->type), "Value does not match the field type.");
+}
+
+static const JSON_FIELD *__find_field(const JSON_STRUCT_DESC *desc, const char *key, uint64_t key_len)
+{
+    for (uint64_t f = 0; f < desc->length; ++f)
+    {
+        const char *name = desc->fields[f].name;
+
+        if (strncmp(name, key, key_len) == 0 && name[key_len] == '\0')
+            return &desc->fields[f];
+    }
+    return NULL;
+}
+
+static err_t __decode_object(__PARSER *p, uint64_t *i, const JSON_STRUCT_DESC *desc, char *out)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__decode_object");
+
+    if (p->depth >= p->max_depth)
+        return __parser_fail(p, JSON_ERR_MAX_DEPTH, *i, NULL, "Maximum nesting depth exceeded.");
+
+    p->depth += 1;
+    (*i) += 1; // opening bracket
+    __skip_whitespace(p, i);
+
+    if (__peek(p, *i) == '}')
+    {
+        (*i) += 1;
+        p->depth -= 1;
+        return 0;
+    }
+
+    for (;;)
+    {
+        __skip_whitespace(p, i);
+
+        if (__peek(p, *i) != '"')
+            return __parser_unexpected(p, *i, "'\"'", "Expected a field name.");
+
+        uint64_t key_len = 0;
+        int has_escape = 0;
+
+        if (__unparsed_str_len(p, *i + 1, &key_len, &has_escape) != 0)
+            return 1;
+
+        const JSON_FIELD *field;
+
+        // Keys are matched in place, only escaped ones need decoding first
+        if (!has_escape)
+        {
+            field = __find_field(desc, &p->s[*i + 1], key_len);
+            (*i) += key_len + 2;
+        }
+        else
+        {
+            char *key = __parse_string(p, i);
+
+            if (key == NULL)
+                return 1;
+
+            field = __find_field(desc, key, __str_len(key));
+            __mem_free(p->alloc, key);
+        }
+
+        if (__consume_colon(p, i) != 0)
+            return 1;
+
+        if (field != NULL && !__field_size_ok(field))
+            return __parser_fail(p, JSON_ERR_TYPE_MISMATCH, *i, json_field_type_to_str(field->type), "Field descriptor size does not match its type.");
+
+        err_t res = (field != NULL) ? __decode_field(p, i, field, out) : __skip_value(p, i);
+
+        if (res != 0)
+            return 1;
+
+        __skip_whitespace(p, i);
+
+        char next = __peek(p, *i);
+        (*i) += 1;
+
+        if (next == '}')
+            break;
+        if (next != ',')
+            return __parser_unexpected(p, *i - 1, "',' or '}'", "Found unexpected character after object entry.");
+    }
+
+    p->depth -= 1;
+    return 0;
+}
+
+/**
+ * @brief Get the string representation of a JSON_FIELD_TYPE
+ *
+ * @param type
+ * @return NULL | const char* (memory not owned, do not free)
+ */
+const char *json_field_type_to_str(JSON_FIELD_TYPE type)
+{
+    if (type > JSON_FIELD_STRUCT)
+    {
+        return NULL;
+    }
+    return __FIELD_TO_STR[type];
+}
+
+/**
+ * @brief Decodes a JSON object straight into a caller-owned struct described
+ * by desc, without building JSON nodes. Keys missing from the input and null
+ * values leave their field untouched, keys missing from desc are skipped.
+ * JSON_FIELD_STRING fields receive strings allocated with the global
+ * allocator, replacing and releasing the one already there: zero `out` first
+ * and release them with json_struct_free, also on failure.
+ *
+ * @param s json string (does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @param desc struct descriptor
+ * @param out struct to fill
+ * @param err NULL | filled with the error, JSON_ERR_TYPE_MISMATCH if a value does not fit its field
+ * @return err_t
+ */
+err_t json_decode_struct(const char *s, uint64_t len, const JSON_STRUCT_DESC *desc, void *out, JSON_ERROR *err)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_decode_struct");
+
+    __PARSER p = {
+        .s = s,
+        .len = len,
+        .opts = NULL,
+        .alloc = NULL,
+        .err = {0},
+        .depth = 0,
+        .max_depth = JSON_PARSER_MAX_DEPTH,
+        .flags = JSON_PARSE_DEFAULT,
+    };
+
+    __STAT_TIMER_START(start);
+
+    uint64_t i = 0;
+
+    if (s == NULL || desc == NULL || out == NULL)
+    {
+        __parser_fail(&p, JSON_ERR_NULL_INPUT, 0, NULL, "json_decode_struct failed NULL argument.");
+    }
+    else
+    {
+        __skip_whitespace(&p, &i);
+
+        if (__peek(&p, i) != '{')
+            __parser_unexpected(&p, i, "'{'", "Expected an object at the top level.");
+        else if (__decode_object(&p, &i, desc, out) == 0)
+        {
+            __skip_whitespace(&p, &i);
+
+            if (i < len)
+                __parser_unexpected(&p, i, "end of input", "Found data after the top level object.");
+        }
+    }
+
+    __STAT_ADD(parse_calls, 1);
+    __STAT_ADD(bytes_parsed, (p.err.code == JSON_ERR_NONE) ? len : p.err.offset);
+    __STAT_TIMER_STOP(start, parse_ns);
+
+    if (err != NULL)
+        (*err) = p.err;
+
+    return p.err.code != JSON_ERR_NONE;
+}
+
+/**
+ * @brief Releases the JSON_FIELD_STRING fields json_decode_struct allocated
+ * in obj, nested structs included, and sets them to NULL.
+ *
+ * @param desc struct descriptor
+ * @param obj struct decoded with desc
+ */
+void json_struct_free(const JSON_STRUCT_DESC *desc, void *obj)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_struct_free");
+
+    for (uint64_t f = 0; f < desc->length; ++f)
+    {
+        const JSON_FIELD *field = &desc->fields[f];
+        char *dst = (char *)obj + field->offset;
+
+        if (field->type == JSON_FIELD_STRING)
+        {
+            char *str;
+            memcpy(&str, dst, sizeof(char *));
+            __mem_free(NULL, str);
+            str = NULL;
+            memcpy(dst, &str, sizeof(char *));
+        }
+        else if (field->type == JSON_FIELD_STRUCT)
+        {
+            json_struct_free(field->desc, dst);
+        }
+    }
+}
+
+// Sink mode buffers this many bytes before handing them over
+#define __WRITER_CHUNK 4096
+
+#define __WRITER_IS_OBJECT(w) (((w)->nesting[((w)->depth - 1) / 8] >> (((w)->depth - 1) % 8)) & 1)
+
+static err_t __writer_fail(JSON_WRITER *w, const char *message)
+{
+    if (!w->failed)
+        __print(message);
+    w->failed = 1;
+    return 1;
+}
+
+static void __writer_put(JSON_WRITER *w, const char *s, uint64_t n)
+{
+    if (w->failed)
+        return;
+
+    if (w->len + n + 1 > w->cap)
+    {
+        if (w->sink != NULL)
+        {
+            if (w->len > 0 && w->sink(w->user, w->data, w->len) != 0)
+            {
+                __writer_fail(w, "json_writer sink failed.");
+                return;
+            }
+            w->len = 0;
+
+            // Too large for the chunk, hand it over as is
+            if (n + 1 > __WRITER_CHUNK)
+            {
+                if (w->sink(w->user, s, n) != 0)
+                    __writer_fail(w, "json_writer sink failed.");
+                return;
+            }
+        }
+
+        uint64_t cap = w->cap ? w->cap : (w->sink != NULL ? __WRITER_CHUNK : 256);
+        while (w->len + n + 1 > cap)
+            cap *= 2;
+
+        if (cap != w->cap)
+        {
+            char *data = __mem_realloc(w->allocator, w->data, cap);
+
+            if (data == NULL)
+            {
+                __writer_fail(w, "json_writer failed to grow its buffer.");
+                return;
+            }
+            w->data = data;
+            w->cap = cap;
+        }
+    }
+
+    memcpy(w->data + w->len, s, n);
+    w->len += n;
+}
+
+// Separators, plus the nesting checks when they are compiled in
+static err_t __writer_before_value(JSON_WRITER *w)
+{
+    if (w->failed)
+        return 1;
+
+#if JSON_PARSER_WRITER_CHECKS
+    if (w->depth == 0 && w->done)
+        return __writer_fail(w, "json_writer already wrote a complete document.");
+    if (w->depth > 0 && __WRITER_IS_OBJECT(w) && !w->after_key)
+        return __writer_fail(w, "json_writer needs a key before a value inside an object.");
+#endif
+
+    if (w->need_comma && !w->after_key)
+        __writer_put(w, ",", 1);
+
+    w->after_key = 0;
+    return w->failed;
+}
+
+static err_t __writer_after_value(JSON_WRITER *w)
+{
+    w->need_comma = 1;
+    w->done = (w->depth == 0);
+    return w->failed;
+}
+
+static err_t __writer_begin(JSON_WRITER *w, int is_object)
+{
+    if (__writer_before_value(w) != 0)
+        return 1;
+
+#if JSON_PARSER_WRITER_CHECKS
+    if (w->depth >= JSON_PARSER_MAX_DEPTH)
+        return __writer_fail(w, "json_writer exceeded JSON_PARSER_MAX_DEPTH.");
+
+    uint8_t bit = (uint8_t)(1u << (w->depth % 8));
+    if (is_object)
+        w->nesting[w->depth / 8] |= bit;
+    else
+        w->nesting[w->depth / 8] &= (uint8_t)~bit;
+#endif
+
+    w->depth += 1;
+    w->need_comma = 0;
+    __writer_put(w, is_object ? "{" : "[", 1);
+    return w->failed;
+}
+
+static err_t __writer_end(JSON_WRITER *w, int is_object)
+{
+    if (w->failed)
+        return 1;
+
+#if JSON_PARSER_WRITER_CHECKS
+    if (w->depth == 0 || __WRITER_IS_OBJECT(w) != is_object)
+        return __writer_fail(w, is_object ? "json_writer_end_object does not close an object." : "json_writer_end_array does not close an array.");
+    if (w->after_key)
+        return __writer_fail(w, "json_writer_end_object after a key without value.");
+#endif
+
+    w->depth -= 1;
+    __writer_put(w, is_object ? "}" : "]", 1);
+    return __writer_after_value(w);
+}
+
+static void __writer_escaped(JSON_WRITER *w, const char *s, uint64_t len)
+{
+    uint64_t run = 0;
+
+    __writer_put(w, "\"", 1);
+
+    for (uint64_t i = 0; i < len;)
+    {
+        if (!__needs_escape((unsigned char)s[i], w->flags))
+        {
+            ++i;
+            ++run;
+            continue;
+        }
+
+        __writer_put(w, s + i - run, run);
+        run = 0;
+
+        char escaped[12];
+        uint64_t n = __escape_char(s, &i, len, w->flags, escaped);
+        __writer_put(w, escaped, n);
+    }
+
+    __writer_put(w, s + len - run, run);
+    __writer_put(w, "\"", 1);
+}
+
+/**
+ * @brief Prepares a writer that accumulates the document in one growable
+ * buffer, returned by json_writer_finish.
+ *
+ * @param w
+ * @param flags JSON_STRINGIFY_DEFAULT | JSON_STRINGIFY_ASCII
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ */
+void json_writer_init(JSON_WRITER *w, JSON_STRINGIFY_FLAGS flags, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_writer_init");
+
+    memset(w, 0, sizeof(JSON_WRITER));
+    w->flags = flags;
+    w->allocator = allocator;
+}
+
+/**
+ * @brief Prepares a writer that hands its output to sink in chunks of a few
+ * KB, so memory use stays bounded whatever the document size.
+ *
+ * @param w
+ * @param sink called with consecutive pieces of the document, returns 1 to abort
+ * @param user passed to sink
+ * @param flags JSON_STRINGIFY_DEFAULT | JSON_STRINGIFY_ASCII
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ */
+void json_writer_init_sink(JSON_WRITER *w, JSON_WRITER_SINK sink, void *user, JSON_STRINGIFY_FLAGS flags, const JSON_ALLOCATOR *allocator)
+{
+    json_writer_init(w, flags, allocator);
+    w->sink = sink;
+    w->user = user;
+}
+
+err_t json_writer_begin_object(JSON_WRITER *w)
+{
+    return __writer_begin(w, 1);
+}
+
+err_t json_writer_end_object(JSON_WRITER *w)
+{
+    return __writer_end(w, 1);
+}
+
+err_t json_writer_begin_array(JSON_WRITER *w)
+{
+    return __writer_begin(w, 0);
+}
+
+err_t json_writer_end_array(JSON_WRITER *w)
+{
+    return __writer_end(w, 0);
+}
+
+/**
+ * @brief Writes the key of the next object entry, escaped like json_stringify.
+ *
+ * @param w
+ * @param key
+ * @return err_t
+ */
+err_t json_writer_key(JSON_WRITER *w, const char *key)
+{
+    if (w->failed)
+        return 1;
+
+    if (key == NULL)
+        return __writer_fail(w, "json_writer_key failed NULL argument.");
+
+#if JSON_PARSER_WRITER_CHECKS
+    if (w->depth == 0 || !__WRITER_IS_OBJECT(w) || w->after_key)
+        return __writer_fail(w, "json_writer_key is only valid inside an object, before each value.");
+#endif
+
+    if (w->need_comma)
+        __writer_put(w, ",", 1);
+
+    __writer_escaped(w, key, __str_len(key));
+    __writer_put(w, ":", 1);
+    w->after_key = 1;
+    return w->failed;
+}
+
+/**
+ * @brief Writes len bytes of s as a string, s does not need to be NUL terminated.
+ *
+ * @param w
+ * @param s
+ * @param len
+ * @return err_t
+ */
+err_t json_writer_string_len(JSON_WRITER *w, const char *s, uint64_t len)
+{
+    if (s == NULL)
+        return __writer_fail(w, "json_writer_string failed NULL argument.");
+
+    if (__writer_before_value(w) != 0)
+        return 1;
+
+    __writer_escaped(w, s, len);
+    return __writer_after_value(w);
+}
+
+err_t json_writer_string(JSON_WRITER *w, const char *s)
+{
+    return json_writer_string_len(w, s, s != NULL ? __str_len(s) : 0);
+}
+
+/**
+ * @brief Writes a number formatted like json_stringify. NaN and infinities
+ * have no JSON form and are written as null.
+ *
+ * @param w
+ * @param num
+ * @return err_t
+ */
+err_t json_writer_number(JSON_WRITER *w, JSON_NUMBER num)
+{
+    if (__writer_before_value(w) != 0)
+        return 1;
+
+    char buff[512];
+
+    if (isnan(num) || isinf(num))
+        __writer_put(w, "null", 4);
+    else if (__format_number(num, buff) == 0)
+        __writer_put(w, buff, __str_len(buff));
+    else
+        return __writer_fail(w, "json_writer_number failed to format number.");
+
+    return __writer_after_value(w);
+}
+
+/**
+ * @brief Writes an integer exactly, including values a double cannot hold.
+ *
+ * @param w
+ * @param num
+ * @return err_t
+ */
+err_t json_writer_integer(JSON_WRITER *w, int64_t num)
+{
+    if (__writer_before_value(w) != 0)
+        return 1;
+
+    char buff[24];
+    int n = snprintf(buff, sizeof(buff), "%lld", (long long)num);
+    __writer_put(w, buff, (uint64_t)n);
+    return __writer_after_value(w);
+}
+
+err_t json_writer_bool(JSON_WRITER *w, int b)
+{
+    if (__writer_before_value(w) != 0)
+        return 1;
+
+    __writer_put(w, b ? "true" : "false", b ? 4 : 5);
+    return __writer_after_value(w);
+}
+
+err_t json_writer_null(JSON_WRITER *w)
+{
+    if (__writer_before_value(w) != 0)
+        return 1;
+
+    __writer_put(w, "null", 4);
+    return __writer_after_value(w);
+}
+
+/**
+ * @brief Writes an existing tree or subtree as the next value, so prebuilt
+ * parts can be mixed with streamed ones.
+ *
+ * @param w
+ * @param json JSON struct
+ * @return err_t
+ */
+err_t json_writer_value(JSON_WRITER *w, JSON *json)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_writer_value");
+
+    if (json == NULL)
+        return __writer_fail(w, "json_writer_value failed NULL argument.");
+
+    switch (json->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *obj = json->value;
+
+        json_writer_begin_object(w);
+        for (uint64_t i = 0; i < obj->length && !w->failed; ++i)
+        {
+            json_writer_key(w, obj->fields[i]);
+            json_writer_value(w, obj->values[i]);
+        }
+        return json_writer_end_object(w);
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *arr = json->value;
+
+        json_writer_begin_array(w);
+        for (uint64_t i = 0; i < arr->length && !w->failed; ++i)
+        {
+            json_writer_value(w, arr->elements[i]);
+        }
+        return json_writer_end_array(w);
+    }
+    case VAL_NUMBER:
+        return json_writer_number(w, *(JSON_NUMBER *)json->value);
+    case VAL_STRING:
+        return json_writer_string(w, json->value);
+    case VAL_BOOL:
+        return json_writer_bool(w, *(int *)json->value);
+    case VAL_NULL:
+        return json_writer_null(w);
+    default:
+        return __writer_fail(w, "json_writer_value found an invalid node type.");
+    }
+}
+
+/**
+ * @brief Completes the document and releases the writer. In buffer mode the
+ * output is moved to out, in sink mode the last chunk is flushed and out is
+ * set to NULL. On failure nothing is returned and the writer is released too.
+ *
+ * @param w
+ * @param out NULL | receives the document (memory owned, release it with the writer allocator)
+ * @param out_len NULL | receives the document length
+ * @return err_t (1 if any call failed or, with JSON_PARSER_WRITER_CHECKS, the document is incomplete)
+ */
+err_t json_writer_finish(JSON_WRITER *w, char **out, uint64_t *out_len)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_writer_finish");
+
+    if (out != NULL)
+        (*out) = NULL;
+
+#if JSON_PARSER_WRITER_CHECKS
+    if (!w->failed && (w->depth != 0 || !w->done))
+        __writer_fail(w, "json_writer_finish called before the document was complete.");
+#endif
+
+    // Makes sure there is room for the terminator
+    __writer_put(w, "", 0);
+
+    if (!w->failed && w->sink != NULL && w->len > 0 && w->sink(w->user, w->data, w->len) != 0)
+        __writer_fail(w, "json_writer sink failed.");
+
+    if (w->failed || w->sink != NULL || out == NULL)
+    {
+        err_t failed = w->failed;
+        json_writer_discard(w);
+        return failed;
+    }
+
+    w->data[w->len] = '\0';
+    (*out) = w->data;
+    if (out_len != NULL)
+        (*out_len) = w->len;
+
+    __STAT_ADD(stringify_calls, 1);
+
+    w->data = NULL;
+    w->len = 0;
+    w->cap = 0;
+    return 0;
+}
+
+/**
+ * @brief Releases a writer without producing output, for error paths.
+ *
+ * @param w
+ */
+void json_writer_discard(JSON_WRITER *w)
+{
+    __mem_free(w->allocator, w->data);
+    w->data = NULL;
+    w->len = 0;
+    w->cap = 0;
+}
+
+static void __encode_object(JSON_WRITER *w, const JSON_STRUCT_DESC *desc, const char *in)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__encode_object");
+
+    json_writer_begin_object(w);
+
+    for (uint64_t f = 0; f < desc->length; ++f)
+    {
+        const JSON_FIELD *field = &desc->fields[f];
+        const char *src = in + field->offset;
+
+        if (!__field_size_ok(field))
+        {
+            __writer_fail(w, "json_encode_struct field descriptor size does not match its type.");
+            return;
+        }
+
+        json_writer_key(w, field->name);
+
+        switch (field->type)
+        {
+        case JSON_FIELD_DOUBLE:
+        {
+            double d;
+            memcpy(&d, src, sizeof(double));
+            json_writer_number(w, d);
+            break;
+        }
+        case JSON_FIELD_FLOAT:
+        {
+            float fl;
+            memcpy(&fl, src, sizeof(float));
+            json_writer_number(w, fl);
+            break;
+        }
+        case JSON_FIELD_INT32:
+        {
+            int32_t v32;
+            memcpy(&v32, src, sizeof(int32_t));
+            json_writer_integer(w, v32);
+            break;
+        }
+        case JSON_FIELD_INT64:
+        {
+            int64_t v64;
+            memcpy(&v64, src, sizeof(int64_t));
+            json_writer_integer(w, v64);
+            break;
+        }
+        case JSON_FIELD_BOOL:
+        {
+            int v;
+            memcpy(&v, src, sizeof(int));
+            json_writer_bool(w, v);
+            break;
+        }
+        case JSON_FIELD_STRING:
+        {
+            const char *str;
+            memcpy(&str, src, sizeof(char *));
+
+            if (str == NULL)
+                json_writer_null(w);
+            else
+                json_writer_string(w, str);
+            break;
+        }
+        case JSON_FIELD_CHARS:
+        {
+            // Bounded by the array, the NUL may be missing if the caller filled it all
+            uint64_t n = 0;
+            while (n < field->size && src[n] != '\0')
+                ++n;
+
+            json_writer_string_len(w, src, n);
+            break;
+        }
+        case JSON_FIELD_STRUCT:
+        {
+            __encode_object(w, field->desc, src);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    json_writer_end_object(w);
+}
+
+/**
+ * @brief Encodes a struct described by desc as a JSON object, fields in
+ * descriptor order. NULL strings and non finite numbers are written as null.
+ *
+ * @param desc struct descriptor
+ * @param in struct to encode
+ * @return NULL | char* (memory owned, you need to free it with the global allocator, free() by default)
+ */
+char *json_encode_struct(const JSON_STRUCT_DESC *desc, const void *in)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_encode_struct");
+
+    if (desc == NULL || in == NULL)
+    {
+        __print("json_encode_struct failed NULL argument.");
+        return NULL;
+    }
+
+    __STAT_TIMER_START(start);
+
+    JSON_WRITER w;
+    char *out = NULL;
+
+    json_writer_init(&w, JSON_STRINGIFY_DEFAULT, NULL);
+    __encode_object(&w, desc, in);
+    json_writer_finish(&w, &out, NULL);
+
+    __STAT_TIMER_STOP(start, stringify_ns);
+    return out;
+}
+
+// 64-bit finalizer from splitmix64, every input bit affects every output bit
+static uint64_t __hash_mix(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBull;
+    h ^= h >> 31;
+    return h;
+}
+
+static uint64_t __hash_bytes(const char *data, uint64_t len, uint64_t seed)
+{
+    uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15ull);
+    uint64_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = __hash_mix(h ^ word);
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, len - i);
+    return __hash_mix(h ^ tail);
+}
+
+static uint64_t __hash_value(JSON *json, uint64_t seed)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__hash_value");
+
+    uint64_t h = seed ^ ((uint64_t)json->type + 1) * 0x9E3779B97F4A7C15ull;
+
+    switch (json->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *obj = json->value;
+        uint64_t sum = 0;
+
+        // Entries are summed so the hash does not depend on key order
+        for (uint64_t i = 0; i < obj->length; ++i)
+        {
+            uint64_t key = __hash_bytes(obj->fields[i], __str_len(obj->fields[i]), seed);
+            sum += __hash_mix(key ^ __hash_value(obj->values[i], seed));
+        }
+
+        return __hash_mix(h ^ sum ^ obj->length);
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *arr = json->value;
+
+        for (uint64_t i = 0; i < arr->length; ++i)
+            h = __hash_mix(h ^ __hash_value(arr->elements[i], seed));
+
+        return __hash_mix(h ^ arr->length);
+    }
+    case VAL_NUMBER:
+    {
+        // -0 == 0, equal values must hash the same
+        JSON_NUMBER num = *(JSON_NUMBER *)json->value;
+        uint64_t bits;
+
+        if (num == 0)
+            num = 0;
+        memcpy(&bits, &num, sizeof(bits));
+        return __hash_mix(h ^ bits);
+    }
+    case VAL_STRING:
+        return __hash_bytes(json->value, __str_len(json->value), h);
+    case VAL_BOOL:
+        return __hash_mix(h ^ (uint64_t)(*(int *)json->value != 0));
+    default:
+        return __hash_mix(h);
+    }
+}
+
+/**
+ * @brief Computes a 64-bit structural hash of a document or subtree without
+ * serializing it. Object entries are combined independently of their order,
+ * so values json_equal considers equal hash the same. Not suitable against
+ * adversarial input: use a random seed if the keys come from untrusted data.
+ *
+ * @param json JSON struct
+ * @param seed
+ * @return uint64_t (0 if json is NULL)
+ */
+uint64_t json_hash(JSON *json, uint64_t seed)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_hash");
+
+    if (json == NULL)
+    {
+        __print("json_hash failed NULL argument.");
+        return 0;
+    }
+
+    return __hash_value(json, seed);
+}
+
+static int __equal_value(JSON *a, JSON *b);
+
+// Entry j of ob is not matched yet and has the key and value of entry i of oa
+static int __equal_entry(JSON_OBJECT *oa, uint64_t i, JSON_OBJECT *ob, uint64_t j, const uint64_t *used)
+{
+    if (used[j / 64] & ((uint64_t)1 << (j % 64)))
+        return 0;
+
+    return __str_comp(oa->fields[i], ob->fields[j]) && __equal_value(oa->values[i], ob->values[j]);
+}
+
+static int __equal_value(JSON *a, JSON *b)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__equal_value");
+
+    if (a == b)
+        return 1;
+
+    if (a->type != b->type)
+        return 0;
+
+    switch (a->type)
+    {
+    case VAL_OBJECT:
+    {
+        JSON_OBJECT *oa = a->value;
+        JSON_OBJECT *ob = b->value;
+
+        if (oa->length != ob->length)
+            return 0;
+
+        // Each entry of b matches at most one entry of a, so objects with
+        // duplicate keys are equal only if they hold the same entries
+        uint64_t local[4] = {0};
+        uint64_t words = (ob->length + 63) / 64;
+        uint64_t *used = local;
+
+        if (words > 4)
+        {
+            used = __mem_alloc(NULL, words * sizeof(uint64_t));
+
+            if (used == NULL)
+            {
+                __print("Failed to allocate memory for matched entries in json_equal");
+                return 0;
+            }
+            memset(used, 0, words * sizeof(uint64_t));
+        }
+
+        int equal = 1;
+
+        for (uint64_t i = 0; i < oa->length && equal; ++i)
+        {
+            // Documents built the same way keep their keys in the same order
+            uint64_t j = i;
+
+            if (!__equal_entry(oa, i, ob, j, used))
+            {
+                for (j = 0; j < ob->length; ++j)
+                {
+                    if (j != i && __equal_entry(oa, i, ob, j, used))
+                        break;
+                }
+            }
+
+            if (j < ob->length)
+                used[j / 64] |= (uint64_t)1 << (j % 64);
+            else
+                equal = 0;
+        }
+
+        if (used != local)
+            __mem_free(NULL, used);
+        return equal;
+    }
+    case VAL_ARRAY:
+    {
+        JSON_ARRAY *aa = a->value;
+        JSON_ARRAY *ab = b->value;
+
+        if (aa->length != ab->length)
+            return 0;
+
+        for (uint64_t i = 0; i < aa->length; ++i)
+        {
+            if (!__equal_value(aa->elements[i], ab->elements[i]))
+                return 0;
+        }
+
+        return 1;
+    }
+    case VAL_NUMBER:
+        return *(JSON_NUMBER *)a->value == *(JSON_NUMBER *)b->value;
+    case VAL_STRING:
+        return __str_comp(a->value, b->value);
+    case VAL_BOOL:
+        return (*(int *)a->value != 0) == (*(int *)b->value != 0);
+    case VAL_NULL:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Compares two documents or subtrees structurally, stopping at the
+ * first difference. Object keys may be in any order, array elements may not.
+ * Entries with duplicate keys are matched one to one, objects of more than
+ * 256 entries allocate a bitmap with the global allocator for that.
+ *
+ * @param a JSON struct
+ * @param b JSON struct
+ * @return int (1 if equal, 0 otherwise or if either is NULL)
+ */
+int json_equal(JSON *a, JSON *b)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_equal");
+
+    if (a == NULL || b == NULL)
+    {
+        __print("json_equal failed NULL argument.");
+        return 0;
+    }
+
+    return __equal_value(a, b);
+}
+
+static uint64_t __column_width(JSON_COLUMN_TYPE type)
+{
+    switch (type)
+    {
+    case JSON_COLUMN_DOUBLE:
+        return sizeof(double);
+    case JSON_COLUMN_INT64:
+        return sizeof(int64_t);
+    case JSON_COLUMN_STRING:
+        return sizeof(const char *);
+    case JSON_COLUMN_BOOL:
+        return sizeof(uint8_t);
+    default:
+        return 0;
+    }
+}
+
+// Stores value in row of col, the validity bit stays clear if the types differ
+static void __column_store(JSON_COLUMN *col, uint64_t row, JSON *value)
+{
+    switch (col->type)
+    {
+    case JSON_COLUMN_DOUBLE:
+        if (value->type != VAL_NUMBER)
+            return;
+        col->as.doubles[row] = *(JSON_NUMBER *)value->value;
+        break;
+    case JSON_COLUMN_INT64:
+    {
+        if (value->type != VAL_NUMBER)
+            return;
+
+        JSON_NUMBER num = *(JSON_NUMBER *)value->value;
+
+        // 2^63 is exact as a double, INT64_MAX is not
+        if (num != floor(num) || num < -9223372036854775808.0 || num >= 9223372036854775808.0)
+            return;
+        col->as.ints[row] = (int64_t)num;
+        break;
+    }
+    case JSON_COLUMN_STRING:
+        if (value->type != VAL_STRING)
+            return;
+        col->as.strings[row] = value->value;
+        break;
+    case JSON_COLUMN_BOOL:
+        if (value->type != VAL_BOOL)
+            return;
+        col->as.bools[row] = *(int *)value->value != 0;
+        break;
+    default:
+        return;
+    }
+
+    col->validity[row / 8] |= (uint8_t)(1u << (row % 8));
+    col->valid += 1;
+}
+
+/**
+ * @brief json_columns_free using a specific allocator.
+ *
+ * @param columns
+ * @param n number of columns
+ * @param allocator NULL | JSON_ALLOCATOR* (must match the one used for extraction)
+ */
+void json_columns_free_ex(JSON_COLUMN *columns, uint64_t n, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_columns_free_ex");
+
+    if (columns == NULL)
+        return;
+
+    for (uint64_t c = 0; c < n; ++c)
+    {
+        // Validity lives in the same allocation, right after the values
+        __mem_free(allocator, columns[c].as.doubles);
+        columns[c].validity = NULL;
+        columns[c].as.doubles = NULL;
+        columns[c].length = 0;
+        columns[c].valid = 0;
+    }
+}
+
+/**
+ * @brief Releases the arrays json_extract_columns allocated. The column
+ * types and the strings they point to are left alone.
+ *
+ * @param columns
+ * @param n number of columns
+ */
+void json_columns_free(JSON_COLUMN *columns, uint64_t n)
+{
+    json_columns_free_ex(columns, n, NULL);
+}
+
+/**
+ * @brief json_extract_columns using a specific allocator.
+ *
+ * @param array JSON struct of type VAL_ARRAY
+ * @param field_names field to extract for each column
+ * @param n number of columns
+ * @param out_columns n columns, type set by the caller
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return err_t
+ */
+err_t json_extract_columns_ex(JSON *array, const char *const *field_names, uint64_t n, JSON_COLUMN *out_columns, const JSON_ALLOCATOR *allocator)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_extract_columns_ex");
+
+    if (array == NULL || (n > 0 && (field_names == NULL || out_columns == NULL)))
+    {
+        __print("json_extract_columns failed NULL argument.");
+        return 1;
+    }
+
+    if (array->type != VAL_ARRAY)
+    {
+        __print("Cannot use json_extract_columns on object that is not of type VAL_ARRAY.");
+        return 1;
+    }
+
+    JSON_ARRAY *arr = array->value;
+    uint64_t rows = arr->length;
+    uint64_t bitmap = (rows + 7) / 8;
+
+    for (uint64_t c = 0; c < n; ++c)
+    {
+        out_columns[c].validity = NULL;
+        out_columns[c].as.doubles = NULL;
+    }
+
+    for (uint64_t c = 0; c < n; ++c)
+    {
+        JSON_COLUMN *col = &out_columns[c];
+        uint64_t width = __column_width(col->type);
+
+        if (width == 0)
+        {
+            __print("json_extract_columns found an invalid column type.");
+            json_columns_free_ex(out_columns, n, allocator);
+            return 1;
+        }
+
+        // Values first so they keep their natural alignment, validity after
+        uint64_t values = rows * width;
+        char *block = __mem_alloc(allocator, values + bitmap + 1);
+
+        if (block == NULL)
+        {
+            json_columns_free_ex(out_columns, n, allocator);
+            return 1;
+        }
+
+        memset(block, 0, values + bitmap + 1);
+        col->field = field_names[c];
+        col->as.doubles = (double *)block;
+        col->validity = (uint8_t *)(block + values);
+        col->length = rows;
+        col->valid = 0;
+    }
+
+    // Reused per column across rows: records sharing a key order hit on the
+    // first comparison, a miss falls back to a scan and relearns the slot.
+    uint64_t slots_small[16];
+    uint64_t *slots = slots_small;
+
+    if (n > 16)
+    {
+        slots = __mem_alloc(allocator, sizeof(uint64_t) * n);
+
+        if (slots == NULL)
+        {
+            json_columns_free_ex(out_columns, n, allocator);
+            return 1;
+        }
+    }
+
+    for (uint64_t c = 0; c < n; ++c)
+        slots[c] = c;
+
+    for (uint64_t row = 0; row < rows; ++row)
+    {
+        JSON *record = arr->elements[row];
+
+        if (record->type != VAL_OBJECT)
+            continue;
+
+        JSON_OBJECT *obj = record->value;
+
+        for (uint64_t c = 0; c < n; ++c)
+        {
+            const char *name = field_names[c];
+            uint64_t slot = slots[c];
+
+            if (slot >= obj->length || !__str_comp(name, obj->fields[slot]))
+            {
+                slot = obj->length;
+
+                for (uint64_t i = 0; i < obj->length; ++i)
+                {
+                    if (__str_comp(name, obj->fields[i]))
+                    {
+                        slot = i;
+                        break;
+                    }
+                }
+
+                if (slot == obj->length)
+                    continue;
+                slots[c] = slot;
+            }
+
+            __column_store(&out_columns[c], row, obj->values[slot]);
+        }
+    }
+
+    if (slots != slots_small)
+        __mem_free(allocator, slots);
+
+    return 0;
+}
+
+/**
+ * @brief Walks an array of objects once and writes each requested field
+ * into a contiguous typed column. Set out_columns[i].type before calling.
+ * Rows whose element is not an object, lacks the field or holds another type
+ * (or a non integral number for JSON_COLUMN_INT64) get a zero value and a
+ * clear validity bit. String columns point into array, they are valid until
+ * it is freed or modified.
+ *
+ * @param array JSON struct of type VAL_ARRAY
+ * @param field_names field to extract for each column
+ * @param n number of columns
+ * @param out_columns n columns, type set by the caller
+ * @return err_t (release the columns with json_columns_free)
+ */
+err_t json_extract_columns(JSON *array, const char *const *field_names, uint64_t n, JSON_COLUMN *out_columns)
+{
+    return json_extract_columns_ex(array, field_names, n, out_columns, NULL);
+}
+
+// Powers of ten that are exact in a double
+static const double __EXACT_POW10[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/**
+ * Reads one number with the strict JSON grammar. When the significand fits in
+ * 53 bits and the decimal exponent is within 22 the result is a single exact
+ * multiply or divide, so correctly rounded. Anything longer is checked the
+ * same way and only converted by strtod.
+ */
+static err_t __scan_number(__PARSER *p, uint64_t *i, double *out)
+{
+    uint64_t start = *i;
+    uint64_t k = *i;
+    int negative = 0;
+    uint64_t mantissa = 0;
+    uint64_t digits = 0; // significant digits, leading zeros excluded, past 19 only counted
+    int64_t exp10 = 0;
+
+    if (k < p->len && p->s[k] == '-')
+    {
+        negative = 1;
+        ++k;
+    }
+
+    if (k >= p->len || !__is_digit(p->s[k]))
+        return __parser_fail(p, JSON_ERR_INVALID_NUMBER, k, "digit", "Found invalid number.");
+
+    if (p->s[k] == '0')
+    {
+        ++k;
+    }
+    else
+    {
+        for (; k < p->len && __is_digit(p->s[k]); ++k)
+        {
+            if (digits < 19)
+                mantissa = mantissa * 10 + (uint64_t)(p->s[k] - '0');
+            ++digits;
+        }
+    }
+
+    if (k < p->len && p->s[k] == '.')
+    {
+        ++k;
+
+        if (k >= p->len || !__is_digit(p->s[k]))
+            return __parser_fail(p, JSON_ERR_INVALID_NUMBER, k, "digit", "Found invalid number.");
+
+        for (; k < p->len && __is_digit(p->s[k]); ++k)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (uint64_t)(p->s[k] - '0');
+                digits += (mantissa != 0);
+                exp10 -= 1;
+            }
+            else
+            {
+                ++digits;
+            }
+        }
+    }
+
+    if (k < p->len && (p->s[k] == 'e' || p->s[k] == 'E'))
+    {
+        ++k;
+
+        int exp_negative = 0;
+        int64_t exp = 0;
+
+        if (k < p->len && (p->s[k] == '+' || p->s[k] == '-'))
+            exp_negative = (p->s[k++] == '-');
+
+        if (k >= p->len || !__is_digit(p->s[k]))
+            return __parser_fail(p, JSON_ERR_INVALID_NUMBER, k, "digit", "Found invalid number.");
+
+        for (; k < p->len && __is_digit(p->s[k]); ++k)
+        {
+            if (exp < 100000)
+                exp = exp * 10 + (p->s[k] - '0');
+        }
+
+        exp10 += exp_negative ? -exp : exp;
+    }
+
+    uint64_t first = start + negative;
+
+    if (p->s[first] == '0' && first + 1 < p->len && __is_digit(p->s[first + 1]))
+        return __parser_fail(p, JSON_ERR_INVALID_NUMBER, first, "',' or ']'", "Found leading zero in number.");
+
+    // The token must end here, so __read_number converts exactly [start, k)
+    if (k < p->len && (__is_digit(p->s[k]) || p->s[k] == '.' || p->s[k] == 'e' || p->s[k] == 'E' || p->s[k] == '+' || p->s[k] == '-'))
+        return __parser_fail(p, JSON_ERR_INVALID_NUMBER, k, "',' or ']'", "Found invalid number.");
+
+    // Too many digits for the fast path
+    if (digits > 19)
+        return __read_number(p, i, out);
+
+    double value;
+
+    if (mantissa == 0)
+        value = 0.0;
+    else if (mantissa <= (1ull << 53) && exp10 >= -22 && exp10 <= 22)
+        value = exp10 < 0 ? (double)mantissa / __EXACT_POW10[-exp10] : (double)mantissa * __EXACT_POW10[exp10];
+    else
+        return __read_number(p, i, out);
+
+    (*out) = negative ? -value : value;
+    (*i) = k;
+    return 0;
+}
+
+static err_t __parse_number_array(const char *s, uint64_t len, void *out, int is_float, uint64_t cap, uint64_t *count, JSON_ERROR *err)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__parse_number_array");
+
+    __PARSER p = {
+        .s = s,
+        .len = len,
+        .opts = NULL,
+        .alloc = NULL,
+        .err = {0},
+        .depth = 0,
+        .max_depth = JSON_PARSER_MAX_DEPTH,
+        .flags = JSON_PARSE_DEFAULT,
+    };
+
+    __STAT_TIMER_START(start);
+
+    uint64_t i = 0;
+    uint64_t n = 0;
+
+    if (s == NULL || (out == NULL && cap > 0))
+    {
+        __parser_fail(&p, JSON_ERR_NULL_INPUT, 0, NULL, "json_parse_number_array failed NULL argument.");
+        goto done;
+    }
+
+    __skip_whitespace(&p, &i);
+
+    if (__peek(&p, i) != '[')
+    {
+        __parser_unexpected(&p, i, "'['", "Expected an array at the top level.");
+        goto done;
+    }
+
+    i += 1;
+    __skip_whitespace(&p, &i);
+
+    if (__peek(&p, i) == ']')
+    {
+        i += 1;
+    }
+    else
+    {
+        for (;;)
+        {
+            __skip_whitespace(&p, &i);
+
+            char c = __peek(&p, i);
+            double value;
+
+            if (c != '-' && !__is_digit(c))
+            {
+                if (i < len && __str_contains_c("\"{[tfn", c))
+                    __parser_fail(&p, JSON_ERR_TYPE_MISMATCH, i, "number", "Number arrays may only contain numbers.");
+                else
+                    __parser_unexpected(&p, i, "number", "Found unexpected character while parsing number array.");
+                goto done;
+            }
+
+            if (__scan_number(&p, &i, &value) != 0)
+                goto done;
+
+            // Past cap the values are still checked and counted, not stored
+            if (n < cap)
+            {
+                if (is_float)
+                    ((float *)out)[n] = (float)value;
+                else
+                    ((double *)out)[n] = value;
+            }
+            n += 1;
+
+            __skip_whitespace(&p, &i);
+
+            char next = __peek(&p, i);
+            i += 1;
+
+            if (next == ']')
+                break;
+            if (next != ',')
+            {
+                __parser_unexpected(&p, i - 1, "',' or ']'", "Found unexpected character after number.");
+                goto done;
+            }
+        }
+    }
+
+    __skip_whitespace(&p, &i);
+
+    if (i < len)
+        __parser_unexpected(&p, i, "end of input", "Found data after the top level array.");
+    else if (n > cap)
+        __parser_fail(&p, JSON_ERR_CAPACITY, i, NULL, "Number array does not fit the output buffer.");
+
+done:
+    __STAT_ADD(parse_calls, 1);
+    __STAT_ADD(bytes_parsed, (p.err.code == JSON_ERR_NONE) ? len : p.err.offset);
+    __STAT_TIMER_STOP(start, parse_ns);
+
+    if (count != NULL)
+        (*count) = n;
+
+    if (err != NULL)
+        (*err) = p.err;
+
+    return p.err.code != JSON_ERR_NONE;
+}
+
+/**
+ * @brief Parses a JSON array of numbers straight into a float buffer, without
+ * building JSON nodes. Values are rounded to double first, then to float.
+ * If the array holds more than cap numbers, the first cap are written, count
+ * is set to the full length and JSON_ERR_CAPACITY is returned, so passing a
+ * NULL buffer with cap 0 measures the array.
+ *
+ * @param s json string (does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @param out NULL | buffer of cap floats
+ * @param cap
+ * @param count NULL | set to the number of elements in the array
+ * @param err NULL | filled with the error, JSON_ERR_TYPE_MISMATCH for non number elements
+ * @return err_t
+ */
+err_t json_parse_number_array(const char *s, uint64_t len, float *out, uint64_t cap, uint64_t *count, JSON_ERROR *err)
+{
+    return __parse_number_array(s, len, out, 1, cap, count, err);
+}
+
+/**
+ * @brief json_parse_number_array into a double buffer.
+ *
+ * @param s json string (does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @param out NULL | buffer of cap doubles
+ * @param cap
+ * @param count NULL | set to the number of elements in the array
+ * @param err NULL | filled with the error
+ * @return err_t
+ */
+err_t json_parse_number_array_double(const char *s, uint64_t len, double *out, uint64_t cap, uint64_t *count, JSON_ERROR *err)
+{
+    return __parse_number_array(s, len, out, 0, cap, count, err);
+}
+
+/**
+ * Writes the shortest decimal of 6 to 9 significant digits that reads back as
+ * x, in plain notation. Returns 0 when x is out of the handled range, the
+ * caller then falls back to snprintf.
+ */
+static uint64_t __format_float(float x, char *out)
+{
+    double ax = fabs((double)x);
+
+    if (!(ax >= 1e-7 && ax < 1e9))
+        return 0;
+
+    // Decimal exponent of the leading digit, only a hint: the check below
+    // keeps the output exact if it is off by one near a power of ten.
+    int e10 = 0;
+    if (ax >= 1.0)
+    {
+        while (e10 < 8 && ax >= __EXACT_POW10[e10 + 1])
+            ++e10;
+    }
+    else
+    {
+        while (e10 > -7 && ax < 1.0 / __EXACT_POW10[-e10])
+            --e10;
+    }
+
+    for (int digits = 6; digits <= 9; ++digits)
+    {
+        // value = m / 10^scale, scale may be negative for large values
+        int scale = digits - 1 - e10;
+        double scaled = scale >= 0 ? ax * __EXACT_POW10[scale] : ax / __EXACT_POW10[-scale];
+        uint64_t m = (uint64_t)(scaled + 0.5);
+        double back = scale >= 0 ? (double)m / __EXACT_POW10[scale] : (double)m * __EXACT_POW10[-scale];
+
+        if ((float)back != (float)ax)
+            continue;
+
+        while (m != 0 && m % 10 == 0 && scale > 0)
+        {
+            m /= 10;
+            scale -= 1;
+        }
+
+        char digits_buff[24];
+        int nd = 0;
+        do
+        {
+            digits_buff[nd++] = (char)('0' + m % 10);
+            m /= 10;
+        } while (m != 0);
+
+        uint64_t n = 0;
+        if (x < 0)
+            out[n++] = '-';
+
+        if (scale <= 0)
+        {
+            while (nd > 0)
+                out[n++] = digits_buff[--nd];
+            for (int z = 0; z < -scale; ++z)
+                out[n++] = '0';
+        }
+        else if (nd > scale)
+        {
+            while (nd > scale)
+                out[n++] = digits_buff[--nd];
+            out[n++] = '.';
+            while (nd > 0)
+                out[n++] = digits_buff[--nd];
+        }
+        else
+        {
+            out[n++] = '0';
+            out[n++] = '.';
+            for (int z = 0; z < scale - nd; ++z)
+                out[n++] = '0';
+            while (nd > 0)
+                out[n++] = digits_buff[--nd];
+        }
+
+        return n;
+    }
+
+    return 0;
+}
+
+static char *__write_number_array(const void *values, int is_float, uint64_t count, const JSON_ALLOCATOR *a)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("__write_number_array");
+
+    // Longest outputs are "-999999986991104" and "-2.2250738585072014e-308"
+    const uint64_t width = is_float ? 18 : 26;
+
+    __STAT_TIMER_START(start);
 
-    if (err)
-    {
+    char *out = __mem_alloc(a, count * width + 3);
+
+    if (out == NULL)
         return NULL;
-    }
 
-    j->value = buff;
-    return j;
-}
+    uint64_t n = 0;
+    out[n++] = '[';
 
-/**
- * @brief Creates a JSON struct of type VAL_NUMBER.
- *
- * @param d
- * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
- */
-JSON *json_make_number(double num)
-{
-    if (num == NAN)
+    for (uint64_t k = 0; k < count; ++k)
     {
-        return NULL;
+        double value = is_float ? (double)((const float *)values)[k] : ((const double *)values)[k];
+
+        if (k > 0)
+            out[n++] = ',';
+
+        if (isnan(value) || isinf(value))
+        {
+            memcpy(out + n, "null", 4);
+            n += 4;
+        }
+        // Whole numbers are the common case in ids and quantized data
+        else if (value == floor(value) && fabs(value) < 1e15)
+        {
+            n += (uint64_t)snprintf(out + n, width, "%lld", (long long)value);
+        }
+        else
+        {
+            uint64_t written = is_float ? __format_float((float)value, out + n) : 0;
+            n += written != 0 ? written : (uint64_t)snprintf(out + n, width, is_float ? "%.9g" : "%.17g", value);
+        }
     }
-    JSON *j = malloc(sizeof(JSON));
 
-    double *num_ptr = malloc(sizeof(double));
-    (*num_ptr) = num;
+    out[n++] = ']';
+    out[n] = '\0';
 
-    j->type = VAL_NUMBER;
-    j->value = num_ptr;
-    return j;
+    char *shrunk = __mem_realloc(a, out, n + 1);
+
+    __STAT_ADD(stringify_calls, 1);
+    __STAT_TIMER_STOP(start, stringify_ns);
+    return shrunk != NULL ? shrunk : out;
 }
 
 /**
- * @brief Creates a JSON struct of type VAL_BOOL.
+ * @brief json_write_number_array using a specific allocator.
  *
- * @param b bool (0|1). if != 0, will be considered true.
- * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ * @param values
+ * @param count
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | char* (memory owned, release it with the same allocator)
  */
-JSON *json_make_bool(int b)
+char *json_write_number_array_ex(const float *values, uint64_t count, const JSON_ALLOCATOR *allocator)
 {
-    JSON *j = malloc(sizeof(JSON));
+    if (JSON_PARSER_DEBUG)
+        __print("json_write_number_array_ex");
 
-    double *bool_pt = malloc(sizeof(int));
-    (*bool_pt) = b ? 1 : 0;
+    if (values == NULL && count > 0)
+    {
+        __print("json_write_number_array failed NULL argument.");
+        return NULL;
+    }
 
-    j->type = VAL_BOOL;
-    j->value = bool_pt;
-    return j;
+    return __write_number_array(values, 1, count, allocator);
 }
 
 /**
- * @brief Creates a JSON struct of type VAL_NULL.
+ * @brief Serializes a float buffer as a JSON array, each value with enough
+ * digits to read back the same float. NaN and infinities are written as null.
  *
- * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ * @param values
+ * @param count
+ * @return NULL | char* (memory owned, you need to free it with the global allocator, free() by default)
  */
-JSON *json_make_null()
+char *json_write_number_array(const float *values, uint64_t count)
 {
-    JSON *j = malloc(sizeof(JSON));
-    j->type = VAL_NULL;
-    j->value = NULL;
-    return j;
+    return json_write_number_array_ex(values, count, NULL);
 }
 
 /**
- * @brief Creates a JSON struct of type VAL_OBJECT. Field strings are copied.
- * Make sure to not free the JSON structs or let them fall out of scope.
+ * @brief json_write_number_array_double using a specific allocator.
  *
- * @param len
- * @param fields
  * @param values
- * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ * @param count
+ * @param allocator NULL | JSON_ALLOCATOR* (NULL uses the global allocator)
+ * @return NULL | char* (memory owned, release it with the same allocator)
  */
-JSON *json_make_object(uint64_t len, char *fields[len], JSON *values[len])
+char *json_write_number_array_double_ex(const double *values, uint64_t count, const JSON_ALLOCATOR *allocator)
 {
-    JSON_OBJECT *obj = malloc(sizeof(JSON_OBJECT));
-
-    err_t err = __init_object(obj);
+    if (JSON_PARSER_DEBUG)
+        __print("json_write_number_array_double_ex");
 
-    if (err)
+    if (values == NULL && count > 0)
     {
+        __print("json_write_number_array_double failed NULL argument.");
         return NULL;
     }
 
-    for (uint64_t i = 0; i < len; ++i)
-    {
-        err_t err = __append_object_entry(obj, fields[i], values[i]);
-
-        if (err)
-        {
-            return NULL;
-        }
-    }
-
-    JSON *j = malloc(sizeof(JSON));
-    j->type = VAL_OBJECT;
-    j->value = obj;
-    return j;
+    return __write_number_array(values, 0, count, allocator);
 }
 
 /**
- * @brief Creates a JSON struct of type VAL_ARRAY.
- * Make sure to not free the JSON structs or let them fall out of scope.
+ * @brief json_write_number_array from a double buffer, each value with
+ * enough digits to read back the same double.
  *
- * @param len
  * @param values
- * @return NULL | JSON* (memory is owned, use json_free to release if standalone)
+ * @param count
+ * @return NULL | char* (memory owned, you need to free it with the global allocator, free() by default)
  */
-JSON *json_make_array(uint64_t len, JSON *values[len])
+char *json_write_number_array_double(const double *values, uint64_t count)
 {
-    JSON_ARRAY *arr = malloc(sizeof(JSON_ARRAY));
+    return json_write_number_array_double_ex(values, count, NULL);
+}
 
-    err_t err = __init_array(arr);
+typedef uint8_t __STEP_STATE;
 
-    if (err)
-    {
-        return NULL;
-    }
+#define __STEP_VALUE (__STEP_STATE)0 // expecting a value
+#define __STEP_FIRST (__STEP_STATE)1 // after '[', '{' or ',': an entry or the closing bracket
+#define __STEP_KEY (__STEP_STATE)2   // expecting a field name
+#define __STEP_NEXT (__STEP_STATE)3  // after an entry: ',' or the closing bracket
+#define __STEP_DONE (__STEP_STATE)4
+#define __STEP_FAILED (__STEP_STATE)5
 
-    for (uint64_t i = 0; i < len; ++i)
-    {
-        err_t err = __append_array_element(arr, values[i]);
+// Checking the clock costs more than a small value, only do it every few
+#define __STEP_CLOCK_EVERY 64
 
-        if (err)
-        {
-            return NULL;
-        }
-    }
+struct json_parse_state
+{
+    __PARSER p;
+    JSON_PARSE_OPTIONS opts; // copied, p.opts points here
+    uint64_t i;
+    __STEP_STATE state;
+    JSON *root;
+    JSON **stack; // open containers, p.depth of them
+    uint64_t stack_cap;
+    char *key; // field name waiting for its value
+};
 
-    JSON *j = malloc(sizeof(JSON));
-    j->type = VAL_ARRAY;
-    j->value = arr;
-    return j;
+static uint64_t __step_now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
-err_t json_object_append(JSON *json, const char *field, JSON *value)
+// Links a new node into the tree right away, so the partial tree is always
+// complete enough for __free_value.
+static err_t __step_attach(JSON_PARSE_STATE *st, JSON *node)
 {
-    if (json == NULL || field == NULL || value == NULL)
+    __PARSER *p = &st->p;
+
+    if (st->root == NULL)
     {
-        __print("json_object_append failed NULL argument.");
-        return 1;
+        st->root = node;
+        return 0;
     }
 
-    if (json->type == VAL_OBJECT)
+    JSON *parent = st->stack[p->depth - 1];
+    err_t res;
+
+    if (parent->type == VAL_OBJECT)
     {
-        __print("json_object_append first argument is not of type VAL_OBJECT");
-        return 1;
+        res = __append_object_entry_owned(parent->value, st->key, node, p->alloc);
+        if (res == 0)
+            st->key = NULL;
+    }
+    else
+    {
+        res = __append_array_element(parent->value, node, p->alloc);
     }
 
-    err_t err = __append_object_entry(json->value, field, value);
-
-    if (err)
+    if (res != 0)
     {
-        return 1;
+        __free_value(node, p->alloc);
+        return __parser_fail(p, JSON_ERR_ALLOC, st->i, NULL, "Failed to append entry in json_parse_step.");
     }
 
     return 0;
 }
 
-err_t json_object_delete(JSON *json, const char *field)
+static err_t __step_open(JSON_PARSE_STATE *st, char c)
 {
-    if (json == NULL || field == NULL)
-    {
-        __print("json_object_delete failed NULL argument.");
-        return 1;
-    }
+    __PARSER *p = &st->p;
 
-    if (json->type == VAL_OBJECT)
+    if (p->depth >= p->max_depth)
+        return __parser_fail(p, JSON_ERR_MAX_DEPTH, st->i, NULL, "Maximum nesting depth reached in json_parse_step.");
+
+    if (p->depth >= st->stack_cap)
     {
-        __print("json_object_delete first argument is not of type VAL_OBJECT");
-        return 1;
+        uint64_t cap = st->stack_cap ? st->stack_cap * 2 : 16;
+        JSON **stack = __mem_realloc(p->alloc, st->stack, sizeof(JSON *) * cap);
+
+        if (stack == NULL)
+            return __parser_fail(p, JSON_ERR_ALLOC, st->i, NULL, "Failed to grow the stack in json_parse_step.");
+
+        st->stack = stack;
+        st->stack_cap = cap;
     }
 
-    JSON_OBJECT *obj = json->value;
+    JSON *node = (c == '{') ? json_make_object_ex(0, NULL, NULL, p->alloc) : json_make_array_ex(0, NULL, p->alloc);
 
-    if (obj->length == 0)
-    {
-        __print("json_object_delete object is of length 0");
+    if (node == NULL)
+        return __parser_fail(p, JSON_ERR_ALLOC, st->i, NULL, "Failed to allocate container in json_parse_step.");
+
+    if (__step_attach(st, node) != 0)
         return 1;
-    }
 
-    JSON_OBJECT *new_obj = malloc(sizeof(JSON_OBJECT));
+    st->stack[p->depth] = node;
+    p->depth += 1;
+    st->i += 1;
+    st->state = __STEP_FIRST;
+    return 0;
+}
+
+static void __step_close(JSON_PARSE_STATE *st)
+{
+    st->i += 1;
+    st->p.depth -= 1;
+    st->state = (st->p.depth == 0) ? __STEP_DONE : __STEP_NEXT;
+}
+
+/**
+ * @brief Prepares a parse of s that runs in slices with json_parse_step, for
+ * event loops that cannot block for a whole document. The result is the same
+ * as json_parse_ex. s and the allocator must stay valid until json_parse_end.
+ *
+ * @param s json string (does not need to be NUL terminated)
+ * @param len length of s in bytes
+ * @param opts NULL | parse options, copied
+ * @return NULL | JSON_PARSE_STATE* (memory owned, release it with json_parse_end)
+ */
+JSON_PARSE_STATE *json_parse_begin(const char *s, uint64_t len, const JSON_PARSE_OPTIONS *opts)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_parse_begin");
 
-    uint64_t new_length = obj->length - 1;
+    const JSON_ALLOCATOR *a = (opts != NULL) ? opts->allocator : NULL;
+    JSON_PARSE_STATE *st = __mem_alloc(a, sizeof(JSON_PARSE_STATE));
 
-    if (new_length == 0)
+    if (st == NULL)
+        return NULL;
+
+    memset(st, 0, sizeof(JSON_PARSE_STATE));
+
+    if (opts != NULL)
+        st->opts = (*opts);
+
+    st->p = (__PARSER){
+        .s = s,
+        .len = len,
+        .opts = (opts != NULL) ? &st->opts : NULL,
+        .alloc = a,
+        .err = {0},
+        .depth = 0,
+        .max_depth = (opts != NULL && opts->max_depth != 0) ? opts->max_depth : JSON_PARSER_MAX_DEPTH,
+        .flags = (opts != NULL) ? opts->flags : JSON_PARSE_DEFAULT,
+    };
+    st->state = __STEP_VALUE;
+
+    if (s == NULL)
     {
-        new_obj->fields = NULL;
-        new_obj->values = NULL;
-        new_obj->length = 0;
+        __parser_fail(&st->p, JSON_ERR_NULL_INPUT, 0, NULL, "Input string is NULL.");
+        st->state = __STEP_FAILED;
     }
-    else
+
+    return st;
+}
+
+/**
+ * @brief Continues a parse started with json_parse_begin until the document
+ * is complete, an error occurs, or a budget runs out. A budget is checked
+ * between values, so a single long string can overrun it.
+ *
+ * @param st
+ * @param max_bytes 0 | input bytes to consume in this slice
+ * @param max_ns 0 | wall time to spend in this slice
+ * @return JSON_STEP_DONE | JSON_STEP_AGAIN (call again) | JSON_STEP_ERROR
+ */
+JSON_STEP_STATUS json_parse_step(JSON_PARSE_STATE *st, uint64_t max_bytes, uint64_t max_ns)
+{
+    if (JSON_PARSER_DEBUG)
+        __print("json_parse_step");
+
+    __PARSER *p = &st->p;
+    uint64_t start_i = st->i;
+    uint64_t start_ns = (max_ns != 0 || JSON_PARSER_STATS) ? __step_now_ns() : 0;
+    uint64_t values = 0;
+
+    while (st->state != __STEP_DONE && st->state != __STEP_FAILED)
     {
-        new_obj->fields = malloc(sizeof(char *) * new_length);
+        if (max_bytes != 0 && st->i - start_i >= max_bytes)
+            break;
 
-        if (new_obj->fields == NULL)
-        {
-            __print("Failed to alloc fields in object.");
-            return 1;
-        }
+        if (max_ns != 0 && ++values % __STEP_CLOCK_EVERY == 0 && __step_now_ns() - start_ns >= max_ns)
+            break;
+
+        __skip_whitespace(p, &st->i);
 
-        new_obj->values = malloc(sizeof(JSON *) * new_length);
+        char c = __peek(p, st->i);
+        err_t res = 0;
 
-        if (new_obj->values == NULL)
+        switch (st->state)
         {
-            __print("Failed to alloc values in object.");
-            return 1;
-        }
-        new_obj->length = new_length;
-    }
+        case __STEP_VALUE:
+        {
+            if (st->root == NULL && c != '{' && c != '[')
+            {
+                res = __parser_unexpected(p, st->i, "'{' or '['", "Expected an object or an array at the top level.");
+                break;
+            }
 
-    uint64_t k = 0;
-    for (uint64_t i = 0; i < obj->length; ++i)
-    {
-        if (__str_comp(field, obj->fields[i]))
+            if (c == '{' || c == '[')
+            {
+                res = __step_open(st, c);
+                break;
+            }
+
+            JSON *node = __mem_alloc(p->alloc, sizeof(JSON));
+
+            if (node == NULL)
+            {
+                res = __parser_fail(p, JSON_ERR_ALLOC, st->i, NULL, "Failed to allocate value in json_parse_step.");
+                break;
+            }
+
+            if (__parse_any_value(node, p, &st->i) != 0)
+            {
+                __free_value(node, p->alloc);
+                res = 1;
+                break;
+            }
+
+            res = __step_attach(st, node);
+            st->state = __STEP_NEXT;
+            break;
+        }
+        case __STEP_FIRST:
         {
-            continue;
+            JSON *top = st->stack[p->depth - 1];
+
+            // Like the recursive parser, a closing bracket is accepted after ','
+            if (c == (top->type == VAL_OBJECT ? '}' : ']'))
+                __step_close(st);
+            else
+                st->state = (top->type == VAL_OBJECT) ? __STEP_KEY : __STEP_VALUE;
+            break;
         }
-        new_obj->fields[k] = obj->fields[i];
-        new_obj->values[k] = obj->values[i];
-        ++k;
-    }
+        case __STEP_KEY:
+        {
+            if (c != '"')
+            {
+                res = __parser_unexpected(p, st->i, "'\"' or '}'", "Found unexpected character while parsing object.");
+                break;
+            }
 
-    free(obj->fields);
-    obj->fields = NULL;
-    free(obj->values);
-    obj->values = NULL;
-    free(obj);
+            st->key = __parse_string(p, &st->i);
 
-    json->value = new_obj;
-    return 0;
-}
+            if (st->key == NULL || __consume_colon(p, &st->i) != 0)
+            {
+                res = 1;
+                break;
+            }
 
-err_t json_array_append(JSON *json, JSON *value)
-{
-    if (json == NULL || value == NULL)
-    {
-        __print("json_array_append failed NULL argument.");
-        return 1;
-    }
+            st->state = __STEP_VALUE;
+            break;
+        }
+        case __STEP_NEXT:
+        {
+            int is_object = st->stack[p->depth - 1]->type == VAL_OBJECT;
 
-    if (json->type == VAL_ARRAY)
-    {
-        __print("json_array_append first argument is not of type VAL_OBJECT");
-        return 1;
-    }
+            if (c == ',')
+            {
+                st->i += 1;
+                st->state = __STEP_FIRST;
+            }
+            else if (c == (is_object ? '}' : ']'))
+            {
+                __step_close(st);
+            }
+            else
+            {
+                res = is_object ? __parser_unexpected(p, st->i, "',' or '}'", "Expected ',' or '}' after object entry.")
+                                : __parser_unexpected(p, st->i, "',' or ']'", "Expected ',' or ']' after array element.");
+            }
+            break;
+        }
+        default:
+            break;
+        }
 
-    err_t err = __append_array_element(json->value, value);
+        if (res != 0)
+            st->state = __STEP_FAILED;
+    }
 
-    if (err)
+    __STAT_ADD(bytes_parsed, st->i - start_i);
+    if (JSON_PARSER_STATS)
     {
-        return 1;
+        __STAT_ADD(parse_ns, __step_now_ns() - start_ns);
     }
 
-    return 0;
+    if (st->state == __STEP_DONE)
+        return JSON_STEP_DONE;
+
+    return (st->state == __STEP_FAILED) ? JSON_STEP_ERROR : JSON_STEP_AGAIN;
 }
 
-err_t json_array_delete(JSON *json, uint64_t index)
+/**
+ * @brief Releases a parse state and returns the document if json_parse_step
+ * completed it. Calling it earlier cancels the parse: the partial tree is
+ * freed, NULL is returned and err->code stays JSON_ERR_NONE.
+ *
+ * @param st NULL | state from json_parse_begin
+ * @param err NULL | filled with the error
+ * @return NULL | JSON* (memory owned, you need to free it using `json_free`)
+ */
+JSON *json_parse_end(JSON_PARSE_STATE *st, JSON_ERROR *err)
 {
-    if (json == NULL)
-    {
-        __print("json_array_delete failed NULL argument.");
-        return 1;
-    }
+    if (JSON_PARSER_DEBUG)
+        __print("json_parse_end");
 
-    if (json->type == VAL_ARRAY)
-    {
-        __print("json_array_delete first argument is not of type VAL_ARRAY");
-        return 1;
-    }
+    if (st == NULL)
+        return NULL;
 
-    JSON_ARRAY *arr = json->value;
+    const JSON_ALLOCATOR *a = st->p.alloc;
+    JSON *result = NULL;
 
-    if (arr->length == 0)
+    if (st->state == __STEP_DONE)
     {
-        __print("json_array_delete array is of length 0");
-        return 1;
+        result = st->root;
     }
-
-    JSON_ARRAY *new_arr = malloc(sizeof(JSON_ARRAY));
-
-    uint64_t new_length = arr->length - 1;
-
-    if (new_length == 0)
+    else if (st->root != NULL)
     {
-        new_arr->elements = NULL;
-        new_arr->length = 0;
+        __free_value(st->root, a);
     }
-    else
-    {
-        new_arr->elements = malloc(sizeof(JSON *) * new_length);
 
-        if (new_arr->elements == NULL)
-        {
-            __print("Failed to alloc values in array.");
-            return 1;
-        }
-        new_arr->length = new_length;
-    }
+    if (err != NULL)
+        (*err) = st->p.err;
 
-    uint64_t k = 0;
-    for (uint64_t i = 0; i < arr->length; ++i)
-    {
-        if (i == index)
-        {
-            continue;
-        }
-        new_arr->elements[k] = arr->elements[i];
-        ++k;
-    }
+    __STAT_ADD(parse_calls, 1);
 
-    free(arr->elements);
-    arr->elements = NULL;
-    free(arr);
+    __mem_free(a, st->key);
+    __mem_free(a, st->stack);
+    __mem_free(a, st);
+    return result;
+}
 
-    json->value = new_arr;
-    return 0;
-}
\ No newline at end of file
+#endif // !JSON_PARSER_DECLARATIONS_ONLY
@@ -0,0 +1,3 @@
+clang -g bench.c -o bench.exe -Ofast -std=c17
+clang -g stress.c -o stress.exe -Ofast -std=c17
+clang -g test.c -o test.exe -O2 -std=c17
\ No newline at end of file
@@ -0,0 +1,3 @@
+gcc -g bench.c -o bench.exe -Ofast -std=c17
+gcc -g stress.c -o stress.exe -Ofast -std=c17
+gcc -g test.c -o test.exe -O2 -std=c17
\ No newline at end of file
@@ -0,0 +1,3 @@
+zig cc -g bench.c -o bench.exe -Ofast -std=c17
+zig cc -g stress.c -o stress.exe -Ofast -std=c17
+zig cc -g test.c -o test.exe -O2 -std=c17
\ No newline at end of file
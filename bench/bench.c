@@ -0,0 +1,982 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "string.h"
+#include "time.h"
+
+#if defined(_WIN32)
+#include "windows.h"
+#include "psapi.h"
+#else
+#include "sys/resource.h"
+#endif
+
+// Errors are part of the benchmark input validation, not of the measurement
+#define JSON_PARSER_SILENT 1
+
+// Worker threads of the parallel stringify and free_async stages and atomic
+// config handles, needs -pthread
+#define JSON_PARSER_THREADS 1
+
+#if !defined(BENCH_THREADS)
+#define BENCH_THREADS 4
+#endif
+
+#include "../JSONitator.h"
+
+//==============================================================================
+// Allocation counting
+//==============================================================================
+
+// Installed as the global allocator so every allocation made by the
+// parser/serializer is counted.
+
+uint64_t bench_allocs = 0;
+uint64_t bench_alloc_bytes = 0;
+uint64_t bench_frees = 0;
+
+void *bench_malloc(void *user, size_t size)
+{
+    bench_allocs += 1;
+    bench_alloc_bytes += size;
+    return malloc(size);
+}
+
+void *bench_realloc(void *user, void *ptr, size_t size)
+{
+    bench_allocs += 1;
+    bench_alloc_bytes += size;
+    return realloc(ptr, size);
+}
+
+void bench_free(void *user, void *ptr)
+{
+    if (ptr != NULL)
+        bench_frees += 1;
+    free(ptr);
+}
+
+const JSON_ALLOCATOR bench_allocator = {
+    .alloc = bench_malloc,
+    .resize = bench_realloc,
+    .release = bench_free,
+    .user = NULL,
+};
+
+//==============================================================================
+// Timing and memory
+//==============================================================================
+
+uint64_t bench_now_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t bench_peak_rss_kb(void)
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return (uint64_t)pmc.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return (uint64_t)usage.ru_maxrss / 1024;
+#else
+    return (uint64_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+//==============================================================================
+// Corpus
+//==============================================================================
+
+typedef struct bench_buffer
+{
+    char *data;
+    uint64_t len;
+    uint64_t cap;
+} BENCH_BUFFER;
+
+void buffer_reserve(BENCH_BUFFER *b, uint64_t extra)
+{
+    if (b->len + extra + 1 <= b->cap)
+        return;
+
+    uint64_t cap = b->cap ? b->cap : 4096;
+    while (b->len + extra + 1 > cap)
+        cap *= 2;
+
+    char *data = realloc(b->data, cap);
+    if (data == NULL)
+    {
+        printf("Failed to grow corpus buffer.\n");
+        exit(1);
+    }
+    b->data = data;
+    b->cap = cap;
+}
+
+void buffer_printf(BENCH_BUFFER *b, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    buffer_reserve(b, (uint64_t)needed);
+
+    va_start(args, format);
+    vsnprintf(b->data + b->len, (size_t)needed + 1, format, args);
+    va_end(args);
+
+    b->len += (uint64_t)needed;
+}
+
+typedef struct bench_corpus
+{
+    const char *name;
+    BENCH_BUFFER buff;
+    int is_ndjson;
+    uint64_t path_len; // json_get_deep path, applied to every document
+    const char *path[8];
+    const char *lookup; // json_object_get key, applied to the root of every document
+    int is_number_array; // documents are flat numeric arrays
+} BENCH_CORPUS;
+
+int corpus_load_file(BENCH_CORPUS *c, const char *file_path)
+{
+    FILE *f = fopen(file_path, "rb");
+
+    if (f == NULL)
+        return 1;
+
+    fseek(f, 0, SEEK_END);
+    uint64_t fsize = ftell(f);
+    rewind(f);
+
+    buffer_reserve(&c->buff, fsize);
+    uint64_t read_size = fread(c->buff.data, sizeof(char), fsize, f);
+    fclose(f);
+
+    if (read_size != fsize)
+        return 1;
+
+    c->buff.len = fsize;
+    c->buff.data[fsize] = '\0';
+    return 0;
+}
+
+// Deterministic generator so every build measures the exact same bytes
+uint64_t bench_rng = 0x9E3779B97F4A7C15ull;
+
+uint64_t rng_next(void)
+{
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 7;
+    bench_rng ^= bench_rng << 17;
+    return bench_rng;
+}
+
+void gen_string_heavy(BENCH_CORPUS *c, uint64_t count)
+{
+    static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "\\\"quoted\\\"", "tab\\there", "line\\nbreak", "back\\\\slash", "consectetur"};
+
+    buffer_printf(&c->buff, "{\"messages\":[");
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        buffer_printf(&c->buff, "%s{\"author\":\"user_%llu\",\"text\":\"", i ? "," : "", (unsigned long long)(i % 97));
+
+        uint64_t n_words = 8 + rng_next() % 120;
+        for (uint64_t w = 0; w < n_words; ++w)
+        {
+            buffer_printf(&c->buff, "%s%s", w ? " " : "", words[rng_next() % 10]);
+        }
+        buffer_printf(&c->buff, "\"}");
+    }
+    buffer_printf(&c->buff, "]}");
+}
+
+void gen_number_heavy(BENCH_CORPUS *c, uint64_t rows, uint64_t cols)
+{
+    buffer_printf(&c->buff, "{\"matrix\":[");
+    for (uint64_t r = 0; r < rows; ++r)
+    {
+        buffer_printf(&c->buff, "%s[", r ? "," : "");
+        for (uint64_t k = 0; k < cols; ++k)
+        {
+            uint64_t x = rng_next();
+            if (x & 1)
+                buffer_printf(&c->buff, "%s%lld", k ? "," : "", (long long)(x >> 40) - (1ll << 22));
+            else
+                buffer_printf(&c->buff, "%s%.6f", k ? "," : "", (double)(x >> 11) / (double)(1ull << 53) * 2000.0 - 1000.0);
+        }
+        buffer_printf(&c->buff, "]");
+    }
+    buffer_printf(&c->buff, "]}");
+}
+
+void gen_deeply_nested(BENCH_CORPUS *c, uint64_t chains, uint64_t depth)
+{
+    buffer_printf(&c->buff, "{\"chains\":[");
+    for (uint64_t n = 0; n < chains; ++n)
+    {
+        buffer_printf(&c->buff, "%s", n ? "," : "");
+        for (uint64_t d = 0; d < depth; ++d)
+        {
+            if (d % 2 == 0)
+                buffer_printf(&c->buff, "{\"level\":%llu,\"next\":", (unsigned long long)d);
+            else
+                buffer_printf(&c->buff, "[%llu,", (unsigned long long)d);
+        }
+        buffer_printf(&c->buff, "null");
+        for (uint64_t d = depth; d > 0; --d)
+        {
+            buffer_printf(&c->buff, "%s", ((d - 1) % 2 == 0) ? "}" : "]");
+        }
+    }
+    buffer_printf(&c->buff, "]}");
+}
+
+void gen_embeddings(BENCH_CORPUS *c, uint64_t lines, uint64_t dims)
+{
+    for (uint64_t i = 0; i < lines; ++i)
+    {
+        buffer_printf(&c->buff, "[");
+        for (uint64_t d = 0; d < dims; ++d)
+        {
+            float x = (float)((double)(rng_next() >> 11) / (double)(1ull << 53) * 0.2 - 0.1);
+            buffer_printf(&c->buff, "%s%.9g", d ? "," : "", x);
+        }
+        buffer_printf(&c->buff, "]\n");
+    }
+}
+
+void gen_ndjson(BENCH_CORPUS *c, uint64_t lines)
+{
+    for (uint64_t i = 0; i < lines; ++i)
+    {
+        buffer_printf(&c->buff,
+                      "{\"id\":%llu,\"name\":\"user_%llu\",\"score\":%.3f,\"active\":%s,\"tags\":[\"alpha\",\"beta\",\"gamma\"],"
+                      "\"profile\":{\"country\":\"FR\",\"age\":%llu,\"bio\":\"Some text about user number %llu.\"}}\n",
+                      (unsigned long long)i, (unsigned long long)i, (double)(rng_next() % 100000) / 1000.0,
+                      (rng_next() & 1) ? "true" : "false", (unsigned long long)(18 + rng_next() % 60), (unsigned long long)i);
+    }
+}
+
+//==============================================================================
+// Documents
+//==============================================================================
+
+// A corpus is a list of documents: one for regular files, one per line for NDJSON
+typedef struct bench_doc
+{
+    const char *s;
+    uint64_t len;
+} BENCH_DOC;
+
+uint64_t corpus_split(BENCH_CORPUS *c, BENCH_DOC **docs)
+{
+    if (!c->is_ndjson)
+    {
+        (*docs) = malloc(sizeof(BENCH_DOC));
+        (*docs)[0].s = c->buff.data;
+        (*docs)[0].len = c->buff.len;
+        return 1;
+    }
+
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < c->buff.len; ++i)
+        count += c->buff.data[i] == '\n';
+
+    (*docs) = malloc(sizeof(BENCH_DOC) * (count + 1));
+
+    uint64_t n = 0;
+    uint64_t start = 0;
+    for (uint64_t i = 0; i <= c->buff.len; ++i)
+    {
+        if (i == c->buff.len || c->buff.data[i] == '\n')
+        {
+            if (i > start)
+            {
+                (*docs)[n].s = c->buff.data + start;
+                (*docs)[n].len = i - start;
+                ++n;
+            }
+            start = i + 1;
+        }
+    }
+    return n;
+}
+
+//==============================================================================
+// Stages
+//==============================================================================
+
+typedef struct bench_result
+{
+    uint64_t ops;       // documents (or lookups) processed
+    uint64_t bytes;     // input bytes processed
+    uint64_t ns;        // time spent inside the measured calls
+    uint64_t allocs;    // malloc + realloc calls inside the measured calls
+    uint64_t alloc_bytes;
+} BENCH_RESULT;
+
+void report(const char *corpus, const char *stage, BENCH_RESULT *r)
+{
+    double ns_per_op = r->ops ? (double)r->ns / (double)r->ops : 0.0;
+    double mb_per_s = (r->ns && r->bytes) ? ((double)r->bytes / (1024.0 * 1024.0)) / ((double)r->ns / 1e9) : 0.0;
+    double allocs_per_op = r->ops ? (double)r->allocs / (double)r->ops : 0.0;
+    double bytes_per_op = r->ops ? (double)r->alloc_bytes / (double)r->ops : 0.0;
+
+    printf("{\"corpus\":\"%s\",\"stage\":\"%s\",\"ops\":%llu,\"bytes\":%llu,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f,"
+           "\"allocs_per_op\":%.2f,\"alloc_bytes_per_op\":%.1f,\"peak_rss_kb\":%llu}\n",
+           corpus, stage, (unsigned long long)r->ops, (unsigned long long)r->bytes, ns_per_op, mb_per_s,
+           allocs_per_op, bytes_per_op, (unsigned long long)bench_peak_rss_kb());
+    fflush(stdout);
+}
+
+JSON *parse_doc(BENCH_DOC *doc)
+{
+    return json_parse_ex(doc->s, doc->len, NULL, NULL);
+}
+
+void bench_corpus(BENCH_CORPUS *c, double min_seconds)
+{
+    BENCH_DOC *docs = NULL;
+    uint64_t n_docs = corpus_split(c, &docs);
+
+    JSON **trees = malloc(sizeof(JSON *) * n_docs);
+
+    // Validate the corpus once so failures are not silently benchmarked
+    for (uint64_t d = 0; d < n_docs; ++d)
+    {
+        JSON_ERROR err;
+        trees[d] = json_parse_ex(docs[d].s, docs[d].len, NULL, &err);
+
+        if (trees[d] == NULL)
+        {
+            fprintf(stderr, "bench: corpus %s document %llu failed to parse: %s at byte %llu\n", c->name,
+                    (unsigned long long)d, json_error_to_str(err.code), (unsigned long long)err.offset);
+            exit(1);
+        }
+    }
+
+    uint64_t min_ns = (uint64_t)(min_seconds * 1e9);
+
+    //==========================================================================
+    // json_parse
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                JSON *j = parse_doc(&docs[d]);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += docs[d].len;
+                json_free(j);
+            }
+        }
+        report(c->name, "parse", &r);
+    }
+
+    //==========================================================================
+    // json_parse_ex with key orders learned across the corpus
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        JSON_SHAPES *shapes = json_shapes_new(NULL);
+        JSON_PARSE_OPTIONS opts = {.shapes = shapes};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                JSON *j = json_parse_ex(docs[d].s, docs[d].len, &opts, NULL);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += docs[d].len;
+                json_free(j);
+            }
+        }
+        report(c->name, "parse_shapes", &r);
+
+        JSON_SHAPE_STATS st;
+        json_shapes_stats(shapes, &st);
+        fprintf(stderr, "bench: corpus %s shape hit rate %.4f (%llu positions, %llu keys)\n", c->name,
+                (st.hits + st.misses) ? (double)st.hits / (double)(st.hits + st.misses) : 0.0,
+                (unsigned long long)st.positions, (unsigned long long)st.keys);
+        json_shapes_free(shapes);
+    }
+
+    //==========================================================================
+    // json_parse_into, every document parsed into the tree of the previous one
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        JSON *j = parse_doc(&docs[0]);
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                json_parse_into_ex(j, docs[d].s, docs[d].len, NULL, NULL);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += docs[d].len;
+            }
+        }
+        json_free(j);
+        report(c->name, "parse_into", &r);
+    }
+
+    //==========================================================================
+    // json_validate
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        uint64_t valid = 0;
+        while (r.ns < min_ns)
+        {
+            uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+            uint64_t t0 = bench_now_ns();
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                valid += json_validate(docs[d].s, docs[d].len, NULL) == 0;
+                r.bytes += docs[d].len;
+            }
+            r.ns += bench_now_ns() - t0;
+            r.allocs += bench_allocs - a0;
+            r.alloc_bytes += bench_alloc_bytes - b0;
+            r.ops += n_docs;
+        }
+        if (valid != r.ops)
+            fprintf(stderr, "bench: corpus %s json_validate rejected %llu documents\n", c->name, (unsigned long long)(r.ops - valid));
+        report(c->name, "validate", &r);
+    }
+
+    //==========================================================================
+    // json_stringify
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                char *out = json_stringify(trees[d]);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += out ? strlen(out) : 0;
+                bench_free(NULL, out);
+            }
+        }
+        report(c->name, "stringify", &r);
+    }
+
+    //==========================================================================
+    // json_writer_value, the same output as json_stringify through the writer
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                JSON_WRITER w;
+                char *out = NULL;
+                uint64_t len = 0;
+
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                json_writer_init(&w, JSON_STRINGIFY_DEFAULT, NULL);
+                json_writer_value(&w, trees[d]);
+                json_writer_finish(&w, &out, &len);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += len;
+                bench_free(NULL, out);
+            }
+        }
+        report(c->name, "writer", &r);
+    }
+
+    //==========================================================================
+    // json_stringify_iov, long strings referenced in place
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                struct iovec *iov = NULL;
+                uint64_t count = 0;
+
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                json_stringify_iov(trees[d], &iov, &count);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                for (uint64_t k = 0; k < count; ++k)
+                    r.bytes += iov[k].iov_len;
+                bench_free(NULL, iov);
+            }
+        }
+        report(c->name, "stringify_iov", &r);
+    }
+
+    //==========================================================================
+    // json_stringify_parallel, root arrays split over BENCH_THREADS threads
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t len = 0;
+
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                char *out = json_stringify_parallel(trees[d], JSON_STRINGIFY_DEFAULT, BENCH_THREADS, &len, NULL);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += len;
+                bench_free(NULL, out);
+            }
+        }
+        report(c->name, "stringify_parallel", &r);
+    }
+
+    //==========================================================================
+    // json_stringify_ndjson, every document of the corpus as one NDJSON buffer
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            uint64_t len = 0;
+
+            uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+            uint64_t t0 = bench_now_ns();
+            char *out = json_stringify_ndjson(trees, n_docs, JSON_STRINGIFY_DEFAULT, BENCH_THREADS, &len, NULL);
+            r.ns += bench_now_ns() - t0;
+            r.allocs += bench_allocs - a0;
+            r.alloc_bytes += bench_alloc_bytes - b0;
+            r.ops += n_docs;
+            r.bytes += len;
+            bench_free(NULL, out);
+        }
+        report(c->name, "stringify_ndjson", &r);
+    }
+
+    //==========================================================================
+    // json_free
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                JSON *j = parse_doc(&docs[d]);
+                uint64_t t0 = bench_now_ns();
+                json_free(j);
+                r.ns += bench_now_ns() - t0;
+                r.ops += 1;
+                r.bytes += docs[d].len;
+            }
+        }
+        report(c->name, "free", &r);
+    }
+
+    //==========================================================================
+    // json_free_async, time spent by the caller only
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                JSON *j = parse_doc(&docs[d]);
+                uint64_t t0 = bench_now_ns();
+                json_free_async(j);
+                r.ns += bench_now_ns() - t0;
+                r.ops += 1;
+                r.bytes += docs[d].len;
+            }
+            json_free_wait();
+        }
+        report(c->name, "free_async", &r);
+    }
+
+    //==========================================================================
+    // json_compact, then json_stringify over the compacted trees
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                JSON *j = json_compact(trees[d]);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += docs[d].len;
+                json_free(j);
+            }
+        }
+        report(c->name, "compact", &r);
+
+        JSON **compacted = malloc(sizeof(JSON *) * n_docs);
+        for (uint64_t d = 0; d < n_docs; ++d)
+            compacted[d] = json_compact(trees[d]);
+
+        r = (BENCH_RESULT){0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                char *out = json_stringify(compacted[d]);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += out ? strlen(out) : 0;
+                bench_free(NULL, out);
+            }
+        }
+        report(c->name, "stringify_compact", &r);
+
+        for (uint64_t d = 0; d < n_docs; ++d)
+            json_free(compacted[d]);
+        free(compacted);
+    }
+
+    //==========================================================================
+    // json_hash, then json_equal against a clone (worst case, no early exit)
+    //==========================================================================
+    {
+        BENCH_RESULT r = {0};
+        uint64_t mix = 0;
+        while (r.ns < min_ns)
+        {
+            uint64_t t0 = bench_now_ns();
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                mix ^= json_hash(trees[d], 0);
+                r.bytes += docs[d].len;
+            }
+            r.ns += bench_now_ns() - t0;
+            r.ops += n_docs;
+        }
+        if (mix == 1)
+            fprintf(stderr, "bench: corpus %s json_hash collapsed\n", c->name);
+        report(c->name, "hash", &r);
+
+        JSON **clones = malloc(sizeof(JSON *) * n_docs);
+        for (uint64_t d = 0; d < n_docs; ++d)
+            clones[d] = json_clone(trees[d]);
+
+        r = (BENCH_RESULT){0};
+        uint64_t equal = 0;
+        while (r.ns < min_ns)
+        {
+            uint64_t t0 = bench_now_ns();
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                equal += json_equal(trees[d], clones[d]);
+                r.bytes += docs[d].len;
+            }
+            r.ns += bench_now_ns() - t0;
+            r.ops += n_docs;
+        }
+        if (equal != r.ops)
+            fprintf(stderr, "bench: corpus %s json_equal rejected %llu clones\n", c->name, (unsigned long long)(r.ops - equal));
+        report(c->name, "equal", &r);
+
+        for (uint64_t d = 0; d < n_docs; ++d)
+            json_free(clones[d]);
+        free(clones);
+    }
+
+    //==========================================================================
+    // json_parse_number_array, then json_write_number_array from its output
+    //==========================================================================
+    if (c->is_number_array)
+    {
+        uint64_t cap = 0;
+        for (uint64_t d = 0; d < n_docs; ++d)
+        {
+            JSON_ARRAY *arr = trees[d]->value;
+            cap = arr->length > cap ? arr->length : cap;
+        }
+
+        float *values = malloc(sizeof(float) * (cap + 1));
+
+        BENCH_RESULT r = {0};
+        uint64_t count = 0;
+        while (r.ns < min_ns)
+        {
+            uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+            uint64_t t0 = bench_now_ns();
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                if (json_parse_number_array(docs[d].s, docs[d].len, values, cap, &count, NULL) != 0)
+                    r.allocs += 1000000; // make failures obvious in the report
+                r.bytes += docs[d].len;
+            }
+            r.ns += bench_now_ns() - t0;
+            r.allocs += bench_allocs - a0;
+            r.alloc_bytes += bench_alloc_bytes - b0;
+            r.ops += n_docs;
+        }
+        report(c->name, "number_array", &r);
+
+        r = (BENCH_RESULT){0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                json_parse_number_array(docs[d].s, docs[d].len, values, cap, &count, NULL);
+
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                char *out = json_write_number_array(values, count);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += out ? strlen(out) : 0;
+                bench_free(NULL, out);
+            }
+        }
+        report(c->name, "write_number_array", &r);
+
+        free(values);
+    }
+
+    //==========================================================================
+    // json_get_deep
+    //==========================================================================
+    if (c->path_len > 0)
+    {
+        BENCH_RESULT r = {0};
+        uint64_t found = 0;
+        while (r.ns < min_ns)
+        {
+            uint64_t t0 = bench_now_ns();
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                found += json_get_deep(trees[d], c->path_len, c->path) != NULL;
+            }
+            r.ns += bench_now_ns() - t0;
+            r.ops += n_docs;
+        }
+        if (found != r.ops)
+            fprintf(stderr, "bench: corpus %s json_get_deep missed %llu lookups\n", c->name, (unsigned long long)(r.ops - found));
+        report(c->name, "get_deep", &r);
+    }
+
+    //==========================================================================
+    // json_get_deep through a JSON_CONFIG_HANDLE, read_begin/read_end included
+    //==========================================================================
+    if (c->path_len > 0)
+    {
+        JSON_CONFIG_HANDLE *handle = json_config_new(json_clone(trees[0]), NULL);
+        BENCH_RESULT r = {0};
+        uint64_t found = 0;
+        while (r.ns < min_ns)
+        {
+            uint64_t t0 = bench_now_ns();
+            for (uint64_t k = 0; k < 1000; ++k)
+            {
+                JSON *config = json_config_read_begin(handle);
+                found += json_get_deep(config, c->path_len, c->path) != NULL;
+                json_config_read_end(handle);
+            }
+            r.ns += bench_now_ns() - t0;
+            r.ops += 1000;
+        }
+        if (found != r.ops)
+            fprintf(stderr, "bench: corpus %s config json_get_deep missed %llu lookups\n", c->name, (unsigned long long)(r.ops - found));
+        report(c->name, "config_get_deep", &r);
+        json_config_free(handle);
+    }
+
+    //==========================================================================
+    // json_object_get
+    //==========================================================================
+    if (c->lookup != NULL)
+    {
+        BENCH_RESULT r = {0};
+        uint64_t found = 0;
+        while (r.ns < min_ns)
+        {
+            uint64_t t0 = bench_now_ns();
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                found += json_object_get(trees[d], c->lookup) != NULL;
+            }
+            r.ns += bench_now_ns() - t0;
+            r.ops += n_docs;
+        }
+        if (found != r.ops)
+            fprintf(stderr, "bench: corpus %s json_object_get missed %llu lookups\n", c->name, (unsigned long long)(r.ops - found));
+        report(c->name, "object_get", &r);
+    }
+
+    //==========================================================================
+    // Embedding each document in a new one with json_clone, then with
+    // json_retain (last, the trees stay shared afterwards)
+    //==========================================================================
+    for (int shared = 0; shared < 2; ++shared)
+    {
+        BENCH_RESULT r = {0};
+        while (r.ns < min_ns)
+        {
+            for (uint64_t d = 0; d < n_docs; ++d)
+            {
+                uint64_t a0 = bench_allocs, b0 = bench_alloc_bytes;
+                uint64_t t0 = bench_now_ns();
+                JSON *outer = json_make_object(0, NULL, NULL);
+                json_object_append(outer, "doc", shared ? json_retain(trees[d]) : json_clone(trees[d]));
+                json_free(outer);
+                r.ns += bench_now_ns() - t0;
+                r.allocs += bench_allocs - a0;
+                r.alloc_bytes += bench_alloc_bytes - b0;
+                r.ops += 1;
+                r.bytes += docs[d].len;
+            }
+        }
+        report(c->name, shared ? "embed_retain" : "embed_clone", &r);
+    }
+
+    for (uint64_t d = 0; d < n_docs; ++d)
+        json_free(trees[d]);
+
+    free(trees);
+    free(docs);
+}
+
+//==============================================================================
+// Entry point
+//==============================================================================
+
+// Usage: bench [path/to/in.json] [min seconds per stage]
+// Prints one JSON object per (corpus, stage) on stdout.
+int main(int argc, char **argv)
+{
+    const char *in_path = argc > 1 ? argv[1] : "in.json";
+    double min_seconds = argc > 2 ? atof(argv[2]) : 0.5;
+
+    BENCH_CORPUS corpora[6] = {
+        {
+            .name = "in.json",
+            .path_len = 3,
+            .path = {"_", "user_name", "default"},
+            .lookup = "moderation",
+        },
+        {
+            .name = "strings",
+            .path_len = 3,
+            .path = {"messages", "1000", "text"},
+            .lookup = "messages",
+        },
+        {
+            .name = "numbers",
+            .path_len = 3,
+            .path = {"matrix", "100", "50"},
+            .lookup = "matrix",
+        },
+        {
+            .name = "nested",
+            .path_len = 5,
+            .path = {"chains", "10", "next", "1", "next"},
+            .lookup = "chains",
+        },
+        {
+            .name = "records.ndjson",
+            .is_ndjson = 1,
+            .path_len = 2,
+            .path = {"profile", "country"},
+            .lookup = "name",
+        },
+        {
+            .name = "embeddings.ndjson",
+            .is_ndjson = 1,
+            .is_number_array = 1,
+        },
+    };
+
+    json_set_allocator(&bench_allocator);
+
+    if (corpus_load_file(&corpora[0], in_path) != 0)
+    {
+        fprintf(stderr, "bench: failed to read %s\n", in_path);
+        return 1;
+    }
+
+    gen_string_heavy(&corpora[1], 20000);
+    gen_number_heavy(&corpora[2], 500, 400);
+    gen_deeply_nested(&corpora[3], 200, 256);
+    gen_ndjson(&corpora[4], 50000);
+    gen_embeddings(&corpora[5], 2000, 768);
+
+    for (uint64_t k = 0; k < 6; ++k)
+    {
+        bench_corpus(&corpora[k], min_seconds);
+        free(corpora[k].buff.data);
+    }
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "string.h"
+#include "time.h"
+
+#if defined(_WIN32)
+#include "windows.h"
+#else
+#include "pthread.h"
+#endif
+
+#define JSON_PARSER_SILENT 1
+
+#include "../JSONitator.h"
+
+//==============================================================================
+// Concurrency stress
+//==============================================================================
+
+// Every thread parses, stringifies and frees the same document in a loop and
+// compares each round trip against the one produced by the main thread before
+// any worker started. Odd threads pass a per-call allocator so both the global
+// and the per-call allocator paths run concurrently.
+
+typedef struct stress_worker
+{
+    const char *input;
+    uint64_t input_len;
+    const char *expected;
+    double min_seconds;
+    int use_call_allocator;
+    uint64_t ops;
+    uint64_t mismatches;
+    uint64_t failures;
+} STRESS_WORKER;
+
+void *stress_malloc(void *user, size_t size)
+{
+    return malloc(size);
+}
+
+void *stress_realloc(void *user, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+void stress_free(void *user, void *ptr)
+{
+    free(ptr);
+}
+
+const JSON_ALLOCATOR stress_allocator = {
+    .alloc = stress_malloc,
+    .resize = stress_realloc,
+    .release = stress_free,
+    .user = NULL,
+};
+
+uint64_t stress_now_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void stress_run(STRESS_WORKER *w)
+{
+    const JSON_ALLOCATOR *a = w->use_call_allocator ? &stress_allocator : NULL;
+    JSON_PARSE_OPTIONS opts = {
+        .on_error = NULL,
+        .user = NULL,
+        .allocator = a,
+        .max_depth = 0,
+    };
+
+    uint64_t deadline = stress_now_ns() + (uint64_t)(w->min_seconds * 1e9);
+    do
+    {
+        JSON_ERROR err;
+        JSON *json = json_parse_ex(w->input, w->input_len, &opts, &err);
+        if (json == NULL)
+        {
+            w->failures += 1;
+            continue;
+        }
+
+        char *str = json_stringify_ex(json, a);
+        if (str == NULL)
+            w->failures += 1;
+        else if (strcmp(str, w->expected) != 0)
+            w->mismatches += 1;
+
+        if (a != NULL)
+            a->release(a->user, str);
+        else
+            json_get_allocator()->release(json_get_allocator()->user, str);
+        json_free_ex(json, a);
+        w->ops += 1;
+    } while (stress_now_ns() < deadline);
+}
+
+#if defined(_WIN32)
+DWORD WINAPI stress_thread(LPVOID arg)
+{
+    stress_run((STRESS_WORKER *)arg);
+    return 0;
+}
+#else
+void *stress_thread(void *arg)
+{
+    stress_run((STRESS_WORKER *)arg);
+    return NULL;
+}
+#endif
+
+char *file_read(const char *path, uint64_t *len)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *data = malloc((size_t)fsize + 1);
+    if (data == NULL || fread(data, 1, (size_t)fsize, f) != (size_t)fsize)
+    {
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+
+    data[fsize] = '\0';
+    *len = (uint64_t)fsize;
+    return data;
+}
+
+// Usage: stress [path/to/in.json] [threads] [seconds]
+// Prints one NDJSON line and exits with 1 if any round trip differed.
+int main(int argc, char **argv)
+{
+    const char *in_path = argc > 1 ? argv[1] : "in.json";
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+    double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+
+    if (threads < 1)
+        threads = 1;
+
+    uint64_t input_len = 0;
+    char *input = file_read(in_path, &input_len);
+    if (input == NULL)
+    {
+        printf("Failed to read %s.\n", in_path);
+        return 1;
+    }
+
+    JSON *reference = json_parse(input);
+    if (reference == NULL)
+    {
+        printf("Failed to parse %s.\n", in_path);
+        free(input);
+        return 1;
+    }
+    char *expected = json_stringify(reference);
+    json_free(reference);
+
+    STRESS_WORKER *workers = calloc((size_t)threads, sizeof(STRESS_WORKER));
+#if defined(_WIN32)
+    HANDLE *handles = calloc((size_t)threads, sizeof(HANDLE));
+#else
+    pthread_t *handles = calloc((size_t)threads, sizeof(pthread_t));
+#endif
+    if (workers == NULL || handles == NULL || expected == NULL)
+    {
+        printf("Failed to allocate workers.\n");
+        return 1;
+    }
+
+    uint64_t start = stress_now_ns();
+    for (int t = 0; t < threads; t++)
+    {
+        workers[t] = (STRESS_WORKER){
+            .input = input,
+            .input_len = input_len,
+            .expected = expected,
+            .min_seconds = seconds,
+            .use_call_allocator = t % 2,
+        };
+#if defined(_WIN32)
+        handles[t] = CreateThread(NULL, 0, stress_thread, &workers[t], 0, NULL);
+#else
+        pthread_create(&handles[t], NULL, stress_thread, &workers[t]);
+#endif
+    }
+
+    uint64_t ops = 0, mismatches = 0, failures = 0;
+    for (int t = 0; t < threads; t++)
+    {
+#if defined(_WIN32)
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+#else
+        pthread_join(handles[t], NULL);
+#endif
+        ops += workers[t].ops;
+        mismatches += workers[t].mismatches;
+        failures += workers[t].failures;
+    }
+    uint64_t elapsed = stress_now_ns() - start;
+
+    double mb_per_s = (double)ops * (double)input_len / 1e6 / ((double)elapsed / 1e9);
+    printf("{\"tool\":\"stress\",\"threads\":%d,\"ops\":%llu,\"mismatches\":%llu,"
+           "\"failures\":%llu,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f}\n",
+           threads, (unsigned long long)ops, (unsigned long long)mismatches,
+           (unsigned long long)failures, ops ? (double)elapsed * threads / (double)ops : 0.0,
+           mb_per_s);
+
+    free(workers);
+    free(handles);
+    free(expected);
+    free(input);
+    return mismatches != 0 || failures != 0;
+}
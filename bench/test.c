@@ -0,0 +1,1383 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "string.h"
+#include "math.h"
+
+#if defined(_WIN32)
+#include "windows.h"
+#else
+#include "pthread.h"
+#endif
+
+#define JSON_PARSER_SILENT 1
+#define JSON_PARSER_THREADS 1
+
+#include "../JSONitator.h"
+
+//==============================================================================
+// Harness
+//==============================================================================
+
+// Every allocation of the library goes through test_allocator, so each section
+// ends by checking that it released everything it allocated.
+
+uint64_t test_checks = 0;
+uint64_t test_failures = 0;
+_Atomic int64_t test_live = 0;
+
+#define CHECK(cond)                                                        \
+    do                                                                     \
+    {                                                                      \
+        test_checks += 1;                                                  \
+        if (!(cond))                                                       \
+        {                                                                  \
+            test_failures += 1;                                            \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                  \
+    } while (0)
+
+void *test_malloc(void *user, size_t size)
+{
+    void *ptr = malloc(size);
+    if (ptr != NULL)
+        atomic_fetch_add(&test_live, 1);
+    return ptr;
+}
+
+void *test_realloc(void *user, void *ptr, size_t size)
+{
+    void *out = realloc(ptr, size);
+    if (ptr == NULL && out != NULL)
+        atomic_fetch_add(&test_live, 1);
+    return out;
+}
+
+void test_free(void *user, void *ptr)
+{
+    if (ptr != NULL)
+        atomic_fetch_sub(&test_live, 1);
+    free(ptr);
+}
+
+const JSON_ALLOCATOR test_allocator = {
+    .alloc = test_malloc,
+    .resize = test_realloc,
+    .release = test_free,
+    .user = NULL,
+};
+
+void test_release(void *ptr)
+{
+    test_allocator.release(test_allocator.user, ptr);
+}
+
+// Counts live bytes in *(int64_t *)user, for checks on how much a tree takes
+void *test_sized_alloc(void *user, size_t size)
+{
+    size_t *ptr = malloc(sizeof(max_align_t) + size);
+    if (ptr == NULL)
+        return NULL;
+    ptr[0] = size;
+    *(int64_t *)user += size;
+    return (char *)ptr + sizeof(max_align_t);
+}
+
+void *test_sized_resize(void *user, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return test_sized_alloc(user, size);
+    size_t *base = (size_t *)((char *)ptr - sizeof(max_align_t));
+    size_t old = base[0];
+    base = realloc(base, sizeof(max_align_t) + size);
+    if (base == NULL)
+        return NULL;
+    base[0] = size;
+    *(int64_t *)user += (int64_t)size - (int64_t)old;
+    return (char *)base + sizeof(max_align_t);
+}
+
+void test_sized_free(void *user, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    size_t *base = (size_t *)((char *)ptr - sizeof(max_align_t));
+    *(int64_t *)user -= base[0];
+    free(base);
+}
+
+// Compares the compact serialization of json against expected
+int test_json_is(JSON *json, const char *expected)
+{
+    char *str = json_stringify(json);
+    int same = str != NULL && strcmp(str, expected) == 0;
+    if (!same)
+        printf("  got %s, expected %s\n", str != NULL ? str : "NULL", expected);
+    test_release(str);
+    return same;
+}
+
+void test_section(const char *name, void (*fn)(void))
+{
+    int64_t live = atomic_load(&test_live);
+    uint64_t failures = test_failures;
+
+    fn();
+    json_free_wait();
+
+    int64_t leaked = atomic_load(&test_live) - live;
+    if (leaked != 0)
+    {
+        test_failures += 1;
+        printf("%s: %lld allocations leaked\n", name, (long long)leaked);
+    }
+    printf("%-16s %s\n", name, test_failures == failures ? "ok" : "FAILED");
+}
+
+// Runs fn(arg) on a thread of its own, see test_thread_join
+typedef struct test_thread
+{
+    void (*fn)(void *arg);
+    void *arg;
+#if defined(_WIN32)
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} TEST_THREAD;
+
+#if defined(_WIN32)
+DWORD WINAPI test_thread_main(LPVOID arg)
+{
+    TEST_THREAD *t = arg;
+    t->fn(t->arg);
+    return 0;
+}
+#else
+void *test_thread_main(void *arg)
+{
+    TEST_THREAD *t = arg;
+    t->fn(t->arg);
+    return NULL;
+}
+#endif
+
+void test_thread_start(TEST_THREAD *t, void (*fn)(void *arg), void *arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+#if defined(_WIN32)
+    t->handle = CreateThread(NULL, 0, test_thread_main, t, 0, NULL);
+#else
+    pthread_create(&t->handle, NULL, test_thread_main, t);
+#endif
+}
+
+void test_thread_join(TEST_THREAD *t)
+{
+#if defined(_WIN32)
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle, NULL);
+#endif
+}
+
+//==============================================================================
+// Threads
+//==============================================================================
+
+// Workers parse, stringify and free their own documents at the same time,
+// failed parses included, half of them through a per-call allocator. Nothing
+// but the allocator is shared, so every round trip must match and every error
+// must be reported to the thread that caused it.
+
+typedef struct threads_worker
+{
+    const JSON_ALLOCATOR *allocator;
+    uint64_t mismatches;
+} THREADS_WORKER;
+
+void threads_run(void *arg)
+{
+    THREADS_WORKER *w = arg;
+    const JSON_PARSE_OPTIONS opts = {.allocator = w->allocator};
+    const char *doc = "{\"id\":12,\"tags\":[\"a\",\"b\\n\"],\"nested\":{\"x\":-1.5,\"ok\":true,\"none\":null}}";
+    const char *bad = "{\"id\":12,\"tags\":[\"a\",}";
+
+    for (int i = 0; i < 300; i++)
+    {
+        JSON_ERROR err;
+        JSON *json = json_parse_ex(doc, strlen(doc), &opts, &err);
+        char *str = json_stringify_ex(json, w->allocator);
+
+        if (json == NULL || err.code != JSON_ERR_NONE || str == NULL || strcmp(str, doc) != 0)
+            w->mismatches += 1;
+
+        test_release(str);
+        json_free_ex(json, w->allocator);
+
+        if (json_parse_ex(bad, strlen(bad), &opts, &err) != NULL || err.code != JSON_ERR_UNEXPECTED_CHAR || err.offset != 21)
+            w->mismatches += 1;
+    }
+}
+
+void test_threads(void)
+{
+    THREADS_WORKER workers[4];
+    TEST_THREAD threads[4];
+
+    for (int t = 0; t < 4; t++)
+    {
+        workers[t] = (THREADS_WORKER){.allocator = (t % 2) ? &test_allocator : NULL, .mismatches = 0};
+        test_thread_start(&threads[t], threads_run, &workers[t]);
+    }
+
+    for (int t = 0; t < 4; t++)
+    {
+        test_thread_join(&threads[t]);
+        CHECK(workers[t].mismatches == 0);
+    }
+}
+
+//==============================================================================
+// Parsing
+//==============================================================================
+
+void test_count_error(const JSON_ERROR *err, const char *message, void *user)
+{
+    *(int *)user += 1;
+}
+
+void test_parse(void)
+{
+    JSON_ERROR err;
+
+    JSON *json = json_parse_ex("{\"a\":[1,2.5,\"x\",true,null]}", 27, NULL, &err);
+    CHECK(json != NULL);
+    CHECK(err.code == JSON_ERR_NONE);
+    CHECK(test_json_is(json, "{\"a\":[1,2.5,\"x\",true,null]}"));
+    json_free(json);
+
+    CHECK(json_parse_ex("{\"a\":[1,}", 9, NULL, &err) == NULL);
+    CHECK(err.code == JSON_ERR_UNEXPECTED_CHAR);
+    CHECK(err.offset == 8);
+    CHECK(err.depth == 2);
+
+    CHECK(json_parse_ex("{\"a\":-}", 7, NULL, &err) == NULL);
+    CHECK(err.code == JSON_ERR_INVALID_NUMBER);
+
+    CHECK(json_parse_ex("{\"a\":tru}", 9, NULL, &err) == NULL);
+    CHECK(err.code == JSON_ERR_INVALID_LITERAL);
+
+    CHECK(json_parse_ex("{\"a\":\"\\q\"}", 10, NULL, &err) == NULL);
+    CHECK(err.code == JSON_ERR_INVALID_ESCAPE);
+
+    CHECK(json_parse_ex("{\"a\":[1,2", 9, NULL, &err) == NULL);
+    CHECK(err.code == JSON_ERR_EOF);
+
+    CHECK(json_parse_ex(NULL, 0, NULL, &err) == NULL);
+    CHECK(err.code == JSON_ERR_NULL_INPUT);
+
+    // The diagnostic callback sees the first error only
+    int calls = 0;
+    JSON_PARSE_OPTIONS counted = {.on_error = test_count_error, .user = &calls};
+    CHECK(json_parse_ex("[1,2,", 5, &counted, NULL) == NULL);
+    CHECK(calls == 1);
+    json = json_parse_ex("[1,2]", 5, &counted, NULL);
+    CHECK(json != NULL && calls == 1);
+    json_free(json);
+    CHECK(strcmp(json_error_to_str(JSON_ERR_EOF), "unexpected end of input") == 0);
+
+    JSON_PARSE_OPTIONS shallow = {.max_depth = 2};
+    CHECK(json_parse_ex("[[[1]]]", 7, &shallow, &err) == NULL);
+    CHECK(err.code == JSON_ERR_MAX_DEPTH);
+}
+
+//==============================================================================
+// Clone and compact
+//==============================================================================
+
+void test_compact(void)
+{
+    const char *s = "{\"a\":[1,\"two\",true,null],\"b\":{\"c\":\"d\"}}";
+    JSON *json = json_parse(s);
+
+    JSON *compact = json_compact(json);
+    CHECK(compact != NULL);
+    CHECK(test_json_is(compact, s));
+    CHECK(json_value_string(json_object_get(json_object_get(compact, "b"), "c")) != json_value_string(json_object_get(json_object_get(json, "b"), "c")));
+    CHECK(json_compact(NULL) == NULL);
+
+    // Compacted documents are read only
+    JSON *value = json_make_number(1);
+    CHECK(json_object_append(compact, "e", value) == 1);
+    CHECK(json_array_delete(json_object_get(compact, "a"), 0) == 1);
+    json_free(value);
+
+    // A clone is a regular tree again, independent of its source
+    JSON *clone = json_clone(compact);
+    CHECK(test_json_is(clone, s));
+    CHECK(json_object_delete(clone, "a") == 0);
+    CHECK(test_json_is(clone, "{\"b\":{\"c\":\"d\"}}"));
+    CHECK(test_json_is(compact, s));
+    CHECK(json_clone(NULL) == NULL);
+    json_free(clone);
+    json_free(compact);
+    json_free(json);
+}
+
+//==============================================================================
+// Memory usage
+//==============================================================================
+
+void test_memory(void)
+{
+    JSON *json = json_parse("{\"a\":[1,\"two\",true,null],\"b\":{\"c\":\"d\"}}");
+
+    JSON_MEMORY tree, block;
+    CHECK(json_memory_usage(json, &tree) == 0);
+    CHECK(tree.nodes == 8 * sizeof(JSON));
+    CHECK(tree.containers == 2 * sizeof(JSON_OBJECT) + sizeof(JSON_ARRAY));
+    CHECK(tree.keys == 6);
+    CHECK(tree.strings == 6);
+    CHECK(tree.scalars == sizeof(JSON_NUMBER) + sizeof(int));
+    CHECK(tree.overhead == tree.allocations * JSON_PARSER_ALLOC_OVERHEAD);
+    CHECK(tree.total == tree.nodes + tree.containers + tree.vectors + tree.keys + tree.strings + tree.scalars + tree.overhead);
+    CHECK(json_memory_usage(NULL, &tree) == 1);
+    CHECK(json_memory_usage(json, NULL) == 1);
+
+    // A compacted document is a single allocation
+    JSON *compact = json_compact(json);
+    CHECK(json_memory_usage(compact, &block) == 0);
+    CHECK(block.allocations == 1);
+    CHECK(block.nodes == tree.nodes);
+    json_free(compact);
+    json_free(json);
+}
+
+//==============================================================================
+// Files
+//==============================================================================
+
+void test_file(void)
+{
+    const char *path = "test.json";
+    const char *s = "{\"a\":[1,2],\"b\":\"c\"}";
+    FILE *f = fopen(path, "wb");
+    CHECK(f != NULL);
+    fwrite(s, 1, strlen(s), f);
+    fclose(f);
+
+    JSON *mapped = json_parse_file(path, JSON_FILE_DEFAULT);
+    CHECK(mapped != NULL && test_json_is(mapped, s));
+    json_free(mapped);
+
+    JSON *read = json_parse_file(path, JSON_FILE_NO_MMAP);
+    CHECK(read != NULL && test_json_is(read, s));
+    json_free(read);
+    remove(path);
+
+    JSON_ERROR err;
+    CHECK(json_parse_file_ex("test.missing", JSON_FILE_DEFAULT, NULL, &err) == NULL);
+    CHECK(err.code == JSON_ERR_IO);
+}
+
+//==============================================================================
+// Snapshots
+//==============================================================================
+
+void test_snapshot(void)
+{
+    const char *path = "test.snapshot";
+    JSON *json = json_parse("{\"a\":[1,\"two\",true],\"b\":{\"c\":2.5}}");
+    CHECK(json_snapshot_write(json, path) == 0);
+    json_free(json);
+
+    JSON_SNAPSHOT *snap = json_snapshot_map(path);
+    CHECK(snap != NULL);
+    const JSON_SNAPSHOT_NODE *root = json_snapshot_root(snap);
+    const JSON_SNAPSHOT_NODE *a = json_snapshot_object_get(root, "a");
+    CHECK(a != NULL && a->length == 3);
+    CHECK(*json_snapshot_number(json_snapshot_array_get(a, 0)) == 1);
+    CHECK(strcmp(json_snapshot_string(json_snapshot_array_get(a, 1)), "two") == 0);
+    CHECK(*json_snapshot_bool(json_snapshot_array_get(a, 2)) == 1);
+    CHECK(json_snapshot_array_get(a, 3) == NULL);
+
+    const char *fields[] = {"b", "c"};
+    CHECK(*json_snapshot_number(json_snapshot_get_deep(root, 2, fields)) == 2.5);
+    CHECK(json_snapshot_object_get(root, "z") == NULL);
+    CHECK(json_snapshot_string(a) == NULL);
+    json_snapshot_unmap(snap);
+    remove(path);
+
+    CHECK(json_snapshot_map("test.missing") == NULL);
+}
+
+//==============================================================================
+// Validation
+//==============================================================================
+
+void test_validate(void)
+{
+    JSON_ERROR err;
+    const char *valid[] = {"{\"a\":[1,{}]}", "1", "\"s\"", " [-0.5e+3, true, null] ", "{\"\\u00e9\":\"\\ud83d\\ude00\"}"};
+    const char *invalid[] = {"{\"a\":[1,{]}", "[01]", "[1.]", "[1e]", "[\"\t\"]", "[1] 2", "[tru]", "{\"a\" 1}", ""};
+
+    for (int i = 0; i < 5; i++)
+        CHECK(json_validate(valid[i], strlen(valid[i]), &err) == 0);
+
+    for (int i = 0; i < 9; i++)
+        CHECK(json_validate(invalid[i], strlen(invalid[i]), &err) == 1);
+
+    CHECK(json_validate("{\"a\":[1,{]}", 11, &err) == 1);
+    CHECK(err.code == JSON_ERR_UNEXPECTED_CHAR && err.offset == 9);
+    CHECK(json_validate(NULL, 0, &err) == 1);
+    CHECK(err.code == JSON_ERR_NULL_INPUT);
+
+    char deep[2 * JSON_PARSER_MAX_DEPTH + 3];
+    memset(deep, '[', JSON_PARSER_MAX_DEPTH + 1);
+    memset(deep + JSON_PARSER_MAX_DEPTH + 1, ']', JSON_PARSER_MAX_DEPTH + 1);
+    CHECK(json_validate(deep, 2 * JSON_PARSER_MAX_DEPTH + 2, &err) == 1);
+    CHECK(err.code == JSON_ERR_MAX_DEPTH);
+}
+
+//==============================================================================
+// Unicode
+//==============================================================================
+
+void test_unicode(void)
+{
+    JSON_ERROR err;
+
+    // Escapes decode to UTF-8, surrogate pairs included
+    JSON *json = json_parse("[\"caf\\u00e9 \\ud83d\\ude00 \\u20AC\"]");
+    CHECK(json != NULL);
+    CHECK(strcmp(json_value_string(json_array_get(json, 0)), "caf\xC3\xA9 \xF0\x9F\x98\x80 \xE2\x82\xAC") == 0);
+
+    char *ascii = json_stringify_flags(json, JSON_STRINGIFY_ASCII, NULL);
+    CHECK(strcmp(ascii, "[\"caf\\u00e9 \\ud83d\\ude00 \\u20ac\"]") == 0);
+    test_release(ascii);
+    json_free(json);
+
+    const char *escapes[] = {"[\"\\u0000\"]", "[\"\\ud83d\"]", "[\"\\ude00x\"]", "[\"\\u12G4\"]"};
+    for (int i = 0; i < 4; i++)
+    {
+        CHECK(json_parse_ex(escapes[i], strlen(escapes[i]), NULL, &err) == NULL);
+        CHECK(err.code == JSON_ERR_INVALID_ESCAPE);
+    }
+
+    // Raw bytes are only checked on request
+    JSON_PARSE_OPTIONS utf8 = {.flags = JSON_PARSE_VALIDATE_UTF8};
+    const char *raw[] = {"[\"\xC3\x28\"]", "[\"\xE2\x82\"]", "[\"\xC0\xAF\"]", "[\"\xED\xA0\x80\"]"};
+    for (int i = 0; i < 4; i++)
+    {
+        CHECK(json_parse_ex(raw[i], strlen(raw[i]), &utf8, &err) == NULL);
+        CHECK(err.code == JSON_ERR_INVALID_UTF8);
+    }
+
+    json = json_parse_ex(raw[0], strlen(raw[0]), NULL, &err);
+    CHECK(json != NULL);
+    json_free(json);
+}
+
+//==============================================================================
+// Structs
+//==============================================================================
+
+typedef struct test_inner
+{
+    int64_t count;
+} TEST_INNER;
+
+typedef struct test_record
+{
+    double score;
+    int32_t id;
+    int ok;
+    char *name;
+    char tag[4];
+    TEST_INNER inner;
+} TEST_RECORD;
+
+const JSON_FIELD TEST_INNER_FIELDS[] = {
+    JSON_FIELD_OF(TEST_INNER, count, JSON_FIELD_INT64),
+};
+const JSON_STRUCT_DESC TEST_INNER_DESC = JSON_STRUCT_DESC_OF(TEST_INNER_FIELDS);
+
+const JSON_FIELD TEST_RECORD_FIELDS[] = {
+    JSON_FIELD_OF(TEST_RECORD, score, JSON_FIELD_DOUBLE),
+    JSON_FIELD_OF(TEST_RECORD, id, JSON_FIELD_INT32),
+    JSON_FIELD_OF(TEST_RECORD, ok, JSON_FIELD_BOOL),
+    JSON_FIELD_OF(TEST_RECORD, name, JSON_FIELD_STRING),
+    JSON_FIELD_OF(TEST_RECORD, tag, JSON_FIELD_CHARS),
+    JSON_FIELD_NESTED(TEST_RECORD, inner, "inner", TEST_INNER_DESC),
+};
+const JSON_STRUCT_DESC TEST_RECORD_DESC = JSON_STRUCT_DESC_OF(TEST_RECORD_FIELDS);
+
+void test_struct(void)
+{
+    const char *s = "{\"score\":1.5,\"id\":7,\"ok\":true,\"name\":\"n\",\"tag\":\"abc\",\"extra\":[1],\"inner\":{\"count\":9}}";
+    TEST_RECORD rec = {0};
+    JSON_ERROR err;
+
+    CHECK(json_decode_struct(s, strlen(s), &TEST_RECORD_DESC, &rec, &err) == 0);
+    CHECK(rec.score == 1.5 && rec.id == 7 && rec.ok == 1);
+    CHECK(strcmp(rec.name, "n") == 0 && strcmp(rec.tag, "abc") == 0);
+    CHECK(rec.inner.count == 9);
+
+    char *out = json_encode_struct(&TEST_RECORD_DESC, &rec);
+    CHECK(strcmp(out, "{\"score\":1.5,\"id\":7,\"ok\":true,\"name\":\"n\",\"tag\":\"abc\",\"inner\":{\"count\":9}}") == 0);
+    test_release(out);
+    json_struct_free(&TEST_RECORD_DESC, &rec);
+    CHECK(rec.name == NULL);
+
+    // A repeated key replaces the string, the section leak check covers the first one
+    const char *repeated = "{\"name\":\"first\",\"name\":\"second\"}";
+    CHECK(json_decode_struct(repeated, strlen(repeated), &TEST_RECORD_DESC, &rec, &err) == 0);
+    CHECK(strcmp(rec.name, "second") == 0);
+    json_struct_free(&TEST_RECORD_DESC, &rec);
+
+    // Values that do not fit their field, strings already decoded are kept
+    const char *bad[] = {
+        "{\"name\":\"x\",\"id\":\"7\"}",
+        "{\"name\":\"x\",\"id\":4294967296}",
+        "{\"name\":\"x\",\"tag\":\"abcd\"}",
+        "{\"name\":\"x\",\"inner\":{\"count\":1.5}}",
+    };
+    for (int i = 0; i < 4; i++)
+    {
+        memset(&rec, 0, sizeof(rec));
+        CHECK(json_decode_struct(bad[i], strlen(bad[i]), &TEST_RECORD_DESC, &rec, &err) == 1);
+        CHECK(err.code == JSON_ERR_TYPE_MISMATCH);
+        json_struct_free(&TEST_RECORD_DESC, &rec);
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    CHECK(json_decode_struct("{\"id\":1,", 8, &TEST_RECORD_DESC, &rec, &err) == 1);
+    CHECK(err.code == JSON_ERR_EOF);
+    json_struct_free(&TEST_RECORD_DESC, &rec);
+
+    rec.name = NULL;
+    rec.score = NAN;
+    out = json_encode_struct(&TEST_RECORD_DESC, &rec);
+    CHECK(strncmp(out, "{\"score\":null,", 14) == 0);
+    CHECK(strstr(out, "\"name\":null") != NULL);
+    test_release(out);
+}
+
+//==============================================================================
+// Hashing and equality
+//==============================================================================
+
+void test_equal(void)
+{
+    JSON *a = json_parse("{\"a\":1,\"b\":[1,{\"c\":null}],\"d\":\"x\"}");
+    JSON *b = json_parse("{\"d\":\"x\",\"b\":[1,{\"c\":null}],\"a\":1.0}");
+    JSON *c = json_parse("{\"a\":1,\"b\":[{\"c\":null},1],\"d\":\"x\"}");
+    JSON *d = json_parse("{\"a\":1,\"b\":[1,{\"c\":null}]}");
+
+    CHECK(json_equal(a, b) == 1);
+    CHECK(json_hash(a, 7) == json_hash(b, 7));
+    CHECK(json_hash(a, 7) != json_hash(a, 8));
+    CHECK(json_equal(a, c) == 0);
+    CHECK(json_hash(a, 7) != json_hash(c, 7));
+    CHECK(json_equal(a, d) == 0);
+    CHECK(json_equal(d, a) == 0);
+    CHECK(json_equal(a, NULL) == 0);
+
+    // Duplicate keys are matched one to one
+    JSON *dup = json_parse("{\"a\":1,\"a\":1}");
+    JSON *one = json_parse("{\"a\":1,\"b\":2}");
+    JSON *swapped = json_parse("{\"a\":2,\"a\":1}");
+    JSON *twice = json_parse("{\"a\":1,\"a\":2}");
+    CHECK(json_equal(dup, one) == 0);
+    CHECK(json_equal(one, dup) == 0);
+    CHECK(json_equal(dup, twice) == 0);
+    CHECK(json_equal(swapped, twice) == 1);
+    CHECK(json_hash(swapped, 7) == json_hash(twice, 7));
+    json_free(dup);
+    json_free(one);
+    json_free(swapped);
+    json_free(twice);
+
+    // Large objects in reverse order
+    JSON *big = json_parse("{}");
+    JSON *reversed = json_parse("{}");
+    char key[16];
+    for (int i = 0; i < 300; i++)
+    {
+        snprintf(key, sizeof(key), "k%d", i);
+        json_object_append(big, key, json_make_number(i));
+        snprintf(key, sizeof(key), "k%d", 299 - i);
+        json_object_append(reversed, key, json_make_number(299 - i));
+    }
+    CHECK(json_equal(big, reversed) == 1);
+    json_object_delete(reversed, "k0");
+    json_object_append(reversed, "k0", json_make_number(-1));
+    CHECK(json_equal(big, reversed) == 0);
+    json_free(big);
+    json_free(reversed);
+    CHECK(json_equal(NULL, NULL) == 0);
+    CHECK(json_hash(NULL, 7) == 0);
+
+    json_free(a);
+    json_free(b);
+    json_free(c);
+    json_free(d);
+}
+
+//==============================================================================
+// Columns
+//==============================================================================
+
+void test_columns(void)
+{
+    JSON *rows = json_parse("[{\"a\":1,\"s\":\"x\",\"b\":true},{\"a\":2.5,\"s\":3},5,{\"a\":-4,\"s\":\"y\"}]");
+    const char *names[] = {"a", "a", "s", "b"};
+    JSON_COLUMN cols[4] = {
+        {.type = JSON_COLUMN_INT64},
+        {.type = JSON_COLUMN_DOUBLE},
+        {.type = JSON_COLUMN_STRING},
+        {.type = JSON_COLUMN_BOOL},
+    };
+
+    CHECK(json_extract_columns(rows, names, 4, cols) == 0);
+    CHECK(cols[0].length == 4 && cols[0].valid == 2);
+    CHECK(cols[0].as.ints[0] == 1 && cols[0].as.ints[1] == 0 && cols[0].as.ints[3] == -4);
+    CHECK(cols[0].validity[0] == 0x9);
+    CHECK(cols[1].valid == 3 && cols[1].as.doubles[1] == 2.5);
+    CHECK(cols[2].valid == 2 && strcmp(cols[2].as.strings[3], "y") == 0);
+    CHECK(cols[3].valid == 1 && cols[3].as.bools[0] == 1);
+    json_columns_free(cols, 4);
+
+    JSON *object = json_parse("{\"a\":1}");
+    CHECK(json_extract_columns(object, names, 1, cols) == 1);
+    json_free(object);
+    json_free(rows);
+}
+
+//==============================================================================
+// Number arrays
+//==============================================================================
+
+void test_number_array(void)
+{
+    JSON_ERROR err;
+    double d[4];
+    float f[4];
+    uint64_t count = 0;
+
+    CHECK(json_parse_number_array_double(" [1, -2.5e3 ,0.125] ", 20, d, 4, &count, &err) == 0);
+    CHECK(count == 3 && d[0] == 1 && d[1] == -2500 && d[2] == 0.125);
+    CHECK(json_parse_number_array("[]", 2, f, 4, &count, &err) == 0);
+    CHECK(count == 0);
+
+    CHECK(json_parse_number_array("[1,2,3,4,5]", 11, f, 2, &count, &err) == 1);
+    CHECK(err.code == JSON_ERR_CAPACITY);
+    CHECK(count == 5 && f[0] == 1 && f[1] == 2);
+    CHECK(json_parse_number_array("[1,2,3]", 7, NULL, 0, &count, &err) == 1);
+    CHECK(count == 3);
+
+    CHECK(json_parse_number_array("[1,\"x\"]", 7, f, 4, &count, &err) == 1);
+    CHECK(err.code == JSON_ERR_TYPE_MISMATCH);
+    CHECK(json_parse_number_array_double("[1,]", 4, d, 4, &count, &err) == 1);
+    CHECK(json_parse_number_array_double("[1.]", 4, d, 4, &count, &err) == 1);
+    CHECK(err.code == JSON_ERR_INVALID_NUMBER);
+    CHECK(json_parse_number_array_double("[-]", 3, d, 4, &count, &err) == 1);
+    CHECK(err.code == JSON_ERR_INVALID_NUMBER);
+    CHECK(json_parse_number_array_double("[1] x", 5, d, 4, &count, &err) == 1);
+
+    // Long integers fall back to strtod
+    CHECK(json_parse_number_array_double("[123456789012345678901]", 23, d, 4, &count, &err) == 0);
+    CHECK(d[0] == 123456789012345678901.0);
+    CHECK(json_parse_number_array_double("[-0.12345678901234567890123e-5]", 31, d, 4, &count, &err) == 0);
+    CHECK(d[0] == -0.12345678901234567890123e-5);
+
+    // but only once the strict grammar accepted the whole token
+    const char *invalid[] = {
+        "[123456789012345678901.]",
+        "[123456789012345678901e]",
+        "[123456789012345678901e+]",
+        "[1234567890123456789012345.5.5]",
+        "[1.5.2]",
+        "[1e5e5]",
+        "[1.5-3]",
+    };
+    for (int k = 0; k < 7; k++)
+    {
+        CHECK(json_parse_number_array_double(invalid[k], strlen(invalid[k]), d, 4, &count, &err) == 1);
+        CHECK(err.code == JSON_ERR_INVALID_NUMBER);
+    }
+
+    const double values[] = {0.5, -2, 1024, NAN};
+    char *s = json_write_number_array_double(values, 4);
+    CHECK(strcmp(s, "[0.5,-2,1024,null]") == 0);
+    test_release(s);
+
+    const float floats[] = {0.1f, 3};
+    s = json_write_number_array(floats, 2);
+    CHECK(json_parse_number_array(s, strlen(s), f, 4, &count, &err) == 0);
+    CHECK(count == 2 && f[0] == 0.1f && f[1] == 3);
+    test_release(s);
+}
+
+//==============================================================================
+// Owned and borrowed builders
+//==============================================================================
+
+char *test_strdup(const char *s)
+{
+    char *out = test_allocator.alloc(test_allocator.user, strlen(s) + 1);
+    strcpy(out, s);
+    return out;
+}
+
+void test_builders(void)
+{
+    int64_t live = atomic_load(&test_live);
+    JSON *doc = json_parse("{\"list\":[]}");
+
+    CHECK(json_object_append_owned(doc, test_strdup("owned"), json_make_string_owned(test_strdup("mine"))) == 0);
+    CHECK(json_object_append_borrowed(doc, "borrowed", json_make_string_borrowed("static")) == 0);
+    CHECK(json_object_append_owned_ex(doc, test_strdup("mixed"), json_make_string_borrowed_ex("lit", &test_allocator), &test_allocator) == 0);
+    CHECK(json_object_append_borrowed_ex(doc, "sub", json_parse("{\"k\":1}"), &test_allocator) == 0);
+    JSON *sub = json_object_get(doc, "sub");
+    CHECK(json_object_append_borrowed(sub, "b", json_make_string_owned_ex(test_strdup("heap"), &test_allocator)) == 0);
+    CHECK(json_array_append(json_object_get(doc, "list"), json_make_string_borrowed("item")) == 0);
+
+    const char *full = "{\"list\":[\"item\"],\"owned\":\"mine\",\"borrowed\":\"static\",\"mixed\":\"lit\",\"sub\":{\"k\":1,\"b\":\"heap\"}}";
+    CHECK(test_json_is(doc, full));
+    CHECK(json_make_string_owned(NULL) == NULL);
+    CHECK(json_make_string_borrowed(NULL) == NULL);
+
+    // Borrowed keys and strings are not the document's memory
+    JSON *bare = json_parse("{}");
+    json_object_append_borrowed(bare, "key", json_make_string_borrowed("value"));
+    JSON_MEMORY m;
+    json_memory_usage(bare, &m);
+    CHECK(m.keys == 0 && m.strings == 0);
+    json_free(bare);
+
+    // Clones and compacted copies own everything they hold
+    JSON *clone = json_clone(doc);
+    JSON *compact = json_compact(doc);
+    CHECK(json_object_delete(doc, "owned") == 0);
+    CHECK(json_object_delete(doc, "borrowed") == 0);
+    CHECK(json_object_delete(clone, "mixed") == 0);
+    CHECK(json_array_delete(json_object_get(clone, "list"), 0) == 0);
+    CHECK(test_json_is(compact, full));
+    CHECK(test_json_is(doc, "{\"list\":[\"item\"],\"mixed\":\"lit\",\"sub\":{\"k\":1,\"b\":\"heap\"}}"));
+    CHECK(test_json_is(clone, "{\"list\":[],\"owned\":\"mine\",\"borrowed\":\"static\",\"sub\":{\"k\":1,\"b\":\"heap\"}}"));
+    json_free(clone);
+    json_free(compact);
+
+    // A shared copy is modified through copy on write, the borrowed key stays with the original
+    JSON *other = json_parse("{}");
+    CHECK(json_object_append(other, "shared", json_retain(sub)) == 0);
+    JSON *shared = json_object_get(other, "shared");
+    CHECK(json_object_delete(shared, "b") == 0);
+    CHECK(json_object_append_borrowed(shared, "c", json_make_string_borrowed("more")) == 0);
+    CHECK(test_json_is(other, "{\"shared\":{\"k\":1,\"c\":\"more\"}}"));
+    CHECK(test_json_is(sub, "{\"k\":1,\"b\":\"heap\"}"));
+    json_free(other);
+
+    // Parsing into the tree replaces borrowed strings with its own
+    const char *next = "{\"list\":[\"new\"],\"mixed\":\"lit2\",\"sub\":{\"k\":2,\"b\":\"heap\"}}";
+    CHECK(json_parse_into(doc, next, strlen(next)) == 0);
+    CHECK(test_json_is(doc, next));
+
+    // A failed append leaves field and value with the caller
+    char *key = test_strdup("key");
+    JSON *value = json_make_string_owned(test_strdup("value"));
+    CHECK(json_object_append_owned(json_object_get(doc, "list"), key, value) == 1);
+    CHECK(json_object_append_borrowed(json_object_get(doc, "list"), "key", value) == 1);
+    CHECK(json_object_append_owned(doc, NULL, value) == 1);
+    CHECK(strcmp(key, "key") == 0 && strcmp(json_value_string(value), "value") == 0);
+    test_release(key);
+    json_free(value);
+
+    json_free(doc);
+    CHECK(atomic_load(&test_live) == live);
+}
+
+//==============================================================================
+// Writer
+//==============================================================================
+
+typedef struct sink_buffer
+{
+    char data[256];
+    uint64_t len;
+} SINK_BUFFER;
+
+err_t test_sink(void *user, const char *data, uint64_t len)
+{
+    SINK_BUFFER *b = user;
+    if (b->len + len >= sizeof(b->data))
+        return 1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+void test_writer(void)
+{
+    JSON_WRITER w;
+    char *out = NULL;
+    uint64_t len = 0;
+
+    json_writer_init(&w, JSON_STRINGIFY_DEFAULT, NULL);
+    json_writer_begin_object(&w);
+    json_writer_key(&w, "a");
+    json_writer_integer(&w, -9007199254740993LL);
+    json_writer_key(&w, "b");
+    json_writer_begin_array(&w);
+    json_writer_number(&w, 0.5);
+    json_writer_string_len(&w, "q\"x", 3);
+    json_writer_bool(&w, 0);
+    json_writer_null(&w);
+    JSON *value = json_parse("{\"c\":[]}");
+    json_writer_value(&w, value);
+    json_free(value);
+    json_writer_end_array(&w);
+    json_writer_end_object(&w);
+    CHECK(json_writer_finish(&w, &out, &len) == 0);
+    CHECK(strcmp(out, "{\"a\":-9007199254740993,\"b\":[0.5,\"q\\\"x\",false,null,{\"c\":[]}]}") == 0);
+    CHECK(len == strlen(out));
+    test_release(out);
+
+    SINK_BUFFER buffer = {.len = 0};
+    json_writer_init_sink(&w, test_sink, &buffer, JSON_STRINGIFY_ASCII, NULL);
+    json_writer_begin_array(&w);
+    json_writer_string(&w, "\xC3\xA9");
+    json_writer_end_array(&w);
+    CHECK(json_writer_finish(&w, &out, NULL) == 0);
+    CHECK(out == NULL);
+    CHECK(strcmp(buffer.data, "[\"\\u00e9\"]") == 0);
+
+#if JSON_PARSER_WRITER_CHECKS
+    // Misuse fails the writer and every later call
+    json_writer_init(&w, JSON_STRINGIFY_DEFAULT, NULL);
+    json_writer_begin_object(&w);
+    CHECK(json_writer_integer(&w, 1) == 1);
+    CHECK(json_writer_key(&w, "a") == 1);
+    CHECK(json_writer_finish(&w, &out, NULL) == 1);
+
+    json_writer_init(&w, JSON_STRINGIFY_DEFAULT, NULL);
+    json_writer_begin_array(&w);
+    CHECK(json_writer_end_object(&w) == 1);
+    json_writer_discard(&w);
+
+    json_writer_init(&w, JSON_STRINGIFY_DEFAULT, NULL);
+    json_writer_begin_array(&w);
+    CHECK(json_writer_finish(&w, &out, NULL) == 1);
+#endif
+
+    // Non finite numbers have no JSON form
+    json_writer_init(&w, JSON_STRINGIFY_DEFAULT, NULL);
+    json_writer_begin_array(&w);
+    json_writer_number(&w, INFINITY);
+    json_writer_number(&w, NAN);
+    json_writer_end_array(&w);
+    CHECK(json_writer_finish(&w, &out, NULL) == 0);
+    CHECK(strcmp(out, "[null,null]") == 0);
+    test_release(out);
+}
+
+//==============================================================================
+// Time-sliced parsing
+//==============================================================================
+
+void test_step(void)
+{
+    const char *s = "{\"list\":[1,2,3,4,5,6,7,8],\"name\":\"step\"}";
+    JSON_PARSE_STATE *st = json_parse_begin(s, strlen(s), NULL);
+    CHECK(st != NULL);
+
+    JSON_STEP_STATUS status;
+    int slices = 0;
+    while ((status = json_parse_step(st, 4, 0)) == JSON_STEP_AGAIN)
+        slices += 1;
+    CHECK(status == JSON_STEP_DONE);
+    CHECK(slices > 1);
+
+    JSON_ERROR err;
+    JSON *json = json_parse_end(st, &err);
+    CHECK(json != NULL);
+    CHECK(test_json_is(json, s));
+    json_free(json);
+
+    st = json_parse_begin("[1,2,}", 6, NULL);
+    while ((status = json_parse_step(st, 2, 0)) == JSON_STEP_AGAIN)
+        ;
+    CHECK(status == JSON_STEP_ERROR);
+    CHECK(json_parse_end(st, &err) == NULL);
+    CHECK(err.code == JSON_ERR_UNEXPECTED_CHAR);
+    CHECK(err.offset == 5);
+}
+
+//==============================================================================
+// Output size and iovecs
+//==============================================================================
+
+void test_stringify(void)
+{
+    JSON *json = json_parse("{\"s\":\"caf\xC3\xA9\\n\",\"n\":[1,-2.5,1024],\"long\":\"0123456789012345678901234567890123456789012345678901234567890123456789\"}");
+
+    char *str = json_stringify(json);
+    CHECK(json_stringify_size(json) == strlen(str));
+
+    char *ascii = json_stringify_flags(json, JSON_STRINGIFY_ASCII, NULL);
+    CHECK(strncmp(ascii, "{\"s\":\"caf\\u00e9\\n\",\"n\":[1,-2.5,1024],", 37) == 0);
+    CHECK(json_stringify_size_flags(json, JSON_STRINGIFY_ASCII) == strlen(ascii));
+    test_release(ascii);
+
+    // Segments concatenate to the same text, the long string is referenced in place
+    struct iovec *iov = NULL;
+    uint64_t count = 0;
+    CHECK(json_stringify_iov(json, &iov, &count) == 0);
+    CHECK(count > 1);
+
+    char joined[256];
+    uint64_t total = 0;
+    int in_place = 0;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        memcpy(joined + total, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+        in_place |= iov[i].iov_base == (void *)json_value_string(json_object_get(json, "long"));
+    }
+    CHECK(total == strlen(str) && memcmp(joined, str, total) == 0);
+    CHECK(in_place);
+    test_release(iov);
+    test_release(str);
+    json_free(json);
+
+    CHECK(json_stringify_size(NULL) == 0);
+    iov = (struct iovec *)&count;
+    CHECK(json_stringify_iov(NULL, &iov, &count) == 1);
+    CHECK(iov == NULL);
+}
+
+//==============================================================================
+// Parsing into an existing tree
+//==============================================================================
+
+void test_parse_into(void)
+{
+    JSON *json = json_parse("{\"a\":1,\"b\":{\"c\":\"x\"},\"d\":[1,2,3]}");
+    const char *next = "{\"a\":2,\"b\":{\"c\":\"longer string\"},\"d\":[4],\"e\":true}";
+
+    CHECK(json_parse_into(json, next, strlen(next)) == 0);
+    CHECK(test_json_is(json, next));
+
+    // A failed parse leaves a valid document behind, with unspecified content
+    JSON_ERROR err;
+    CHECK(json_parse_into_ex(json, "{\"a\":[", 6, NULL, &err) == 1);
+    CHECK(err.code == JSON_ERR_EOF);
+    CHECK(json_parse_into(json, "[1]", 3) == 0);
+    CHECK(test_json_is(json, "[1]"));
+    json_free(json);
+
+    // Roots that cannot be reused
+    JSON *source = json_parse("{\"a\":1}");
+    JSON *compact = json_compact(source);
+    json_free(source);
+    CHECK(json_parse_into_ex(compact, "{\"a\":2}", 7, NULL, &err) == 1);
+    CHECK(err.code == JSON_ERR_TYPE_MISMATCH);
+
+    // Below the root a compacted document is replaced as a whole
+    JSON *tree = json_parse("{\"c\":1,\"e\":[]}");
+    json_array_append(json_object_get(tree, "e"), json_compact(compact));
+    json_object_delete(tree, "c");
+    json_object_append(tree, "c", compact);
+    const char *longer = "{\"e\":[{\"a\":[3]}],\"c\":{\"a\":\"a much longer string value\",\"t\":1}}";
+    CHECK(json_parse_into(tree, longer, strlen(longer)) == 0);
+    CHECK(test_json_is(tree, longer));
+    json_free(tree);
+}
+
+//==============================================================================
+// Learned shapes
+//==============================================================================
+
+void test_shapes(void)
+{
+    JSON_SHAPES *shapes = json_shapes_new(NULL);
+    JSON_PARSE_OPTIONS opts = {.shapes = shapes};
+    const char *docs[] = {
+        "[{\"id\":1,\"name\":\"a\"},{\"id\":2,\"name\":\"b\"}]",
+        "[{\"id\":3,\"name\":\"c\"},{\"name\":\"d\",\"id\":4}]",
+    };
+
+    for (int i = 0; i < 2; i++)
+    {
+        JSON *json = json_parse_ex(docs[i], strlen(docs[i]), &opts, NULL);
+        CHECK(json != NULL);
+        CHECK(test_json_is(json, docs[i]));
+        json_free(json);
+    }
+
+    JSON_SHAPE_STATS stats;
+    json_shapes_stats(shapes, &stats);
+    CHECK(stats.hits > 0);
+    CHECK(stats.misses > 0);
+    CHECK(stats.keys == 2);
+    json_shapes_free(shapes);
+
+    // Arrays of tagged unions: each record only takes room for its own keys
+    char *mixed = malloc(20000 * 40 + 2);
+    uint64_t len = 0;
+    mixed[len++] = '[';
+    for (int i = 0; i < 20000; i++)
+        len += sprintf(mixed + len, "%s{\"type\":%d,\"a%d\":%d,\"b%d\":1}", i ? "," : "", i % 20, i % 20, i, i % 20);
+    mixed[len++] = ']';
+
+    int64_t bytes = 0;
+    JSON_ALLOCATOR sized = {.alloc = test_sized_alloc, .resize = test_sized_resize, .release = test_sized_free, .user = &bytes};
+    JSON_PARSE_OPTIONS plain = {.allocator = &sized};
+    JSON *json = json_parse_ex(mixed, len, &plain, NULL);
+    int64_t without = bytes;
+    json_free_ex(json, &sized);
+
+    shapes = json_shapes_new(NULL);
+    opts = (JSON_PARSE_OPTIONS){.allocator = &sized, .shapes = shapes};
+    json_free_ex(json_parse_ex(mixed, len, &opts, NULL), &sized);
+    json_shapes_stats(shapes, &stats);
+
+    json = json_parse_ex(mixed, len, &opts, NULL);
+    JSON_SHAPE_STATS after;
+    json_shapes_stats(shapes, &after);
+    CHECK(json != NULL && ((JSON_ARRAY *)json->value)->length == 20000);
+    CHECK(bytes < without);
+    CHECK(after.hits - stats.hits > after.misses - stats.misses);
+    json_free_ex(json, &sized);
+    json_shapes_free(shapes);
+    CHECK(bytes == 0);
+    free(mixed);
+}
+
+//==============================================================================
+// Parallel serialization
+//==============================================================================
+
+void test_parallel(void)
+{
+    JSON *list = json_parse("{\"meta\":1,\"rows\":[]}");
+    JSON *rows = json_object_get(list, "rows");
+    for (int i = 0; i < 1000; i++)
+        json_array_append(rows, json_make_number(i));
+
+    char *serial = json_stringify(list);
+    uint64_t len = 0;
+    char *parallel = json_stringify_parallel(list, JSON_STRINGIFY_DEFAULT, 4, &len, NULL);
+    CHECK(parallel != NULL && strcmp(serial, parallel) == 0);
+    CHECK(len == strlen(serial));
+    test_release(parallel);
+
+    // One line per document, in order
+    JSON *docs[3] = {list, rows, list};
+    char *row_str = json_stringify(rows);
+    char *expected = malloc(2 * strlen(serial) + strlen(row_str) + 4);
+    sprintf(expected, "%s\n%s\n%s\n", serial, row_str, serial);
+
+    char *ndjson = json_stringify_ndjson(docs, 3, JSON_STRINGIFY_DEFAULT, 2, &len, NULL);
+    CHECK(ndjson != NULL && strcmp(ndjson, expected) == 0);
+    CHECK(len == strlen(expected));
+    test_release(ndjson);
+
+    free(expected);
+    test_release(row_str);
+    test_release(serial);
+    json_free(list);
+}
+
+//==============================================================================
+// Deferred frees
+//==============================================================================
+
+void test_free_async(void)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        JSON *json = json_parse("{\"a\":[1,2,{\"b\":\"c\"}],\"d\":\"e\"}");
+        CHECK(json != NULL);
+        json_free_async(json);
+    }
+    json_free_async(NULL);
+    json_free_wait();
+
+    // A deep document is freed without recursion
+    uint64_t depth = JSON_PARSER_MAX_DEPTH;
+    char *deep = malloc(2 * depth + 1);
+    memset(deep, '[', depth);
+    memset(deep + depth, ']', depth);
+    deep[2 * depth] = '\0';
+    JSON *json = json_parse(deep);
+    CHECK(json != NULL);
+    json_free(json);
+    free(deep);
+}
+
+//==============================================================================
+// Shared subtrees
+//==============================================================================
+
+void test_retain(void)
+{
+    JSON *a = json_parse("{\"x\":{\"k\":[1,2]}}");
+    JSON *x = json_object_get(a, "x");
+    JSON_MEMORY before, after;
+    json_memory_usage(a, &before);
+
+    JSON *ref = json_retain(x);
+    CHECK(ref != NULL);
+
+    // x and k moved behind a count each, now reported apart
+    json_memory_usage(a, &after);
+    CHECK(after.total + after.shared == before.total + 2 * sizeof(uint64_t));
+    // Left to a: its node, object and two vectors, the key "x" and the node of x
+    CHECK(after.allocations == 6);
+    CHECK(json_equal(ref, x));
+
+    JSON *b = json_parse("{}");
+    CHECK(json_object_append(b, "x", ref) == 0);
+
+    // Copy on write: the other document does not see the change
+    CHECK(json_object_append(ref, "n", json_make_null()) == 0);
+    CHECK(test_json_is(a, "{\"x\":{\"k\":[1,2]}}"));
+    CHECK(test_json_is(b, "{\"x\":{\"k\":[1,2],\"n\":null}}"));
+
+    // Children reached through a shared node are read only until unshared
+    JSON *shared_child = json_object_get(x, "k");
+    JSON *one = json_make_number(3);
+    CHECK(json_array_append(shared_child, one) == 1);
+    CHECK(json_unshare(x) == 0);
+    JSON *k = json_object_get(x, "k");
+    CHECK(json_array_append(k, one) == 0);
+    CHECK(test_json_is(a, "{\"x\":{\"k\":[1,2,3]}}"));
+    CHECK(test_json_is(b, "{\"x\":{\"k\":[1,2],\"n\":null}}"));
+
+    // A reference that was never appended is released on its own
+    JSON *standalone = json_retain(json_object_get(b, "x"));
+    CHECK(standalone != NULL);
+    json_release(standalone);
+
+    // Scalars are copied, compacted documents cannot be shared
+    JSON *scalar = json_retain(json_array_get(k, 0));
+    CHECK(scalar != NULL && *json_value_number(scalar) == 1);
+    json_release(scalar);
+
+    // Shared payloads are measured apart, once per reference
+    JSON_MEMORY ma, mb, mref;
+    JSON *ref_doc = json_parse("{}");
+    json_object_append(ref_doc, "x", json_retain(x));
+    json_memory_usage(a, &ma);
+    json_memory_usage(b, &mb);
+    json_memory_usage(ref_doc, &mref);
+    CHECK(ma.shared > 0 && ma.shared == mref.shared);
+    CHECK(mb.shared > 0);
+    CHECK(mref.nodes == 2 * sizeof(JSON));
+    CHECK(mref.containers == sizeof(JSON_OBJECT));
+    json_free(ref_doc);
+    json_memory_usage(a, &mref);
+    CHECK(mref.total == ma.total && mref.shared == ma.shared);
+
+    JSON *fresh = json_clone(a);
+    JSON_MEMORY mf;
+    json_memory_usage(fresh, &mf);
+    CHECK(mf.shared == 0);
+    CHECK(ma.total + ma.shared > mf.total);
+    json_free(fresh);
+
+    JSON *source = json_parse("{\"a\":[1]}");
+    JSON *compact = json_compact(source);
+    CHECK(json_retain(compact) == NULL);
+    json_free(compact);
+    json_free(source);
+
+    json_free(a);
+    json_free(b);
+}
+
+//==============================================================================
+// Frozen documents
+//==============================================================================
+
+void test_freeze(void)
+{
+    JSON *json = json_parse("{\"a\":[1,{\"b\":2}]}");
+    CHECK(json_is_frozen(json) == 0);
+    CHECK(json_freeze(json) == 0);
+    CHECK(json_is_frozen(json) == 1);
+    CHECK(json_is_frozen(json_array_get(json_object_get(json, "a"), 1)) == 1);
+
+    JSON *value = json_make_number(1);
+    CHECK(json_object_append(json, "c", value) == 1);
+    CHECK(json_object_delete(json, "a") == 1);
+    CHECK(json_array_append(json_object_get(json, "a"), value) == 1);
+    CHECK(json_retain(json_object_get(json, "a")) == NULL);
+    json_free(value);
+
+    JSON *copy = json_clone(json);
+    CHECK(json_is_frozen(copy) == 0);
+    CHECK(json_object_delete(copy, "a") == 0);
+    json_free(copy);
+    json_free(json);
+
+    // Frozen trees are not parsed into
+    JSON_ERROR err;
+    JSON *frozen = json_parse("{\"a\":1}");
+    json_freeze(frozen);
+    CHECK(json_parse_into_ex(frozen, "{\"a\":2}", 7, NULL, &err) == 1);
+    CHECK(err.code == JSON_ERR_TYPE_MISMATCH);
+    CHECK(test_json_is(frozen, "{\"a\":1}"));
+
+    // A frozen subtree is neither reused nor replaced
+    JSON *tree = json_parse("{\"c\":{\"s\":\"x\"}}");
+    JSON *c = json_object_get(tree, "c");
+    json_freeze(c);
+    CHECK(json_parse_into_ex(tree, "{\"c\":{\"s\":\"y\"}}", 15, NULL, &err) == 1);
+    CHECK(err.code == JSON_ERR_TYPE_MISMATCH);
+    CHECK(json_object_get(tree, "c") == c);
+    CHECK(test_json_is(c, "{\"s\":\"x\"}"));
+    json_free(tree);
+
+    // and cannot be appended to another document
+    tree = json_parse("{\"e\":[]}");
+    CHECK(json_object_append(tree, "c", frozen) == 1);
+    CHECK(json_array_append(json_object_get(tree, "e"), frozen) == 1);
+    json_free(tree);
+    json_free(frozen);
+}
+
+//==============================================================================
+// Config handle
+//==============================================================================
+
+typedef struct config_thread_arg
+{
+    JSON_CONFIG_HANDLE *handle;
+    int rounds;
+    uint64_t bad;
+} CONFIG_THREAD_ARG;
+
+// Both fields are published together, a reader never sees them differ
+void config_read(void *arg)
+{
+    CONFIG_THREAD_ARG *r = arg;
+    for (int i = 0; i < r->rounds; i++)
+    {
+        JSON *json = json_config_read_begin(r->handle);
+        double *v = json_value_number(json_object_get(json, "v"));
+        double *w = json_value_number(json_object_get(json, "w"));
+        if (v == NULL || w == NULL || *v != *w)
+            r->bad += 1;
+        json_config_read_end(r->handle);
+    }
+}
+
+// Returns without json_config_read_end
+void config_read_open(void *arg)
+{
+    json_config_read_begin(arg);
+}
+
+void test_config(void)
+{
+    CHECK(json_config_new(NULL, NULL) == NULL);
+
+    JSON_CONFIG_HANDLE *handle = json_config_new(json_parse("{\"v\":0,\"w\":0}"), NULL);
+    CHECK(handle != NULL);
+
+    // A read keeps its document alive across a publish
+    JSON *old = json_config_read_begin(handle);
+    CHECK(json_is_frozen(old));
+    CHECK(json_config_publish(handle, json_parse("{\"v\":1,\"w\":1}")) == 0);
+    CHECK(*json_value_number(json_object_get(old, "v")) == 0);
+    CHECK(json_config_reclaim(handle) == 1);
+    json_config_read_end(handle);
+    CHECK(json_config_reclaim(handle) == 0);
+
+    JSON *now = json_config_read_begin(handle);
+    CHECK(*json_value_number(json_object_get(now, "v")) == 1);
+    json_config_read_end(handle);
+
+    // Readers on other threads while the writer publishes
+    CONFIG_THREAD_ARG readers[2];
+    TEST_THREAD threads[2];
+    for (int t = 0; t < 2; t++)
+    {
+        readers[t] = (CONFIG_THREAD_ARG){.handle = handle, .rounds = 20000, .bad = 0};
+        test_thread_start(&threads[t], config_read, &readers[t]);
+    }
+
+    char doc[64];
+    for (int i = 2; i < 200; i++)
+    {
+        snprintf(doc, sizeof(doc), "{\"v\":%d,\"w\":%d}", i, i);
+        CHECK(json_config_publish(handle, json_parse(doc)) == 0);
+    }
+
+    for (int t = 0; t < 2; t++)
+    {
+        test_thread_join(&threads[t]);
+        CHECK(readers[t].bad == 0);
+    }
+
+    // Threads that exit inside a read end it and give their slot back
+    for (int t = 0; t < 64; t++)
+    {
+        test_thread_start(&threads[0], config_read_open, handle);
+        test_thread_join(&threads[0]);
+        CHECK(json_config_publish(handle, json_parse("{\"v\":0,\"w\":0}")) == 0);
+    }
+    CHECK(json_config_reclaim(handle) == 0);
+
+    json_config_free(handle);
+}
+
+//==============================================================================
+// Main
+//==============================================================================
+
+// Usage: test
+// Checks the contract and error paths of the public API, prints one line per
+// section and exits with 1 if any check failed or a section leaked.
+int main(int argc, char **argv)
+{
+    json_set_allocator(&test_allocator);
+
+    test_section("threads", test_threads);
+    test_section("parse", test_parse);
+    test_section("compact", test_compact);
+    test_section("memory", test_memory);
+    test_section("file", test_file);
+    test_section("snapshot", test_snapshot);
+    test_section("validate", test_validate);
+    test_section("unicode", test_unicode);
+    test_section("struct", test_struct);
+    test_section("equal", test_equal);
+    test_section("columns", test_columns);
+    test_section("number_array", test_number_array);
+    test_section("builders", test_builders);
+    test_section("writer", test_writer);
+    test_section("step", test_step);
+    test_section("stringify", test_stringify);
+    test_section("parse_into", test_parse_into);
+    test_section("shapes", test_shapes);
+    test_section("parallel", test_parallel);
+    test_section("free_async", test_free_async);
+    test_section("retain", test_retain);
+    test_section("freeze", test_freeze);
+    test_section("config", test_config);
+
+    printf("%llu checks, %llu failed\n", (unsigned long long)test_checks, (unsigned long long)test_failures);
+    return test_failures == 0 ? 0 : 1;
+}
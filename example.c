@@ -9,54 +9,23 @@
 
 #include "JSONitator.h"
 
-char *file_read(const char *file_path)
-{
-    FILE *f = fopen(file_path, "rb");
-
-    if (f == NULL)
-        return NULL;
-
-    fseek(f, 0, SEEK_END);
-    uint64_t fsize = ftell(f);
-    rewind(f);
-
-    char *file_buff = malloc(sizeof(char) * fsize);
-    uint64_t read_size = fread(file_buff, sizeof(char), fsize, f);
-
-    if (fsize != read_size)
-    {
-        printf("Failed to read entirety of file.\n");
-        return NULL;
-    }
-
-    fclose(f);
-    return file_buff;
-}
-
 int main(void)
 {
     const char *FILE_PATH = "in.json";
-    char *file_buff = file_read(FILE_PATH);
-
-    if (file_buff == NULL)
-    {
-        printf("Failed to read file.\n");
-        return 1;
-    }
 
     //==========================================================================
     // Parse JSON file
     //==========================================================================
 
-    JSON *json = json_parse(file_buff);
+    // Maps the file and parses it in place, json_parse works on strings
+    JSON *json = json_parse_file(FILE_PATH, JSON_FILE_DEFAULT);
 
-    // json_parse can fail
+    // json_parse_file can fail
     if (json == NULL)
     {
         printf("json is null.\n");
         return 1;
     }
-    free(file_buff);
 
     //==========================================================================
     // Stringify JSON struct